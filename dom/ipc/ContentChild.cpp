@@ -80,6 +80,7 @@
 #include "mozilla/dom/MemoryReportRequest.h"
 #include "mozilla/dom/PSessionStorageObserverChild.h"
 #include "mozilla/dom/PostMessageEvent.h"
+#include "mozilla/dom/PrivateAttribution.h"
 #include "mozilla/dom/PushNotifier.h"
 #include "mozilla/dom/RemoteWorkerService.h"
 #include "mozilla/dom/ScreenOrientation.h"
@@ -2734,6 +2735,13 @@ mozilla::ipc::IPCResult ContentChild::RecvLastPrivateDocShellDestroyed() {
   return IPC_OK();
 }
 
+mozilla::ipc::IPCResult ContentChild::RecvUpdatePrivateAttributionBudgets(
+    mozilla::ipc::ReadOnlySharedMemoryHandle&& aHandle,
+    mozilla::ipc::ReadOnlySharedMemoryHandle&& aGeneration) {
+  PrivateAttribution::UpdateBudgetTable(aHandle, aGeneration);
+  return IPC_OK();
+}
+
 mozilla::ipc::IPCResult ContentChild::RecvNotifyProcessPriorityChanged(
     const hal::ProcessPriority& aPriority) {
   nsCOMPtr<nsIObserverService> os = services::GetObserverService();
@@ -2969,6 +2977,9 @@ mozilla::ipc::IPCResult ContentChild::RecvShutdown() {
   AppShutdown::AdvanceShutdownPhaseWithoutNotify(
       ShutdownPhase::AppShutdownConfirmed);
 
+  // Don't drop impressions still waiting for their batch to be sent.
+  PrivateAttribution::FlushPendingImpressions();
+
   nsCOMPtr<nsIObserverService> os = services::GetObserverService();
   if (os) {
     ProcessChild::AppendToIPCShutdownStateAnnotation(
@@ -387,6 +387,10 @@ class ContentChild final : public PContentChild,
 
   mozilla::ipc::IPCResult RecvLastPrivateDocShellDestroyed();
 
+  mozilla::ipc::IPCResult RecvUpdatePrivateAttributionBudgets(
+      mozilla::ipc::ReadOnlySharedMemoryHandle&& aHandle,
+      mozilla::ipc::ReadOnlySharedMemoryHandle&& aGeneration);
+
   mozilla::ipc::IPCResult RecvNotifyProcessPriorityChanged(
       const hal::ProcessPriority& aPriority);
 
@@ -84,6 +84,7 @@
 #include "mozilla/StyleSheetInlines.h"
 #include "mozilla/TaskController.h"
 #include "mozilla/glean/DomMetrics.h"
+#include "mozilla/glean/DomPrivateattributionMetrics.h"
 #include "mozilla/Telemetry.h"
 #include "mozilla/TelemetryIPC.h"
 #include "mozilla/ThreadSafety.h"
@@ -120,6 +121,8 @@
 #include "mozilla/dom/PCycleCollectWithLogsParent.h"
 #include "mozilla/dom/ParentProcessMessageManager.h"
 #include "mozilla/dom/Permissions.h"
+#include "mozilla/dom/PrivateAttributionBudgetTable.h"
+#include "mozilla/dom/PrivateAttributionImpressionStore.h"
 #include "mozilla/dom/ProcessMessageManager.h"
 #include "mozilla/dom/PushNotifier.h"
 #include "mozilla/dom/RemoteWorkerServiceParent.h"
@@ -1179,15 +1182,32 @@ mozilla::ipc::IPCResult ContentParent::RecvCreateGMPService() {
   return IPC_OK();
 }
 
-IPCResult ContentParent::RecvAttributionEvent(
-    const nsACString& aHost, PrivateAttributionImpressionType aType,
-    uint32_t aIndex, const nsAString& aAd, const nsACString& aTargetHost) {
+IPCResult ContentParent::RecvAttributionEvents(
+    nsTArray<IPCAttributionImpression>&& aImpressions) {
+  if (aImpressions.IsEmpty()) {
+    return IPC_OK();
+  }
+
   nsCOMPtr<nsIPrivateAttributionService> pa =
       components::PrivateAttribution::Service();
   if (NS_WARN_IF(!pa)) {
     return IPC_OK();
   }
-  pa->OnAttributionEvent(aHost, GetEnumString(aType), aIndex, aAd, aTargetHost);
+
+  const size_t count = aImpressions.Length();
+  nsTArray<nsCString> sourceHosts(count);
+  nsTArray<nsCString> types(count);
+  nsTArray<uint32_t> indices(count);
+  nsTArray<nsString> ads(count);
+  nsTArray<nsCString> targetHosts(count);
+  for (auto& impression : aImpressions) {
+    sourceHosts.AppendElement(std::move(impression.sourceHost()));
+    types.AppendElement(GetEnumString(impression.type()));
+    indices.AppendElement(impression.index());
+    ads.AppendElement(std::move(impression.ad()));
+    targetHosts.AppendElement(std::move(impression.targetHost()));
+  }
+  pa->OnAttributionEvents(sourceHosts, types, indices, ads, targetHosts);
   return IPC_OK();
 }
 
@@ -1195,7 +1215,13 @@ IPCResult ContentParent::RecvAttributionConversion(
     const nsACString& aHost, const nsAString& aTask, uint32_t aHistogramSize,
     const Maybe<uint32_t>& aLookbackDays,
     const Maybe<PrivateAttributionImpressionType>& aImpressionType,
-    const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSourceHosts) {
+    const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSourceHosts,
+    const TimeStamp& aSentAt) {
+  PROFILER_MARKER_TEXT("PrivateAttribution conversion received", DOM,
+                       MarkerTiming::IntervalUntilNowFrom(aSentAt), aHost);
+  glean::private_attribution::ipc_latency.AccumulateRawDuration(
+      TimeStamp::Now() - aSentAt);
+
   nsCOMPtr<nsIPrivateAttributionService> pa =
       components::PrivateAttribution::Service();
   if (NS_WARN_IF(!pa)) {
@@ -1239,13 +1265,28 @@ IPCResult ContentParent::RecvComputeReportFor(
 IPCResult ContentParent::RecvGetBudget(const nsACString& aFilterType,
                                        const uint64_t& aEpochId,
                                        const nsACString& aUri,
-                                       double* aBudget) {
-  nsCOMPtr<nsIPrivateAttributionService> pa =
-      components::PrivateAttribution::Service();
-  if (NS_WARN_IF(!pa)) {
+                                       GetBudgetResolver&& aResolver) {
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  if (NS_WARN_IF(!store)) {
+    aResolver(-3.0);
     return IPC_OK();
   }
-  pa->GetBudget(aFilterType, aEpochId, aUri, aBudget);
+  store->GetBudget(aFilterType, aEpochId, aUri)
+      ->Then(GetMainThreadSerialEventTarget(), __func__,
+             [resolver = std::move(aResolver),
+              filterType = nsCString(aFilterType), aEpochId,
+              uri = nsCString(aUri)](
+                 const PrivateAttributionImpressionStore::BudgetPromise::
+                     ResolveOrRejectValue& aValue) {
+               if (aValue.IsReject()) {
+                 resolver(-3.0);
+                 return;
+               }
+               resolver(aValue.ResolveValue());
+               PrivateAttributionBudgetPublisher::Record(
+                   filterType, aEpochId, uri, aValue.ResolveValue());
+             });
   return IPC_OK();
 }
 
@@ -2945,6 +2986,8 @@ bool ContentParent::InitInternal(ProcessPriority aInitialPriority) {
   sharedData->Flush();
   sharedData->SendTo(this);
 
+  PrivateAttributionBudgetPublisher::SendTo(this);
+
   nsCOMPtr<nsIChromeRegistry> registrySvc = nsChromeRegistry::GetService();
   nsChromeRegistryChrome* chromeRegistry =
       static_cast<nsChromeRegistryChrome*>(registrySvc.get());
@@ -503,14 +503,14 @@ class ContentParent final : public PContentParent,
     return PContentParent::RecvPHalConstructor(aActor);
   }
 
-  mozilla::ipc::IPCResult RecvAttributionEvent(
-      const nsACString& aHost, PrivateAttributionImpressionType aType,
-      uint32_t aIndex, const nsAString& aAd, const nsACString& aTargetHost);
+  mozilla::ipc::IPCResult RecvAttributionEvents(
+      nsTArray<IPCAttributionImpression>&& aImpressions);
   mozilla::ipc::IPCResult RecvAttributionConversion(
       const nsACString& aHost, const nsAString& aTask, uint32_t aHistogramSize,
       const Maybe<uint32_t>& aLookbackDays,
       const Maybe<PrivateAttributionImpressionType>& aImpressionType,
-      const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSourceHosts);
+      const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSourceHosts,
+      const TimeStamp& aSentAt);
   mozilla::ipc::IPCResult RecvAddMockEvent(const uint64_t& aIndex,
                                            const uint64_t& aTimestamp,
                                            const nsACString& aSourceHost,
@@ -523,7 +523,7 @@ class ContentParent final : public PContentParent,
   mozilla::ipc::IPCResult RecvGetBudget(const nsACString& aFilterType,
                                         const uint64_t& aEpochId,
                                         const nsACString& aUri,
-                                        double* aBudget);
+                                        GetBudgetResolver&& aResolver);
   mozilla::ipc::IPCResult RecvClearBudgets();
 
   PHeapSnapshotTempFileHelperParent* AllocPHeapSnapshotTempFileHelperParent();
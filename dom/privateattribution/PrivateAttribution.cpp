@@ -5,11 +5,18 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "PrivateAttribution.h"
+#include "PrivateAttributionBudgetTable.h"
+#include "PrivateAttributionImpressionStore.h"
 #include "mozilla/dom/BindingUtils.h"
 #include "mozilla/dom/ContentChild.h"
 #include "mozilla/dom/PrivateAttributionBinding.h"
+#include "mozilla/dom/Promise.h"
+#include "mozilla/ClearOnShutdown.h"
 #include "mozilla/Components.h"
+#include "mozilla/ProfilerMarkers.h"
 #include "mozilla/StaticPrefs_datareporting.h"
+#include "mozilla/StaticPrefs_dom.h"
+#include "mozilla/StaticPtr.h"
 #include "nsIGlobalObject.h"
 #include "nsIPrivateAttributionService.h"
 #include "nsXULAppAPI.h"
@@ -19,6 +26,17 @@ namespace mozilla::dom {
 
 NS_IMPL_CYCLE_COLLECTION_WRAPPERCACHE(PrivateAttribution, mOwner)
 
+// Impressions saved in this content process that haven't been sent to the
+// parent yet. Main thread only.
+static StaticAutoPtr<nsTArray<IPCAttributionImpression>> sPendingImpressions;
+static bool sFlushScheduled = false;
+
+// Send the batch right away once this many impressions are pending.
+static constexpr size_t kMaxPendingImpressions = 64;
+
+// Latest snapshot of the parent's budget table. Main thread only.
+static StaticRefPtr<PrivateAttributionBudgetTable> sBudgetTable;
+
 PrivateAttribution::PrivateAttribution(nsIGlobalObject* aGlobal)
     : mOwner(aGlobal) {
   MOZ_ASSERT(aGlobal);
@@ -86,12 +104,64 @@ void PrivateAttribution::SaveImpression(
     return;
   }
 
+  BufferImpression(IPCAttributionImpression(source, aOptions.mType,
+                                            aOptions.mIndex, aOptions.mAd,
+                                            aOptions.mTarget));
+}
+
+// static
+void PrivateAttribution::BufferImpression(
+    IPCAttributionImpression&& aImpression) {
+  MOZ_ASSERT(NS_IsMainThread());
+  MOZ_ASSERT(!XRE_IsParentProcess());
+
+  if (!sPendingImpressions) {
+    sPendingImpressions = new nsTArray<IPCAttributionImpression>();
+    ClearOnShutdown(&sPendingImpressions);
+  }
+  sPendingImpressions->AppendElement(std::move(aImpression));
+
+  if (sPendingImpressions->Length() >= kMaxPendingImpressions) {
+    FlushPendingImpressions();
+    return;
+  }
+
+  if (sFlushScheduled) {
+    return;
+  }
+
+  // Flush when the main thread goes idle, but no later than the batch
+  // timeout so impressions aren't held indefinitely on a busy page.
+  nsresult rv = NS_DispatchToCurrentThreadQueue(
+      NS_NewRunnableFunction("PrivateAttribution::FlushPendingImpressions",
+                             [] { FlushPendingImpressions(); }),
+      StaticPrefs::dom_private_attribution_impression_batch_timeout_ms(),
+      EventQueuePriority::Idle);
+  if (NS_WARN_IF(NS_FAILED(rv))) {
+    FlushPendingImpressions();
+    return;
+  }
+  sFlushScheduled = true;
+}
+
+// static
+void PrivateAttribution::FlushPendingImpressions() {
+  MOZ_ASSERT(NS_IsMainThread());
+  sFlushScheduled = false;
+
+  if (!sPendingImpressions || sPendingImpressions->IsEmpty()) {
+    return;
+  }
+
+  nsTArray<IPCAttributionImpression> impressions =
+      std::move(*sPendingImpressions);
+  sPendingImpressions->Clear();
+
   auto* content = ContentChild::GetSingleton();
   if (NS_WARN_IF(!content)) {
     return;
   }
-  content->SendAttributionEvent(source, aOptions.mType, aOptions.mIndex,
-                                aOptions.mAd, aOptions.mTarget);
+  content->SendAttributionEvents(impressions);
 }
 
 void PrivateAttribution::MeasureConversion(
@@ -110,6 +180,9 @@ void PrivateAttribution::MeasureConversion(
     return;
   }
 
+  PROFILER_MARKER_TEXT("PrivateAttribution measureConversion", DOM, {},
+                       source);
+
   if (XRE_IsParentProcess()) {
     nsCOMPtr<nsIPrivateAttributionService> pa =
         components::PrivateAttribution::Service();
@@ -126,6 +199,10 @@ void PrivateAttribution::MeasureConversion(
     return;
   }
 
+  // Impressions still buffered here must reach the parent before this
+  // message does, or it would be handled without them.
+  FlushPendingImpressions();
+
   auto* content = ContentChild::GetSingleton();
   if (NS_WARN_IF(!content)) {
     return;
@@ -136,7 +213,7 @@ void PrivateAttribution::MeasureConversion(
                                          : Nothing(),
       aOptions.mImpression.WasPassed() ? Some(aOptions.mImpression.Value())
                                        : Nothing(),
-      aOptions.mAds, aOptions.mSources);
+      aOptions.mAds, aOptions.mSources, TimeStamp::Now());
 }
 
 void PrivateAttribution::AddMockEvent(uint64_t aIndex, uint64_t aTimestamp,
@@ -161,6 +238,8 @@ void PrivateAttribution::AddMockEvent(uint64_t aIndex, uint64_t aTimestamp,
     return;
   }
 
+  FlushPendingImpressions();
+
   auto* content = ContentChild::GetSingleton();
   if (NS_WARN_IF(!content)) {
     return;
@@ -196,6 +275,8 @@ void PrivateAttribution::ComputeReportFor(
     return;
   }
 
+  FlushPendingImpressions();
+
   auto* content = ContentChild::GetSingleton();
   if (NS_WARN_IF(!content)) {
     return;
@@ -204,34 +285,88 @@ void PrivateAttribution::ComputeReportFor(
                                 aLookbackDays, aAd);
 }
 
-double PrivateAttribution::GetBudget(const nsACString& aFilterType,
-                                     uint64_t aEpochId, const nsACString& aUri,
-                                     ErrorResult& aRv) {
+already_AddRefed<Promise> PrivateAttribution::GetBudget(
+    const nsACString& aFilterType, uint64_t aEpochId, const nsACString& aUri,
+    ErrorResult& aRv) {
+  RefPtr<Promise> promise = Promise::Create(mOwner, aRv);
+  if (aRv.Failed()) {
+    return nullptr;
+  }
+
   if (!ShouldRecord()) {
-    return -1.0;
+    promise->MaybeResolve(-1.0);
+    return promise.forget();
   }
 
   if (!ValidateHost(aUri, aRv)) {
-    return -2.0;
+    return nullptr;
   }
 
-  double budget = -3.0;
   if (XRE_IsParentProcess()) {
-    nsCOMPtr<nsIPrivateAttributionService> pa =
-        components::PrivateAttribution::Service();
-    if (NS_WARN_IF(!pa)) {
-      return -4.0;
+    RefPtr<PrivateAttributionImpressionStore> store =
+        PrivateAttributionImpressionStore::GetSingleton();
+    if (NS_WARN_IF(!store)) {
+      promise->MaybeResolve(-4.0);
+      return promise.forget();
+    }
+    store->GetBudget(aFilterType, aEpochId, aUri)
+        ->Then(
+            GetCurrentSerialEventTarget(), __func__,
+            [promise](double aBudget) { promise->MaybeResolve(aBudget); },
+            [promise](nsresult) { promise->MaybeResolve(-3.0); });
+    return promise.forget();
+  }
+
+  // A snapshot taken before a privacy filter was consumed or reset is not
+  // used, even before the next one arrives.
+  if (sBudgetTable && sBudgetTable->IsCurrent()) {
+    nsCString key =
+        PrivateAttributionBudgetTable::Key(aFilterType, aEpochId, aUri);
+    if (Maybe<double> budget = sBudgetTable->Lookup(key)) {
+      promise->MaybeResolve(*budget);
+      return promise.forget();
     }
-    pa->GetBudget(aFilterType, aEpochId, aUri, &budget);
-    return budget;
   }
 
   auto* content = ContentChild::GetSingleton();
   if (NS_WARN_IF(!content)) {
-    return -5.0;
+    promise->MaybeResolve(-5.0);
+    return promise.forget();
   }
-  content->SendGetBudget(aFilterType, aEpochId, aUri, &budget);
-  return budget;
+
+  // The parent adds the budget to its table, so later lookups are answered
+  // locally once the next snapshot arrives.
+  content->SendGetBudget(aFilterType, aEpochId, aUri)
+      ->Then(
+          GetCurrentSerialEventTarget(), __func__,
+          [promise](double aBudget) { promise->MaybeResolve(aBudget); },
+          [promise](mozilla::ipc::ResponseRejectReason) {
+            promise->MaybeRejectWithOperationError(
+                "Couldn't get the budget from the parent process");
+          });
+  return promise.forget();
+}
+
+// static
+void PrivateAttribution::UpdateBudgetTable(
+    const mozilla::ipc::ReadOnlySharedMemoryHandle& aHandle,
+    const mozilla::ipc::ReadOnlySharedMemoryHandle& aGeneration) {
+  MOZ_ASSERT(NS_IsMainThread());
+  RefPtr<PrivateAttributionBudgetTable> table;
+  if (aHandle && aGeneration) {
+    table = PrivateAttributionBudgetTable::Map(aHandle, aGeneration);
+    NS_WARNING_ASSERTION(table, "Malformed Private Attribution budget table");
+  }
+  // Snapshots taken at the same generation only differ by the budgets that
+  // were added to them.
+  if (table && sBudgetTable &&
+      table->Generation() < sBudgetTable->Generation()) {
+    return;
+  }
+  if (!sBudgetTable && table) {
+    ClearOnShutdown(&sBudgetTable);
+  }
+  sBudgetTable = table;
 }
 
 void PrivateAttribution::ClearBudgets(ErrorResult& aRv) {
@@ -249,6 +384,8 @@ void PrivateAttribution::ClearBudgets(ErrorResult& aRv) {
     return;
   }
 
+  FlushPendingImpressions();
+
   auto* content = ContentChild::GetSingleton();
   if (NS_WARN_IF(!content)) {
     return;
@@ -7,6 +7,7 @@
 #ifndef mozilla_dom_PrivateAttribution_h
 #define mozilla_dom_PrivateAttribution_h
 
+#include "mozilla/ipc/SharedMemoryHandle.h"
 #include "nsTArray.h"
 #include "nsWrapperCache.h"
 #include "nsCOMPtr.h"
@@ -18,6 +19,8 @@ class ErrorResult;
 
 namespace mozilla::dom {
 
+class IPCAttributionImpression;
+class Promise;
 struct PrivateAttributionImpressionOptions;
 struct PrivateAttributionConversionOptions;
 
@@ -43,14 +46,30 @@ class PrivateAttribution final : public nsWrapperCache {
                         const nsTArray<nsCString>& aSourceHosts,
                         uint64_t aHistogramSize, uint64_t aLookbackDays,
                         const nsAString& aAd, ErrorResult& aRv);
-  [[nodiscard]] double GetBudget(const nsACString& aFilterType,
-                                 uint64_t aEpochId, const nsACString& aUri,
-                                 ErrorResult& aRv);
+  // Resolves with the remaining budget. Content processes answer from the
+  // parent's shared budget table when they can and otherwise ask the parent
+  // without blocking.
+  already_AddRefed<Promise> GetBudget(const nsACString& aFilterType,
+                                      uint64_t aEpochId, const nsACString& aUri,
+                                      ErrorResult& aRv);
   void ClearBudgets(ErrorResult& aRv);
 
+  // Sends the impressions buffered in this content process to the parent.
+  static void FlushPendingImpressions();
+
+  // Maps a new snapshot of the parent's budget table and the generation it is
+  // checked against, replacing the current one. An empty handle drops it.
+  static void UpdateBudgetTable(
+      const mozilla::ipc::ReadOnlySharedMemoryHandle& aHandle,
+      const mozilla::ipc::ReadOnlySharedMemoryHandle& aGeneration);
+
  private:
   static bool ShouldRecord();
 
+  // Queues an impression for the next batch sent to the parent, scheduling a
+  // flush if none is pending. Content processes only.
+  static void BufferImpression(IPCAttributionImpression&& aImpression);
+
   [[nodiscard]] bool GetSourceHostIfNonPrivate(nsACString&, ErrorResult&);
 
   ~PrivateAttribution();
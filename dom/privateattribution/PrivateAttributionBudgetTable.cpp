@@ -0,0 +1,503 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PrivateAttributionBudgetTable.h"
+#include "PrivateAttributionImpressionStore.h"
+
+#include "mozilla/BinarySearch.h"
+#include "mozilla/CheckedInt.h"
+#include "mozilla/ClearOnShutdown.h"
+#include "mozilla/Services.h"
+#include "mozilla/StaticPtr.h"
+#include "mozilla/dom/ContentParent.h"
+#include "mozilla/dom/ipc/MemMapSnapshot.h"
+#include "nsIObserverService.h"
+#include "nsThreadUtils.h"
+#include "nsXULAppAPI.h"
+
+#include <atomic>
+
+namespace mozilla::dom {
+
+using ipc::ReadOnlySharedMemoryHandle;
+using ipc::ReadOnlySharedMemoryMapping;
+
+// "PABT", followed by the layout version. Bump kVersion whenever Header or
+// Entry change.
+static const uint32_t kMagic = 0x50414254;
+static const uint32_t kVersion = 1;
+
+// How long changes are collected before a new snapshot is sent, so a burst
+// of lookups from a page is published once rather than once per lookup.
+static const uint32_t kPublishDelayMs = 100;
+
+static const char kBudgetsChangedTopic[] =
+    "private-attribution-budgets-changed";
+
+struct PrivateAttributionBudgetTable::Header {
+  uint32_t mMagic;
+  uint32_t mVersion;
+  uint64_t mGeneration;
+  uint32_t mCount;
+  // Start of the key strings, right after the entries.
+  uint32_t mKeysOffset;
+};
+
+struct PrivateAttributionBudgetTable::Entry {
+  // Relative to Header::mKeysOffset.
+  uint32_t mKeyOffset;
+  uint32_t mKeyLength;
+  double mBudget;
+};
+
+struct PrivateAttributionBudgetTable::SharedGeneration {
+  std::atomic<uint64_t> mValue;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "The shared generation is read from several processes");
+
+// static
+nsCString PrivateAttributionBudgetTable::Key(const nsACString& aFilterType,
+                                             uint64_t aEpochId,
+                                             const nsACString& aUri) {
+  nsCString key;
+  key.AppendInt(aFilterType.Length());
+  key.Append(':');
+  key.Append(aFilterType);
+  key.AppendInt(aEpochId);
+  key.Append('|');
+  key.Append(aUri);
+  return key;
+}
+
+// static
+Result<ReadOnlySharedMemoryHandle, nsresult>
+PrivateAttributionBudgetTable::Serialize(uint64_t aGeneration,
+                                         const Budgets& aBudgets) {
+  nsTArray<nsCString> keys(aBudgets.Count());
+  CheckedUint32 keysSize = 0;
+  for (const auto& key : aBudgets.Keys()) {
+    keys.AppendElement(key);
+    keysSize += key.Length();
+  }
+  keys.Sort();
+
+  CheckedUint32 keysOffset =
+      CheckedUint32(keys.Length()) * sizeof(Entry) + sizeof(Header);
+  CheckedUint32 size = keysOffset + keysSize;
+  if (!size.isValid()) {
+    return Err(NS_ERROR_OUT_OF_MEMORY);
+  }
+
+  ipc::MemMapSnapshot mem;
+  MOZ_TRY(mem.Init(size.value()));
+  auto ptr = mem.Get<uint8_t>();
+
+  Header header{kMagic, kVersion, aGeneration, uint32_t(keys.Length()),
+                keysOffset.value()};
+  memcpy(ptr.get(), &header, sizeof(header));
+
+  uint32_t entryOffset = sizeof(Header);
+  uint32_t keyOffset = 0;
+  for (const auto& key : keys) {
+    Entry entry{keyOffset, key.Length(), aBudgets.Get(key)};
+    memcpy(&ptr[entryOffset], &entry, sizeof(entry));
+    memcpy(&ptr[keysOffset.value() + keyOffset], key.get(), key.Length());
+    entryOffset += sizeof(Entry);
+    keyOffset += key.Length();
+  }
+
+  return mem.Finalize();
+}
+
+// static
+Result<std::tuple<ReadOnlySharedMemoryHandle, ipc::SharedMemoryMapping>,
+       nsresult>
+PrivateAttributionBudgetTable::CreateGeneration() {
+  auto handle = ipc::shared_memory::CreateFreezable(sizeof(SharedGeneration));
+  if (!handle) {
+    return Err(NS_ERROR_OUT_OF_MEMORY);
+  }
+  auto [readOnly, mapping] =
+      std::move(handle).Map().FreezeWithMutableMapping();
+  if (!readOnly || !mapping) {
+    return Err(NS_ERROR_FAILURE);
+  }
+  new (mapping.DataAs<SharedGeneration>()) SharedGeneration{0};
+  return std::make_tuple(std::move(readOnly), std::move(mapping));
+}
+
+// static
+void PrivateAttributionBudgetTable::SetGeneration(
+    const ipc::SharedMemoryMapping& aGeneration, uint64_t aValue) {
+  aGeneration.DataAs<SharedGeneration>()->mValue.store(
+      aValue, std::memory_order_release);
+}
+
+// static
+already_AddRefed<PrivateAttributionBudgetTable>
+PrivateAttributionBudgetTable::Map(
+    const ReadOnlySharedMemoryHandle& aHandle,
+    const ReadOnlySharedMemoryHandle& aGeneration) {
+  ReadOnlySharedMemoryMapping mapping = aHandle.Map();
+  if (!mapping || mapping.Size() < sizeof(Header)) {
+    return nullptr;
+  }
+  ReadOnlySharedMemoryMapping generation = aGeneration.Map();
+  if (!generation || generation.Size() < sizeof(SharedGeneration)) {
+    return nullptr;
+  }
+
+  // Check the layout once here so lookups can trust the offsets.
+  const auto* header = mapping.DataAs<Header>();
+  if (header->mMagic != kMagic || header->mVersion != kVersion) {
+    return nullptr;
+  }
+  CheckedUint32 keysOffset =
+      CheckedUint32(header->mCount) * sizeof(Entry) + sizeof(Header);
+  if (!keysOffset.isValid() || keysOffset.value() != header->mKeysOffset ||
+      header->mKeysOffset > mapping.Size()) {
+    return nullptr;
+  }
+  const size_t keysSize = mapping.Size() - header->mKeysOffset;
+  const auto* entries = reinterpret_cast<const Entry*>(header + 1);
+  for (uint32_t i = 0; i < header->mCount; ++i) {
+    CheckedUint32 keyEnd =
+        CheckedUint32(entries[i].mKeyOffset) + entries[i].mKeyLength;
+    if (!keyEnd.isValid() || keyEnd.value() > keysSize) {
+      return nullptr;
+    }
+  }
+
+  return do_AddRef(new PrivateAttributionBudgetTable(std::move(mapping),
+                                                    std::move(generation)));
+}
+
+PrivateAttributionBudgetTable::PrivateAttributionBudgetTable(
+    ReadOnlySharedMemoryMapping&& aMapping,
+    ReadOnlySharedMemoryMapping&& aGeneration)
+    : mMapping(std::move(aMapping)), mGeneration(std::move(aGeneration)) {}
+
+const PrivateAttributionBudgetTable::Header&
+PrivateAttributionBudgetTable::GetHeader() const {
+  return *mMapping.DataAs<Header>();
+}
+
+const PrivateAttributionBudgetTable::Entry*
+PrivateAttributionBudgetTable::Entries() const {
+  return reinterpret_cast<const Entry*>(&GetHeader() + 1);
+}
+
+nsDependentCSubstring PrivateAttributionBudgetTable::KeyAt(
+    const Entry& aEntry) const {
+  const char* keys = mMapping.DataAs<char>() + GetHeader().mKeysOffset;
+  return Substring(keys + aEntry.mKeyOffset, aEntry.mKeyLength);
+}
+
+uint64_t PrivateAttributionBudgetTable::Generation() const {
+  return GetHeader().mGeneration;
+}
+
+bool PrivateAttributionBudgetTable::IsCurrent() const {
+  return mGeneration.DataAs<SharedGeneration>()->mValue.load(
+             std::memory_order_acquire) == Generation();
+}
+
+uint32_t PrivateAttributionBudgetTable::Count() const {
+  return GetHeader().mCount;
+}
+
+Maybe<double> PrivateAttributionBudgetTable::Lookup(
+    const nsACString& aKey) const {
+  const Entry* entries = Entries();
+  size_t index;
+  if (!BinarySearchIf(
+          entries, 0, Count(),
+          [&](const Entry& aEntry) { return Compare(aKey, KeyAt(aEntry)); },
+          &index)) {
+    return Nothing();
+  }
+  return Some(entries[index].mBudget);
+}
+
+static StaticRefPtr<PrivateAttributionBudgetPublisher> sPublisher;
+
+NS_IMPL_ISUPPORTS(PrivateAttributionBudgetPublisher, nsIObserver)
+
+// static
+PrivateAttributionBudgetPublisher*
+PrivateAttributionBudgetPublisher::GetOrCreate() {
+  MOZ_ASSERT(XRE_IsParentProcess());
+  MOZ_ASSERT(NS_IsMainThread());
+  if (sPublisher) {
+    return sPublisher;
+  }
+  if (PastShutdownPhase(ShutdownPhase::XPCOMWillShutdown)) {
+    return nullptr;
+  }
+  nsCOMPtr<nsIObserverService> obs = services::GetObserverService();
+  if (NS_WARN_IF(!obs)) {
+    return nullptr;
+  }
+
+  sPublisher = new PrivateAttributionBudgetPublisher();
+  // Without a shared generation, content processes can't tell a snapshot is
+  // out of date, so none is published and they ask the parent instead.
+  auto generation = PrivateAttributionBudgetTable::CreateGeneration();
+  if (generation.isOk()) {
+    std::tie(sPublisher->mGenerationHandle, sPublisher->mGenerationMapping) =
+        generation.unwrap();
+  } else {
+    NS_WARNING("Couldn't share the Private Attribution budget generation");
+  }
+  obs->AddObserver(sPublisher, kBudgetsChangedTopic, false);
+  RunOnShutdown(
+      [] {
+        nsCOMPtr<nsIObserverService> obs = services::GetObserverService();
+        if (obs) {
+          obs->RemoveObserver(sPublisher, kBudgetsChangedTopic);
+        }
+        sPublisher = nullptr;
+      },
+      ShutdownPhase::XPCOMWillShutdown);
+  return sPublisher;
+}
+
+// static
+void PrivateAttributionBudgetPublisher::Record(const nsACString& aFilterType,
+                                               uint64_t aEpochId,
+                                               const nsACString& aUri,
+                                               double aBudget) {
+  PrivateAttributionBudgetPublisher* publisher = GetOrCreate();
+  if (!publisher) {
+    return;
+  }
+
+  nsCString key =
+      PrivateAttributionBudgetTable::Key(aFilterType, aEpochId, aUri);
+  auto entry = publisher->mBudgets.Lookup(key);
+  if (entry) {
+    if (entry->mBudget == aBudget) {
+      return;
+    }
+    entry->mBudget = aBudget;
+  } else {
+    if (publisher->mBudgets.Count() >= kMaxPublishedBudgets) {
+      publisher->EvictExpired();
+      if (publisher->mBudgets.Count() >= kMaxPublishedBudgets) {
+        return;
+      }
+    }
+    publisher->mBudgets.InsertOrUpdate(
+        key, TrackedBudget{nsCString(aFilterType), aEpochId, nsCString(aUri),
+                           aBudget});
+  }
+  publisher->SchedulePublish();
+}
+
+// static
+void PrivateAttributionBudgetPublisher::SendTo(ContentParent* aParent) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (sPublisher && sPublisher->mHandle) {
+    Unused << aParent->SendUpdatePrivateAttributionBudgets(
+        sPublisher->mHandle.Clone(), sPublisher->mGenerationHandle.Clone());
+  }
+}
+
+// static
+void PrivateAttributionBudgetPublisher::Invalidate(uint64_t aStartEpoch,
+                                                   uint64_t aEndEpoch) {
+  MOZ_ASSERT(NS_IsMainThread());
+  // Content processes only get snapshots once the publisher exists.
+  if (!sPublisher || !sPublisher->mGenerationMapping) {
+    return;
+  }
+  sPublisher->mGeneration++;
+  PrivateAttributionBudgetTable::SetGeneration(sPublisher->mGenerationMapping,
+                                               sPublisher->mGeneration);
+  sPublisher->mStaleStartEpoch =
+      std::min(sPublisher->mStaleStartEpoch, aStartEpoch);
+  sPublisher->mStaleEndEpoch = std::max(sPublisher->mStaleEndEpoch, aEndEpoch);
+}
+
+// static
+Maybe<double> PrivateAttributionBudgetPublisher::GetTrackedBudgetForTesting(
+    const nsACString& aKey) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (!sPublisher) {
+    return Nothing();
+  }
+  auto entry = sPublisher->mBudgets.Lookup(aKey);
+  return entry ? Some(entry->mBudget) : Nothing();
+}
+
+// static
+uint32_t PrivateAttributionBudgetPublisher::TrackedBudgetCountForTesting() {
+  MOZ_ASSERT(NS_IsMainThread());
+  return sPublisher ? sPublisher->mBudgets.Count() : 0;
+}
+
+// static
+void PrivateAttributionBudgetPublisher::ClearForTesting() {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (sPublisher) {
+    sPublisher->mBudgets.Clear();
+  }
+}
+
+NS_IMETHODIMP
+PrivateAttributionBudgetPublisher::Observe(nsISupports* aSubject,
+                                           const char* aTopic,
+                                           const char16_t* aData) {
+  MOZ_ASSERT(!strcmp(aTopic, kBudgetsChangedTopic));
+
+  // A conversion passes the epochs its report covered; anything else, such
+  // as clearing the budgets, may have changed all of them.
+  uint64_t startEpoch = 0;
+  uint64_t endEpoch = UINT64_MAX;
+  NS_ConvertUTF16toUTF8 range(aData ? aData : u"");
+  int32_t comma = range.FindChar(',');
+  if (comma != kNotFound) {
+    nsresult rv1, rv2;
+    uint64_t start = Substring(range, 0, comma).ToInteger64(&rv1);
+    uint64_t end = Substring(range, comma + 1).ToInteger64(&rv2);
+    if (NS_SUCCEEDED(rv1) && NS_SUCCEEDED(rv2)) {
+      startEpoch = start;
+      endEpoch = end;
+    }
+  }
+  Refresh(startEpoch, endEpoch);
+  return NS_OK;
+}
+
+void PrivateAttributionBudgetPublisher::EvictExpired() {
+  const uint64_t firstEpoch =
+      PrivateAttributionImpressionStore::FirstRetainedEpoch();
+  bool evicted = false;
+  for (auto iter = mBudgets.Iter(); !iter.Done(); iter.Next()) {
+    if (iter.Data().mEpochId < firstEpoch) {
+      iter.Remove();
+      evicted = true;
+    }
+  }
+  if (evicted) {
+    SchedulePublish();
+  }
+}
+
+void PrivateAttributionBudgetPublisher::Refresh(uint64_t aStartEpoch,
+                                                uint64_t aEndEpoch) {
+  EvictExpired();
+
+  // The budgets are read after the changes that invalidated them, so once
+  // they are back, the snapshot is current again.
+  aStartEpoch = std::min(aStartEpoch, mStaleStartEpoch);
+  aEndEpoch = std::max(aEndEpoch, mStaleEndEpoch);
+  const uint64_t generation = mGeneration;
+  auto markRefreshed = [generation](PrivateAttributionBudgetPublisher* aSelf) {
+    if (aSelf->mGeneration != generation ||
+        aSelf->mStaleStartEpoch > aSelf->mStaleEndEpoch) {
+      return false;
+    }
+    aSelf->mStaleStartEpoch = UINT64_MAX;
+    aSelf->mStaleEndEpoch = 0;
+    return true;
+  };
+
+  nsTArray<nsCString> keys;
+  nsTArray<PrivateAttributionBudgetQuery> queries;
+  for (const auto& entry : mBudgets) {
+    const TrackedBudget& budget = entry.GetData();
+    if (budget.mEpochId < aStartEpoch || budget.mEpochId > aEndEpoch) {
+      continue;
+    }
+    keys.AppendElement(entry.GetKey());
+    queries.AppendElement(PrivateAttributionBudgetQuery{
+        budget.mFilterType, budget.mEpochId, budget.mUri});
+  }
+  if (queries.IsEmpty()) {
+    if (markRefreshed(this)) {
+      SchedulePublish();
+    }
+    return;
+  }
+
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  if (NS_WARN_IF(!store)) {
+    return;
+  }
+
+  // pdslib is read on the store's queue, after the report that changed the
+  // budgets, and the snapshot is published once the values are back.
+  RefPtr<PrivateAttributionBudgetPublisher> self = this;
+  store->GetBudgets(std::move(queries))
+      ->Then(GetMainThreadSerialEventTarget(), __func__,
+             [self, keys = std::move(keys), markRefreshed](
+                 const PrivateAttributionImpressionStore::BudgetsPromise::
+                     ResolveOrRejectValue& aValue) {
+               if (aValue.IsReject()) {
+                 return;
+               }
+               const nsTArray<double>& budgets = aValue.ResolveValue();
+               bool changed = markRefreshed(self);
+               for (size_t i = 0; i < keys.Length(); i++) {
+                 auto entry = self->mBudgets.Lookup(keys[i]);
+                 if (entry && entry->mBudget != budgets[i]) {
+                   entry->mBudget = budgets[i];
+                   changed = true;
+                 }
+               }
+               if (changed) {
+                 self->SchedulePublish();
+               }
+             });
+}
+
+void PrivateAttributionBudgetPublisher::SchedulePublish() {
+  if (mPublishScheduled) {
+    return;
+  }
+  mPublishScheduled = true;
+  NS_DelayedDispatchToCurrentThread(
+      NewRunnableMethod("PrivateAttributionBudgetPublisher::Publish", this,
+                        &PrivateAttributionBudgetPublisher::Publish),
+      kPublishDelayMs);
+}
+
+void PrivateAttributionBudgetPublisher::Publish() {
+  mPublishScheduled = false;
+  // The next refresh publishes the budgets once they are current again.
+  if (mStaleStartEpoch <= mStaleEndEpoch) {
+    return;
+  }
+
+  PrivateAttributionBudgetTable::Budgets budgets(mBudgets.Count());
+  for (const auto& entry : mBudgets) {
+    budgets.InsertOrUpdate(entry.GetKey(), entry.GetData().mBudget);
+  }
+
+  // If the snapshot can't be written, an empty handle makes content
+  // processes drop the stale one and ask the parent instead.
+  auto result =
+      mGenerationMapping
+          ? PrivateAttributionBudgetTable::Serialize(mGeneration, budgets)
+          : Result<ReadOnlySharedMemoryHandle, nsresult>(
+                Err(NS_ERROR_NOT_AVAILABLE));
+  if (NS_WARN_IF(result.isErr())) {
+    mHandle = nullptr;
+  } else {
+    mHandle = result.unwrap();
+  }
+
+  for (auto* cp : ContentParent::AllProcesses(ContentParent::eLive)) {
+    Unused << cp->SendUpdatePrivateAttributionBudgets(
+        mHandle.Clone(), mGenerationHandle.Clone());
+  }
+}
+
+}  // namespace mozilla::dom
@@ -0,0 +1,155 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef mozilla_dom_PrivateAttributionBudgetTable_h
+#define mozilla_dom_PrivateAttributionBudgetTable_h
+
+#include "mozilla/Maybe.h"
+#include "mozilla/Result.h"
+#include "mozilla/ipc/SharedMemoryHandle.h"
+#include "mozilla/ipc/SharedMemoryMapping.h"
+#include "nsIObserver.h"
+#include "nsISupportsImpl.h"
+#include "nsString.h"
+#include "nsTHashMap.h"
+
+#include <tuple>
+
+namespace mozilla::dom {
+
+class ContentParent;
+
+// Read-only snapshot of privacy filter budgets, published by the parent in a
+// shared memory region so content processes can look budgets up without a
+// round trip.
+//
+// The region holds a header, an array of entries sorted by key, and the key
+// strings they point into. The header carries the layout version and the
+// generation of the budgets it was taken at.
+//
+// The parent also shares the current generation with content processes in a
+// separate region only it can write. It bumps it before any privacy filter is
+// consumed or reset, so a snapshot stops being used as soon as its budgets may
+// be out of date, rather than once the next one arrives.
+class PrivateAttributionBudgetTable final {
+ public:
+  NS_INLINE_DECL_REFCOUNTING(PrivateAttributionBudgetTable)
+
+  using Budgets = nsTHashMap<nsCStringHashKey, double>;
+
+  // Key of the budget of one (filter type, epoch, site) triple. The filter
+  // type comes from content, so it is length-prefixed rather than delimited.
+  static nsCString Key(const nsACString& aFilterType, uint64_t aEpochId,
+                       const nsACString& aUri);
+
+  // Writes aBudgets into a new read-only shared memory region.
+  static Result<ipc::ReadOnlySharedMemoryHandle, nsresult> Serialize(
+      uint64_t aGeneration, const Budgets& aBudgets);
+
+  // Creates the shared generation, returning a read-only handle for content
+  // processes and the parent's writable mapping.
+  static Result<
+      std::tuple<ipc::ReadOnlySharedMemoryHandle, ipc::SharedMemoryMapping>,
+      nsresult>
+  CreateGeneration();
+  static void SetGeneration(const ipc::SharedMemoryMapping& aGeneration,
+                            uint64_t aValue);
+
+  // Maps a region written by Serialize(), along with the shared generation.
+  // Returns null if either is malformed or has another layout version.
+  static already_AddRefed<PrivateAttributionBudgetTable> Map(
+      const ipc::ReadOnlySharedMemoryHandle& aHandle,
+      const ipc::ReadOnlySharedMemoryHandle& aGeneration);
+
+  uint64_t Generation() const;
+  // Whether no budget changed since the snapshot was taken.
+  bool IsCurrent() const;
+  uint32_t Count() const;
+  Maybe<double> Lookup(const nsACString& aKey) const;
+
+ private:
+  struct Header;
+  struct Entry;
+  struct SharedGeneration;
+
+  PrivateAttributionBudgetTable(ipc::ReadOnlySharedMemoryMapping&& aMapping,
+                                ipc::ReadOnlySharedMemoryMapping&& aGeneration);
+  ~PrivateAttributionBudgetTable() = default;
+
+  const Header& GetHeader() const;
+  const Entry* Entries() const;
+  nsDependentCSubstring KeyAt(const Entry& aEntry) const;
+
+  ipc::ReadOnlySharedMemoryMapping mMapping;
+  ipc::ReadOnlySharedMemoryMapping mGeneration;
+};
+
+// Parent side of the budget table. Tracks the budgets content processes have
+// asked for, re-reads them whenever a privacy filter changes and sends every
+// content process a new snapshot. Main thread only.
+class PrivateAttributionBudgetPublisher final : public nsIObserver {
+ public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_NSIOBSERVER
+
+  // Budgets beyond this many are still answered over IPC, just not
+  // published. Budgets of expired epochs make room for new ones.
+  static constexpr uint32_t kMaxPublishedBudgets = 4096;
+
+  // Adds a budget a content process asked for to the next snapshot.
+  static void Record(const nsACString& aFilterType, uint64_t aEpochId,
+                     const nsACString& aUri, double aBudget);
+
+  // Sends the current snapshot, if any, to a newly launched process.
+  static void SendTo(ContentParent* aParent);
+
+  // Makes content processes stop using their snapshot before the privacy
+  // filters of epochs aStartEpoch through aEndEpoch are consumed or reset.
+  // No snapshot is published again until those budgets have been re-read.
+  static void Invalidate(uint64_t aStartEpoch, uint64_t aEndEpoch);
+
+  static Maybe<double> GetTrackedBudgetForTesting(const nsACString& aKey);
+  static uint32_t TrackedBudgetCountForTesting();
+  static void ClearForTesting();
+
+ private:
+  struct TrackedBudget {
+    nsCString mFilterType;
+    uint64_t mEpochId = 0;
+    nsCString mUri;
+    double mBudget = 0.0;
+  };
+
+  PrivateAttributionBudgetPublisher() = default;
+  ~PrivateAttributionBudgetPublisher() = default;
+
+  static PrivateAttributionBudgetPublisher* GetOrCreate();
+
+  // Drops the budgets of epochs no conversion can reach any more.
+  void EvictExpired();
+  // Re-reads the tracked budgets of epochs aStartEpoch through aEndEpoch, and
+  // of the invalidated ones, from pdslib, off the main thread, and publishes
+  // those that changed.
+  void Refresh(uint64_t aStartEpoch, uint64_t aEndEpoch);
+  // Coalesces the changes made during this task into one snapshot.
+  void SchedulePublish();
+  void Publish();
+
+  nsTHashMap<nsCStringHashKey, TrackedBudget> mBudgets;
+  ipc::ReadOnlySharedMemoryHandle mHandle;
+  ipc::ReadOnlySharedMemoryHandle mGenerationHandle;
+  ipc::SharedMemoryMapping mGenerationMapping;
+  uint64_t mGeneration = 0;
+  // The epochs invalidated since the last refresh that started at the
+  // current generation. Empty if mStaleStartEpoch > mStaleEndEpoch.
+  uint64_t mStaleStartEpoch = UINT64_MAX;
+  uint64_t mStaleEndEpoch = 0;
+  bool mPublishScheduled = false;
+};
+
+}  // namespace mozilla::dom
+
+#endif  // mozilla_dom_PrivateAttributionBudgetTable_h
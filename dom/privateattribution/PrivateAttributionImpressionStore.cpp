@@ -0,0 +1,1489 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PrivateAttributionImpressionStore.h"
+#include "PrivateAttributionBudgetTable.h"
+
+#include "mozIStorageConnection.h"
+#include "mozIStorageService.h"
+#include "mozIStorageStatement.h"
+#include "mozStorageCID.h"
+#include "mozStorageHelper.h"
+#include "mozilla/ClearOnShutdown.h"
+#include "mozilla/Components.h"
+#include "mozilla/IntegerPrintfMacros.h"
+#include "mozilla/Services.h"
+#include "mozilla/StaticPrefs_dom.h"
+#include "mozilla/StaticPtr.h"
+#include "mozilla/ProfilerMarkers.h"
+#include "mozilla/ScopeExit.h"
+#include "mozilla/dom/Promise.h"
+#include "mozilla/glean/DomPrivateattributionMetrics.h"
+#include "nsAppDirectoryServiceDefs.h"
+#include "nsDirectoryServiceUtils.h"
+#include "nsIFile.h"
+#include "nsIObserverService.h"
+#include "nsThreadUtils.h"
+#include "prtime.h"
+#include "xpcpublic.h"
+
+#define PRIVATE_ATTRIBUTION_DB_FILENAME "private-attribution.sqlite"_ns
+#define SCHEMA_VERSION 1
+
+// Must match PrivateAttributionService.sys.mjs.
+static const int64_t kDayInMs = 24 * 60 * 60 * 1000;
+static const int64_t kEpochDurationMs = 7 * kDayInMs;
+
+// Vacuum once at least this share of the database file's pages is free.
+static const int64_t kVacuumFreePagesPercent = 25;
+
+// Upper bound on the number of impressions held in memory.
+static const size_t kMaxCachedImpressions = 10000;
+
+MOZ_DEFINE_MALLOC_SIZE_OF(ImpressionCacheMallocSizeOf)
+
+namespace mozilla::dom {
+
+LazyLogModule gPrivateAttributionLog("PrivateAttribution");
+
+static StaticRefPtr<PrivateAttributionImpressionStore> sImpressionStore;
+static bool sInitFailed = false;
+
+// PrivateAttributionHistogramRequest
+
+NS_IMPL_ISUPPORTS(PrivateAttributionHistogramRequest, PpaHistogramRequest)
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetStartEpoch(uint64_t* aStartEpoch) {
+  *aStartEpoch = mParams.mStartEpoch;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetEndEpoch(uint64_t* aEndEpoch) {
+  *aEndEpoch = mParams.mEndEpoch;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetAttributableValue(
+    double* aAttributableValue) {
+  *aAttributableValue = mParams.mAttributableValue;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetMaxAttributableValue(
+    double* aMaxAttributableValue) {
+  *aMaxAttributableValue = mParams.mMaxAttributableValue;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetRequestedEpsilon(
+    double* aRequestedEpsilon) {
+  *aRequestedEpsilon = mParams.mRequestedEpsilon;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetHistogramSize(
+    uint64_t* aHistogramSize) {
+  *aHistogramSize = mParams.mHistogramSize;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetTriggerHost(nsACString& aTriggerHost) {
+  aTriggerHost = mParams.mTargetHost;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetSourceHosts(
+    nsTArray<nsCString>& aSourceHosts) {
+  aSourceHosts = mParams.mSourceHosts.Clone();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetIntermediaryHosts(
+    nsTArray<nsCString>& aIntermediaryHosts) {
+  aIntermediaryHosts.Clear();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionHistogramRequest::GetQuerierHosts(
+    nsTArray<nsCString>& aQuerierHosts) {
+  aQuerierHosts = {mParams.mTargetHost};
+  return NS_OK;
+}
+
+// PrivateAttributionPackedImpressions
+
+NS_IMPL_ISUPPORTS(PrivateAttributionPackedImpressions,
+                  nsIPrivateAttributionPackedImpressions)
+
+PrivateAttributionPackedImpressions::PrivateAttributionPackedImpressions(
+    const nsTArray<PrivateAttributionImpressionData>& aRows)
+    : mTimestamps(aRows.Length()),
+      mEpochs(aRows.Length()),
+      mHistogramIndices(aRows.Length()),
+      mSourceHostIds(aRows.Length()),
+      mTargetHostIds(aRows.Length()) {
+  for (const auto& row : aRows) {
+    mTimestamps.AppendElement(row.mTimestamp);
+    mEpochs.AppendElement(row.mEpoch);
+    mHistogramIndices.AppendElement(row.mIndex);
+    mSourceHostIds.AppendElement(
+        InternHost(row.mSourceHostId, row.mSourceHost));
+    mTargetHostIds.AppendElement(
+        InternHost(row.mTargetHostId, row.mTargetHost));
+  }
+}
+
+uint32_t PrivateAttributionPackedImpressions::InternHost(
+    uint32_t aStoreId, const nsACString& aHost) {
+  return mHostIds.LookupOrInsertWith(aStoreId, [&] {
+    mHosts.AppendElement(aHost);
+    return static_cast<uint32_t>(mHosts.Length() - 1);
+  });
+}
+
+NS_IMETHODIMP
+PrivateAttributionPackedImpressions::GetLength(uint32_t* aLength) {
+  *aLength = mTimestamps.Length();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionPackedImpressions::GetHosts(nsTArray<nsCString>& aHosts) {
+  aHosts = mHosts.Clone();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionPackedImpressions::GetTimestamps(
+    nsTArray<uint64_t>& aTimestamps) {
+  aTimestamps = mTimestamps.Clone();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionPackedImpressions::GetEpochs(nsTArray<uint64_t>& aEpochs) {
+  aEpochs = mEpochs.Clone();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionPackedImpressions::GetHistogramIndices(
+    nsTArray<uint64_t>& aHistogramIndices) {
+  aHistogramIndices = mHistogramIndices.Clone();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionPackedImpressions::GetSourceHostIds(
+    nsTArray<uint32_t>& aSourceHostIds) {
+  aSourceHostIds = mSourceHostIds.Clone();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionPackedImpressions::GetTargetHostIds(
+    nsTArray<uint32_t>& aTargetHostIds) {
+  aTargetHostIds = mTargetHostIds.Clone();
+  return NS_OK;
+}
+
+// PrivateAttributionImpressionStore
+
+NS_IMPL_ISUPPORTS(PrivateAttributionImpressionStore,
+                  nsIPrivateAttributionImpressionStore, nsIAsyncShutdownBlocker,
+                  nsIObserver, nsIMemoryReporter)
+
+// static
+uint64_t PrivateAttributionImpressionStore::FirstRetainedEpoch() {
+  // See PrivateAttributionService.daysAgoToEpoch.
+  int64_t lookbackMs =
+      int64_t(StaticPrefs::dom_private_attribution_max_lookback_days()) *
+      kDayInMs;
+  int64_t oldest = PR_Now() / PR_USEC_PER_MSEC - lookbackMs;
+  return oldest > 0 ? uint64_t(oldest / kEpochDurationMs) : 0;
+}
+
+// static
+already_AddRefed<PrivateAttributionImpressionStore>
+PrivateAttributionImpressionStore::GetSingleton() {
+  MOZ_ASSERT(XRE_IsParentProcess());
+  MOZ_ASSERT(NS_IsMainThread());
+
+  // Init previously failed, don't try again.
+  if (sInitFailed) {
+    return nullptr;
+  }
+
+  if (!sImpressionStore) {
+    sImpressionStore = new PrivateAttributionImpressionStore();
+    RunOnShutdown([] { sImpressionStore = nullptr; });
+
+    nsresult rv = sImpressionStore->Init();
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      sInitFailed = true;
+      sImpressionStore = nullptr;
+      return nullptr;
+    }
+  }
+
+  return do_AddRef(sImpressionStore);
+}
+
+nsresult PrivateAttributionImpressionStore::Init() {
+  MOZ_ASSERT(NS_IsMainThread());
+
+  // Close the database before the profile goes away. Init may be called
+  // during shutdown, in which case there is nothing left to store.
+  nsCOMPtr<nsIAsyncShutdownClient> shutdownBarrier = GetAsyncShutdownBarrier();
+  NS_ENSURE_TRUE(shutdownBarrier, NS_ERROR_FAILURE);
+
+  bool closed;
+  nsresult rv = shutdownBarrier->GetIsClosed(&closed);
+  NS_ENSURE_SUCCESS(rv, rv);
+  NS_ENSURE_TRUE(!closed, NS_ERROR_ILLEGAL_DURING_SHUTDOWN);
+
+  rv = NS_GetSpecialDirectory(NS_APP_USER_PROFILE_50_DIR,
+                              getter_AddRefs(mDatabaseFile));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = mDatabaseFile->AppendNative(PRIVATE_ATTRIBUTION_DB_FILENAME);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = NS_CreateBackgroundTaskQueue("PrivateAttributionImpressionStore",
+                                    getter_AddRefs(mBackgroundQueue));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<nsIObserverService> obs = services::GetObserverService();
+  NS_ENSURE_TRUE(obs, NS_ERROR_FAILURE);
+  rv = obs->AddObserver(this, "idle-daily", false);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  RegisterWeakMemoryReporter(this);
+
+  return shutdownBarrier->AddBlocker(
+      this, NS_LITERAL_STRING_FROM_CSTRING(__FILE__), __LINE__, u""_ns);
+}
+
+nsresult PrivateAttributionImpressionStore::EnsurePdslib() {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mPdslib) {
+    return NS_OK;
+  }
+  nsresult rv;
+  mPdslib = do_GetService("@mozilla.org/private-attribution-pdslib;1", &rv);
+  return rv;
+}
+
+nsresult PrivateAttributionImpressionStore::AddImpression(
+    PrivateAttributionImpressionData&& aData) {
+  MOZ_ASSERT(NS_IsMainThread());
+  NS_ENSURE_TRUE(!mShuttingDown, NS_ERROR_NOT_AVAILABLE);
+
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return mBackgroundQueue->Dispatch(
+      NS_NewRunnableFunction(
+          "PrivateAttributionImpressionStore::AddImpression",
+          [self, data = std::move(aData)]() {
+            nsresult rv = self->InsertData(data);
+            if (NS_FAILED(rv)) {
+              MOZ_LOG(gPrivateAttributionLog, LogLevel::Warning,
+                      ("Failed to store impression: 0x%08" PRIx32,
+                       static_cast<uint32_t>(rv)));
+            }
+          }),
+      NS_DISPATCH_EVENT_MAY_BLOCK);
+}
+
+nsresult PrivateAttributionImpressionStore::AddImpressions(
+    nsTArray<PrivateAttributionImpressionData>&& aData) {
+  MOZ_ASSERT(NS_IsMainThread());
+  NS_ENSURE_TRUE(!mShuttingDown, NS_ERROR_NOT_AVAILABLE);
+  if (aData.IsEmpty()) {
+    return NS_OK;
+  }
+
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return mBackgroundQueue->Dispatch(
+      NS_NewRunnableFunction(
+          "PrivateAttributionImpressionStore::AddImpressions",
+          [self, data = std::move(aData)]() {
+            nsresult rv = self->InsertDataBatch(data);
+            if (NS_FAILED(rv)) {
+              MOZ_LOG(gPrivateAttributionLog, LogLevel::Warning,
+                      ("Failed to store %zu impressions: 0x%08" PRIx32,
+                       data.Length(), static_cast<uint32_t>(rv)));
+            }
+          }),
+      NS_DISPATCH_EVENT_MAY_BLOCK);
+}
+
+RefPtr<PrivateAttributionImpressionStore::ImpressionsPromise>
+PrivateAttributionImpressionStore::GetImpressions(
+    uint64_t aStartEpoch, uint64_t aEndEpoch, const nsACString& aTargetHost,
+    const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSources) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return ImpressionsPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE,
+                                               __func__);
+  }
+
+  // Nothing can match an empty filter; skip the round trip.
+  if (aAds.IsEmpty() || aSources.IsEmpty() || aStartEpoch > aEndEpoch) {
+    return ImpressionsPromise::CreateAndResolve(
+        nsTArray<PrivateAttributionImpressionData>(), __func__);
+  }
+
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return InvokeAsync(
+      mBackgroundQueue, __func__,
+      [self, aStartEpoch, aEndEpoch, targetHost = nsCString(aTargetHost),
+       ads = aAds.Clone(), sources = aSources.Clone()]() {
+        nsTArray<PrivateAttributionImpressionData> result;
+        nsresult rv = self->SelectData(aStartEpoch, aEndEpoch, targetHost, ads,
+                                       sources, result);
+        if (NS_FAILED(rv)) {
+          return ImpressionsPromise::CreateAndReject(rv, __func__);
+        }
+        return ImpressionsPromise::CreateAndResolve(std::move(result),
+                                                    __func__);
+      });
+}
+
+RefPtr<PrivateAttributionImpressionStore::ClearPromise>
+PrivateAttributionImpressionStore::Clear() {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return ClearPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE, __func__);
+  }
+
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return InvokeAsync(mBackgroundQueue, __func__, [self]() {
+    nsresult rv = self->ClearData();
+    if (NS_FAILED(rv)) {
+      return ClearPromise::CreateAndReject(rv, __func__);
+    }
+    return ClearPromise::CreateAndResolve(true, __func__);
+  });
+}
+
+RefPtr<PrivateAttributionImpressionStore::ReportPromise>
+PrivateAttributionImpressionStore::ComputeReport(
+    PrivateAttributionReportParams&& aParams) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return ReportPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE, __func__);
+  }
+
+  nsresult rv = EnsurePdslib();
+  if (NS_FAILED(rv)) {
+    return ReportPromise::CreateAndReject(rv, __func__);
+  }
+
+  // pdslib consumes the budgets of these epochs on the queue, so content
+  // processes have to stop using their snapshot of them now.
+  PrivateAttributionBudgetPublisher::Invalidate(aParams.mStartEpoch,
+                                                aParams.mEndEpoch);
+
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return InvokeAsync(
+      mBackgroundQueue, __func__,
+      [self, pdslib = mPdslib, params = std::move(aParams)]() mutable {
+        nsTArray<double> report;
+        nsresult rv =
+            self->ComputeReportData(pdslib, std::move(params), report);
+        if (NS_FAILED(rv)) {
+          return ReportPromise::CreateAndReject(rv, __func__);
+        }
+        return ReportPromise::CreateAndResolve(std::move(report), __func__);
+      });
+}
+
+RefPtr<PrivateAttributionImpressionStore::BudgetPromise>
+PrivateAttributionImpressionStore::GetBudget(const nsACString& aFilterType,
+                                             uint64_t aEpochId,
+                                             const nsACString& aUri) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return BudgetPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE, __func__);
+  }
+
+  nsresult rv = EnsurePdslib();
+  if (NS_FAILED(rv)) {
+    return BudgetPromise::CreateAndReject(rv, __func__);
+  }
+
+  return InvokeAsync(
+      mBackgroundQueue, __func__,
+      [pdslib = mPdslib, filterType = nsCString(aFilterType), aEpochId,
+       uri = nsCString(aUri)]() {
+        double budget = 0.0;
+        nsresult rv = pdslib->GetBudget(filterType, aEpochId, uri, &budget);
+        if (NS_FAILED(rv)) {
+          return BudgetPromise::CreateAndReject(rv, __func__);
+        }
+        return BudgetPromise::CreateAndResolve(budget, __func__);
+      });
+}
+
+RefPtr<PrivateAttributionImpressionStore::BudgetsPromise>
+PrivateAttributionImpressionStore::GetBudgets(
+    nsTArray<PrivateAttributionBudgetQuery>&& aQueries) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return BudgetsPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE, __func__);
+  }
+
+  nsresult rv = EnsurePdslib();
+  if (NS_FAILED(rv)) {
+    return BudgetsPromise::CreateAndReject(rv, __func__);
+  }
+
+  return InvokeAsync(
+      mBackgroundQueue, __func__,
+      [pdslib = mPdslib, queries = std::move(aQueries)]() {
+        nsTArray<double> budgets(queries.Length());
+        for (const auto& query : queries) {
+          double budget = 0.0;
+          nsresult rv = pdslib->GetBudget(query.mFilterType, query.mEpochId,
+                                          query.mUri, &budget);
+          if (NS_FAILED(rv)) {
+            return BudgetsPromise::CreateAndReject(rv, __func__);
+          }
+          budgets.AppendElement(budget);
+        }
+        return BudgetsPromise::CreateAndResolve(std::move(budgets), __func__);
+      });
+}
+
+RefPtr<PrivateAttributionImpressionStore::ClearPromise>
+PrivateAttributionImpressionStore::ClearBudgets() {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return ClearPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE, __func__);
+  }
+
+  nsresult rv = EnsurePdslib();
+  if (NS_FAILED(rv)) {
+    return ClearPromise::CreateAndReject(rv, __func__);
+  }
+
+  PrivateAttributionBudgetPublisher::Invalidate(0, UINT64_MAX);
+
+  return InvokeAsync(mBackgroundQueue, __func__, [pdslib = mPdslib]() {
+    nsresult rv = pdslib->ClearBudgets();
+    if (NS_FAILED(rv)) {
+      return ClearPromise::CreateAndReject(rv, __func__);
+    }
+    return ClearPromise::CreateAndResolve(true, __func__);
+  });
+}
+
+RefPtr<GenericPromise>
+PrivateAttributionImpressionStore::RemoveImpressionsBefore(
+    uint64_t aFirstEpoch) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return GenericPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE, __func__);
+  }
+
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return InvokeAsync(mBackgroundQueue, __func__, [self, aFirstEpoch]() {
+    nsresult rv = self->ExpireData(aFirstEpoch);
+    if (NS_FAILED(rv)) {
+      return GenericPromise::CreateAndReject(rv, __func__);
+    }
+    return GenericPromise::CreateAndResolve(true, __func__);
+  });
+}
+
+RefPtr<PrivateAttributionImpressionStore::ClearPromise>
+PrivateAttributionImpressionStore::CloseConnectionForTesting() {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (mShuttingDown) {
+    return ClearPromise::CreateAndReject(NS_ERROR_NOT_AVAILABLE, __func__);
+  }
+
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return InvokeAsync(mBackgroundQueue, __func__, [self]() {
+    self->CloseConnection();
+    return ClearPromise::CreateAndResolve(true, __func__);
+  });
+}
+
+already_AddRefed<nsIFile>
+PrivateAttributionImpressionStore::GetDatabaseFileForTesting() const {
+  MOZ_ASSERT(NS_IsMainThread());
+  nsCOMPtr<nsIFile> file;
+  if (mDatabaseFile) {
+    mDatabaseFile->Clone(getter_AddRefs(file));
+  }
+  return file.forget();
+}
+
+// nsIPrivateAttributionImpressionStore
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::AddImpression(uint32_t aIndex,
+                                                 const nsACString& aSourceHost,
+                                                 const nsACString& aTargetHost,
+                                                 uint64_t aTimestamp,
+                                                 uint64_t aEpoch,
+                                                 const nsAString& aAd) {
+  return AddImpression(PrivateAttributionImpressionData{
+      aIndex, nsCString(aSourceHost), nsCString(aTargetHost), aTimestamp,
+      aEpoch, nsString(aAd)});
+}
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::AddImpressions(
+    const nsTArray<uint32_t>& aIndices,
+    const nsTArray<nsCString>& aSourceHosts,
+    const nsTArray<nsCString>& aTargetHosts, uint64_t aTimestamp,
+    uint64_t aEpoch, const nsTArray<nsString>& aAds) {
+  const size_t count = aIndices.Length();
+  NS_ENSURE_TRUE(aSourceHosts.Length() == count &&
+                     aTargetHosts.Length() == count && aAds.Length() == count,
+                 NS_ERROR_INVALID_ARG);
+
+  nsTArray<PrivateAttributionImpressionData> data(count);
+  for (size_t i = 0; i < count; ++i) {
+    data.AppendElement(PrivateAttributionImpressionData{
+        aIndices[i], aSourceHosts[i], aTargetHosts[i], aTimestamp, aEpoch,
+        aAds[i]});
+  }
+  return AddImpressions(std::move(data));
+}
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::Clear(JSContext* aCx, Promise** aPromise) {
+  NS_ENSURE_ARG_POINTER(aCx);
+  NS_ENSURE_ARG_POINTER(aPromise);
+
+  nsIGlobalObject* globalObject = xpc::CurrentNativeGlobal(aCx);
+  NS_ENSURE_TRUE(globalObject, NS_ERROR_UNEXPECTED);
+
+  ErrorResult result;
+  RefPtr<Promise> promise = Promise::Create(globalObject, result);
+  if (result.Failed()) {
+    return result.StealNSResult();
+  }
+
+  Clear()->Then(
+      GetMainThreadSerialEventTarget(), __func__,
+      [promise](bool) { promise->MaybeResolveWithUndefined(); },
+      [promise](nsresult aRv) { promise->MaybeReject(aRv); });
+
+  promise.forget(aPromise);
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::ComputeReport(
+    uint64_t aStartEpoch, uint64_t aEndEpoch, const nsACString& aTargetHost,
+    const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSourceHosts,
+    uint64_t aHistogramSize, double aAttributableValue,
+    double aMaxAttributableValue, double aRequestedEpsilon, JSContext* aCx,
+    Promise** aPromise) {
+  NS_ENSURE_ARG_POINTER(aCx);
+  NS_ENSURE_ARG_POINTER(aPromise);
+
+  nsIGlobalObject* globalObject = xpc::CurrentNativeGlobal(aCx);
+  NS_ENSURE_TRUE(globalObject, NS_ERROR_UNEXPECTED);
+
+  ErrorResult result;
+  RefPtr<Promise> promise = Promise::Create(globalObject, result);
+  if (result.Failed()) {
+    return result.StealNSResult();
+  }
+
+  ComputeReport(PrivateAttributionReportParams{
+                    aStartEpoch, aEndEpoch, nsCString(aTargetHost),
+                    aAds.Clone(), aSourceHosts.Clone(), aHistogramSize,
+                    aAttributableValue, aMaxAttributableValue,
+                    aRequestedEpsilon})
+      ->Then(
+          GetMainThreadSerialEventTarget(), __func__,
+          [promise](nsTArray<double>&& aReport) {
+            promise->MaybeResolve(aReport);
+          },
+          [promise](nsresult aRv) { promise->MaybeReject(aRv); });
+
+  promise.forget(aPromise);
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::GetBudget(const nsACString& aFilterType,
+                                             uint64_t aEpochId,
+                                             const nsACString& aUri,
+                                             JSContext* aCx,
+                                             Promise** aPromise) {
+  NS_ENSURE_ARG_POINTER(aCx);
+  NS_ENSURE_ARG_POINTER(aPromise);
+
+  nsIGlobalObject* globalObject = xpc::CurrentNativeGlobal(aCx);
+  NS_ENSURE_TRUE(globalObject, NS_ERROR_UNEXPECTED);
+
+  ErrorResult result;
+  RefPtr<Promise> promise = Promise::Create(globalObject, result);
+  if (result.Failed()) {
+    return result.StealNSResult();
+  }
+
+  GetBudget(aFilterType, aEpochId, aUri)
+      ->Then(
+          GetMainThreadSerialEventTarget(), __func__,
+          [promise](double aBudget) { promise->MaybeResolve(aBudget); },
+          [promise](nsresult aRv) { promise->MaybeReject(aRv); });
+
+  promise.forget(aPromise);
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::ClearBudgets(JSContext* aCx,
+                                                Promise** aPromise) {
+  NS_ENSURE_ARG_POINTER(aCx);
+  NS_ENSURE_ARG_POINTER(aPromise);
+
+  nsIGlobalObject* globalObject = xpc::CurrentNativeGlobal(aCx);
+  NS_ENSURE_TRUE(globalObject, NS_ERROR_UNEXPECTED);
+
+  ErrorResult result;
+  RefPtr<Promise> promise = Promise::Create(globalObject, result);
+  if (result.Failed()) {
+    return result.StealNSResult();
+  }
+
+  ClearBudgets()->Then(
+      GetMainThreadSerialEventTarget(), __func__,
+      [promise](bool) { promise->MaybeResolveWithUndefined(); },
+      [promise](nsresult aRv) { promise->MaybeReject(aRv); });
+
+  promise.forget(aPromise);
+  return NS_OK;
+}
+
+// nsIObserver
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::Observe(nsISupports* aSubject,
+                                           const char* aTopic,
+                                           const char16_t* aData) {
+  MOZ_ASSERT(NS_IsMainThread());
+  if (strcmp(aTopic, "idle-daily")) {
+    return NS_OK;
+  }
+
+  RemoveImpressionsBefore(FirstRetainedEpoch())
+      ->Then(GetMainThreadSerialEventTarget(), __func__,
+             [](const GenericPromise::ResolveOrRejectValue& aResult) {
+               if (aResult.IsReject()) {
+                 MOZ_LOG(gPrivateAttributionLog, LogLevel::Warning,
+                         ("Failed to expire impressions: 0x%08" PRIx32,
+                          static_cast<uint32_t>(aResult.RejectValue())));
+               }
+             });
+  return NS_OK;
+}
+
+// nsIAsyncShutdownBlocker
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::BlockShutdown(
+    nsIAsyncShutdownClient* aClient) {
+  MOZ_ASSERT(NS_IsMainThread());
+  mShuttingDown = true;
+
+  nsCOMPtr<nsIObserverService> obs = services::GetObserverService();
+  if (obs) {
+    obs->RemoveObserver(this, "idle-daily");
+  }
+  UnregisterWeakMemoryReporter(this);
+
+  // The queue is serial, so every write dispatched before this point is
+  // flushed before the connection is closed.
+  RefPtr<PrivateAttributionImpressionStore> self = this;
+  return mBackgroundQueue->Dispatch(
+      NS_NewRunnableFunction(
+          "PrivateAttributionImpressionStore::BlockShutdown",
+          [self]() {
+            self->CloseConnection();
+            NS_DispatchToMainThread(NS_NewRunnableFunction(
+                "PrivateAttributionImpressionStore::BlockShutdown - "
+                "mainthread callback",
+                [self]() {
+                  nsCOMPtr<nsIAsyncShutdownClient> barrier =
+                      self->GetAsyncShutdownBarrier();
+                  DebugOnly<nsresult> rv = barrier->RemoveBlocker(self);
+                  MOZ_ASSERT(NS_SUCCEEDED(rv));
+                }));
+          }),
+      NS_DISPATCH_EVENT_MAY_BLOCK);
+}
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::GetName(nsAString& aName) {
+  aName.AssignLiteral("PrivateAttributionImpressionStore: Flushing to disk");
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::GetState(nsIPropertyBag**) { return NS_OK; }
+
+// nsIMemoryReporter
+
+NS_IMETHODIMP
+PrivateAttributionImpressionStore::CollectReports(
+    nsIHandleReportCallback* aHandleReport, nsISupports* aData,
+    bool aAnonymize) {
+  MOZ_COLLECT_REPORT(
+      "explicit/private-attribution/impression-cache", KIND_HEAP, UNITS_BYTES,
+      mImpressionCacheBytes,
+      "Memory used by the in-memory cache of recent Private Attribution "
+      "impressions.");
+  return NS_OK;
+}
+
+already_AddRefed<nsIAsyncShutdownClient>
+PrivateAttributionImpressionStore::GetAsyncShutdownBarrier() const {
+  nsCOMPtr<nsIAsyncShutdownService> svc = components::AsyncShutdown::Service();
+  MOZ_RELEASE_ASSERT(svc);
+
+  nsCOMPtr<nsIAsyncShutdownClient> client;
+  nsresult rv = svc->GetProfileBeforeChange(getter_AddRefs(client));
+  MOZ_RELEASE_ASSERT(NS_SUCCEEDED(rv));
+  MOZ_RELEASE_ASSERT(client);
+
+  return client.forget();
+}
+
+// Worker thread helpers
+
+nsresult PrivateAttributionImpressionStore::EnsureConnection() {
+  MOZ_ASSERT(!NS_IsMainThread());
+  if (mConnection) {
+    return NS_OK;
+  }
+
+  nsresult rv = CreateDatabaseConnection();
+  if (NS_FAILED(rv)) {
+    mConnection = nullptr;
+  }
+  return rv;
+}
+
+nsresult PrivateAttributionImpressionStore::CreateDatabaseConnection(
+    bool aShouldRetry) {
+  MOZ_ASSERT(!NS_IsMainThread());
+  NS_ENSURE_TRUE(mDatabaseFile, NS_ERROR_NULL_POINTER);
+
+  nsCOMPtr<mozIStorageService> storage =
+      do_GetService(MOZ_STORAGE_SERVICE_CONTRACTID);
+  NS_ENSURE_TRUE(storage, NS_ERROR_UNEXPECTED);
+
+  nsresult rv = storage->OpenDatabase(mDatabaseFile,
+                                      mozIStorageService::CONNECTION_DEFAULT,
+                                      getter_AddRefs(mConnection));
+  if (rv == NS_ERROR_FILE_CORRUPTED && aShouldRetry) {
+    MOZ_LOG(gPrivateAttributionLog, LogLevel::Debug,
+            ("%s: Database file is corrupted, removing it and retrying",
+             __FUNCTION__));
+    rv = mDatabaseFile->Remove(false);
+    NS_ENSURE_SUCCESS(rv, rv);
+    return CreateDatabaseConnection(false);
+  }
+  NS_ENSURE_SUCCESS(rv, rv);
+  NS_ENSURE_TRUE(mConnection, NS_ERROR_UNEXPECTED);
+
+  bool ready = false;
+  mConnection->GetConnectionReady(&ready);
+  NS_ENSURE_TRUE(ready, NS_ERROR_UNEXPECTED);
+
+  return EnsureTable();
+}
+
+nsresult PrivateAttributionImpressionStore::EnsureTable() {
+  MOZ_ASSERT(!NS_IsMainThread());
+  NS_ENSURE_TRUE(mConnection, NS_ERROR_UNEXPECTED);
+
+  int32_t schemaVersion = 0;
+  nsresult rv = mConnection->GetSchemaVersion(&schemaVersion);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  if (schemaVersion == SCHEMA_VERSION) {
+    return NS_OK;
+  }
+
+  mozStorageTransaction transaction(mConnection, false);
+  rv = transaction.Start();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // No other layout was ever shipped, so anything that isn't this version,
+  // including a newer one, is dropped and recreated empty.
+  if (schemaVersion != 0) {
+    MOZ_LOG(gPrivateAttributionLog, LogLevel::Debug,
+            ("%s: Recreating tables of unknown schema version %d",
+             __FUNCTION__, schemaVersion));
+    rv = mConnection->ExecuteSimpleSQL("DROP TABLE IF EXISTS impressions;"_ns);
+    NS_ENSURE_SUCCESS(rv, rv);
+    rv = mConnection->ExecuteSimpleSQL("DROP TABLE IF EXISTS hosts;"_ns);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  // Every site is stored once in the hosts table and impressions refer to it
+  // by ID, so rows stay small and lookups compare integers.
+  rv = mConnection->ExecuteSimpleSQL(
+      "CREATE TABLE hosts ("
+      "id INTEGER PRIMARY KEY, "
+      "host TEXT NOT NULL UNIQUE"
+      ");"_ns);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Impressions are append-only; the index serves the conversion lookup so a
+  // query reads only the rows it returns.
+  rv = mConnection->ExecuteSimpleSQL(
+      "CREATE TABLE impressions ("
+      "id INTEGER PRIMARY KEY, "
+      "epoch INTEGER NOT NULL, "
+      "targetHostId INTEGER NOT NULL, "
+      "ad TEXT NOT NULL, "
+      "sourceHostId INTEGER NOT NULL, "
+      "histogramIndex INTEGER NOT NULL, "
+      "timestamp INTEGER NOT NULL"
+      ");"_ns);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = mConnection->ExecuteSimpleSQL(
+      "CREATE INDEX impressions_by_target "
+      "ON impressions (targetHostId, ad, epoch);"_ns);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = mConnection->SetSchemaVersion(SCHEMA_VERSION);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  return transaction.Commit();
+}
+
+nsresult PrivateAttributionImpressionStore::GetOrCreateHostId(
+    const nsACString& aHost, int64_t* aId) {
+  MOZ_ASSERT(!NS_IsMainThread());
+  if (auto id = mHostIds.MaybeGet(aHost)) {
+    *aId = *id;
+    return NS_OK;
+  }
+
+  nsresult rv;
+  if (!mInsertHostStmt) {
+    rv = mConnection->CreateStatement(
+        "INSERT INTO hosts (host) VALUES (:host) "
+        "ON CONFLICT (host) DO UPDATE SET host = excluded.host "
+        "RETURNING id;"_ns,
+        getter_AddRefs(mInsertHostStmt));
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  mozStorageStatementScoper scoper(mInsertHostStmt);
+  rv = mInsertHostStmt->BindUTF8StringByName("host"_ns, aHost);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  bool hasResult = false;
+  rv = mInsertHostStmt->ExecuteStep(&hasResult);
+  NS_ENSURE_SUCCESS(rv, rv);
+  NS_ENSURE_TRUE(hasResult, NS_ERROR_UNEXPECTED);
+
+  *aId = mInsertHostStmt->AsInt64(0);
+  mHostIds.InsertOrUpdate(aHost, *aId);
+  return NS_OK;
+}
+
+nsresult PrivateAttributionImpressionStore::LookupHostIds(
+    const nsTArray<nsCString>& aHosts, HostsById& aHostsById) {
+  MOZ_ASSERT(!NS_IsMainThread());
+
+  nsTArray<nsCString> missing;
+  for (const auto& host : aHosts) {
+    if (auto id = mHostIds.MaybeGet(host)) {
+      aHostsById.InsertOrUpdate(*id, host);
+    } else {
+      missing.AppendElement(host);
+    }
+  }
+  if (missing.IsEmpty()) {
+    return NS_OK;
+  }
+
+  // Hosts that were never stored have no ID and can't match anything.
+  nsCOMPtr<mozIStorageStatement> stmt;
+  nsresult rv = mConnection->CreateStatement(
+      "SELECT id, host FROM hosts WHERE host IN carray(:hosts);"_ns,
+      getter_AddRefs(stmt));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = stmt->BindArrayOfUTF8StringsByName("hosts"_ns, missing);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  bool hasResult;
+  while (NS_SUCCEEDED(rv = stmt->ExecuteStep(&hasResult)) && hasResult) {
+    int64_t id = stmt->AsInt64(0);
+    nsAutoCString host;
+    rv = stmt->GetUTF8String(1, host);
+    NS_ENSURE_SUCCESS(rv, rv);
+    mHostIds.InsertOrUpdate(host, id);
+    aHostsById.InsertOrUpdate(id, host);
+  }
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  return NS_OK;
+}
+
+nsresult PrivateAttributionImpressionStore::InsertData(
+    const PrivateAttributionImpressionData& aData) {
+  MOZ_ASSERT(!NS_IsMainThread(),
+             "Must not write to the table from the main thread.");
+  nsresult rv = EnsureConnection();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  int64_t targetHostId;
+  rv = GetOrCreateHostId(aData.mTargetHost, &targetHostId);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  int64_t sourceHostId;
+  rv = GetOrCreateHostId(aData.mSourceHost, &sourceHostId);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  if (!mInsertStmt) {
+    rv = mConnection->CreateStatement(
+        "INSERT INTO impressions "
+        "(epoch, targetHostId, ad, sourceHostId, histogramIndex, timestamp) "
+        "VALUES (:epoch, :targetHostId, :ad, :sourceHostId, :histogramIndex, "
+        ":timestamp);"_ns,
+        getter_AddRefs(mInsertStmt));
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  mozStorageStatementScoper scoper(mInsertStmt);
+
+  rv = mInsertStmt->BindInt64ByName("epoch"_ns,
+                                    static_cast<int64_t>(aData.mEpoch));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = mInsertStmt->BindInt64ByName("targetHostId"_ns, targetHostId);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = mInsertStmt->BindStringByName("ad"_ns, aData.mAd);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = mInsertStmt->BindInt64ByName("sourceHostId"_ns, sourceHostId);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = mInsertStmt->BindInt32ByName("histogramIndex"_ns,
+                                    static_cast<int32_t>(aData.mIndex));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = mInsertStmt->BindInt64ByName("timestamp"_ns,
+                                    static_cast<int64_t>(aData.mTimestamp));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = mInsertStmt->Execute();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Outside of InsertDataBatch() the row is committed by now; inside it, the
+  // batch drops the cache if its transaction fails.
+  CacheInsertedImpression(targetHostId, sourceHostId, aData);
+  return NS_OK;
+}
+
+nsresult PrivateAttributionImpressionStore::InsertDataBatch(
+    const nsTArray<PrivateAttributionImpressionData>& aData) {
+  MOZ_ASSERT(!NS_IsMainThread(),
+             "Must not write to the table from the main thread.");
+  nsresult rv = EnsureConnection();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  mozStorageTransaction transaction(mConnection, false);
+  rv = transaction.Start();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Host IDs and impressions are cached as they are inserted, before the
+  // transaction commits. Drop them if it doesn't, as they may be rolled back.
+  auto clearCaches = MakeScopeExit([&] {
+    mHostIds.Clear();
+    ClearImpressionCache();
+  });
+
+  for (const auto& data : aData) {
+    rv = InsertData(data);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  rv = transaction.Commit();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  clearCaches.release();
+  return NS_OK;
+}
+
+nsresult PrivateAttributionImpressionStore::SelectData(
+    uint64_t aStartEpoch, uint64_t aEndEpoch, const nsACString& aTargetHost,
+    const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSources,
+    nsTArray<PrivateAttributionImpressionData>& aResult) {
+  MOZ_ASSERT(!NS_IsMainThread(),
+             "Must not read the table from the main thread.");
+  AUTO_PROFILER_MARKER_TEXT("PrivateAttribution impression lookup", DOM, {},
+                            aTargetHost);
+  auto timerId = glean::private_attribution::impression_lookup_time.Start();
+  auto cancelTimer = MakeScopeExit([&] {
+    glean::private_attribution::impression_lookup_time.Cancel(
+        std::move(timerId));
+  });
+
+  nsresult rv = EnsureConnection();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  HostsById targetHosts;
+  rv = LookupHostIds(nsTArray<nsCString>{nsCString(aTargetHost)}, targetHosts);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  HostsById sourceHosts;
+  rv = LookupHostIds(aSources, sourceHosts);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  if (targetHosts.IsEmpty() || sourceHosts.IsEmpty()) {
+    cancelTimer.release();
+    glean::private_attribution::impression_lookup_time.StopAndAccumulate(
+        std::move(timerId));
+    return NS_OK;
+  }
+  const int64_t targetHostId = targetHosts.ConstIter().Key();
+
+  // Lookups within the retention window are served from the cache, loading
+  // every recent impression of the target on a miss. Targets with too many
+  // impressions to cache use the index below instead.
+  UniquePtr<CachedTarget> loaded;
+  CachedTarget* target = nullptr;
+  if (aStartEpoch >= FirstRetainedEpoch() &&
+      !mUncacheableTargets.Contains(targetHostId)) {
+    auto entry = mImpressionCache.Lookup(targetHostId);
+    if (entry && entry.Data()->mFirstEpoch <= aStartEpoch) {
+      target = entry.Data().get();
+    } else {
+      rv = LoadCachedTarget(targetHostId, FirstRetainedEpoch(), loaded);
+      NS_ENSURE_SUCCESS(rv, rv);
+      target = loaded.get();
+      if (!target) {
+        mUncacheableTargets.Insert(targetHostId);
+      }
+    }
+  }
+
+  if (target) {
+    target->mLastUse = ++mImpressionCacheUses;
+
+    uint32_t scanned = 0;
+    for (const auto& impression : target->mImpressions) {
+      if (impression.mEpoch < aStartEpoch) {
+        continue;
+      }
+      if (impression.mEpoch > aEndEpoch) {
+        break;
+      }
+      // Count what the index would have returned, as below.
+      if (!aAds.Contains(impression.mAd)) {
+        continue;
+      }
+      ++scanned;
+      auto sourceHost = sourceHosts.Lookup(impression.mSourceHostId);
+      if (!sourceHost) {
+        continue;
+      }
+
+      PrivateAttributionImpressionData* row = aResult.AppendElement();
+      row->mIndex = impression.mIndex;
+      row->mSourceHostId = impression.mSourceHostId;
+      row->mSourceHost = *sourceHost;
+      row->mTargetHostId = static_cast<uint32_t>(targetHostId);
+      row->mTargetHost = aTargetHost;
+      row->mTimestamp = impression.mTimestamp;
+      row->mEpoch = impression.mEpoch;
+      row->mAd = impression.mAd;
+    }
+
+    if (loaded) {
+      AddToImpressionCache(targetHostId, std::move(loaded));
+    }
+
+    cancelTimer.release();
+    glean::private_attribution::impression_lookup_time.StopAndAccumulate(
+        std::move(timerId));
+    glean::private_attribution::impressions_scanned.Add(scanned);
+    glean::private_attribution::impressions_matched.Add(aResult.Length());
+    return NS_OK;
+  }
+
+  // The index covers target, ad and epoch. The source filter is applied here
+  // rather than in SQL, which also maps IDs back to host names without
+  // joining the hosts table and tells how many rows were scanned.
+  nsCOMPtr<mozIStorageStatement> stmt;
+  rv = mConnection->CreateStatement(
+      "SELECT histogramIndex, sourceHostId, timestamp, epoch, ad "
+      "FROM impressions "
+      "WHERE targetHostId = :targetHostId AND ad IN carray(:ads) "
+      "AND epoch BETWEEN :startEpoch AND :endEpoch "
+      "ORDER BY epoch, id;"_ns,
+      getter_AddRefs(stmt));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = stmt->BindInt64ByName("startEpoch"_ns,
+                             static_cast<int64_t>(aStartEpoch));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = stmt->BindInt64ByName("endEpoch"_ns, static_cast<int64_t>(aEndEpoch));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = stmt->BindInt64ByName("targetHostId"_ns, targetHostId);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = stmt->BindArrayOfStringsByName("ads"_ns, aAds);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  uint32_t scanned = 0;
+  bool hasResult;
+  while (NS_SUCCEEDED(rv = stmt->ExecuteStep(&hasResult)) && hasResult) {
+    ++scanned;
+    const int64_t sourceHostId = stmt->AsInt64(1);
+    auto sourceHost = sourceHosts.Lookup(sourceHostId);
+    if (!sourceHost) {
+      continue;
+    }
+
+    PrivateAttributionImpressionData* row = aResult.AppendElement();
+    row->mIndex = static_cast<uint32_t>(stmt->AsInt32(0));
+    row->mSourceHostId = static_cast<uint32_t>(sourceHostId);
+    row->mSourceHost = *sourceHost;
+    row->mTargetHostId = static_cast<uint32_t>(targetHostId);
+    row->mTargetHost = aTargetHost;
+    row->mTimestamp = static_cast<uint64_t>(stmt->AsInt64(2));
+    row->mEpoch = static_cast<uint64_t>(stmt->AsInt64(3));
+    rv = stmt->GetString(4, row->mAd);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  cancelTimer.release();
+  glean::private_attribution::impression_lookup_time.StopAndAccumulate(
+      std::move(timerId));
+  glean::private_attribution::impressions_scanned.Add(scanned);
+  glean::private_attribution::impressions_matched.Add(aResult.Length());
+
+  return NS_OK;
+}
+
+nsresult PrivateAttributionImpressionStore::ClearData() {
+  MOZ_ASSERT(!NS_IsMainThread(),
+             "Must not write to the table from the main thread.");
+  nsresult rv = EnsureConnection();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  mozStorageTransaction transaction(mConnection, false);
+  rv = transaction.Start();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = mConnection->ExecuteSimpleSQL("DELETE FROM impressions;"_ns);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = mConnection->ExecuteSimpleSQL("DELETE FROM hosts;"_ns);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  mHostIds.Clear();
+  ClearImpressionCache();
+  return transaction.Commit();
+}
+
+nsresult PrivateAttributionImpressionStore::ExpireData(uint64_t aFirstEpoch) {
+  MOZ_ASSERT(!NS_IsMainThread(),
+             "Must not write to the table from the main thread.");
+  nsresult rv = EnsureConnection();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  mozStorageTransaction transaction(mConnection, false);
+  rv = transaction.Start();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  nsCOMPtr<mozIStorageStatement> stmt;
+  rv = mConnection->CreateStatement(
+      "DELETE FROM impressions WHERE epoch < :firstEpoch;"_ns,
+      getter_AddRefs(stmt));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = stmt->BindInt64ByName("firstEpoch"_ns,
+                             static_cast<int64_t>(aFirstEpoch));
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = stmt->Execute();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  int32_t expired = 0;
+  rv = mConnection->GetAffectedRows(&expired);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  // Drop hosts no remaining impression refers to.
+  rv = mConnection->ExecuteSimpleSQL(
+      "DELETE FROM hosts WHERE id NOT IN ("
+      "SELECT sourceHostId FROM impressions "
+      "UNION SELECT targetHostId FROM impressions);"_ns);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = transaction.Commit();
+  mHostIds.Clear();
+  ClearImpressionCache();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  MOZ_LOG(gPrivateAttributionLog, LogLevel::Debug,
+          ("Expired %d impressions before epoch %" PRIu64, expired,
+           aFirstEpoch));
+
+  return MaybeVacuum();
+}
+
+nsresult PrivateAttributionImpressionStore::MaybeVacuum() {
+  MOZ_ASSERT(!NS_IsMainThread());
+
+  nsCOMPtr<mozIStorageStatement> stmt;
+  nsresult rv = mConnection->CreateStatement(
+      "SELECT freelist_count, page_count "
+      "FROM pragma_freelist_count(), pragma_page_count();"_ns,
+      getter_AddRefs(stmt));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  bool hasResult = false;
+  rv = stmt->ExecuteStep(&hasResult);
+  NS_ENSURE_SUCCESS(rv, rv);
+  NS_ENSURE_TRUE(hasResult, NS_ERROR_UNEXPECTED);
+
+  int64_t freePages = stmt->AsInt64(0);
+  int64_t pages = stmt->AsInt64(1);
+  rv = stmt->Finalize();
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  if (pages == 0 || freePages * 100 < pages * kVacuumFreePagesPercent) {
+    return NS_OK;
+  }
+
+  // VACUUM can't run while a statement is active; the cached ones are
+  // recreated on demand.
+  if (mInsertStmt) {
+    mInsertStmt->Finalize();
+    mInsertStmt = nullptr;
+  }
+  if (mInsertHostStmt) {
+    mInsertHostStmt->Finalize();
+    mInsertHostStmt = nullptr;
+  }
+
+  MOZ_LOG(gPrivateAttributionLog, LogLevel::Debug,
+          ("Vacuuming impression store, %" PRId64 " of %" PRId64 " pages free",
+           freePages, pages));
+  return mConnection->ExecuteSimpleSQL("VACUUM;"_ns);
+}
+
+nsresult PrivateAttributionImpressionStore::ComputeReportData(
+    nsIPrivateAttributionPdslibService* aPdslib,
+    PrivateAttributionReportParams&& aParams, nsTArray<double>& aReport) {
+  MOZ_ASSERT(!NS_IsMainThread(),
+             "Must not compute reports on the main thread.");
+
+  // pdslib still gets a request when nothing can match, so the conversion is
+  // accounted for the same way either way.
+  nsTArray<PrivateAttributionImpressionData> rows;
+  if (!aParams.mAds.IsEmpty() && !aParams.mSourceHosts.IsEmpty() &&
+      aParams.mStartEpoch <= aParams.mEndEpoch) {
+    nsresult rv =
+        SelectData(aParams.mStartEpoch, aParams.mEndEpoch, aParams.mTargetHost,
+                   aParams.mAds, aParams.mSourceHosts, rows);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  AUTO_PROFILER_MARKER_TEXT("PrivateAttribution report computation", DOM, {},
+                            aParams.mTargetHost);
+  auto timerId = glean::private_attribution::report_compute_time.Start();
+  auto cancelTimer = MakeScopeExit([&] {
+    glean::private_attribution::report_compute_time.Cancel(std::move(timerId));
+  });
+  glean::private_attribution::events_per_report.AccumulateSingleSample(
+      rows.Length());
+
+  RefPtr<PrivateAttributionPackedImpressions> events =
+      new PrivateAttributionPackedImpressions(rows);
+  RefPtr<PpaHistogramRequest> request =
+      new PrivateAttributionHistogramRequest(std::move(aParams));
+
+  nsresult rv = aPdslib->ComputeReportPacked(
+      request, events->Hosts(), events->Timestamps(), events->Epochs(),
+      events->HistogramIndices(), events->SourceHostIds(),
+      events->TargetHostIds(), aReport);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  cancelTimer.release();
+  glean::private_attribution::report_compute_time.StopAndAccumulate(
+      std::move(timerId));
+  return NS_OK;
+}
+
+nsresult PrivateAttributionImpressionStore::LoadCachedTarget(
+    int64_t aTargetHostId, uint64_t aFirstEpoch,
+    UniquePtr<CachedTarget>& aResult) {
+  MOZ_ASSERT(!NS_IsMainThread());
+
+  nsCOMPtr<mozIStorageStatement> stmt;
+  nsresult rv = mConnection->CreateStatement(
+      "SELECT histogramIndex, sourceHostId, timestamp, epoch, ad "
+      "FROM impressions "
+      "WHERE targetHostId = :targetHostId AND epoch >= :firstEpoch "
+      "ORDER BY epoch, id;"_ns,
+      getter_AddRefs(stmt));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  rv = stmt->BindInt64ByName("targetHostId"_ns, aTargetHostId);
+  NS_ENSURE_SUCCESS(rv, rv);
+  rv = stmt->BindInt64ByName("firstEpoch"_ns,
+                             static_cast<int64_t>(aFirstEpoch));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  auto target = MakeUnique<CachedTarget>();
+  target->mFirstEpoch = aFirstEpoch;
+
+  bool hasResult;
+  while (NS_SUCCEEDED(rv = stmt->ExecuteStep(&hasResult)) && hasResult) {
+    if (target->mImpressions.Length() == kMaxCachedImpressions) {
+      // Too many to cache; leave aResult empty.
+      return NS_OK;
+    }
+    CachedImpression* impression = target->mImpressions.AppendElement();
+    impression->mIndex = static_cast<uint32_t>(stmt->AsInt32(0));
+    impression->mSourceHostId = static_cast<uint32_t>(stmt->AsInt64(1));
+    impression->mTimestamp = static_cast<uint64_t>(stmt->AsInt64(2));
+    impression->mEpoch = static_cast<uint64_t>(stmt->AsInt64(3));
+    rv = stmt->GetString(4, impression->mAd);
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  target->mBytes = target->mImpressions.ShallowSizeOfExcludingThis(
+      ImpressionCacheMallocSizeOf);
+  for (const auto& impression : target->mImpressions) {
+    target->mBytes += impression.mAd.SizeOfExcludingThisIfUnshared(
+        ImpressionCacheMallocSizeOf);
+  }
+
+  aResult = std::move(target);
+  return NS_OK;
+}
+
+void PrivateAttributionImpressionStore::AddToImpressionCache(
+    int64_t aTargetHostId, UniquePtr<CachedTarget>&& aTarget) {
+  MOZ_ASSERT(!NS_IsMainThread());
+  MOZ_ASSERT(aTarget->mImpressions.Length() <= kMaxCachedImpressions);
+
+  if (auto entry = mImpressionCache.Lookup(aTargetHostId)) {
+    mCachedImpressionCount -= entry.Data()->mImpressions.Length();
+    mImpressionCacheBytes -= entry.Data()->mBytes;
+  }
+  mCachedImpressionCount += aTarget->mImpressions.Length();
+  mImpressionCacheBytes += aTarget->mBytes;
+  mImpressionCache.InsertOrUpdate(aTargetHostId, std::move(aTarget));
+
+  EvictFromImpressionCache(aTargetHostId);
+}
+
+void PrivateAttributionImpressionStore::CacheInsertedImpression(
+    int64_t aTargetHostId, int64_t aSourceHostId,
+    const PrivateAttributionImpressionData& aData) {
+  MOZ_ASSERT(!NS_IsMainThread());
+  auto entry = mImpressionCache.Lookup(aTargetHostId);
+  if (!entry || aData.mEpoch < entry.Data()->mFirstEpoch) {
+    return;
+  }
+
+  // New rows have the highest ID, so they go after every row of the same
+  // epoch. Impressions usually arrive in epoch order and land at the end.
+  nsTArray<CachedImpression>& impressions = entry.Data()->mImpressions;
+  size_t index = impressions.Length();
+  while (index > 0 && impressions[index - 1].mEpoch > aData.mEpoch) {
+    --index;
+  }
+  CachedImpression* impression = impressions.InsertElementAt(
+      index, CachedImpression{aData.mIndex,
+                              static_cast<uint32_t>(aSourceHostId),
+                              aData.mTimestamp, aData.mEpoch, aData.mAd});
+
+  size_t bytes = sizeof(CachedImpression) +
+                 impression->mAd.SizeOfExcludingThisIfUnshared(
+                     ImpressionCacheMallocSizeOf);
+  entry.Data()->mBytes += bytes;
+  mImpressionCacheBytes += bytes;
+  ++mCachedImpressionCount;
+
+  EvictFromImpressionCache(aTargetHostId);
+}
+
+void PrivateAttributionImpressionStore::EvictFromImpressionCache(
+    int64_t aKeep) {
+  MOZ_ASSERT(!NS_IsMainThread());
+  while (mCachedImpressionCount > kMaxCachedImpressions) {
+    // There are few targets, so a linear scan for the oldest is fine.
+    Maybe<uint64_t> oldest;
+    uint64_t oldestUse = UINT64_MAX;
+    for (const auto& entry : mImpressionCache) {
+      if (entry.GetKey() != uint64_t(aKeep) &&
+          entry.GetData()->mLastUse < oldestUse) {
+        oldest = Some(entry.GetKey());
+        oldestUse = entry.GetData()->mLastUse;
+      }
+    }
+    if (!oldest) {
+      // aKeep alone outgrew the cache.
+      oldest = Some(uint64_t(aKeep));
+      mUncacheableTargets.Insert(aKeep);
+    }
+
+    auto entry = mImpressionCache.Lookup(*oldest);
+    MOZ_ASSERT(entry);
+    mCachedImpressionCount -= entry.Data()->mImpressions.Length();
+    mImpressionCacheBytes -= entry.Data()->mBytes;
+    entry.Remove();
+  }
+}
+
+void PrivateAttributionImpressionStore::ClearImpressionCache() {
+  MOZ_ASSERT(!NS_IsMainThread());
+  mImpressionCache.Clear();
+  mUncacheableTargets.Clear();
+  mCachedImpressionCount = 0;
+  mImpressionCacheBytes = 0;
+}
+
+void PrivateAttributionImpressionStore::CloseConnection() {
+  MOZ_ASSERT(!NS_IsMainThread());
+  // The host IDs are only valid for the file that was open.
+  mHostIds.Clear();
+  ClearImpressionCache();
+  if (mInsertStmt) {
+    mInsertStmt->Finalize();
+    mInsertStmt = nullptr;
+  }
+  if (mInsertHostStmt) {
+    mInsertHostStmt->Finalize();
+    mInsertHostStmt = nullptr;
+  }
+  if (mConnection) {
+    DebugOnly<nsresult> rv = mConnection->Close();
+    NS_WARNING_ASSERTION(NS_SUCCEEDED(rv),
+                         "Failed to close database connection");
+    mConnection = nullptr;
+  }
+}
+
+}  // namespace mozilla::dom
@@ -0,0 +1,283 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef mozilla_dom_PrivateAttributionImpressionStore_h
+#define mozilla_dom_PrivateAttributionImpressionStore_h
+
+#include "mozilla/Atomics.h"
+#include "mozilla/Logging.h"
+#include "mozilla/MozPromise.h"
+#include "mozilla/UniquePtr.h"
+#include "nsCOMPtr.h"
+#include "nsIAsyncShutdown.h"
+#include "nsIMemoryReporter.h"
+#include "nsIObserver.h"
+#include "nsIPrivateAttributionImpressionStore.h"
+#include "nsIPrivateAttributionPdslibService.h"
+#include "nsString.h"
+#include "nsTArray.h"
+#include "nsTHashMap.h"
+#include "nsTHashSet.h"
+
+class mozIStorageConnection;
+class mozIStorageStatement;
+class nsIFile;
+class nsISerialEventTarget;
+
+namespace mozilla::dom {
+
+extern LazyLogModule gPrivateAttributionLog;
+
+// Plain copy of one impression row, safe to move between threads.
+struct PrivateAttributionImpressionData {
+  uint32_t mIndex = 0;
+  nsCString mSourceHost;
+  nsCString mTargetHost;
+  uint64_t mTimestamp = 0;
+  uint64_t mEpoch = 0;
+  nsString mAd;
+  // IDs of the hosts in the store's host dictionary. Only set on rows read
+  // back from the store.
+  uint32_t mSourceHostId = 0;
+  uint32_t mTargetHostId = 0;
+};
+
+// Parameters of one conversion report.
+struct PrivateAttributionReportParams {
+  uint64_t mStartEpoch = 0;
+  uint64_t mEndEpoch = 0;
+  nsCString mTargetHost;
+  nsTArray<nsString> mAds;
+  nsTArray<nsCString> mSourceHosts;
+  uint64_t mHistogramSize = 0;
+  double mAttributableValue = 0.0;
+  double mMaxAttributableValue = 0.0;
+  double mRequestedEpsilon = 0.0;
+};
+
+// One privacy filter budget to read from pdslib.
+struct PrivateAttributionBudgetQuery {
+  nsCString mFilterType;
+  uint64_t mEpochId = 0;
+  nsCString mUri;
+};
+
+// Native PpaHistogramRequest, so a request can be handed to pdslib off the
+// main thread.
+class PrivateAttributionHistogramRequest final : public PpaHistogramRequest {
+ public:
+  NS_DECL_THREADSAFE_ISUPPORTS
+  NS_DECL_PPAHISTOGRAMREQUEST
+
+  explicit PrivateAttributionHistogramRequest(
+      PrivateAttributionReportParams&& aParams)
+      : mParams(std::move(aParams)) {}
+
+ private:
+  ~PrivateAttributionHistogramRequest() = default;
+
+  const PrivateAttributionReportParams mParams;
+};
+
+// Column-wise copy of a set of impressions read from the store, with hosts
+// deduplicated into a table so each event only carries integer IDs.
+class PrivateAttributionPackedImpressions final
+    : public nsIPrivateAttributionPackedImpressions {
+ public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_NSIPRIVATEATTRIBUTIONPACKEDIMPRESSIONS
+
+  explicit PrivateAttributionPackedImpressions(
+      const nsTArray<PrivateAttributionImpressionData>& aRows);
+
+  const nsTArray<nsCString>& Hosts() const { return mHosts; }
+  const nsTArray<uint64_t>& Timestamps() const { return mTimestamps; }
+  const nsTArray<uint64_t>& Epochs() const { return mEpochs; }
+  const nsTArray<uint64_t>& HistogramIndices() const {
+    return mHistogramIndices;
+  }
+  const nsTArray<uint32_t>& SourceHostIds() const { return mSourceHostIds; }
+  const nsTArray<uint32_t>& TargetHostIds() const { return mTargetHostIds; }
+
+ private:
+  ~PrivateAttributionPackedImpressions() = default;
+
+  // Maps a store host ID to its index in mHosts, adding it if needed.
+  uint32_t InternHost(uint32_t aStoreId, const nsACString& aHost);
+
+  nsTHashMap<nsUint32HashKey, uint32_t> mHostIds;
+  nsTArray<nsCString> mHosts;
+  nsTArray<uint64_t> mTimestamps;
+  nsTArray<uint64_t> mEpochs;
+  nsTArray<uint64_t> mHistogramIndices;
+  nsTArray<uint32_t> mSourceHostIds;
+  nsTArray<uint32_t> mTargetHostIds;
+};
+
+class PrivateAttributionImpressionStore final
+    : public nsIPrivateAttributionImpressionStore,
+      public nsIAsyncShutdownBlocker,
+      public nsIObserver,
+      public nsIMemoryReporter {
+ public:
+  NS_DECL_THREADSAFE_ISUPPORTS
+  NS_DECL_NSIPRIVATEATTRIBUTIONIMPRESSIONSTORE
+  NS_DECL_NSIASYNCSHUTDOWNBLOCKER
+  NS_DECL_NSIOBSERVER
+  NS_DECL_NSIMEMORYREPORTER
+
+  static already_AddRefed<PrivateAttributionImpressionStore> GetSingleton();
+
+  // The first epoch a conversion with the longest lookback window can still
+  // reach. Impressions and budgets of earlier epochs are of no further use.
+  static uint64_t FirstRetainedEpoch();
+
+  using ImpressionsPromise =
+      MozPromise<nsTArray<PrivateAttributionImpressionData>, nsresult, true>;
+  using ClearPromise = MozPromise<bool, nsresult, true>;
+  using ReportPromise = MozPromise<nsTArray<double>, nsresult, true>;
+  using BudgetPromise = MozPromise<double, nsresult, true>;
+  using BudgetsPromise = MozPromise<nsTArray<double>, nsresult, true>;
+
+  // Native entry points used by the XPCOM methods above. Main thread only.
+  [[nodiscard]] nsresult AddImpression(
+      PrivateAttributionImpressionData&& aData);
+  [[nodiscard]] nsresult AddImpressions(
+      nsTArray<PrivateAttributionImpressionData>&& aData);
+  RefPtr<ImpressionsPromise> GetImpressions(
+      uint64_t aStartEpoch, uint64_t aEndEpoch, const nsACString& aTargetHost,
+      const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSources);
+  RefPtr<ClearPromise> Clear();
+  // Looks up the impressions for a conversion and computes its pdslib report
+  // on the background queue. Only the report is posted back.
+  RefPtr<ReportPromise> ComputeReport(PrivateAttributionReportParams&& aParams);
+  // Read and reset the pdslib privacy filters on the background queue too,
+  // so they see the budgets spent by every report computed before them.
+  RefPtr<BudgetPromise> GetBudget(const nsACString& aFilterType,
+                                  uint64_t aEpochId, const nsACString& aUri);
+  RefPtr<BudgetsPromise> GetBudgets(
+      nsTArray<PrivateAttributionBudgetQuery>&& aQueries);
+  RefPtr<ClearPromise> ClearBudgets();
+  // Deletes impressions in epochs before aFirstEpoch and shrinks the database
+  // file if enough of it is free. Runs on idle-daily with the first epoch
+  // still inside the longest lookback window.
+  RefPtr<GenericPromise> RemoveImpressionsBefore(uint64_t aFirstEpoch);
+
+  // Closes the database once every task dispatched before has run. The next
+  // task reopens it, recreating the tables if their schema is unknown.
+  RefPtr<ClearPromise> CloseConnectionForTesting();
+  already_AddRefed<nsIFile> GetDatabaseFileForTesting() const;
+
+ private:
+  PrivateAttributionImpressionStore() = default;
+  ~PrivateAttributionImpressionStore() = default;
+
+  [[nodiscard]] nsresult Init();
+  // Gets the pdslib service the first time it is needed. Main thread only.
+  [[nodiscard]] nsresult EnsurePdslib();
+
+  already_AddRefed<nsIAsyncShutdownClient> GetAsyncShutdownBarrier() const;
+
+  // Opens the database and creates the schema if needed. The connection is
+  // opened lazily by the first task that needs it. Worker thread only.
+  [[nodiscard]] nsresult EnsureConnection();
+  [[nodiscard]] nsresult CreateDatabaseConnection(bool aShouldRetry = true);
+  [[nodiscard]] nsresult EnsureTable();
+
+  // Returns the host dictionary ID for aHost, adding it if needed.
+  [[nodiscard]] nsresult GetOrCreateHostId(const nsACString& aHost,
+                                           int64_t* aId);
+  using HostsById = nsTHashMap<nsUint64HashKey, nsCString>;
+  // Adds those of aHosts that are in the dictionary to aHostsById.
+  [[nodiscard]] nsresult LookupHostIds(const nsTArray<nsCString>& aHosts,
+                                       HostsById& aHostsById);
+
+  [[nodiscard]] nsresult InsertData(
+      const PrivateAttributionImpressionData& aData);
+  [[nodiscard]] nsresult InsertDataBatch(
+      const nsTArray<PrivateAttributionImpressionData>& aData);
+  [[nodiscard]] nsresult SelectData(
+      uint64_t aStartEpoch, uint64_t aEndEpoch, const nsACString& aTargetHost,
+      const nsTArray<nsString>& aAds, const nsTArray<nsCString>& aSources,
+      nsTArray<PrivateAttributionImpressionData>& aResult);
+  [[nodiscard]] nsresult ClearData();
+  [[nodiscard]] nsresult ExpireData(uint64_t aFirstEpoch);
+  [[nodiscard]] nsresult MaybeVacuum();
+  [[nodiscard]] nsresult ComputeReportData(
+      nsIPrivateAttributionPdslibService* aPdslib,
+      PrivateAttributionReportParams&& aParams, nsTArray<double>& aReport);
+
+  void CloseConnection();
+
+  // Impressions of one target host, from mFirstEpoch on, in epoch and then
+  // insertion order.
+  struct CachedImpression {
+    uint32_t mIndex;
+    uint32_t mSourceHostId;
+    uint64_t mTimestamp;
+    uint64_t mEpoch;
+    nsString mAd;
+  };
+  struct CachedTarget {
+    uint64_t mFirstEpoch = 0;
+    uint64_t mLastUse = 0;
+    size_t mBytes = 0;
+    nsTArray<CachedImpression> mImpressions;
+  };
+
+  // Reads every impression of aTargetHostId from aFirstEpoch on. Leaves
+  // aResult null if there are more than the cache can hold.
+  [[nodiscard]] nsresult LoadCachedTarget(int64_t aTargetHostId,
+                                          uint64_t aFirstEpoch,
+                                          UniquePtr<CachedTarget>& aResult);
+  void AddToImpressionCache(int64_t aTargetHostId,
+                            UniquePtr<CachedTarget>&& aTarget);
+  // Keeps a cached target in sync with a row just written to the table.
+  void CacheInsertedImpression(int64_t aTargetHostId, int64_t aSourceHostId,
+                               const PrivateAttributionImpressionData& aData);
+  // Evicts the least recently used targets, except aKeep, until the cache
+  // is within its size limit.
+  void EvictFromImpressionCache(int64_t aKeep);
+  void ClearImpressionCache();
+
+  // Background task queue all database work runs on, in dispatch order.
+  nsCOMPtr<nsISerialEventTarget> mBackgroundQueue;  // main thread only
+
+  // Set once shutdown has begun; later requests are rejected.
+  bool mShuttingDown = false;  // main thread only
+
+  // Set on the main thread in Init() and only read by the worker afterwards.
+  nsCOMPtr<nsIFile> mDatabaseFile;
+
+  // Acquired on the main thread by EnsurePdslib() and only called on the
+  // worker afterwards. Every pdslib call in the parent process, reports as
+  // well as budget reads and resets, goes through the worker, which keeps
+  // them in dispatch order.
+  nsCOMPtr<nsIPrivateAttributionPdslibService> mPdslib;
+
+  // Worker thread only.
+  nsCOMPtr<mozIStorageConnection> mConnection;
+  nsCOMPtr<mozIStorageStatement> mInsertStmt;
+  nsCOMPtr<mozIStorageStatement> mInsertHostStmt;
+  // Cache of the hosts table.
+  nsTHashMap<nsCStringHashKey, int64_t> mHostIds;
+  // Recent impressions by target host ID, so a site converting repeatedly
+  // is served from memory. Written through on insert and dropped whenever
+  // rows are deleted.
+  nsTHashMap<nsUint64HashKey, UniquePtr<CachedTarget>> mImpressionCache;
+  // Targets with more recent impressions than the cache can hold. Their
+  // lookups always use the index. Dropped along with the cache.
+  nsTHashSet<uint64_t> mUncacheableTargets;
+  size_t mCachedImpressionCount = 0;
+  uint64_t mImpressionCacheUses = 0;
+
+  // Size of mImpressionCache, for the memory reporter.
+  Atomic<size_t, Relaxed> mImpressionCacheBytes{0};
+};
+
+}  // namespace mozilla::dom
+
+#endif  // mozilla_dom_PrivateAttributionImpressionStore_h
@@ -9,9 +9,9 @@ import { XPCOMUtils } from "resource://gre/modules/XPCOMUtils.sys.mjs";
 import { AppConstants } from "resource://gre/modules/AppConstants.sys.mjs";
 
 ChromeUtils.defineESModuleGetters(lazy, {
-  IndexedDB: "resource://gre/modules/IndexedDB.sys.mjs",
   DAPTelemetrySender: "resource://gre/modules/DAPTelemetrySender.sys.mjs",
   HPKEConfigManager: "resource://gre/modules/HPKEConfigManager.sys.mjs",
+  IndexedDB: "resource://gre/modules/IndexedDB.sys.mjs",
   setTimeout: "resource://gre/modules/Timer.sys.mjs",
 });
 
@@ -29,6 +29,13 @@ XPCOMUtils.defineLazyPreferenceGetter(
   true
 );
 
+XPCOMUtils.defineLazyPreferenceGetter(
+  lazy,
+  "gMaxLookbackDays",
+  "dom.private-attribution.max-lookback-days",
+  30
+);
+
 XPCOMUtils.defineLazyPreferenceGetter(
   lazy,
   "gOhttpRelayUrl",
@@ -44,6 +51,11 @@ const DAY_IN_MILLI = 1000 * 60 * 60 * 24;
 const EPOCH_DURATION = 7 * DAY_IN_MILLI;
 const DAP_TIMEOUT_MILLI = 30000;
 
+// Impressions used to be kept in this IndexedDB database. It is deleted once
+// per profile, which the pref records.
+const LEGACY_DB_NAME = "PrivateAttribution";
+const LEGACY_DB_REMOVED_PREF = "dom.private-attribution.legacy-db-removed";
+
 /**
  *
  */
@@ -58,11 +70,6 @@ export class PrivateAttributionService {
     this._dateProvider = dateProvider ?? Date;
     this._testForceEnabled = testForceEnabled;
     this._testDapOptions = testDapOptions;
-
-    this.dbName = "PrivateAttribution";
-    this.impressionStoreName = "impressions";
-    this.storeNames = [this.impressionStoreName];
-    this.dbVersion = 1;
   }
 
   get dapTelemetrySender() {
@@ -81,7 +88,7 @@ export class PrivateAttributionService {
     const now = this.now();
 
     try {
-      const impressionStore = await this.getImpressionStore();
+      const impressionStore = this.getImpressionStore();
 
       const epoch = this.timestampToEpoch(now);
       const impression = {
@@ -93,7 +100,29 @@ export class PrivateAttributionService {
         ad,
       };
 
-      await this.addNewImpression(impressionStore, impression);
+      this.addNewImpression(impressionStore, impression);
+    } catch (e) {
+      console.error(e);
+    }
+  }
+
+  async onAttributionEvents(sourceHosts, types, indices, ads, targetHosts) {
+    if (!this.isEnabled()) {
+      return;
+    }
+
+    const now = this.now();
+
+    try {
+      const impressionStore = this.getImpressionStore();
+      impressionStore.addImpressions(
+        indices,
+        sourceHosts,
+        targetHosts,
+        now,
+        this.timestampToEpoch(now),
+        ads
+      );
     } catch (e) {
       console.error(e);
     }
@@ -113,51 +142,40 @@ export class PrivateAttributionService {
     }
 
     const now = this.now();
+    const nowEpoch = this.timestampToEpoch(now);
+    // Older impressions are expired by the store, so never look further
+    // back than they are kept.
+    const lookbackDaysEpoch = this.daysAgoToEpoch(
+      now,
+      Math.min(lookbackDays, lazy.gMaxLookbackDays)
+    );
+    const timerId = Glean.privateAttribution.conversionTime.start();
 
     try {
-      const impressionStore = await this.getImpressionStore();
-
-      const nowEpoch = this.timestampToEpoch(now);
-      const lookbackDaysEpoch = this.daysAgoToEpoch(now, lookbackDays);
-      for (let epoch = lookbackDaysEpoch; epoch <= nowEpoch; epoch++) {
-        const impressions = await this.getImpressions(impressionStore, epoch);
-
-        const relevantImpressions = await this.filterRelevantImpressions(
-          impressions,
-          ads,
-          sourceHosts,
-          targetHost
-        );
-
-        // format impressions as pdslib events
-        const events = relevantImpressions.map(impression => ({
-          timestamp: impression.timestamp,
-          epochNumber: impression.epoch,
-          histogramIndex: impression.index,
-          sourceHost: impression.sourceHost,
-          triggerHosts: [impression.targetHost],
-          intermediaryHosts: [impression.targetHost],
-          querierHosts: [impression.targetHost],
-        }));
-
-        const request = {
-          startEpoch: lookbackDaysEpoch,
-          endEpoch: nowEpoch,
-          attributableValue: 100.0,
-          maxAttributableValue: 200.0,
-          requestedEpsilon: 1.0,
-          histogramSize,
-          triggerHost: targetHost,
-          sourceHosts,
-          intermediaryHosts: [],
-          querierHosts: [targetHost],
-        };
-
-        const report = this.pdslib.computeReport(request, events);
-        console.log("Pdslib report:", report);
-      }
+      const impressionStore = this.getImpressionStore();
+
+      // One ranged query covers the whole lookback window, and pdslib
+      // computes a single report over all of its epochs. Both run on the
+      // store's background queue; only the report comes back here.
+      const report = await impressionStore.computeReport(
+        lookbackDaysEpoch,
+        nowEpoch,
+        targetHost,
+        ads,
+        sourceHosts ?? [],
+        histogramSize,
+        100.0, // attributableValue
+        200.0, // maxAttributableValue
+        1.0 // requestedEpsilon
+      );
+      Glean.privateAttribution.conversionTime.stopAndAccumulate(timerId);
+      console.log("Pdslib report:", report);
     } catch (e) {
+      Glean.privateAttribution.conversionTime.cancel(timerId);
       console.error(e);
+    } finally {
+      // Only the filters of the epochs the report covered were charged.
+      this.notifyBudgetsChanged(lookbackDaysEpoch, nowEpoch);
     }
   }
 
@@ -171,8 +189,8 @@ export class PrivateAttributionService {
       ad,
     };
 
-    const impressionStore = await this.getImpressionStore();
-    await this.addNewImpression(impressionStore, impression);
+    const impressionStore = this.getImpressionStore();
+    this.addNewImpression(impressionStore, impression);
   }
 
   async computeReportFor(
@@ -193,18 +211,27 @@ export class PrivateAttributionService {
     );
   }
 
-  getBudget(...args) {
-    return this.pdslib.getBudget(...args);
-  }
+  async clearBudgets() {
+    // pdslib is only called from the store's background queue.
+    const impressionStore = this.getImpressionStore();
+    await impressionStore.clearBudgets();
 
-  async clearBudgets(...args) {
-    this.pdslib.clearBudgets(...args);
+    this.notifyBudgetsChanged();
 
     // also clear impressions
-    const impressionStore = await this.getImpressionStore();
     await impressionStore.clear();
   }
 
+  // Lets content processes drop the budgets they cached. Without an epoch
+  // range, every budget may have changed.
+  notifyBudgetsChanged(startEpoch, endEpoch) {
+    Services.obs.notifyObservers(
+      null,
+      "private-attribution-budgets-changed",
+      startEpoch === undefined ? "" : `${startEpoch},${endEpoch}`
+    );
+  }
+
   timestampToEpoch(timestamp) {
     return Math.floor(timestamp / EPOCH_DURATION);
   }
@@ -215,66 +242,41 @@ export class PrivateAttributionService {
     return this.timestampToEpoch(targetTime);
   }
 
-  async addNewImpression(impressionStore, impression) {
-    const impressions = (await impressionStore.get(impression.epoch)) ?? [];
-    impressions.push(impression);
-    await impressionStore.put(impressions, impression.epoch);
-  }
-
-  async getImpressions(impressionStore, epoch) {
-    return (await impressionStore.get(epoch)) ?? [];
-  }
-
-  async filterRelevantImpressions(impressions, ads, sourceHosts, targetHost) {
-    return impressions.filter(
-      impression =>
-        ads.includes(impression.ad) &&
-        targetHost === impression.targetHost &&
-        (!sourceHosts || sourceHosts.includes(impression.sourceHost))
+  addNewImpression(impressionStore, impression) {
+    impressionStore.addImpression(
+      impression.index,
+      impression.sourceHost,
+      impression.targetHost,
+      impression.timestamp,
+      impression.epoch,
+      impression.ad
     );
   }
 
-  async getImpressionStore() {
-    return await this.getStore(this.impressionStoreName);
-  }
-
-  async getStore(storeName) {
-    return (await this.db).objectStore(storeName, "readwrite");
+  getImpressionStore() {
+    if (!this._impressionStore) {
+      this._impressionStore = Cc[
+        "@mozilla.org/private-attribution-impression-store;1"
+      ].getService(Ci.nsIPrivateAttributionImpressionStore);
+      this._legacyDatabaseRemoval = this.removeLegacyDatabase();
+    }
+    return this._impressionStore;
   }
 
-  get db() {
-    return this._db || (this._db = this.createOrOpenDb());
-  }
+  async removeLegacyDatabase() {
+    if (Services.prefs.getBoolPref(LEGACY_DB_REMOVED_PREF, false)) {
+      return;
+    }
 
-  async createOrOpenDb() {
     try {
-      return await this.openDatabase();
-    } catch {
-      await lazy.IndexedDB.deleteDatabase(this.dbName);
-      return this.openDatabase();
+      await lazy.IndexedDB.deleteDatabase(LEGACY_DB_NAME);
+      Services.prefs.setBoolPref(LEGACY_DB_REMOVED_PREF, true);
+    } catch (e) {
+      // Tried again next session.
+      console.error(e);
     }
   }
 
-  async openDatabase() {
-    return await lazy.IndexedDB.open(this.dbName, this.dbVersion, db => {
-      this.storeNames.forEach(store => {
-        if (!db.objectStoreNames.contains(store)) {
-          db.createObjectStore(store);
-        }
-      });
-    });
-  }
-
-  get pdslib() {
-    return this._pdslib || (this._pdslib = this.getPdslibService());
-  }
-
-  getPdslibService() {
-    return Cc["@mozilla.org/private-attribution-pdslib;1"].getService(
-      Ci.nsIPrivateAttributionPdslibService
-    );
-  }
-
   async sendDapReport(id, index, size, value) {
     const task = {
       id,
@@ -285,6 +287,17 @@ export class PrivateAttributionService {
     const measurement = new Array(size).fill(0);
     measurement[index] = value;
 
+    const timerId = Glean.privateAttribution.dapSubmissionTime.start();
+    try {
+      await this._sendDapMeasurement(task, measurement);
+      Glean.privateAttribution.dapSubmissionTime.stopAndAccumulate(timerId);
+    } catch (e) {
+      Glean.privateAttribution.dapSubmissionTime.cancel(timerId);
+      throw e;
+    }
+  }
+
+  async _sendDapMeasurement(task, measurement) {
     let options = {
       timeout: DAP_TIMEOUT_MILLI,
       ohttp_relay: lazy.gOhttpRelayUrl,
@@ -310,7 +323,9 @@ export class PrivateAttributionService {
       throw new Error("PPA requires an OHTTP relay for submission");
     }
 
-    await this.dapTelemetrySender.sendDAPMeasurement(
+    // Reports from conversions that land close together are generated and
+    // uploaded as one batch.
+    await this.dapTelemetrySender.queueDAPMeasurement(
       task,
       measurement,
       options
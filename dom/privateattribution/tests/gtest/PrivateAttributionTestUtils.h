@@ -0,0 +1,40 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef mozilla_dom_PrivateAttributionTestUtils_h
+#define mozilla_dom_PrivateAttributionTestUtils_h
+
+#include "mozilla/Maybe.h"
+#include "mozilla/MozPromise.h"
+#include "mozilla/SpinEventLoopUntil.h"
+#include "nsThreadUtils.h"
+#include "prtime.h"
+
+namespace mozilla::dom {
+
+// Must match PrivateAttributionService.sys.mjs.
+constexpr uint64_t kTestEpochDuration = 7 * 24 * 60 * 60 * 1000;
+
+inline uint64_t CurrentTestEpoch() {
+  return uint64_t(PR_Now() / PR_USEC_PER_MSEC) / kTestEpochDuration;
+}
+
+// Spins the event loop until aPromise settles.
+template <typename PromiseT>
+typename PromiseT::ResolveOrRejectValue Await(RefPtr<PromiseT>&& aPromise) {
+  Maybe<typename PromiseT::ResolveOrRejectValue> result;
+  aPromise->Then(GetCurrentSerialEventTarget(), __func__,
+                 [&](typename PromiseT::ResolveOrRejectValue&& aValue) {
+                   result.emplace(std::move(aValue));
+                 });
+  SpinEventLoopUntil("PrivateAttributionTest"_ns,
+                     [&] { return result.isSome(); });
+  return result.extract();
+}
+
+}  // namespace mozilla::dom
+
+#endif  // mozilla_dom_PrivateAttributionTestUtils_h
@@ -0,0 +1,188 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Load generator for the Private Attribution pipeline. Populates the
+// impression store with N impressions spread over M epochs and H hosts, then
+// runs conversions through the store and pdslib, printing insert throughput,
+// conversion latency percentiles and heap growth. The sizes can be overridden
+// with PA_BENCH_IMPRESSIONS, PA_BENCH_EPOCHS, PA_BENCH_HOSTS and
+// PA_BENCH_CONVERSIONS to size a deployment.
+//
+// It takes a while and writes to the profile, so it is disabled by default.
+// Run it with
+// ./mach gtest 'PrivateAttributionBenchmark.*' --gtest_also_run_disabled_tests
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+
+#include "PrivateAttributionImpressionStore.h"
+#include "PrivateAttributionTestUtils.h"
+#include "gtest/gtest.h"
+#include "mozilla/Atomics.h"
+#include "mozilla/TimeStamp.h"
+#include "mozilla/Unused.h"
+#include "nsPrintfCString.h"
+
+#ifdef MOZ_MEMORY
+#  include "mozmemory.h"
+#endif
+
+using namespace mozilla;
+using namespace mozilla::dom;
+
+static const uint32_t kAdCount = 4;
+static const uint32_t kHistogramSize = 8;
+
+static uint32_t SizeFromEnv(const char* aName, uint32_t aDefault) {
+  const char* value = getenv(aName);
+  if (!value || !*value) {
+    return aDefault;
+  }
+  uint32_t size = static_cast<uint32_t>(strtoul(value, nullptr, 10));
+  return size ? size : aDefault;
+}
+
+static size_t HeapAllocated() {
+#ifdef MOZ_MEMORY
+  jemalloc_stats_t stats;
+  jemalloc_stats(&stats);
+  return stats.allocated;
+#else
+  return 0;
+#endif
+}
+
+// Samples the heap from another thread while the store and pdslib work, so
+// the peak reflects memory held mid-lookup and mid-report.
+class HeapSampler {
+ public:
+  HeapSampler() : mPeak(HeapAllocated()) {
+    mThread = std::thread([this] {
+      while (!mStop) {
+        size_t allocated = HeapAllocated();
+        if (allocated > mPeak) {
+          mPeak = allocated;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+  }
+
+  ~HeapSampler() { Stop(); }
+
+  size_t Stop() {
+    if (mThread.joinable()) {
+      mStop = true;
+      mThread.join();
+    }
+    return mPeak;
+  }
+
+ private:
+  Atomic<bool> mStop{false};
+  Atomic<size_t> mPeak;
+  std::thread mThread;
+};
+
+static nsCString SourceHost(uint32_t aIndex) {
+  return nsPrintfCString("source-%u.example", aIndex);
+}
+
+static nsCString TargetHost(uint32_t aIndex) {
+  return nsPrintfCString("target-%u.example", aIndex);
+}
+
+static nsString Ad(uint32_t aIndex) {
+  return NS_ConvertUTF8toUTF16(nsPrintfCString("ad-%u", aIndex));
+}
+
+static double Percentile(const nsTArray<double>& aSorted, double aFraction) {
+  size_t index = static_cast<size_t>(aFraction * (aSorted.Length() - 1));
+  return aSorted[index];
+}
+
+TEST(PrivateAttributionBenchmark, DISABLED_Pipeline)
+{
+  // Only conversions inside the retention window are served from the
+  // impression cache, so spread impressions over the retained epochs.
+  const uint64_t firstEpoch =
+      PrivateAttributionImpressionStore::FirstRetainedEpoch();
+  const uint32_t impressionCount = SizeFromEnv("PA_BENCH_IMPRESSIONS", 10000);
+  const uint32_t epochCount = SizeFromEnv(
+      "PA_BENCH_EPOCHS", uint32_t(CurrentTestEpoch() - firstEpoch + 1));
+  const uint32_t hostCount = SizeFromEnv("PA_BENCH_HOSTS", 50);
+  const uint32_t conversionCount = SizeFromEnv("PA_BENCH_CONVERSIONS", 100);
+
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+
+  const size_t heapBefore = HeapAllocated();
+  HeapSampler sampler;
+
+  // Impression i lands in epoch i % M and pairs source i % H with target
+  // (i / H) % H, so every target sees impressions from every source.
+  nsTArray<PrivateAttributionImpressionData> impressions(impressionCount);
+  for (uint32_t i = 0; i < impressionCount; ++i) {
+    const uint64_t epoch = firstEpoch + i % epochCount;
+    impressions.AppendElement(PrivateAttributionImpressionData{
+        i % kHistogramSize, SourceHost(i % hostCount),
+        TargetHost((i / hostCount) % hostCount), epoch * kTestEpochDuration + i,
+        epoch, Ad(i % kAdCount)});
+  }
+
+  nsTArray<nsCString> sources(hostCount);
+  for (uint32_t i = 0; i < hostCount; ++i) {
+    sources.AppendElement(SourceHost(i));
+  }
+  nsTArray<nsString> ads(kAdCount);
+  for (uint32_t i = 0; i < kAdCount; ++i) {
+    ads.AppendElement(Ad(i));
+  }
+  const uint64_t lastEpoch = firstEpoch + epochCount - 1;
+
+  // The store's queue is serial, so the lookup resolves once every insert
+  // queued before it has been written.
+  TimeStamp insertStart = TimeStamp::Now();
+  ASSERT_EQ(store->AddImpressions(std::move(impressions)), NS_OK);
+  auto lookup = Await(store->GetImpressions(firstEpoch, lastEpoch,
+                                            TargetHost(0), ads, sources));
+  const double insertMs = (TimeStamp::Now() - insertStart).ToMilliseconds();
+  ASSERT_TRUE(lookup.IsResolve());
+  EXPECT_FALSE(lookup.ResolveValue().IsEmpty());
+
+  nsTArray<double> latencies(conversionCount);
+  for (uint32_t i = 0; i < conversionCount; ++i) {
+    TimeStamp start = TimeStamp::Now();
+    auto report = Await(store->ComputeReport(PrivateAttributionReportParams{
+        firstEpoch, lastEpoch, TargetHost(i % hostCount), ads.Clone(),
+        sources.Clone(), kHistogramSize, 100.0, 200.0, 1.0}));
+    latencies.AppendElement((TimeStamp::Now() - start).ToMilliseconds());
+    ASSERT_TRUE(report.IsResolve());
+    EXPECT_EQ(report.ResolveValue().Length(), kHistogramSize);
+  }
+  const size_t heapPeak = sampler.Stop();
+  latencies.Sort();
+
+  printf(
+      "PrivateAttributionBenchmark: %u impressions, %u epochs, %u hosts\n"
+      "  insert: %.1f ms (%.0f impressions/s)\n"
+      "  conversion (%u runs): p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+      "max %.2f ms\n"
+      "  heap growth: %zu KiB (peak while inserting and converting)\n",
+      impressionCount, epochCount, hostCount, insertMs,
+      impressionCount / (insertMs / 1000.0), conversionCount,
+      Percentile(latencies, 0.5), Percentile(latencies, 0.9),
+      Percentile(latencies, 0.99), latencies.LastElement(),
+      (heapPeak > heapBefore ? heapPeak - heapBefore : 0) / 1024);
+
+  // Leave the profile as we found it.
+  EXPECT_TRUE(Await(store->Clear()).IsResolve());
+  Unused << Await(store->ClearBudgets());
+}
@@ -0,0 +1,203 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PrivateAttributionBudgetTable.h"
+#include "PrivateAttributionImpressionStore.h"
+#include "PrivateAttributionTestUtils.h"
+#include "gtest/gtest.h"
+#include "mozilla/Services.h"
+#include "nsIObserverService.h"
+#include "nsPrintfCString.h"
+
+using namespace mozilla;
+using namespace mozilla::dom;
+
+static already_AddRefed<PrivateAttributionBudgetTable> MapAtGeneration(
+    const ipc::ReadOnlySharedMemoryHandle& aHandle, uint64_t aGeneration,
+    ipc::SharedMemoryMapping* aGenerationMapping = nullptr) {
+  auto result = PrivateAttributionBudgetTable::CreateGeneration();
+  if (result.isErr()) {
+    return nullptr;
+  }
+  auto [handle, mapping] = result.unwrap();
+  PrivateAttributionBudgetTable::SetGeneration(mapping, aGeneration);
+  if (aGenerationMapping) {
+    *aGenerationMapping = std::move(mapping);
+  }
+  return PrivateAttributionBudgetTable::Map(aHandle, handle);
+}
+
+TEST(PrivateAttributionBudgetTable, RoundTrip)
+{
+  PrivateAttributionBudgetTable::Budgets budgets;
+  budgets.InsertOrUpdate(
+      PrivateAttributionBudgetTable::Key("nc"_ns, 2900, "a.example"_ns), 1.0);
+  budgets.InsertOrUpdate(
+      PrivateAttributionBudgetTable::Key("nc"_ns, 2901, "a.example"_ns), 0.25);
+  budgets.InsertOrUpdate(
+      PrivateAttributionBudgetTable::Key("c"_ns, 2900, "b.example"_ns), 0.0);
+
+  auto result = PrivateAttributionBudgetTable::Serialize(7, budgets);
+  ASSERT_TRUE(result.isOk());
+  ipc::ReadOnlySharedMemoryHandle handle = result.unwrap();
+
+  RefPtr<PrivateAttributionBudgetTable> table = MapAtGeneration(handle, 7);
+  ASSERT_TRUE(table);
+  EXPECT_EQ(table->Generation(), 7u);
+  EXPECT_TRUE(table->IsCurrent());
+  EXPECT_EQ(table->Count(), 3u);
+
+  for (const auto& entry : budgets) {
+    Maybe<double> budget = table->Lookup(entry.GetKey());
+    ASSERT_TRUE(budget.isSome()) << entry.GetKey().get();
+    EXPECT_EQ(*budget, entry.GetData());
+  }
+  EXPECT_TRUE(
+      table
+          ->Lookup(PrivateAttributionBudgetTable::Key("nc"_ns, 2902,
+                                                      "a.example"_ns))
+          .isNothing());
+  EXPECT_TRUE(table->Lookup(""_ns).isNothing());
+}
+
+TEST(PrivateAttributionBudgetTable, Empty)
+{
+  auto result = PrivateAttributionBudgetTable::Serialize(
+      1, PrivateAttributionBudgetTable::Budgets());
+  ASSERT_TRUE(result.isOk());
+  ipc::ReadOnlySharedMemoryHandle handle = result.unwrap();
+
+  RefPtr<PrivateAttributionBudgetTable> table = MapAtGeneration(handle, 1);
+  ASSERT_TRUE(table);
+  EXPECT_EQ(table->Count(), 0u);
+  EXPECT_TRUE(
+      table
+          ->Lookup(PrivateAttributionBudgetTable::Key("nc"_ns, 1,
+                                                      "a.example"_ns))
+          .isNothing());
+}
+
+// A snapshot stops being current as soon as the parent bumps the shared
+// generation, before any new snapshot is mapped.
+TEST(PrivateAttributionBudgetTable, SharedGeneration)
+{
+  PrivateAttributionBudgetTable::Budgets budgets;
+  budgets.InsertOrUpdate(
+      PrivateAttributionBudgetTable::Key("nc"_ns, 2900, "a.example"_ns), 1.0);
+  auto result = PrivateAttributionBudgetTable::Serialize(3, budgets);
+  ASSERT_TRUE(result.isOk());
+  ipc::ReadOnlySharedMemoryHandle handle = result.unwrap();
+
+  ipc::SharedMemoryMapping generation;
+  RefPtr<PrivateAttributionBudgetTable> table =
+      MapAtGeneration(handle, 3, &generation);
+  ASSERT_TRUE(table);
+  EXPECT_TRUE(table->IsCurrent());
+
+  PrivateAttributionBudgetTable::SetGeneration(generation, 4);
+  EXPECT_FALSE(table->IsCurrent());
+}
+
+// Filter types come from content, so they can't be used to forge the key of
+// another budget.
+TEST(PrivateAttributionBudgetTable, KeysDontCollide)
+{
+  EXPECT_NE(PrivateAttributionBudgetTable::Key("nc|1"_ns, 2, "a.example"_ns),
+            PrivateAttributionBudgetTable::Key("nc"_ns, 12, "a.example"_ns));
+  EXPECT_NE(PrivateAttributionBudgetTable::Key("nc|1|a"_ns, 2, "b"_ns),
+            PrivateAttributionBudgetTable::Key("nc"_ns, 1, "a|2|b"_ns));
+  EXPECT_NE(PrivateAttributionBudgetTable::Key("1"_ns, 2, "a.example"_ns),
+            PrivateAttributionBudgetTable::Key(""_ns, 12, "a.example"_ns));
+}
+
+using Publisher = PrivateAttributionBudgetPublisher;
+
+static nsCString Host(uint32_t aIndex) {
+  return nsPrintfCString("site%u.example", aIndex);
+}
+
+// Once the table is full, budgets of epochs past retention are evicted to
+// make room, but current ones are never dropped.
+TEST(PrivateAttributionBudgetPublisher, EvictsExpiredEpochsAtCap)
+{
+  Publisher::ClearForTesting();
+  const uint64_t firstEpoch =
+      PrivateAttributionImpressionStore::FirstRetainedEpoch();
+  ASSERT_GT(firstEpoch, 0u);
+
+  for (uint32_t i = 0; i < Publisher::kMaxPublishedBudgets; i++) {
+    Publisher::Record("nc"_ns, firstEpoch - 1, Host(i), 1.0);
+  }
+  EXPECT_EQ(Publisher::TrackedBudgetCountForTesting(),
+            Publisher::kMaxPublishedBudgets);
+
+  Publisher::Record("nc"_ns, firstEpoch, "new.example"_ns, 0.5);
+  EXPECT_EQ(Publisher::TrackedBudgetCountForTesting(), 1u);
+  EXPECT_EQ(Publisher::GetTrackedBudgetForTesting(
+                PrivateAttributionBudgetTable::Key("nc"_ns, firstEpoch,
+                                                   "new.example"_ns)),
+            Some(0.5));
+
+  // Nothing has expired this time, so the cap holds.
+  for (uint32_t i = 1; i < Publisher::kMaxPublishedBudgets; i++) {
+    Publisher::Record("nc"_ns, firstEpoch, Host(i), 1.0);
+  }
+  EXPECT_EQ(Publisher::TrackedBudgetCountForTesting(),
+            Publisher::kMaxPublishedBudgets);
+  Publisher::Record("nc"_ns, firstEpoch, "late.example"_ns, 1.0);
+  EXPECT_EQ(Publisher::TrackedBudgetCountForTesting(),
+            Publisher::kMaxPublishedBudgets);
+  EXPECT_TRUE(Publisher::GetTrackedBudgetForTesting(
+                  PrivateAttributionBudgetTable::Key("nc"_ns, firstEpoch,
+                                                     "late.example"_ns))
+                  .isNothing());
+
+  Publisher::ClearForTesting();
+}
+
+// A conversion only re-reads the budgets of the epochs it covered; clearing
+// the budgets re-reads all of them.
+TEST(PrivateAttributionBudgetPublisher, RefreshesChangedEpochs)
+{
+  Publisher::ClearForTesting();
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  nsCOMPtr<nsIObserverService> obs = services::GetObserverService();
+  ASSERT_TRUE(obs);
+
+  const uint64_t epoch = CurrentTestEpoch();
+  auto current = Await(store->GetBudget("nc"_ns, epoch, "a.example"_ns));
+  ASSERT_TRUE(current.IsResolve());
+  const double budget = current.ResolveValue();
+  const double stale = budget + 1.0;
+
+  const nsCString charged =
+      PrivateAttributionBudgetTable::Key("nc"_ns, epoch, "a.example"_ns);
+  const nsCString other =
+      PrivateAttributionBudgetTable::Key("nc"_ns, epoch - 1, "a.example"_ns);
+  Publisher::Record("nc"_ns, epoch, "a.example"_ns, stale);
+  Publisher::Record("nc"_ns, epoch - 1, "a.example"_ns, stale);
+
+  nsAutoString range;
+  range.AppendInt(epoch);
+  range.Append(',');
+  range.AppendInt(epoch);
+  obs->NotifyObservers(nullptr, "private-attribution-budgets-changed",
+                       range.get());
+  SpinEventLoopUntil("PrivateAttributionTest"_ns, [&] {
+    return Publisher::GetTrackedBudgetForTesting(charged) == Some(budget);
+  });
+  // Both budgets would have been read in the same batch.
+  EXPECT_EQ(Publisher::GetTrackedBudgetForTesting(other), Some(stale));
+
+  obs->NotifyObservers(nullptr, "private-attribution-budgets-changed", u"");
+  SpinEventLoopUntil("PrivateAttributionTest"_ns, [&] {
+    return Publisher::GetTrackedBudgetForTesting(other) != Some(stale);
+  });
+
+  Publisher::ClearForTesting();
+}
@@ -0,0 +1,473 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "PrivateAttributionImpressionStore.h"
+#include "PrivateAttributionTestUtils.h"
+#include "gtest/gtest.h"
+#include "mozIStorageConnection.h"
+#include "mozIStorageService.h"
+#include "mozIStorageStatement.h"
+#include "mozStorageCID.h"
+#include "nsIFile.h"
+
+using namespace mozilla;
+using namespace mozilla::dom;
+
+static PrivateAttributionImpressionData Impression(
+    uint32_t aIndex, uint64_t aEpoch, const nsAString& aAd,
+    const nsACString& aSourceHost = "source.example"_ns,
+    const nsACString& aTargetHost = "target.example"_ns) {
+  return PrivateAttributionImpressionData{aIndex,
+                                          nsCString(aSourceHost),
+                                          nsCString(aTargetHost),
+                                          aEpoch * kTestEpochDuration + aIndex,
+                                          aEpoch,
+                                          nsString(aAd)};
+}
+
+static nsTArray<PrivateAttributionImpressionData> Lookup(
+    PrivateAttributionImpressionStore* aStore, uint64_t aStartEpoch,
+    uint64_t aEndEpoch, const nsTArray<nsString>& aAds,
+    const nsTArray<nsCString>& aSources,
+    const nsACString& aTargetHost = "target.example"_ns) {
+  auto result = Await(aStore->GetImpressions(aStartEpoch, aEndEpoch,
+                                             aTargetHost, aAds, aSources));
+  EXPECT_TRUE(result.IsResolve());
+  return result.IsResolve() ? result.ResolveValue().Clone()
+                            : nsTArray<PrivateAttributionImpressionData>();
+}
+
+static nsTArray<uint32_t> Indices(
+    const nsTArray<PrivateAttributionImpressionData>& aRows) {
+  nsTArray<uint32_t> indices(aRows.Length());
+  for (const auto& row : aRows) {
+    indices.AppendElement(row.mIndex);
+  }
+  return indices;
+}
+
+// Impressions are written to the database file, not only kept in memory, and
+// Clear() removes them from it.
+TEST(PrivateAttributionImpressionStore, PersistsImpressions)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+
+  const uint64_t epoch = CurrentTestEpoch();
+  const nsTArray<nsString> ads{u"ad"_ns};
+  const nsTArray<nsCString> sources{"source.example"_ns};
+
+  ASSERT_EQ(store->AddImpression(Impression(1, epoch, u"ad"_ns)), NS_OK);
+  nsTArray<PrivateAttributionImpressionData> batch;
+  batch.AppendElement(Impression(2, epoch, u"ad"_ns));
+  batch.AppendElement(Impression(3, epoch, u"ad"_ns));
+  ASSERT_EQ(store->AddImpressions(std::move(batch)), NS_OK);
+  ASSERT_TRUE(Await(store->CloseConnectionForTesting()).IsResolve());
+
+  nsTArray<PrivateAttributionImpressionData> rows =
+      Lookup(store, epoch, epoch, ads, sources);
+  EXPECT_EQ(Indices(rows), (nsTArray<uint32_t>{1, 2, 3}));
+  ASSERT_EQ(rows.Length(), 3u);
+  EXPECT_EQ(rows[1].mSourceHost, "source.example"_ns);
+  EXPECT_EQ(rows[1].mTargetHost, "target.example"_ns);
+  EXPECT_EQ(rows[1].mTimestamp, epoch * kTestEpochDuration + 2);
+  EXPECT_EQ(rows[1].mEpoch, epoch);
+  EXPECT_EQ(rows[1].mAd, u"ad"_ns);
+
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+  ASSERT_TRUE(Await(store->CloseConnectionForTesting()).IsResolve());
+  EXPECT_TRUE(Lookup(store, epoch, epoch, ads, sources).IsEmpty());
+}
+
+// Repeated lookups of recent epochs are served from the in-memory cache,
+// which has to see later inserts and forget cleared rows.
+TEST(PrivateAttributionImpressionStore, RecentImpressionsStayCoherent)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+
+  const uint64_t epoch = CurrentTestEpoch();
+  const nsTArray<nsString> ads{u"ad"_ns};
+  const nsTArray<nsCString> sources{"source.example"_ns};
+  auto lookup = [&] { return Lookup(store, epoch, epoch, ads, sources); };
+
+  ASSERT_EQ(store->AddImpression(Impression(1, epoch, u"ad"_ns)), NS_OK);
+  ASSERT_EQ(store->AddImpression(Impression(2, epoch, u"other"_ns)), NS_OK);
+  nsTArray<PrivateAttributionImpressionData> rows = lookup();
+  ASSERT_EQ(rows.Length(), 1u);
+  EXPECT_EQ(rows[0].mIndex, 1u);
+
+  // Written through to the cached target, after the existing row.
+  ASSERT_EQ(store->AddImpression(Impression(3, epoch, u"ad"_ns)), NS_OK);
+  rows = lookup();
+  ASSERT_EQ(rows.Length(), 2u);
+  EXPECT_EQ(rows[0].mIndex, 1u);
+  EXPECT_EQ(rows[1].mIndex, 3u);
+  EXPECT_EQ(rows[1].mSourceHost, "source.example"_ns);
+
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+  EXPECT_TRUE(lookup().IsEmpty());
+}
+
+// Inserts impressions over three epochs starting at aFirstEpoch, out of epoch
+// order, and checks what conversions over different ranges see.
+static void CheckRangeQueries(PrivateAttributionImpressionStore* aStore,
+                              uint64_t aFirstEpoch) {
+  ASSERT_TRUE(Await(aStore->Clear()).IsResolve());
+
+  const uint64_t e0 = aFirstEpoch;
+  const uint64_t e1 = aFirstEpoch + 1;
+  const uint64_t e2 = aFirstEpoch + 2;
+  nsTArray<PrivateAttributionImpressionData> impressions;
+  impressions.AppendElement(Impression(1, e2, u"ad"_ns));
+  impressions.AppendElement(Impression(2, e0, u"ad"_ns));
+  impressions.AppendElement(Impression(3, e1, u"ad"_ns, "other.example"_ns));
+  impressions.AppendElement(Impression(4, e1, u"other"_ns));
+  impressions.AppendElement(Impression(5, e0, u"ad"_ns));
+  impressions.AppendElement(
+      Impression(6, e1, u"ad"_ns, "source.example"_ns, "other.example"_ns));
+  ASSERT_EQ(aStore->AddImpressions(std::move(impressions)), NS_OK);
+
+  const nsTArray<nsString> ads{u"ad"_ns};
+  const nsTArray<nsString> allAds{u"ad"_ns, u"other"_ns};
+  const nsTArray<nsCString> sources{"source.example"_ns};
+  const nsTArray<nsCString> allSources{"source.example"_ns,
+                                       "other.example"_ns,
+                                       "unknown.example"_ns};
+  const nsTArray<nsCString> unknownSources{"unknown.example"_ns};
+
+  // In epoch order, then insertion order, with both bounds included.
+  EXPECT_EQ(Indices(Lookup(aStore, e0, e2, ads, sources)),
+            (nsTArray<uint32_t>{2, 5, 1}));
+  EXPECT_EQ(Indices(Lookup(aStore, e1, e2, ads, sources)),
+            (nsTArray<uint32_t>{1}));
+  EXPECT_EQ(Indices(Lookup(aStore, e0, e0, ads, sources)),
+            (nsTArray<uint32_t>{2, 5}));
+  EXPECT_TRUE(Lookup(aStore, e2 + 1, e2 + 5, ads, sources).IsEmpty());
+  EXPECT_TRUE(Lookup(aStore, e2, e0, ads, sources).IsEmpty());
+
+  // Only the requested ads and sources of the target match.
+  EXPECT_EQ(Indices(Lookup(aStore, e1, e1, allAds, allSources)),
+            (nsTArray<uint32_t>{3, 4}));
+  EXPECT_EQ(Indices(Lookup(aStore, e1, e1, allAds, sources)),
+            (nsTArray<uint32_t>{4}));
+  EXPECT_EQ(Indices(Lookup(aStore, e0, e2, ads, allSources,
+                           "other.example"_ns)),
+            (nsTArray<uint32_t>{6}));
+  EXPECT_TRUE(
+      Lookup(aStore, e0, e2, ads, sources, "unknown.example"_ns).IsEmpty());
+  EXPECT_TRUE(Lookup(aStore, e0, e2, ads, unknownSources).IsEmpty());
+  EXPECT_TRUE(Lookup(aStore, e0, e2, nsTArray<nsString>(), sources).IsEmpty());
+
+  ASSERT_TRUE(Await(aStore->Clear()).IsResolve());
+}
+
+// Conversions within the retention window are served from the cache, older
+// ones from the index. Both have to answer the same way.
+TEST(PrivateAttributionImpressionStore, RangeQueries)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+
+  const uint64_t firstRetained =
+      PrivateAttributionImpressionStore::FirstRetainedEpoch();
+  ASSERT_LE(firstRetained + 2, CurrentTestEpoch());
+  CheckRangeQueries(store, firstRetained);
+  CheckRangeQueries(store, firstRetained - 10);
+}
+
+// A conversion gets one report over its whole window, sized to its
+// histogram, whether or not any impression matches.
+TEST(PrivateAttributionImpressionStore, ComputesOneReportPerConversion)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+
+  const uint64_t epoch = CurrentTestEpoch();
+  ASSERT_EQ(store->AddImpression(Impression(3, epoch - 1, u"ad"_ns)), NS_OK);
+  ASSERT_EQ(store->AddImpression(Impression(1, epoch, u"ad"_ns)), NS_OK);
+
+  auto report = [&](nsTArray<nsString>&& aAds) {
+    auto result = Await(store->ComputeReport(PrivateAttributionReportParams{
+        epoch - 1, epoch, "target.example"_ns, std::move(aAds),
+        nsTArray<nsCString>{"source.example"_ns}, 5, 1.0, 1.0, 1.0}));
+    EXPECT_TRUE(result.IsResolve());
+    return result.IsResolve() ? result.ResolveValue().Clone()
+                              : nsTArray<double>();
+  };
+  EXPECT_EQ(report(nsTArray<nsString>{u"ad"_ns}).Length(), 5u);
+  EXPECT_EQ(report(nsTArray<nsString>{u"none"_ns}).Length(), 5u);
+
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+  EXPECT_TRUE(Await(store->ClearBudgets()).IsResolve());
+}
+
+static nsCOMPtr<mozIStorageConnection> OpenDatabase(
+    PrivateAttributionImpressionStore* aStore) {
+  nsCOMPtr<nsIFile> file = aStore->GetDatabaseFileForTesting();
+  nsCOMPtr<mozIStorageService> storage =
+      do_GetService(MOZ_STORAGE_SERVICE_CONTRACTID);
+  nsCOMPtr<mozIStorageConnection> conn;
+  if (!file || !storage ||
+      NS_FAILED(storage->OpenDatabase(file,
+                                      mozIStorageService::CONNECTION_DEFAULT,
+                                      getter_AddRefs(conn)))) {
+    return nullptr;
+  }
+  return conn;
+}
+
+// Replaces the store's tables with ones of a layout this build doesn't know,
+// holding aRows, and marks them as schema aVersion.
+static void WriteUnknownDatabase(
+    PrivateAttributionImpressionStore* aStore, int32_t aVersion,
+    const nsTArray<PrivateAttributionImpressionData>& aRows) {
+  ASSERT_TRUE(Await(aStore->CloseConnectionForTesting()).IsResolve());
+  nsCOMPtr<mozIStorageConnection> conn = OpenDatabase(aStore);
+  ASSERT_TRUE(conn);
+
+  ASSERT_EQ(conn->ExecuteSimpleSQL("DROP TABLE IF EXISTS impressions;"_ns),
+            NS_OK);
+  ASSERT_EQ(conn->ExecuteSimpleSQL("DROP TABLE IF EXISTS hosts;"_ns), NS_OK);
+  ASSERT_EQ(conn->ExecuteSimpleSQL("CREATE TABLE impressions ("
+                                   "id INTEGER PRIMARY KEY, "
+                                   "epoch INTEGER NOT NULL, "
+                                   "targetHost TEXT NOT NULL, "
+                                   "ad TEXT NOT NULL, "
+                                   "sourceHost TEXT NOT NULL, "
+                                   "histogramIndex INTEGER NOT NULL, "
+                                   "timestamp INTEGER NOT NULL"
+                                   ");"_ns),
+            NS_OK);
+  ASSERT_EQ(
+      conn->ExecuteSimpleSQL("CREATE INDEX impressions_lookup "
+                             "ON impressions (epoch, targetHost, ad);"_ns),
+      NS_OK);
+
+  nsCOMPtr<mozIStorageStatement> stmt;
+  ASSERT_EQ(conn->CreateStatement(
+                "INSERT INTO impressions (epoch, targetHost, ad, sourceHost, "
+                "histogramIndex, timestamp) VALUES (:epoch, :targetHost, "
+                ":ad, :sourceHost, :histogramIndex, :timestamp);"_ns,
+                getter_AddRefs(stmt)),
+            NS_OK);
+  for (const auto& row : aRows) {
+    ASSERT_EQ(stmt->BindInt64ByName("epoch"_ns, int64_t(row.mEpoch)), NS_OK);
+    ASSERT_EQ(stmt->BindUTF8StringByName("targetHost"_ns, row.mTargetHost),
+              NS_OK);
+    ASSERT_EQ(stmt->BindStringByName("ad"_ns, row.mAd), NS_OK);
+    ASSERT_EQ(stmt->BindUTF8StringByName("sourceHost"_ns, row.mSourceHost),
+              NS_OK);
+    ASSERT_EQ(stmt->BindInt32ByName("histogramIndex"_ns, int32_t(row.mIndex)),
+              NS_OK);
+    ASSERT_EQ(stmt->BindInt64ByName("timestamp"_ns, int64_t(row.mTimestamp)),
+              NS_OK);
+    ASSERT_EQ(stmt->Execute(), NS_OK);
+  }
+  ASSERT_EQ(stmt->Finalize(), NS_OK);
+
+  ASSERT_EQ(conn->SetSchemaVersion(aVersion), NS_OK);
+  ASSERT_EQ(conn->Close(), NS_OK);
+}
+
+// Each host is stored once and keeps its ID whether it is the source or the
+// target of an impression, and across reopening the database.
+TEST(PrivateAttributionImpressionStore, InternsHosts)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+
+  const uint64_t epoch = CurrentTestEpoch();
+  const nsTArray<nsString> ads{u"ad"_ns};
+  const nsTArray<nsCString> sources{"a.example"_ns, "b.example"_ns};
+  ASSERT_EQ(store->AddImpression(Impression(1, epoch, u"ad"_ns, "a.example"_ns,
+                                            "b.example"_ns)),
+            NS_OK);
+  ASSERT_EQ(store->AddImpression(Impression(2, epoch, u"ad"_ns, "b.example"_ns,
+                                            "a.example"_ns)),
+            NS_OK);
+
+  nsTArray<PrivateAttributionImpressionData> toB =
+      Lookup(store, epoch, epoch, ads, sources, "b.example"_ns);
+  nsTArray<PrivateAttributionImpressionData> toA =
+      Lookup(store, epoch, epoch, ads, sources, "a.example"_ns);
+  ASSERT_EQ(toB.Length(), 1u);
+  ASSERT_EQ(toA.Length(), 1u);
+  EXPECT_NE(toB[0].mSourceHostId, toB[0].mTargetHostId);
+  EXPECT_EQ(toB[0].mSourceHostId, toA[0].mTargetHostId);
+  EXPECT_EQ(toB[0].mTargetHostId, toA[0].mSourceHostId);
+
+  ASSERT_TRUE(Await(store->CloseConnectionForTesting()).IsResolve());
+  nsTArray<PrivateAttributionImpressionData> reopened =
+      Lookup(store, epoch, epoch, ads, sources, "b.example"_ns);
+  ASSERT_EQ(reopened.Length(), 1u);
+  EXPECT_EQ(reopened[0].mSourceHostId, toB[0].mSourceHostId);
+  EXPECT_EQ(reopened[0].mTargetHostId, toB[0].mTargetHostId);
+
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+}
+
+// Databases of an unknown or newer schema version are dropped and recreated
+// empty when they are first opened.
+TEST(PrivateAttributionImpressionStore, RecreatesUnknownSchemas)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+
+  const uint64_t epoch = CurrentTestEpoch();
+  const nsTArray<nsString> ads{u"ad"_ns};
+  const nsTArray<nsCString> sources{"source.example"_ns};
+
+  for (int32_t version : {2, 100}) {
+    SCOPED_TRACE(version);
+
+    nsTArray<PrivateAttributionImpressionData> unknown;
+    unknown.AppendElement(Impression(1, epoch, u"ad"_ns));
+    unknown.AppendElement(Impression(2, epoch, u"ad"_ns));
+    ASSERT_NO_FATAL_FAILURE(WriteUnknownDatabase(store, version, unknown));
+
+    EXPECT_TRUE(Lookup(store, epoch, epoch, ads, sources).IsEmpty());
+
+    ASSERT_EQ(store->AddImpression(Impression(3, epoch, u"ad"_ns)), NS_OK);
+    EXPECT_EQ(Indices(Lookup(store, epoch, epoch, ads, sources)),
+              (nsTArray<uint32_t>{3}));
+
+    ASSERT_TRUE(Await(store->CloseConnectionForTesting()).IsResolve());
+    nsCOMPtr<mozIStorageConnection> conn = OpenDatabase(store);
+    ASSERT_TRUE(conn);
+    int32_t schemaVersion = 0;
+    EXPECT_EQ(conn->GetSchemaVersion(&schemaVersion), NS_OK);
+    EXPECT_EQ(schemaVersion, 1);
+    bool exists = true;
+    EXPECT_EQ(conn->IndexExists("impressions_lookup"_ns, &exists), NS_OK);
+    EXPECT_FALSE(exists);
+    EXPECT_EQ(conn->IndexExists("impressions_by_target"_ns, &exists), NS_OK);
+    EXPECT_TRUE(exists);
+    EXPECT_EQ(conn->Close(), NS_OK);
+  }
+
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+}
+
+static int64_t QueryInt64(mozIStorageConnection* aConn,
+                          const nsACString& aSQL) {
+  nsCOMPtr<mozIStorageStatement> stmt;
+  bool hasResult = false;
+  if (NS_FAILED(aConn->CreateStatement(aSQL, getter_AddRefs(stmt))) ||
+      NS_FAILED(stmt->ExecuteStep(&hasResult)) || !hasResult) {
+    ADD_FAILURE() << "Query failed: " << PromiseFlatCString(aSQL).get();
+    return -1;
+  }
+  return stmt->AsInt64(0);
+}
+
+// Impressions before the first retained epoch are deleted along with hosts
+// nothing refers to anymore; later ones stay.
+TEST(PrivateAttributionImpressionStore, ExpiresOldEpochs)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+
+  const uint64_t first =
+      PrivateAttributionImpressionStore::FirstRetainedEpoch();
+  const nsTArray<nsString> ads{u"ad"_ns};
+  const nsTArray<nsCString> sources{"source.example"_ns, "old.example"_ns};
+  nsTArray<PrivateAttributionImpressionData> impressions;
+  impressions.AppendElement(Impression(1, first - 2, u"ad"_ns));
+  impressions.AppendElement(Impression(2, first - 1, u"ad"_ns));
+  impressions.AppendElement(Impression(3, first - 1, u"ad"_ns, "old.example"_ns,
+                                       "gone.example"_ns));
+  impressions.AppendElement(Impression(4, first, u"ad"_ns));
+  impressions.AppendElement(Impression(5, first + 1, u"ad"_ns));
+  ASSERT_EQ(store->AddImpressions(std::move(impressions)), NS_OK);
+
+  // Populate the cache first, so the expiry has to invalidate it.
+  EXPECT_EQ(Indices(Lookup(store, first, first + 1, ads, sources)),
+            (nsTArray<uint32_t>{4, 5}));
+  ASSERT_TRUE(Await(store->RemoveImpressionsBefore(first)).IsResolve());
+
+  EXPECT_TRUE(Lookup(store, first - 2, first - 1, ads, sources).IsEmpty());
+  EXPECT_EQ(Indices(Lookup(store, first - 2, first + 1, ads, sources)),
+            (nsTArray<uint32_t>{4, 5}));
+  EXPECT_EQ(Indices(Lookup(store, first, first + 1, ads, sources)),
+            (nsTArray<uint32_t>{4, 5}));
+
+  ASSERT_TRUE(Await(store->CloseConnectionForTesting()).IsResolve());
+  nsCOMPtr<mozIStorageConnection> conn = OpenDatabase(store);
+  ASSERT_TRUE(conn);
+  EXPECT_EQ(QueryInt64(conn, "SELECT COUNT(*) FROM impressions;"_ns), 2);
+  EXPECT_EQ(QueryInt64(conn, "SELECT COUNT(*) FROM hosts;"_ns), 2);
+  EXPECT_EQ(conn->Close(), NS_OK);
+
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+}
+
+// The database file is only compacted once expiry frees a large share of it.
+TEST(PrivateAttributionImpressionStore, VacuumsAfterLargeExpiry)
+{
+  RefPtr<PrivateAttributionImpressionStore> store =
+      PrivateAttributionImpressionStore::GetSingleton();
+  ASSERT_TRUE(store);
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+
+  // Ten old epochs of impressions with long ads, so each epoch fills many
+  // pages of its own.
+  const uint64_t first =
+      PrivateAttributionImpressionStore::FirstRetainedEpoch() - 10;
+  nsString ad;
+  while (ad.Length() < 200) {
+    ad.Append(u'a');
+  }
+  nsTArray<PrivateAttributionImpressionData> impressions;
+  for (uint32_t i = 0; i < 5000; ++i) {
+    impressions.AppendElement(Impression(i, first + i / 500, ad));
+  }
+  ASSERT_EQ(store->AddImpressions(std::move(impressions)), NS_OK);
+
+  auto expire = [&](uint64_t aFirstEpoch, int64_t* aFreePages,
+                    int64_t* aFileSize) {
+    ASSERT_TRUE(
+        Await(store->RemoveImpressionsBefore(aFirstEpoch)).IsResolve());
+    ASSERT_TRUE(Await(store->CloseConnectionForTesting()).IsResolve());
+    nsCOMPtr<mozIStorageConnection> conn = OpenDatabase(store);
+    ASSERT_TRUE(conn);
+    *aFreePages = QueryInt64(conn, "PRAGMA freelist_count;"_ns);
+    EXPECT_EQ(conn->Close(), NS_OK);
+    nsCOMPtr<nsIFile> file = store->GetDatabaseFileForTesting();
+    ASSERT_TRUE(file);
+    ASSERT_EQ(file->GetFileSize(aFileSize), NS_OK);
+  };
+
+  // Nothing to expire; this only measures the file.
+  int64_t freePages = 0;
+  int64_t fullSize = 0;
+  ASSERT_NO_FATAL_FAILURE(expire(first, &freePages, &fullSize));
+
+  // A tenth of the rows leaves the pages they used on the free list.
+  int64_t size = 0;
+  ASSERT_NO_FATAL_FAILURE(expire(first + 1, &freePages, &size));
+  EXPECT_GT(freePages, 0);
+  EXPECT_EQ(size, fullSize);
+
+  // Most of the rest crosses the threshold and gets the file compacted.
+  ASSERT_NO_FATAL_FAILURE(expire(first + 8, &freePages, &size));
+  EXPECT_EQ(freePages, 0);
+  EXPECT_LT(size, fullSize / 2);
+
+  ASSERT_TRUE(Await(store->Clear()).IsResolve());
+}
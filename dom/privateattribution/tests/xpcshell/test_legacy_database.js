@@ -0,0 +1,54 @@
+/* Any copyright is dedicated to the Public Domain.
+   http://creativecommons.org/publicdomain/zero/1.0/ */
+
+"use strict";
+
+const { IndexedDB } = ChromeUtils.importESModule(
+  "resource://gre/modules/IndexedDB.sys.mjs"
+);
+const { PrivateAttributionService } = ChromeUtils.importESModule(
+  "resource://gre/modules/PrivateAttributionService.sys.mjs"
+);
+
+const LEGACY_DB_NAME = "PrivateAttribution";
+const LEGACY_DB_REMOVED_PREF = "dom.private-attribution.legacy-db-removed";
+
+// Opens the database impressions used to be stored in, creating it as older
+// versions did if needed, and returns whether it existed already.
+async function openLegacyDatabase() {
+  let existed = true;
+  const db = await IndexedDB.open(LEGACY_DB_NAME, 1, (db, event) => {
+    existed = event.oldVersion > 0;
+    db.createObjectStore("impressions");
+  });
+  db.close();
+  return existed;
+}
+
+add_setup(function () {
+  do_get_profile();
+  registerCleanupFunction(() => {
+    Services.prefs.clearUserPref(LEGACY_DB_REMOVED_PREF);
+  });
+});
+
+add_task(async function test_removes_legacy_database_once() {
+  Assert.ok(!(await openLegacyDatabase()), "Legacy database is created");
+
+  const service = new PrivateAttributionService({ testForceEnabled: true });
+  service.getImpressionStore();
+  await service._legacyDatabaseRemoval;
+  Assert.ok(
+    Services.prefs.getBoolPref(LEGACY_DB_REMOVED_PREF, false),
+    "Removal is recorded"
+  );
+  Assert.ok(!(await openLegacyDatabase()), "Legacy database was deleted");
+
+  // Once recorded, the name is left alone.
+  const later = new PrivateAttributionService({ testForceEnabled: true });
+  later.getImpressionStore();
+  await later._legacyDatabaseRemoval;
+  Assert.ok(await openLegacyDatabase(), "Database is only deleted once");
+
+  await IndexedDB.deleteDatabase(LEGACY_DB_NAME);
+});
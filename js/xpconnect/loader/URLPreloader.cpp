@@ -15,6 +15,7 @@
 #include "mozilla/Logging.h"
 #include "mozilla/ScopeExit.h"
 #include "mozilla/Services.h"
+#include "mozilla/StaticPrefs_network.h"
 #include "mozilla/Try.h"
 #include "mozilla/Unused.h"
 #include "mozilla/Vector.h"
@@ -142,6 +143,16 @@ Result<Ok, nsresult> URLPreloader::InitInternal() {
 
   MOZ_TRY(NS_GetSpecialDirectory("ProfLDS", getter_AddRefs(mProfD)));
 
+  if (StaticPrefs::network_jar_preload_startup_entries()) {
+    for (auto type : {Omnijar::GRE, Omnijar::APP}) {
+      RefPtr<nsZipArchive> zip = Omnijar::GetReader(type);
+      if (zip && zip != mJarReaders[Omnijar::GRE]) {
+        zip->StartRecordingReads();
+        mJarReaders[type] = std::move(zip);
+      }
+    }
+  }
+
   return Ok();
 }
 
@@ -170,6 +181,7 @@ Result<nsCOMPtr<nsIFile>, nsresult> URLPreloader::GetCacheFile(
 }
 
 static const uint8_t URL_MAGIC[] = "mozURLcachev003";
+static const uint8_t JAR_READS_MAGIC[] = "mozJarReadsv001";
 
 Result<nsCOMPtr<nsIFile>, nsresult> URLPreloader::FindCacheFile() {
   if (StartupCache::GetIgnoreDiskCache()) {
@@ -210,6 +222,8 @@ Result<Ok, nsresult> URLPreloader::WriteCache() {
   }
   mCacheWritten = true;
 
+  Unused << NS_WARN_IF(WriteJarReads().isErr());
+
   LOG(Debug, "Writing cache...");
 
   nsCOMPtr<nsIFile> cacheFile;
@@ -263,6 +277,141 @@ Result<Ok, nsresult> URLPreloader::WriteCache() {
 
 void URLPreloader::Cleanup() { mCachedURLs.Clear(); }
 
+void URLPreloader::SetStartupFinished() {
+  mStartupFinished = true;
+
+  // Entries that weren't read by now aren't needed for startup, so stop
+  // preloading them and keep later reads out of the recorded order.
+  for (auto type : {Omnijar::GRE, Omnijar::APP}) {
+    if (mJarReaders[type]) {
+      mJarReaders[type]->StopPreloading();
+      mJarReaders[type]->StopRecordingReads(mJarReads[type]);
+    }
+  }
+}
+
+Result<Ok, nsresult> URLPreloader::WriteJarReads() {
+  MOZ_ASSERT(!NS_IsMainThread());
+
+  if (!mJarReaders[Omnijar::GRE] && !mJarReaders[Omnijar::APP]) {
+    return Ok();
+  }
+
+  nsCOMPtr<nsIFile> cacheFile;
+  MOZ_TRY_VAR(cacheFile, GetCacheFile(u"-jarReads-new.bin"_ns));
+  MOZ_TRY(WriteJarReadsFile(cacheFile, mJarReads));
+  MOZ_TRY(cacheFile->MoveTo(nullptr, u"urlCache-jarReads.bin"_ns));
+
+  return Ok();
+}
+
+/* static */
+Result<Ok, nsresult> URLPreloader::WriteJarReadsFile(nsIFile* aFile,
+                                                     const JarReads& aReads) {
+  OutputBuffer buf;
+  for (auto type : {Omnijar::GRE, Omnijar::APP}) {
+    for (const auto& entry : aReads[type]) {
+      CacheKey key(type == Omnijar::GRE ? CacheKey::TypeGREJar
+                                        : CacheKey::TypeAppJar,
+                   entry);
+      key.Code(buf);
+    }
+  }
+
+  AutoFDClose raiiFd;
+  MOZ_TRY(aFile->OpenNSPRFileDesc(PR_WRONLY | PR_CREATE_FILE | PR_TRUNCATE,
+                                  0644, getter_Transfers(raiiFd)));
+  const auto fd = raiiFd.get();
+
+  uint8_t headerSize[4];
+  LittleEndian::writeUint32(headerSize, buf.cursor());
+
+  uint8_t crc[4];
+  LittleEndian::writeUint32(crc, ComputeCrc32c(~0, buf.Get(), buf.cursor()));
+
+  MOZ_TRY(Write(fd, JAR_READS_MAGIC, sizeof(JAR_READS_MAGIC)));
+  MOZ_TRY(Write(fd, headerSize, sizeof(headerSize)));
+  MOZ_TRY(Write(fd, crc, sizeof(crc)));
+  MOZ_TRY(Write(fd, buf.Get(), buf.cursor()));
+
+  return Ok();
+}
+
+/* static */
+Result<Ok, nsresult> URLPreloader::ReadJarReadsFile(nsIFile* aFile,
+                                                    JarReads& aReads) {
+  AutoMemMap cache;
+  MOZ_TRY(cache.init(aFile));
+
+  auto size = cache.size();
+
+  uint32_t headerSize;
+  uint32_t crc;
+  if (size < sizeof(JAR_READS_MAGIC) + sizeof(headerSize) + sizeof(crc)) {
+    return Err(NS_ERROR_UNEXPECTED);
+  }
+
+  auto data = cache.get<uint8_t>();
+  auto end = data + size;
+
+  if (memcmp(JAR_READS_MAGIC, data.get(), sizeof(JAR_READS_MAGIC))) {
+    return Err(NS_ERROR_UNEXPECTED);
+  }
+  data += sizeof(JAR_READS_MAGIC);
+
+  headerSize = LittleEndian::readUint32(data.get());
+  data += sizeof(headerSize);
+
+  crc = LittleEndian::readUint32(data.get());
+  data += sizeof(crc);
+
+  if (data + headerSize > end) {
+    return Err(NS_ERROR_UNEXPECTED);
+  }
+
+  if (crc != ComputeCrc32c(~0, data.get(), headerSize)) {
+    return Err(NS_ERROR_UNEXPECTED);
+  }
+
+  InputBuffer buf(Range<const uint8_t>(data, data + headerSize));
+  while (!buf.finished()) {
+    CacheKey key(buf);
+    if (buf.error()) {
+      return Err(NS_ERROR_UNEXPECTED);
+    }
+    if (key.mType == CacheKey::TypeFile) {
+      continue;
+    }
+    aReads[key.OmnijarType()].AppendElement(std::move(key.mPath));
+  }
+
+  return Ok();
+}
+
+Result<Ok, nsresult> URLPreloader::PreloadJarEntries() {
+  MOZ_ASSERT(!NS_IsMainThread());
+
+  if (StartupCache::GetIgnoreDiskCache()) {
+    return Err(NS_ERROR_ABORT);
+  }
+
+  nsCOMPtr<nsIFile> cacheFile;
+  MOZ_TRY_VAR(cacheFile, GetCacheFile(u"-jarReads.bin"_ns));
+
+  JarReads entries;
+  MOZ_TRY(ReadJarReadsFile(cacheFile, entries));
+
+  for (auto type : {Omnijar::GRE, Omnijar::APP}) {
+    if (mJarReaders[type] && !entries[type].IsEmpty()) {
+      LOG(Debug, "Preloading %zu %s jar entries", entries[type].Length(),
+          type == Omnijar::GRE ? "GRE" : "App");
+      mJarReaders[type]->PreloadEntries(entries[type]);
+    }
+  }
+
+  return Ok();
+}
+
 Result<Ok, nsresult> URLPreloader::ReadCache(
     LinkedList<URLEntry>& pendingURLs) {
   LOG(Debug, "Reading cache...");
@@ -480,6 +629,17 @@ void URLPreloader::BeginBackgroundRead() {
       readerThread = nullptr;
       return;
     }
+
+    if (mJarReaders[Omnijar::GRE] || mJarReaders[Omnijar::APP]) {
+      // Jar entries are preloaded from another thread, so that they don't
+      // wait for the files read above.
+      RefPtr<URLPreloader> self = this;
+      nsCOMPtr<nsIRunnable> preload = NS_NewRunnableFunction(
+          "URLPreloader::PreloadJarEntries",
+          [self] { Unused << self->PreloadJarEntries(); });
+      Unused << NS_WARN_IF(NS_FAILED(NS_DispatchBackgroundTask(
+          preload.forget(), NS_DISPATCH_EVENT_MAY_BLOCK)));
+    }
   }
 }
 
@@ -6,6 +6,7 @@
 #ifndef URLPreloader_h
 #define URLPreloader_h
 
+#include "mozilla/Array.h"
 #include "mozilla/DataMutex.h"
 #include "mozilla/FileLocation.h"
 #include "mozilla/HashFunctions.h"
@@ -25,6 +26,7 @@
 #include "nsIResProtocolHandler.h"
 #include "nsIThread.h"
 #include "nsReadableUtils.h"
+#include "nsTArray.h"
 
 class nsZipArchive;
 
@@ -80,7 +82,19 @@ class URLPreloader final : public nsIMemoryReporter {
                                              const nsACString& path,
                                              ReadType readType = Forget);
 
-  void SetStartupFinished() { mStartupFinished = true; }
+  void SetStartupFinished();
+
+  // The Omnijar entries read during startup, in the order they were first
+  // read, indexed by Omnijar::Type.
+  using JarReads = Array<nsTArray<nsCString>, 2>;
+
+  // Writes aReads to aFile, or reads them back from it. These are how
+  // WriteJarReads() and PreloadJarEntries() carry the reads over to the next
+  // session, and are public for testing.
+  static Result<Ok, nsresult> WriteJarReadsFile(nsIFile* aFile,
+                                                const JarReads& aReads);
+  static Result<Ok, nsresult> ReadJarReadsFile(nsIFile* aFile,
+                                               JarReads& aReads);
 
  private:
   struct CacheKey;
@@ -113,6 +127,10 @@ class URLPreloader final : public nsIMemoryReporter {
   // Clear leftover entries after the cache has been written.
   void Cleanup();
 
+  // Writes the Omnijar entries read until startup finished, in the order they
+  // were first read, for PreloadJarEntries() to preload in the next session.
+  Result<Ok, nsresult> WriteJarReads();
+
   // Begins reading files off-thread, and ensures that initialization has
   // completed before leaving the current scope. The caller *must* ensure that
   // no code on the main thread access Omnijar, either directly or indirectly,
@@ -282,6 +300,10 @@ class URLPreloader final : public nsIMemoryReporter {
   void BackgroundReadFiles();
   void BeginBackgroundRead();
 
+  // Reads ahead and inflates the Omnijar entries recorded by WriteJarReads()
+  // during the last session. Runs on a background thread.
+  Result<Ok, nsresult> PreloadJarEntries();
+
   using HashType = nsClassHashtable<nsGenericHashKey<CacheKey>, URLEntry>;
 
   size_t ShallowSizeOfIncludingThis(mozilla::MallocSizeOf mallocSizeOf);
@@ -300,6 +322,14 @@ class URLPreloader final : public nsIMemoryReporter {
   nsCOMPtr<nsIChromeRegistry> mChromeReg;
   nsCOMPtr<nsIFile> mProfD;
 
+  // The Omnijar archives whose reads are recorded and preloaded, indexed by
+  // Omnijar::Type. Only set if the network.jar.preload_startup_entries pref
+  // is, and never changed after initialization.
+  RefPtr<nsZipArchive> mJarReaders[2];
+  // The entries mJarReaders recorded. Set on the main thread when startup
+  // finishes, and only read by the cache write thread afterwards.
+  JarReads mJarReads;
+
   // Note: We use a RefPtr rather than an nsCOMPtr here because the
   // AssertNoQueryNeeded checks done by getter_AddRefs happen at a time that
   // violate data access invariants. It's wrapped in a mutex because
@@ -57,6 +57,7 @@
 #include "mozilla/StaticPresData.h"
 #include "mozilla/StaticPrefs_browser.h"
 #include "mozilla/StaticPrefs_layout.h"
+#include "mozilla/StaticPrefs_memory.h"
 #include "mozilla/StaticPtr.h"
 #include "mozilla/RestyleManager.h"
 #include "mozilla/SizeOfState.h"
@@ -1465,6 +1466,10 @@ bool Gecko_DocumentRule_UseForPresentation(
 void Gecko_SetJemallocThreadLocalArena(bool enabled) {
 #if defined(MOZ_MEMORY)
   jemalloc_thread_local_arena(enabled);
+  // Style threads make lots of small allocations, let them skip the arena
+  // lock for most of them.
+  jemalloc_thread_cache(enabled &&
+                        StaticPrefs::memory_thread_cache_enabled());
 #endif
 }
 
@@ -122,6 +122,9 @@ MALLOC_DECL(jemalloc_purge_freed_pages, void)
 // provides functionality similar to mallctl("arenas.purge") in jemalloc 3.
 // Note that if called on a different thread than the main thread, only arenas
 // that are not created with ARENA_FLAG_THREAD_MAIN_THREAD_ONLY will be purged.
+// Only the calling thread's cache of small regions (see jemalloc_thread_cache)
+// is flushed, so that the pages it held can be purged. Other threads' caches
+// are only flushed on their next malloc or free.
 MALLOC_DECL(jemalloc_free_dirty_pages, void)
 
 // Set the default modifier for mMaxDirty. The value is the number of shifts
@@ -182,6 +185,16 @@ MALLOC_DECL(jemalloc_reset_small_alloc_randomization, void, bool)
 // (true) or out (false)).
 MALLOC_DECL(jemalloc_thread_local_arena, void, bool)
 
+// Opt in or out of a cache of small regions for the current thread (bool
+// argument is whether to opt-in (true) or out (false)). The cache lets the
+// thread allocate and free most small sizes without taking its arena's lock.
+// It is given back to the arena when opting out, when the thread exits, and
+// after jemalloc_free_dirty_pages is called, right away on the calling thread
+// and on other threads' next malloc or free: a thread blocked for a long time
+// keeps its cache, at most 2 KiB per size class, until then. Caching threads
+// should call jemalloc_thread_local_arena first, if they use it.
+MALLOC_DECL(jemalloc_thread_cache, void, bool)
+
 // Provide information about any allocation enclosing the given address.
 MALLOC_DECL(jemalloc_ptr_info, void, const void*, jemalloc_ptr_info_t*)
 #  endif
@@ -1423,6 +1423,15 @@ struct arena_t {
   [[nodiscard]] arena_chunk_t* DallocLarge(arena_chunk_t* aChunk, void* aPtr)
       MOZ_REQUIRES(mLock);
 
+  // Allocate up to aCount regions from the bin at aBinIndex, for a
+  // ThreadCache, and return how many were allocated.
+  uint32_t MallocSmallBatch(size_t aBinIndex, void** aRegions,
+                            uint32_t aCount) MOZ_EXCLUDES(mLock);
+
+  // Free aCount small regions from this arena, for a ThreadCache. aCount must
+  // not exceed kThreadCacheBinMaxRegions.
+  void DallocSmallBatch(void** aRegions, uint32_t aCount) MOZ_EXCLUDES(mLock);
+
   void* Ralloc(void* aPtr, size_t aSize, size_t aOldSize) MOZ_EXCLUDES(mLock);
 
   void UpdateMaxDirty() MOZ_EXCLUDES(mLock);
@@ -1918,6 +1927,115 @@ static detail::ThreadLocal<arena_t*, detail::ThreadLocalKeyStorage>
     thread_arena;
 #endif
 
+// ******************
+// Per-thread caches.
+//
+// A thread that opted in with jemalloc_thread_cache keeps a few free regions
+// of each size class up to kMaxQuantumClass, the sizes choose_arena() serves
+// from the thread's arena, so that most of its small allocations and frees
+// don't take the arena lock. The regions stay allocated as far as the arena
+// is concerned, and to jemalloc_ptr_info: they are taken from and given back
+// to the arena's bins in batches, under a single lock acquisition.
+//
+// A cache is flushed back to its arena when the thread exits, opts out, or
+// switches arenas. Other threads can't touch it, so jemalloc_free_dirty_pages
+// only flushes the calling thread's cache, and asks other threads to flush
+// theirs, which they do on their next malloc or free. Until then, a thread
+// that is blocked, e.g. in poll(), keeps its cache: at most
+// kThreadCacheBinBytes per size class.
+
+static const size_t kNumThreadCacheBins = kNumTinyClasses + kNumQuantumClasses;
+
+// Each bin of a cache holds at most that many bytes, and that many regions.
+static const size_t kThreadCacheBinBytes = 2_KiB;
+static const uint32_t kThreadCacheBinMaxRegions = 32;
+
+struct ThreadCache {
+  explicit ThreadCache(arena_t* aArena);
+
+  // Returns nullptr on OOM.
+  inline void* Malloc(size_t aSize, bool aZero);
+
+  // Returns whether aPtr was cached. It isn't when it's not a small region
+  // from the cache's arena, and should then be freed the usual way.
+  inline bool Free(void* aPtr, size_t aOffset);
+
+  // Gives all the cached regions back to the arena.
+  void Flush();
+
+  // The arena the cached regions belong to.
+  arena_t* mArena;
+
+  // The link to gThreadCaches.
+  DoublyLinkedListElement<ThreadCache> mCachesElem;
+
+  // The total size of the cached regions. Only the owning thread writes it,
+  // jemalloc_stats reads it without locking.
+  Atomic<size_t, MemoryOrdering::Relaxed> mCachedBytes;
+
+ private:
+  struct Bin {
+    uint32_t mCount;
+    // The most recently freed region is last.
+    void* mRegions[kThreadCacheBinMaxRegions];
+  };
+
+  static uint32_t BinCapacity(size_t aSize) {
+    return std::min<size_t>(std::max<size_t>(kThreadCacheBinBytes / aSize, 4),
+                            kThreadCacheBinMaxRegions);
+  }
+
+  inline void MaybeFlushForMemoryPressure();
+
+  bool Fill(Bin& aBin, size_t aSize);
+
+  // Gives aCount of the least recently freed regions back to the arena.
+  void Drain(Bin& aBin, size_t aSize, uint32_t aCount);
+
+  // The value of gThreadCacheFlushGeneration when this cache was last
+  // flushed.
+  uint32_t mFlushGeneration;
+
+  Bin mBins[kNumThreadCacheBins];
+};
+
+namespace mozilla {
+
+template <>
+struct GetDoublyLinkedListElement<ThreadCache> {
+  static DoublyLinkedListElement<ThreadCache>& Get(ThreadCache* aThis) {
+    return aThis->mCachesElem;
+  }
+};
+
+}  // namespace mozilla
+
+// The cache of the current thread, if it opted in.
+#if !defined(XP_DARWIN)
+static MOZ_THREAD_LOCAL(ThreadCache*) thread_cache;
+#else
+static detail::ThreadLocal<ThreadCache*, detail::ThreadLocalKeyStorage>
+    thread_cache;
+#endif
+
+// All the live caches, for jemalloc_stats.
+static Mutex gThreadCachesLock;
+static DoublyLinkedList<ThreadCache> gThreadCaches
+    MOZ_GUARDED_BY(gThreadCachesLock);
+
+// Bumped by jemalloc_free_dirty_pages to have every cache flushed.
+static Atomic<uint32_t, MemoryOrdering::Relaxed> gThreadCacheFlushGeneration;
+
+// Whether thread_cache_init() succeeded.
+static bool gThreadCachesAvailable = false;
+
+// The key with which caches are destroyed when their thread exits.
+#ifdef XP_WIN
+static DWORD gThreadCacheExitKey = FLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t gThreadCacheExitKey;
+#endif
+
 // *****************************
 // Runtime configuration options.
 
@@ -2350,6 +2468,9 @@ extent_node_t* ExtentAlloc::sFirstFree = nullptr;
 template <>
 arena_t* TypedBaseAlloc<arena_t>::sFirstFree = nullptr;
 
+template <>
+ThreadCache* TypedBaseAlloc<ThreadCache>::sFirstFree = nullptr;
+
 template <>
 size_t TypedBaseAlloc<arena_t>::size_of() {
   // Allocate enough space for trailing bins.
@@ -2945,6 +3066,12 @@ static inline arena_t* thread_local_arena(bool enabled) {
     arena = gArenas.GetDefault();
   }
   thread_arena.set(arena);
+
+  ThreadCache* cache = thread_cache.get();
+  if (cache && cache->mArena != arena) {
+    cache->Flush();
+    cache->mArena = arena;
+  }
   return arena;
 }
 
@@ -2954,6 +3081,44 @@ inline void MozJemalloc::jemalloc_thread_local_arena(bool aEnabled) {
   }
 }
 
+// Defined after ThreadCache's methods.
+static void thread_cache_destroy(ThreadCache* aCache);
+static void thread_cache_set_exit_key(ThreadCache* aCache);
+
+inline void MozJemalloc::jemalloc_thread_cache(bool aEnabled) {
+  if (!malloc_init() || !gThreadCachesAvailable) {
+    return;
+  }
+
+  ThreadCache* cache = thread_cache.get();
+  if (aEnabled == !!cache) {
+    return;
+  }
+
+  if (!aEnabled) {
+    thread_cache.set(nullptr);
+    thread_cache_set_exit_key(nullptr);
+    thread_cache_destroy(cache);
+    return;
+  }
+
+  arena_t* arena = thread_arena.get();
+  if (!arena) {
+    arena = thread_local_arena(false);
+  }
+  void* backing = TypedBaseAlloc<ThreadCache>::alloc();
+  if (!backing) {
+    return;
+  }
+  cache = new (backing) ThreadCache(arena);
+  {
+    MutexAutoLock lock(gThreadCachesLock);
+    gThreadCaches.pushBack(cache);
+  }
+  thread_cache.set(cache);
+  thread_cache_set_exit_key(cache);
+}
+
 // Choose an arena based on a per-thread value.
 static inline arena_t* choose_arena(size_t size) {
   arena_t* ret = nullptr;
@@ -4156,37 +4321,37 @@ void arena_t::InitPRNG() {
   mIsPRNGInitializing = false;
 }
 
-void* arena_t::MallocSmall(size_t aSize, bool aZero) {
-  void* ret;
-  arena_bin_t* bin;
-  arena_run_t* run;
-  SizeClass sizeClass(aSize);
-  aSize = sizeClass.Size();
-
-  switch (sizeClass.Type()) {
+// Return the index in arena_t::mBins of the bin for a small size class.
+static inline size_t SmallBinIndex(SizeClass aSizeClass) {
+  size_t size = aSizeClass.Size();
+  switch (aSizeClass.Type()) {
     case SizeClass::Tiny:
-      bin = &mBins[FloorLog2(aSize / kMinTinyClass)];
-      break;
+      return FloorLog2(size / kMinTinyClass);
     case SizeClass::Quantum:
       // Although we divide 2 things by kQuantum, the compiler will
       // reduce `kMinQuantumClass / kQuantum` and `kNumTinyClasses` to a
       // single constant.
-      bin = &mBins[kNumTinyClasses + (aSize / kQuantum) -
-                   (kMinQuantumClass / kQuantum)];
-      break;
+      return kNumTinyClasses + (size / kQuantum) -
+             (kMinQuantumClass / kQuantum);
     case SizeClass::QuantumWide:
-      bin =
-          &mBins[kNumTinyClasses + kNumQuantumClasses + (aSize / kQuantumWide) -
-                 (kMinQuantumWideClass / kQuantumWide)];
-      break;
+      return kNumTinyClasses + kNumQuantumClasses + (size / kQuantumWide) -
+             (kMinQuantumWideClass / kQuantumWide);
     case SizeClass::SubPage:
-      bin =
-          &mBins[kNumTinyClasses + kNumQuantumClasses + kNumQuantumWideClasses +
-                 (FloorLog2(aSize) - LOG2(kMinSubPageClass))];
-      break;
+      return kNumTinyClasses + kNumQuantumClasses + kNumQuantumWideClasses +
+             (FloorLog2(size) - LOG2(kMinSubPageClass));
     default:
       MOZ_MAKE_COMPILER_ASSUME_IS_UNREACHABLE("Unexpected size class type");
   }
+}
+
+void* arena_t::MallocSmall(size_t aSize, bool aZero) {
+  void* ret;
+  arena_bin_t* bin;
+  arena_run_t* run;
+  SizeClass sizeClass(aSize);
+  aSize = sizeClass.Size();
+
+  bin = &mBins[SmallBinIndex(sizeClass)];
   MOZ_DIAGNOSTIC_ASSERT(aSize == bin->mSizeClass);
 
   size_t num_dirty_before, num_dirty_after;
@@ -4238,6 +4403,40 @@ void* arena_t::MallocSmall(size_t aSize, bool aZero) {
   return ret;
 }
 
+uint32_t arena_t::MallocSmallBatch(size_t aBinIndex, void** aRegions,
+                                   uint32_t aCount) {
+  arena_bin_t* bin = &mBins[aBinIndex];
+  uint32_t count = 0;
+
+  size_t num_dirty_before, num_dirty_after;
+  {
+    MaybeMutexAutoLock lock(mLock);
+
+    num_dirty_before = mNumDirty;
+    while (count < aCount) {
+      arena_run_t* run = GetNonFullBinRun(bin);
+      if (MOZ_UNLIKELY(!run)) {
+        break;
+      }
+      MOZ_DIAGNOSTIC_ASSERT(run->mMagic == ARENA_RUN_MAGIC);
+      MOZ_DIAGNOSTIC_ASSERT(run->mNumFree > 0);
+      void* region = ArenaRunRegAlloc(run, bin);
+      MOZ_DIAGNOSTIC_ASSERT(region);
+      run->mNumFree--;
+      aRegions[count++] = region;
+    }
+    num_dirty_after = mNumDirty;
+
+    mStats.allocated_small += count * bin->mSizeClass;
+    mStats.operations += count;
+  }
+  if (num_dirty_after < num_dirty_before) {
+    NotifySignificantReuse();
+  }
+
+  return count;
+}
+
 void* arena_t::MallocLarge(size_t aSize, bool aZero) {
   void* ret;
 
@@ -4773,6 +4972,220 @@ static inline void idalloc(void* ptr, arena_t* aArena) {
   }
 }
 
+void arena_t::DallocSmallBatch(void** aRegions, uint32_t aCount) {
+  MOZ_ASSERT(aCount <= kThreadCacheBinMaxRegions);
+  arena_chunk_t* chunks_dealloc_delay[kThreadCacheBinMaxRegions];
+  uint32_t num_chunks = 0;
+  purge_action_t purge_action;
+  {
+    MaybeMutexAutoLock lock(mLock);
+    for (uint32_t i = 0; i < aCount; i++) {
+      void* ptr = aRegions[i];
+      arena_chunk_t* chunk = GetChunkForPtr(ptr);
+      MOZ_DIAGNOSTIC_ASSERT(chunk->arena == this);
+      size_t pageind = GetChunkOffsetForPtr(ptr) >> gPageSize2Pow;
+      arena_chunk_t* dealloc_chunk =
+          DallocSmall(chunk, ptr, &chunk->map[pageind]);
+      if (dealloc_chunk) {
+        chunks_dealloc_delay[num_chunks++] = dealloc_chunk;
+      }
+    }
+
+    purge_action = ShouldStartPurge();
+  }
+
+  for (uint32_t i = 0; i < num_chunks; i++) {
+    chunk_dealloc((void*)chunks_dealloc_delay[i], kChunkSize, ARENA_CHUNK);
+  }
+
+  MayDoOrQueuePurge(purge_action);
+}
+
+// The size class of the ThreadCache bin, or arena bin, at aBinIndex.
+static inline size_t ThreadCacheBinSize(size_t aBinIndex) {
+  MOZ_ASSERT(aBinIndex < kNumThreadCacheBins);
+  if (aBinIndex < kNumTinyClasses) {
+    return kMinTinyClass << aBinIndex;
+  }
+  return kMinQuantumClass + (aBinIndex - kNumTinyClasses) * kQuantum;
+}
+
+ThreadCache::ThreadCache(arena_t* aArena)
+    : mArena(aArena),
+      mCachedBytes(0),
+      mFlushGeneration(gThreadCacheFlushGeneration) {
+  for (Bin& bin : mBins) {
+    bin.mCount = 0;
+  }
+}
+
+inline void ThreadCache::MaybeFlushForMemoryPressure() {
+  if (MOZ_UNLIKELY(mFlushGeneration != gThreadCacheFlushGeneration)) {
+    Flush();
+  }
+}
+
+void ThreadCache::Flush() {
+  mFlushGeneration = gThreadCacheFlushGeneration;
+  for (size_t i = 0; i < kNumThreadCacheBins; i++) {
+    if (mBins[i].mCount) {
+      Drain(mBins[i], ThreadCacheBinSize(i), mBins[i].mCount);
+    }
+  }
+  MOZ_ASSERT(mCachedBytes == 0);
+}
+
+bool ThreadCache::Fill(Bin& aBin, size_t aSize) {
+  MOZ_ASSERT(aBin.mCount == 0);
+  uint32_t count = mArena->MallocSmallBatch(SmallBinIndex(SizeClass(aSize)),
+                                            aBin.mRegions,
+                                            BinCapacity(aSize) / 2);
+  aBin.mCount = count;
+  // Only this thread writes mCachedBytes, so it needn't be updated
+  // atomically.
+  mCachedBytes = mCachedBytes + count * aSize;
+  return count != 0;
+}
+
+void ThreadCache::Drain(Bin& aBin, size_t aSize, uint32_t aCount) {
+  MOZ_ASSERT(aCount <= aBin.mCount);
+  mArena->DallocSmallBatch(aBin.mRegions, aCount);
+  aBin.mCount -= aCount;
+  memmove(aBin.mRegions, aBin.mRegions + aCount,
+          aBin.mCount * sizeof(aBin.mRegions[0]));
+  mCachedBytes = mCachedBytes - aCount * aSize;
+}
+
+inline void* ThreadCache::Malloc(size_t aSize, bool aZero) {
+  MOZ_ASSERT(aSize <= kMaxQuantumClass);
+  MaybeFlushForMemoryPressure();
+
+  SizeClass sizeClass(aSize);
+  aSize = sizeClass.Size();
+  Bin& bin = mBins[SmallBinIndex(sizeClass)];
+  if (!bin.mCount && !Fill(bin, aSize)) {
+    return nullptr;
+  }
+
+  void* ret = bin.mRegions[--bin.mCount];
+  mCachedBytes = mCachedBytes - aSize;
+  if (!aZero) {
+    ApplyZeroOrJunk(ret, aSize);
+  } else {
+    memset(ret, 0, aSize);
+  }
+  return ret;
+}
+
+inline bool ThreadCache::Free(void* aPtr, size_t aOffset) {
+  auto chunk = (arena_chunk_t*)((uintptr_t)aPtr - aOffset);
+  if (chunk->arena != mArena || mArena->mRandomizeSmallAllocations) {
+    return false;
+  }
+
+  // The page and its run can't go away while aPtr is allocated, so it is
+  // fine to look at them without the arena lock.
+  arena_chunk_map_t* mapelm = &chunk->map[aOffset >> gPageSize2Pow];
+  MOZ_RELEASE_ASSERT(
+      (mapelm->bits &
+       (CHUNK_MAP_FRESH_MADVISED_OR_DECOMMITTED | CHUNK_MAP_ZEROED)) == 0,
+      "Freeing in a page with bad bits.");
+  MOZ_RELEASE_ASSERT((mapelm->bits & CHUNK_MAP_ALLOCATED) != 0,
+                     "Double-free?");
+  if (mapelm->bits & CHUNK_MAP_LARGE) {
+    return false;
+  }
+  auto run = (arena_run_t*)(mapelm->bits & ~gPageSizeMask);
+  MOZ_DIAGNOSTIC_ASSERT(run->mMagic == ARENA_RUN_MAGIC);
+  size_t size = run->mBin->mSizeClass;
+  if (size > kMaxQuantumClass) {
+    return false;
+  }
+
+  // The arena release-asserts that regions aren't freed twice, so do the
+  // same: a region given back to the arena already has its bit set in the
+  // run's bitmap, and one freed to this cache is in the bin. Only freeing or
+  // allocating aPtr changes its bit, which makes reading it without the arena
+  // lock fine.
+  arena_bin_t* arenaBin = run->mBin;
+  uint32_t regind = uint32_t(uintptr_t(aPtr) - uintptr_t(run) -
+                             arenaBin->mRunFirstRegionOffset) /
+                    arenaBin->mSizeDivisor;
+  unsigned elm = regind >> (LOG2(sizeof(int)) + 3);
+  unsigned bit = regind - (elm << (LOG2(sizeof(int)) + 3));
+  MOZ_RELEASE_ASSERT((run->mRegionsMask[elm] & (1U << bit)) == 0,
+                     "Double-free?");
+
+  MaybeFlushForMemoryPressure();
+
+  Bin& bin = mBins[SmallBinIndex(SizeClass(size))];
+  for (uint32_t i = 0; i < bin.mCount; i++) {
+    MOZ_RELEASE_ASSERT(bin.mRegions[i] != aPtr, "Double-free?");
+  }
+  MaybePoison(aPtr, size);
+  uint32_t capacity = BinCapacity(size);
+  if (bin.mCount == capacity) {
+    Drain(bin, size, capacity / 2);
+  }
+  bin.mRegions[bin.mCount++] = aPtr;
+  mCachedBytes = mCachedBytes + size;
+  return true;
+}
+
+// Return the current thread's cache if it should serve an allocation of
+// aSize.
+static inline ThreadCache* choose_thread_cache(size_t aSize) {
+  if (aSize > kMaxQuantumClass) {
+    return nullptr;
+  }
+  ThreadCache* cache = thread_cache.get();
+  if (!cache || cache->mArena->mRandomizeSmallAllocations) {
+    return nullptr;
+  }
+  return cache;
+}
+
+static void thread_cache_destroy(ThreadCache* aCache) {
+  aCache->Flush();
+  {
+    MutexAutoLock lock(gThreadCachesLock);
+    gThreadCaches.remove(aCache);
+  }
+  aCache->~ThreadCache();
+  TypedBaseAlloc<ThreadCache>::dealloc(aCache);
+}
+
+// Called when a thread that has a cache exits.
+#ifdef XP_WIN
+static void NTAPI thread_cache_on_thread_exit(void* aCache) {
+#else
+static void thread_cache_on_thread_exit(void* aCache) {
+#endif
+  thread_cache.set(nullptr);
+  thread_cache_destroy(static_cast<ThreadCache*>(aCache));
+}
+
+static void thread_cache_set_exit_key(ThreadCache* aCache) {
+#ifdef XP_WIN
+  FlsSetValue(gThreadCacheExitKey, aCache);
+#else
+  pthread_setspecific(gThreadCacheExitKey, aCache);
+#endif
+}
+
+static bool thread_cache_init() {
+  if (!gThreadCachesLock.Init() || !thread_cache.init()) {
+    return false;
+  }
+#ifdef XP_WIN
+  gThreadCacheExitKey = FlsAlloc(thread_cache_on_thread_exit);
+  return gThreadCacheExitKey != FLS_OUT_OF_INDEXES;
+#else
+  return pthread_key_create(&gThreadCacheExitKey,
+                            thread_cache_on_thread_exit) == 0;
+#endif
+}
+
 inline purge_action_t arena_t::ShouldStartPurge() {
   if (mNumDirty > mMaxDirty) {
     if (!mIsDeferredPurgeEnabled) {
@@ -5518,6 +5931,8 @@ static bool malloc_init_hard() {
   // Assign the default arena to the initial thread.
   thread_arena.set(gArenas.GetDefault());
 
+  gThreadCachesAvailable = thread_cache_init();
+
   if (!gChunkRTree.Init()) {
     return false;
   }
@@ -5579,6 +5994,12 @@ inline void* BaseAllocator::malloc(size_t aSize) {
   }
   // If mArena is non-null, it must not be in the first page.
   MOZ_DIAGNOSTIC_ASSERT_IF(mArena, (size_t)mArena >= gPageSize);
+  if (!mArena) {
+    if (ThreadCache* cache = choose_thread_cache(aSize)) {
+      ret = cache->Malloc(aSize, /* aZero = */ false);
+      goto RETURN;
+    }
+  }
   arena = mArena ? mArena : choose_arena(aSize);
   ret = arena->Malloc(aSize, /* aZero = */ false);
 
@@ -5616,8 +6037,13 @@ inline void* BaseAllocator::calloc(size_t aNum, size_t aSize) {
       if (allocSize == 0) {
         allocSize = 1;
       }
-      arena_t* arena = mArena ? mArena : choose_arena(allocSize);
-      ret = arena->Malloc(allocSize, /* aZero = */ true);
+      ThreadCache* cache = mArena ? nullptr : choose_thread_cache(allocSize);
+      if (cache) {
+        ret = cache->Malloc(allocSize, /* aZero = */ true);
+      } else {
+        arena_t* arena = mArena ? mArena : choose_arena(allocSize);
+        ret = arena->Malloc(allocSize, /* aZero = */ true);
+      }
     } else {
       ret = nullptr;
     }
@@ -5668,6 +6094,12 @@ inline void BaseAllocator::free(void* aPtr) {
   offset = GetChunkOffsetForPtr(aPtr);
   if (offset != 0) {
     MOZ_RELEASE_ASSERT(malloc_initialized);
+    if (!mArena) {
+      ThreadCache* cache = thread_cache.get();
+      if (cache && cache->Free(aPtr, offset)) {
+        return;
+      }
+    }
     arena_dalloc(aPtr, offset, mArena);
   } else if (aPtr) {
     MOZ_RELEASE_ASSERT(malloc_initialized);
@@ -5711,6 +6143,19 @@ inline size_t MozJemalloc::malloc_usable_size(usable_ptr_t aPtr) {
   return AllocInfo::GetValidated(aPtr).Size();
 }
 
+// The total size of the regions in thread caches.
+static size_t ThreadCachedBytes() {
+  if (!gThreadCachesAvailable) {
+    return 0;
+  }
+  size_t cached = 0;
+  MutexAutoLock lock(gThreadCachesLock);
+  for (ThreadCache& cache : gThreadCaches) {
+    cached += cache.mCachedBytes;
+  }
+  return cached;
+}
+
 inline void MozJemalloc::jemalloc_stats_internal(
     jemalloc_stats_t* aStats, jemalloc_bin_stats_t* aBinStats) {
   size_t non_arena_mapped, chunk_header_size;
@@ -5750,6 +6195,7 @@ inline void MozJemalloc::jemalloc_stats_internal(
   aStats->pages_madvised = 0;
   aStats->bookkeeping = 0;
   aStats->bin_unused = 0;
+  aStats->thread_cache = 0;
 
   non_arena_mapped = 0;
 
@@ -5868,8 +6314,14 @@ inline void MozJemalloc::jemalloc_stats_internal(
   aStats->bookkeeping += chunk_header_size;
   aStats->waste -= chunk_header_size;
 
+  // The arenas count the regions in thread caches as allocated. They are
+  // read at a slightly different time, hence the clamping.
+  aStats->thread_cache = std::min(ThreadCachedBytes(), aStats->allocated);
+  aStats->allocated -= aStats->thread_cache;
+
   MOZ_ASSERT(aStats->mapped >= aStats->allocated + aStats->waste +
-                                   aStats->pages_dirty + aStats->bookkeeping);
+                                   aStats->pages_dirty + aStats->bookkeeping +
+                                   aStats->thread_cache);
 }
 
 inline void MozJemalloc::jemalloc_stats_lite(jemalloc_stats_lite_t* aStats) {
@@ -5901,6 +6353,9 @@ inline void MozJemalloc::jemalloc_stats_lite(jemalloc_stats_lite_t* aStats) {
     }
     aStats->num_operations += gArenas.OperationsDisposedArenas();
   }
+
+  aStats->allocated_bytes -=
+      std::min(ThreadCachedBytes(), aStats->allocated_bytes);
 }
 
 inline size_t MozJemalloc::jemalloc_stats_num_bins() {
@@ -5978,6 +6433,13 @@ inline void MozJemalloc::jemalloc_purge_freed_pages() {
 
 inline void MozJemalloc::jemalloc_free_dirty_pages(void) {
   if (malloc_initialized) {
+    // Have the thread caches give their regions back, so that the pages they
+    // are in can be purged. Only the current thread's cache is flushed now,
+    // other threads flush theirs on their next malloc or free.
+    gThreadCacheFlushGeneration++;
+    if (ThreadCache* cache = thread_cache.get()) {
+      cache->Flush();
+    }
     gArenas.MayPurgeAll(PurgeUnconditional);
   }
 }
@@ -6280,11 +6742,15 @@ void _malloc_prefork(void) MOZ_NO_THREAD_SAFETY_ANALYSIS {
   base_mtx.Lock();
 
   huge_mtx.Lock();
+
+  gThreadCachesLock.Lock();
 }
 
 FORK_HOOK
 void _malloc_postfork_parent(void) MOZ_NO_THREAD_SAFETY_ANALYSIS {
   // Release all mutexes, now that fork() has completed.
+  gThreadCachesLock.Unlock();
+
   huge_mtx.Unlock();
 
   base_mtx.Unlock();
@@ -6306,6 +6772,8 @@ void _malloc_postfork_child(void) {
   gArenas.ResetMainThread();
 
   // Reinitialize all mutexes, now that fork() has completed.
+  gThreadCachesLock.Init();
+
   huge_mtx.Init();
 
   base_mtx.Init();
@@ -122,6 +122,8 @@ typedef struct {
   size_t bookkeeping;     // Committed bytes used internally by the
                           // allocator.
   size_t bin_unused;      // Bytes committed to a bin but currently unused.
+  size_t thread_cache;    // Bytes in per-thread caches of free small
+                          // regions.
 
   size_t num_operations;  // The number of malloc()+free() calls.  Note that
                           // realloc calls
@@ -15,6 +15,7 @@
 //   - jemalloc_purge_freed_pages
 //   - jemalloc_free_dirty_pages
 //   - jemalloc_thread_local_arena
+//   - jemalloc_thread_cache
 //   - jemalloc_ptr_info
 
 #ifdef MALLOC_H
@@ -39,6 +39,7 @@
 //   - jemalloc_purge_freed_pages
 //   - jemalloc_free_dirty_pages
 //   - jemalloc_thread_local_arena
+//   - jemalloc_thread_cache
 //   - jemalloc_ptr_info
 //   (these functions are native to mozjemalloc)
 //
@@ -16,6 +16,10 @@
 
 #include "gtest/gtest.h"
 
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #ifdef MOZ_PHC
 #  include "PHC.h"
 #endif
@@ -866,3 +870,104 @@ TEST(Jemalloc, StatsLite)
 
   moz_dispose_arena(my_arena);
 }
+
+TEST(Jemalloc, ThreadCache)
+{
+  constexpr size_t kSize = 64;
+  constexpr size_t kCount = 16;
+
+  // The test and the caching thread take turns.
+  std::mutex mutex;
+  std::condition_variable cv;
+  unsigned step = 0;
+  auto advanceTo = [&](unsigned aStep) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      step = aStep;
+    }
+    cv.notify_all();
+  };
+  auto waitFor = [&](unsigned aStep) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return step == aStep; });
+  };
+
+  void* cachedAtExit = nullptr;
+  std::thread thread([&] {
+    AutoDisablePHCOnCurrentThread disable;
+    // Give the thread an arena of its own, so that other threads can't reuse
+    // the regions it frees while we look at them.
+    jemalloc_thread_local_arena(true);
+    jemalloc_thread_cache(true);
+
+    void* ptrs[kCount];
+    for (auto& ptr : ptrs) {
+      ptr = malloc(kSize);
+      EXPECT_TRUE(ptr);
+    }
+    for (auto& ptr : ptrs) {
+      free(ptr);
+    }
+
+    // Cached regions are still allocated as far as the arena is concerned,
+    // and the most recently freed one is reused first.
+    void* cached = ptrs[kCount - 1];
+    jemalloc_ptr_info_t info;
+    jemalloc_ptr_info(cached, &info);
+    EXPECT_EQ(info.tag, TagLiveAlloc);
+    void* reused = malloc(kSize);
+    EXPECT_EQ(reused, cached);
+    free(reused);
+
+    void* other = malloc(kSize / 4);
+    advanceTo(1);
+    waitFor(2);
+
+    // After jemalloc_free_dirty_pages, the cache is flushed on the next
+    // malloc or free.
+    free(other);
+    jemalloc_ptr_info(cached, &info);
+    EXPECT_NE(info.tag, TagLiveAlloc);
+    jemalloc_ptr_info(other, &info);
+    EXPECT_EQ(info.tag, TagLiveAlloc);
+    cachedAtExit = other;
+  });
+
+  waitFor(1);
+  jemalloc_stats_t stats;
+  jemalloc_stats(&stats);
+  EXPECT_GE(stats.thread_cache, kCount * kSize);
+  jemalloc_free_dirty_pages();
+  advanceTo(2);
+
+  // The cache is flushed when its thread exits.
+  thread.join();
+  jemalloc_ptr_info_t info;
+  jemalloc_ptr_info(cachedAtExit, &info);
+  EXPECT_NE(info.tag, TagLiveAlloc);
+}
+
+TEST(Jemalloc, ThreadCacheDoubleFree)
+{
+  // Avoid death tests adding some unnecessary (long) delays.
+  SAVE_GDB_SLEEP_LOCAL();
+
+  AutoDisablePHCOnCurrentThread disable;
+  jemalloc_thread_local_arena(true);
+  jemalloc_thread_cache(true);
+
+  // Freeing a region that is already cached crashes, in release builds too.
+  void* ptr = malloc(64);
+  ASSERT_TRUE(ptr);
+  free(ptr);
+  ASSERT_DEATH_WRAP(free(ptr), "");
+
+  // So does freeing one that the cache already gave back to the arena.
+  jemalloc_free_dirty_pages();
+  ASSERT_DEATH_WRAP(free(ptr), "");
+
+  jemalloc_thread_cache(false);
+  jemalloc_thread_local_arena(false);
+
+  RESTORE_GDB_SLEEP_LOCAL();
+}
@@ -830,7 +830,8 @@ class Replay {
     // This formula corresponds to the calculation of wasted (from committed and
     // the other parameters) within jemalloc_stats()
     size_t committed = stats.allocated + stats.waste + stats.pages_dirty +
-                       stats.bookkeeping + stats.bin_unused;
+                       stats.bookkeeping + stats.bin_unused +
+                       stats.thread_cache;
 
     FdPrintf(mStdErr, "\n");
     FdPrintf(mStdErr, "Objects:          %9zu\n", num_objects);
@@ -850,6 +851,7 @@ class Replay {
     FdPrintf(mStdErr, "madvised:         %9zu\n", stats.pages_madvised);
     FdPrintf(mStdErr, "bookkeep:         %9zu\n", stats.bookkeeping);
     FdPrintf(mStdErr, "bin-unused:       %9zu\n", stats.bin_unused);
+    FdPrintf(mStdErr, "thread-cache:     %9zu\n", stats.thread_cache);
     FdPrintf(mStdErr, "quantum-max:      %9zu\n", stats.quantum_max);
     FdPrintf(mStdErr, "quantum-wide-max: %9zu\n", stats.quantum_wide_max);
     FdPrintf(mStdErr, "subpage-max:      %9zu\n", stats.subpage_max);
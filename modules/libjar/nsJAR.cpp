@@ -309,7 +309,8 @@ nsJAR::GetInputStream(const nsACString& aEntryName, nsIInputStream** result) {
     rv = jis->InitDirectory(this, entry.get());
   } else {
     RefPtr<nsZipHandle> fd = mZip->GetFD();
-    rv = jis->InitFile(fd, mZip->GetData(item), item);
+    rv = jis->InitFile(fd, mZip->GetData(item), item,
+                       mZip->TakePreinflatedData(item));
   }
   if (NS_SUCCEEDED(rv)) {
     // Callers use getter_addrefs
@@ -32,8 +32,9 @@ NS_IMPL_ISUPPORTS(nsJARInputStream, nsIInputStream)
  * Takes ownership of |fd|, even on failure
  *--------------------------------------------------------*/
 
-nsresult nsJARInputStream::InitFile(nsZipHandle* aFd, const uint8_t* aData,
-                                    nsZipItem* aItem) {
+nsresult nsJARInputStream::InitFile(
+    nsZipHandle* aFd, const uint8_t* aData, nsZipItem* aItem,
+    mozilla::UniquePtr<uint8_t[]> aInflatedData) {
   nsresult rv = NS_OK;
   MOZ_DIAGNOSTIC_ASSERT(aFd, "Argument may not be null");
   if (!aFd) {
@@ -50,6 +51,19 @@ nsresult nsJARInputStream::InitFile(nsZipHandle* aFd, const uint8_t* aData,
       break;
 
     case DEFLATED:
+      if (aInflatedData) {
+        // Copy the data nsZipArchive::PreloadEntries inflated, and checked
+        // the CRC of, as if the item was stored.
+        mInflatedData = std::move(aInflatedData);
+        mMode = MODE_COPY;
+        mFd = aFd;
+        mZs.next_in = mInflatedData.get();
+        mZs.avail_in = aItem->RealSize();
+        mOutSize = aItem->RealSize();
+        mZs.total_out = 0;
+        return NS_OK;
+      }
+
       rv = gZlibInit(&mZs);
       NS_ENSURE_SUCCESS(rv, rv);
 
@@ -260,6 +274,7 @@ nsJARInputStream::Close() {
   }
   mMode = MODE_CLOSED;
   mFd = nullptr;
+  mInflatedData = nullptr;
   return NS_OK;
 }
 
@@ -11,6 +11,7 @@
 #include "nsJAR.h"
 #include "nsTArray.h"
 #include "mozilla/Attributes.h"
+#include "mozilla/UniquePtr.h"
 
 /*-------------------------------------------------------------------------
  * Class nsJARInputStream declaration. This class defines the type of the
@@ -33,8 +34,10 @@ class nsJARInputStream final : public nsIInputStream {
   NS_DECL_THREADSAFE_ISUPPORTS
   NS_DECL_NSIINPUTSTREAM
 
-  // takes ownership of |fd|, even on failure
-  nsresult InitFile(nsZipHandle* aFd, const uint8_t* aData, nsZipItem* item);
+  // takes ownership of |fd|, even on failure. |aInflatedData| is the
+  // already inflated data of a compressed item, if any.
+  nsresult InitFile(nsZipHandle* aFd, const uint8_t* aData, nsZipItem* item,
+                    mozilla::UniquePtr<uint8_t[]> aInflatedData = nullptr);
 
   nsresult InitDirectory(nsJAR* aJar, const char* aDir);
 
@@ -46,6 +49,7 @@ class nsJARInputStream final : public nsIInputStream {
   uint32_t mInCrc;          // CRC as provided by the zipentry
   uint32_t mOutCrc;         // CRC as calculated by me
   z_stream mZs;             // zip data structure
+  mozilla::UniquePtr<uint8_t[]> mInflatedData;  // data inflated ahead of time
 
   /* For directory reading */
   RefPtr<nsJAR> mJar;          // string reference to zipreader
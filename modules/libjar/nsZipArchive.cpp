@@ -15,6 +15,7 @@
 #include "mozilla/Attributes.h"
 #include "mozilla/Logging.h"
 #include "mozilla/MemUtils.h"
+#include "mozilla/ScopeExit.h"
 #include "mozilla/UniquePtrExtensions.h"
 #include "mozilla/StaticMutex.h"
 #include "mozilla/StaticPrefs_network.h"
@@ -24,11 +25,13 @@
 #include "nsXULAppAPI.h"
 #include "nsZipArchive.h"
 #include "nsString.h"
+#include "nsThreadUtils.h"
 #include "prenv.h"
 #if defined(XP_WIN)
 #  include <windows.h>
 #endif
 
+#include <algorithm>
 // For placement new used for arena allocations of zip file list
 #include <new>
 #define ZIP_ARENABLOCKSIZE (1 * 1024)
@@ -81,6 +84,12 @@ static const uint32_t kMaxNameLength = PATH_MAX; /* Maximum name length */
 // For synthetic zip entries. Date/time corresponds to 1980-01-01 00:00.
 static const uint16_t kSyntheticTime = 0;
 static const uint16_t kSyntheticDate = (1 + (1 << 5) + (0 << 9));
+// PreloadEntries() reads the gaps between entries that are closer than this
+// rather than seeking over them.
+static const uint32_t kPreloadMaxReadaheadGap = 1024 * 1024;
+// PreloadEntries() stops inflating entries when the data nobody took yet
+// reaches this size.
+static const size_t kPreloadMaxInflatedBytes = 32 * 1024 * 1024;
 
 static uint16_t xtoint(const uint8_t* ii);
 static uint32_t xtolong(const uint8_t* ll);
@@ -457,24 +466,41 @@ nsZipItem* nsZipArchive::GetItem(const nsACString& aEntryName) {
       }
     }
     MMAP_FAULT_HANDLER_BEGIN_HANDLE(mFd)
-    nsZipItem* item = mFiles[HashName(aEntryName.BeginReading(), len)];
-    while (item) {
-      if ((len == item->nameLength) &&
-          (!memcmp(aEntryName.BeginReading(), item->Name(), len))) {
-        // Successful GetItem() is a good indicator that the file is about to be
-        // read
-        if (mUseZipLog && mURI.Length()) {
-          zipLog.Write(mURI, aEntryName.BeginReading());
-        }
-        return item;  //-- found it
+    nsZipItem* item = LookupItem(aEntryName);
+    if (item) {
+      // Successful GetItem() is a good indicator that the file is about to be
+      // read
+      if (mUseZipLog && mURI.Length()) {
+        zipLog.Write(mURI, aEntryName.BeginReading());
+      }
+      if (mRecordingReads && !item->isRecorded && !item->IsDirectory()) {
+        item->isRecorded = true;
+        mRecordedReads.AppendElement(item);
       }
-      item = item->next;
+      return item;
     }
     MMAP_FAULT_HANDLER_CATCH(nullptr)
   }
   return nullptr;
 }
 
+//---------------------------------------------
+// nsZipArchive::LookupItem
+// The caller must handle faults in the mapping.
+//---------------------------------------------
+nsZipItem* nsZipArchive::LookupItem(const nsACString& aEntryName) {
+  uint32_t len = aEntryName.Length();
+  nsZipItem* item = mFiles[HashName(aEntryName.BeginReading(), len)];
+  while (item) {
+    if ((len == item->nameLength) &&
+        (!memcmp(aEntryName.BeginReading(), item->Name(), len))) {
+      return item;  //-- found it
+    }
+    item = item->next;
+  }
+  return nullptr;
+}
+
 //---------------------------------------------
 // nsZipArchive::ExtractFile
 // This extracts the item to the filehandle provided.
@@ -714,6 +740,7 @@ nsresult nsZipArchive::BuildFileList(PRFileDesc* aFd)
     item->central = central;
     item->nameLength = namelen;
     item->isSynthetic = false;
+    item->isRecorded = false;
 
     // Add item to file table
 #ifdef DEBUG
@@ -791,6 +818,7 @@ nsresult nsZipArchive::BuildSynthetics() {
         diritem->central = item->central;
         diritem->nameLength = dirlen;
         diritem->isSynthetic = true;
+        diritem->isRecorded = false;
 
         // add diritem to the file table
         diritem->next = mFiles[hash];
@@ -880,13 +908,195 @@ const uint8_t* nsZipArchive::GetData(nsZipItem* aItem) {
 //---------------------------------------------
 int64_t nsZipArchive::SizeOfMapping() { return mFd ? mFd->SizeOfMapping() : 0; }
 
+//---------------------------------------------
+// nsZipArchive::StartRecordingReads
+//---------------------------------------------
+void nsZipArchive::StartRecordingReads() {
+  MutexAutoLock lock(mLock);
+  mRecordingReads = true;
+}
+
+//---------------------------------------------
+// nsZipArchive::StopRecordingReads
+//---------------------------------------------
+void nsZipArchive::StopRecordingReads(nsTArray<nsCString>& aEntries) {
+  MutexAutoLock lock(mLock);
+  mRecordingReads = false;
+
+  MMAP_FAULT_HANDLER_BEGIN_HANDLE(mFd)
+  aEntries.SetCapacity(mRecordedReads.Length());
+  for (nsZipItem* item : mRecordedReads) {
+    aEntries.AppendElement(nsCString(item->Name(), item->nameLength));
+  }
+  MMAP_FAULT_HANDLER_CATCH()
+  mRecordedReads.Clear();
+}
+
+//---------------------------------------------
+// nsZipArchive::PreloadEntries
+//---------------------------------------------
+void nsZipArchive::PreloadEntries(const nsTArray<nsCString>& aEntries) {
+  MOZ_ASSERT(!NS_IsMainThread());
+
+  auto clearPreloading = MakeScopeExit([&] {
+    MutexAutoLock lock(mLock);
+    mPreloading = false;
+  });
+
+  nsTArray<nsZipItem*> items(aEntries.Length());
+  {
+    MutexAutoLock lock(mLock);
+    if (mPreloadStopped) {
+      return;
+    }
+    mPreloading = true;
+
+    MMAP_FAULT_HANDLER_BEGIN_HANDLE(mFd)
+    for (const auto& entry : aEntries) {
+      nsZipItem* item = LookupItem(entry);
+      if (item && !item->IsDirectory()) {
+        items.AppendElement(item);
+      }
+    }
+    MMAP_FAULT_HANDLER_CATCH()
+  }
+
+  // Read the entries ahead in file order, merging the ones that are close
+  // enough, so that the disk sees a few long sequential reads rather than
+  // one random read per entry. Ranges start on 64KiB boundaries from the
+  // start of the mapping, which is a multiple of the page size.
+  nsTArray<nsZipItem*> sortedItems = items.Clone();
+  const uint8_t* fileStart = mFd->mFileStart;
+  MMAP_FAULT_HANDLER_BEGIN_HANDLE(mFd)
+  sortedItems.Sort([](nsZipItem* a, nsZipItem* b) {
+    return int(a->LocalOffset() > b->LocalOffset()) -
+           int(a->LocalOffset() < b->LocalOffset());
+  });
+  MMAP_FAULT_HANDLER_CATCH()
+
+  const uint8_t* rangeStart = nullptr;
+  const uint8_t* rangeEnd = nullptr;
+  auto readahead = [&] {
+    if (rangeStart) {
+      size_t offset = size_t(rangeStart - fileStart) & ~size_t(0xFFFF);
+      mozilla::PrefetchMemory(const_cast<uint8_t*>(fileStart + offset),
+                              rangeEnd - (fileStart + offset));
+    }
+  };
+  MMAP_FAULT_HANDLER_BEGIN_HANDLE(mFd)
+  for (nsZipItem* item : sortedItems) {
+    // Only use the central directory here: reading the local headers would
+    // be the random reads we are trying to avoid. The local extra field is
+    // usually the same size as the central one, and a few bytes more or less
+    // don't matter for readahead.
+    uint32_t offset = item->LocalOffset();
+    if (offset >= mFd->mLen) {
+      continue;
+    }
+    uint32_t length = std::min<uint64_t>(
+        uint64_t(ZIPLOCAL_SIZE) + item->nameLength +
+            xtoint(item->central->extrafield_len) + item->Size(),
+        mFd->mLen - offset);
+    const uint8_t* start = mFd->mFileData + offset;
+    const uint8_t* end = start + length;
+    if (rangeStart && start <= rangeEnd + kPreloadMaxReadaheadGap) {
+      rangeEnd = std::max(rangeEnd, end);
+      continue;
+    }
+    readahead();
+    rangeStart = start;
+    rangeEnd = end;
+  }
+  readahead();
+  MMAP_FAULT_HANDLER_CATCH()
+
+  // Then inflate the compressed entries in the order they will be read.
+  // Stored entries are read from the mapping, which the readahead covered.
+  for (nsZipItem* item : items) {
+    if (item->Compression() != DEFLATED) {
+      continue;
+    }
+    uint32_t size = item->RealSize();
+    {
+      MutexAutoLock lock(mLock);
+      if (mPreloadStopped ||
+          mPreinflatedBytes + size > kPreloadMaxInflatedBytes) {
+        return;
+      }
+      if (mPreinflated.Contains(item)) {
+        continue;
+      }
+    }
+
+    auto buf = MakeUniqueFallible<uint8_t[]>(size);
+    if (!buf) {
+      return;
+    }
+    nsZipCursor cursor(item, this, buf.get(), size, true);
+    uint32_t readLen = 0;
+    if (!cursor.Read(&readLen) || readLen != size) {
+      continue;
+    }
+
+    MutexAutoLock lock(mLock);
+    if (mPreloadStopped) {
+      return;
+    }
+    if (!mPreinflated.Contains(item)) {
+      mPreinflated.InsertOrUpdate(item, std::move(buf));
+      mPreinflatedBytes += size;
+    }
+  }
+}
+
+//---------------------------------------------
+// nsZipArchive::StopPreloading
+//---------------------------------------------
+void nsZipArchive::StopPreloading() {
+  MutexAutoLock lock(mLock);
+  mPreloadStopped = true;
+  mPreinflated.Clear();
+  mPreinflatedBytes = 0;
+}
+
+//---------------------------------------------
+// nsZipArchive::TakePreinflatedData
+//---------------------------------------------
+UniquePtr<uint8_t[]> nsZipArchive::TakePreinflatedData(nsZipItem* aItem) {
+  MOZ_ASSERT(aItem);
+  MutexAutoLock lock(mLock);
+  if (mPreloadStopped || aItem->Compression() != DEFLATED) {
+    return nullptr;
+  }
+  if (auto entry = mPreinflated.Lookup(aItem)) {
+    // Leave a null value behind, so that the entry isn't inflated again.
+    UniquePtr<uint8_t[]> data = std::move(entry.Data());
+    if (data) {
+      mPreinflatedBytes -= aItem->RealSize();
+    }
+    return data;
+  }
+  if (mPreloading) {
+    // Keep PreloadEntries() from inflating the entry after it was read.
+    mPreinflated.InsertOrUpdate(aItem, nullptr);
+  }
+  return nullptr;
+}
+
 //------------------------------------------
 // nsZipArchive constructor and destructor
 //------------------------------------------
 
 nsZipArchive::nsZipArchive(nsZipHandle* aZipHandle, PRFileDesc* aFd,
                            nsresult& aRv)
-    : mRefCnt(0), mFd(aZipHandle), mUseZipLog(false), mBuiltSynthetics(false) {
+    : mRefCnt(0),
+      mFd(aZipHandle),
+      mUseZipLog(false),
+      mBuiltSynthetics(false),
+      mRecordingReads(false),
+      mPreinflatedBytes(0),
+      mPreloading(false),
+      mPreloadStopped(false) {
   // initialize the table to nullptr
   memset(mFiles, 0, sizeof(mFiles));
   MOZ_DIAGNOSTIC_ASSERT(aZipHandle);
@@ -1051,7 +1261,11 @@ static PRTime GetModTime(uint16_t aDate, uint16_t aTime) {
 }
 
 nsZipItem::nsZipItem()
-    : next(nullptr), central(nullptr), nameLength(0), isSynthetic(false) {}
+    : next(nullptr),
+      central(nullptr),
+      nameLength(0),
+      isSynthetic(false),
+      isRecorded(false) {}
 
 uint32_t nsZipItem::LocalOffset() { return xtolong(central->localhdr_offset); }
 
@@ -1216,6 +1430,12 @@ nsZipItemPtr_base::nsZipItemPtr_base(nsZipArchive* aZip,
   bool compressed = (item->Compression() == DEFLATED);
   if (compressed) {
     size = item->RealSize();
+    mAutoBuf = aZip->TakePreinflatedData(item);
+    if (mAutoBuf) {
+      mReturnBuf = mAutoBuf.get();
+      mReadlen = size;
+      return;
+    }
     mAutoBuf = MakeUniqueFallible<uint8_t[]>(size);
     if (!mAutoBuf) {
       return;
@@ -16,6 +16,8 @@
 #include "zipstruct.h"
 #include "nsIFile.h"
 #include "nsISupportsImpl.h"  // For mozilla::ThreadSafeAutoRefCnt
+#include "nsTArray.h"
+#include "nsTHashMap.h"
 #include "mozilla/ArenaAllocator.h"
 #include "mozilla/FileUtils.h"
 #include "mozilla/FileLocation.h"
@@ -70,6 +72,8 @@ class nsZipItem final {
   const ZipCentral* central;
   uint16_t nameLength;
   bool isSynthetic;
+  // Whether the item is in nsZipArchive::mRecordedReads.
+  bool isRecorded;
 };
 
 class nsZipHandle;
@@ -176,6 +180,40 @@ class nsZipArchive final {
    */
   int64_t SizeOfMapping();
 
+  /**
+   * Starts recording the entries GetItem() returns, in the order in which
+   * they are first looked up.
+   */
+  void StartRecordingReads();
+
+  /**
+   * Stops recording, and returns the names of the recorded entries.
+   * @param   aEntries    Outparam for the names, in the order they were read
+   */
+  void StopRecordingReads(nsTArray<nsCString>& aEntries);
+
+  /**
+   * Reads the data of the given entries ahead, in as few sequential passes
+   * over the file as possible, then inflates the compressed ones so that
+   * TakePreinflatedData() can return them. This blocks, so it must be called
+   * off the main thread.
+   *
+   * @param   aEntries    Names of the entries, in the order they will be read
+   */
+  void PreloadEntries(const nsTArray<nsCString>& aEntries);
+
+  /**
+   * Makes PreloadEntries() stop, and frees the data nobody took.
+   */
+  void StopPreloading();
+
+  /**
+   * Returns the data PreloadEntries() inflated for aItem, or null. The data
+   * of an entry can only be taken once.
+   * @param   aItem       Pointer to nsZipItem
+   */
+  mozilla::UniquePtr<uint8_t[]> TakePreinflatedData(nsZipItem* aItem);
+
   /*
    * Refcounting
    */
@@ -205,10 +243,21 @@ class nsZipArchive final {
   mozilla::ArenaAllocator<1024, sizeof(void*)> mArena MOZ_GUARDED_BY(mLock);
   // Whether we synthesized the directory entries
   bool mBuiltSynthetics MOZ_GUARDED_BY(mLock);
+  // Whether GetItem() records the items it returns in mRecordedReads
+  bool mRecordingReads MOZ_GUARDED_BY(mLock);
+  nsTArray<nsZipItem*> mRecordedReads MOZ_GUARDED_BY(mLock);
+  // Data inflated by PreloadEntries(). A null value means the entry was read
+  // before PreloadEntries() got to it, and doesn't need to be inflated.
+  nsTHashMap<nsPtrHashKey<nsZipItem>, mozilla::UniquePtr<uint8_t[]>>
+      mPreinflated MOZ_GUARDED_BY(mLock);
+  size_t mPreinflatedBytes MOZ_GUARDED_BY(mLock);
+  bool mPreloading MOZ_GUARDED_BY(mLock);
+  bool mPreloadStopped MOZ_GUARDED_BY(mLock);
 
  private:
   //--- private methods ---
   nsZipItem* CreateZipItem() MOZ_REQUIRES(mLock);
+  nsZipItem* LookupItem(const nsACString& aEntryName) MOZ_REQUIRES(mLock);
   nsresult BuildFileList(PRFileDesc* aFd = nullptr);
   nsresult BuildSynthetics();
 
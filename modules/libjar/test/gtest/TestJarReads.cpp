@@ -0,0 +1,91 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "mozilla/URLPreloader.h"
+#include "nsDirectoryServiceDefs.h"
+#include "nsDirectoryServiceUtils.h"
+#include "nsIFile.h"
+#include "prio.h"
+
+using namespace mozilla;
+
+namespace {
+
+class URLPreloaderJarReads : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(NS_GetSpecialDirectory(NS_OS_TEMP_DIR, getter_AddRefs(mFile)),
+              NS_OK);
+    ASSERT_EQ(mFile->AppendNative("urlCache-jarReads.bin"_ns), NS_OK);
+    ASSERT_EQ(mFile->CreateUnique(nsIFile::NORMAL_FILE_TYPE, 0600), NS_OK);
+  }
+
+  void TearDown() override {
+    if (mFile) {
+      mFile->Remove(false);
+    }
+  }
+
+  nsCOMPtr<nsIFile> mFile;
+};
+
+}  // namespace
+
+// The recorded reads of both archives come back in the order they were
+// written.
+TEST_F(URLPreloaderJarReads, RoundTrip)
+{
+  URLPreloader::JarReads reads;
+  reads[Omnijar::GRE] = {"modules/a.sys.mjs"_ns, "chrome/b.js"_ns,
+                         "res/c.css"_ns};
+  reads[Omnijar::APP] = {"chrome/browser/d.js"_ns};
+  ASSERT_TRUE(URLPreloader::WriteJarReadsFile(mFile, reads).isOk());
+
+  URLPreloader::JarReads readBack;
+  ASSERT_TRUE(URLPreloader::ReadJarReadsFile(mFile, readBack).isOk());
+  EXPECT_EQ(readBack[Omnijar::GRE], reads[Omnijar::GRE]);
+  EXPECT_EQ(readBack[Omnijar::APP], reads[Omnijar::APP]);
+
+  // Rewriting replaces the previous list.
+  reads[Omnijar::GRE].RemoveElementAt(0);
+  reads[Omnijar::APP].Clear();
+  ASSERT_TRUE(URLPreloader::WriteJarReadsFile(mFile, reads).isOk());
+  URLPreloader::JarReads rewritten;
+  ASSERT_TRUE(URLPreloader::ReadJarReadsFile(mFile, rewritten).isOk());
+  EXPECT_EQ(rewritten[Omnijar::GRE], reads[Omnijar::GRE]);
+  EXPECT_TRUE(rewritten[Omnijar::APP].IsEmpty());
+}
+
+// A damaged list is rejected rather than preloaded.
+TEST_F(URLPreloaderJarReads, RejectsCorruptFile)
+{
+  URLPreloader::JarReads reads;
+  reads[Omnijar::GRE] = {"modules/a.sys.mjs"_ns};
+  ASSERT_TRUE(URLPreloader::WriteJarReadsFile(mFile, reads).isOk());
+
+  int64_t size = 0;
+  ASSERT_EQ(mFile->GetFileSize(&size), NS_OK);
+  ASSERT_GT(size, 1);
+
+  // Flip a byte of the last entry's name.
+  PRFileDesc* fd = nullptr;
+  ASSERT_EQ(mFile->OpenNSPRFileDesc(PR_RDWR, 0, &fd), NS_OK);
+  char byte;
+  ASSERT_EQ(PR_Seek64(fd, size - 1, PR_SEEK_SET), size - 1);
+  ASSERT_EQ(PR_Read(fd, &byte, 1), 1);
+  byte ^= 0x20;
+  ASSERT_EQ(PR_Seek64(fd, size - 1, PR_SEEK_SET), size - 1);
+  ASSERT_EQ(PR_Write(fd, &byte, 1), 1);
+  PR_Close(fd);
+
+  URLPreloader::JarReads readBack;
+  EXPECT_TRUE(URLPreloader::ReadJarReadsFile(mFile, readBack).isErr());
+
+  // As is a truncated one.
+  ASSERT_EQ(mFile->SetFileSize(8), NS_OK);
+  EXPECT_TRUE(URLPreloader::ReadJarReadsFile(mFile, readBack).isErr());
+}
@@ -0,0 +1,251 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim:set ts=2 sw=2 sts=2 et cindent: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "mozilla/EndianUtils.h"
+#include "nsThreadUtils.h"
+#include "nsZipArchive.h"
+#include "zlib.h"
+
+using namespace mozilla;
+
+namespace {
+
+struct TestEntry {
+  const char* mName;
+  nsCString mData;
+  bool mDeflate;
+};
+
+template <typename T>
+void Append(nsTArray<uint8_t>& aOut, T aValue) {
+  uint8_t bytes[sizeof(T)];
+  if constexpr (sizeof(T) == 2) {
+    LittleEndian::writeUint16(bytes, aValue);
+  } else {
+    LittleEndian::writeUint32(bytes, aValue);
+  }
+  aOut.AppendElements(bytes, sizeof(T));
+}
+
+nsTArray<uint8_t> Deflate(const nsCString& aData) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  MOZ_RELEASE_ASSERT(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                                  -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  nsTArray<uint8_t> out;
+  out.SetLength(deflateBound(&zs, aData.Length()));
+  zs.next_in = (Bytef*)aData.BeginReading();
+  zs.avail_in = aData.Length();
+  zs.next_out = out.Elements();
+  zs.avail_out = out.Length();
+  MOZ_RELEASE_ASSERT(deflate(&zs, Z_FINISH) == Z_STREAM_END);
+  out.SetLength(zs.total_out);
+  deflateEnd(&zs);
+  return out;
+}
+
+// Builds a zip file holding aEntries, in that order.
+nsTArray<uint8_t> BuildZip(const nsTArray<TestEntry>& aEntries) {
+  nsTArray<uint8_t> zip;
+  nsTArray<uint8_t> central;
+  for (const auto& entry : aEntries) {
+    nsTArray<uint8_t> data;
+    if (entry.mDeflate) {
+      data = Deflate(entry.mData);
+    } else {
+      data.AppendElements((const uint8_t*)entry.mData.BeginReading(),
+                          entry.mData.Length());
+    }
+    uint16_t method = entry.mDeflate ? DEFLATED : STORED;
+    uint32_t crc = crc32(0, (const Bytef*)entry.mData.BeginReading(),
+                         entry.mData.Length());
+    uint16_t nameLength = strlen(entry.mName);
+    uint32_t offset = zip.Length();
+
+    Append<uint32_t>(zip, LOCALSIG);
+    Append<uint16_t>(zip, 20);  // version
+    Append<uint16_t>(zip, 0);   // bitflag
+    Append<uint16_t>(zip, method);
+    Append<uint16_t>(zip, 0);  // time
+    Append<uint16_t>(zip, 0);  // date
+    Append<uint32_t>(zip, crc);
+    Append<uint32_t>(zip, data.Length());
+    Append<uint32_t>(zip, entry.mData.Length());
+    Append<uint16_t>(zip, nameLength);
+    Append<uint16_t>(zip, 0);  // extrafield_len
+    zip.AppendElements((const uint8_t*)entry.mName, nameLength);
+    zip.AppendElements(data);
+
+    Append<uint32_t>(central, CENTRALSIG);
+    Append<uint16_t>(central, 20);  // version_made_by
+    Append<uint16_t>(central, 20);  // version
+    Append<uint16_t>(central, 0);   // bitflag
+    Append<uint16_t>(central, method);
+    Append<uint16_t>(central, 0);  // time
+    Append<uint16_t>(central, 0);  // date
+    Append<uint32_t>(central, crc);
+    Append<uint32_t>(central, data.Length());
+    Append<uint32_t>(central, entry.mData.Length());
+    Append<uint16_t>(central, nameLength);
+    Append<uint16_t>(central, 0);  // extrafield_len
+    Append<uint16_t>(central, 0);  // commentfield_len
+    Append<uint16_t>(central, 0);  // diskstart_number
+    Append<uint16_t>(central, 0);  // internal_attributes
+    Append<uint32_t>(central, 0);  // external_attributes
+    Append<uint32_t>(central, offset);
+    central.AppendElements((const uint8_t*)entry.mName, nameLength);
+  }
+
+  uint32_t centralOffset = zip.Length();
+  zip.AppendElements(central);
+  Append<uint32_t>(zip, ENDSIG);
+  Append<uint16_t>(zip, 0);  // disk_nr
+  Append<uint16_t>(zip, 0);  // start_central_dir
+  Append<uint16_t>(zip, aEntries.Length());
+  Append<uint16_t>(zip, aEntries.Length());
+  Append<uint32_t>(zip, central.Length());
+  Append<uint32_t>(zip, centralOffset);
+  Append<uint16_t>(zip, 0);  // commentfield_len
+  return zip;
+}
+
+nsCString Repeat(const char* aText, uint32_t aCount) {
+  nsCString result;
+  for (uint32_t i = 0; i < aCount; ++i) {
+    result.Append(aText);
+  }
+  return result;
+}
+
+class ZipPreload : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    mEntries.AppendElement(TestEntry{"a.js", Repeat("alpha ", 1000), true});
+    mEntries.AppendElement(TestEntry{"b.js", Repeat("bravo ", 2000), true});
+    mEntries.AppendElement(TestEntry{"c.txt", "stored"_ns, false});
+    mEntries.AppendElement(TestEntry{"dir/d.js", Repeat("delta ", 500), true});
+    mData = BuildZip(mEntries);
+
+    RefPtr<nsZipHandle> handle;
+    ASSERT_EQ(nsZipHandle::Init(mData.Elements(), mData.Length(),
+                                getter_AddRefs(handle)),
+              NS_OK);
+    mZip = nsZipArchive::OpenArchive(handle);
+    ASSERT_TRUE(mZip);
+  }
+
+  // PreloadEntries() blocks, so it has to run off the main thread.
+  void Preload(const nsTArray<nsCString>& aEntries) {
+    nsCOMPtr<nsIThread> thread;
+    ASSERT_EQ(NS_NewNamedThread("TestZipPreload", getter_AddRefs(thread)),
+              NS_OK);
+    RefPtr<nsZipArchive> zip = mZip;
+    ASSERT_EQ(NS_DispatchAndSpinEventLoopUntilComplete(
+                  "TestZipPreload"_ns, thread,
+                  NS_NewRunnableFunction("TestZipPreload", [&] {
+                    zip->PreloadEntries(aEntries);
+                  })),
+              NS_OK);
+    thread->Shutdown();
+  }
+
+  // Returns the data PreloadEntries() inflated for aName, or a void string.
+  nsCString TakePreinflated(const nsACString& aName) {
+    nsZipItem* item = mZip->GetItem(aName);
+    EXPECT_TRUE(item);
+    UniquePtr<uint8_t[]> data =
+        item ? mZip->TakePreinflatedData(item) : nullptr;
+    nsCString result;
+    if (data) {
+      result.Assign((const char*)data.get(), item->RealSize());
+    } else {
+      result.SetIsVoid(true);
+    }
+    return result;
+  }
+
+  const nsCString& Data(const char* aName) {
+    for (const auto& entry : mEntries) {
+      if (!strcmp(entry.mName, aName)) {
+        return entry.mData;
+      }
+    }
+    MOZ_CRASH("Unknown entry");
+  }
+
+  nsTArray<TestEntry> mEntries;
+  nsTArray<uint8_t> mData;
+  RefPtr<nsZipArchive> mZip;
+};
+
+}  // namespace
+
+// Entries are recorded once, in the order they are first looked up, and only
+// while recording.
+TEST_F(ZipPreload, RecordsReadsInFirstReadOrder)
+{
+  ASSERT_TRUE(mZip->GetItem("a.js"_ns));
+
+  mZip->StartRecordingReads();
+  ASSERT_TRUE(mZip->GetItem("dir/d.js"_ns));
+  ASSERT_TRUE(mZip->GetItem("b.js"_ns));
+  ASSERT_TRUE(mZip->GetItem("dir/d.js"_ns));
+  ASSERT_FALSE(mZip->GetItem("missing.js"_ns));
+  ASSERT_TRUE(mZip->GetItem("a.js"_ns));
+
+  nsTArray<nsCString> recorded;
+  mZip->StopRecordingReads(recorded);
+  EXPECT_EQ(recorded,
+            (nsTArray<nsCString>{"dir/d.js"_ns, "b.js"_ns, "a.js"_ns}));
+
+  ASSERT_TRUE(mZip->GetItem("c.txt"_ns));
+  recorded.Clear();
+  mZip->StopRecordingReads(recorded);
+  EXPECT_TRUE(recorded.IsEmpty());
+}
+
+// Compressed entries are inflated ahead and handed out once. Stored entries
+// are read from the mapping as usual.
+TEST_F(ZipPreload, PreloadEntriesInflatesCompressedEntries)
+{
+  Preload(nsTArray<nsCString>{"b.js"_ns, "c.txt"_ns, "missing.js"_ns,
+                              "a.js"_ns});
+
+  EXPECT_EQ(TakePreinflated("a.js"_ns), Data("a.js"));
+  EXPECT_TRUE(TakePreinflated("a.js"_ns).IsVoid());
+  EXPECT_TRUE(TakePreinflated("c.txt"_ns).IsVoid());
+  EXPECT_TRUE(TakePreinflated("dir/d.js"_ns).IsVoid());
+
+  // Readers take the inflated data too.
+  nsZipItemPtr<char> b(mZip, "b.js"_ns, true);
+  ASSERT_TRUE(b.Buffer());
+  EXPECT_EQ(nsDependentCSubstring(b.Buffer(), b.Length()), Data("b.js"));
+  EXPECT_TRUE(TakePreinflated("b.js"_ns).IsVoid());
+
+  // And inflate as before once it is gone.
+  nsZipItemPtr<char> again(mZip, "b.js"_ns, true);
+  ASSERT_TRUE(again.Buffer());
+  EXPECT_EQ(nsDependentCSubstring(again.Buffer(), again.Length()),
+            Data("b.js"));
+}
+
+// Once preloading is stopped, the data nobody took is dropped and nothing is
+// inflated anymore.
+TEST_F(ZipPreload, StopPreloadingDropsUntakenData)
+{
+  Preload(nsTArray<nsCString>{"a.js"_ns, "b.js"_ns});
+  mZip->StopPreloading();
+  EXPECT_TRUE(TakePreinflated("a.js"_ns).IsVoid());
+
+  Preload(nsTArray<nsCString>{"b.js"_ns, "dir/d.js"_ns});
+  EXPECT_TRUE(TakePreinflated("b.js"_ns).IsVoid());
+  EXPECT_TRUE(TakePreinflated("dir/d.js"_ns).IsVoid());
+
+  nsZipItemPtr<char> d(mZip, "dir/d.js"_ns, true);
+  ASSERT_TRUE(d.Buffer());
+  EXPECT_EQ(nsDependentCSubstring(d.Buffer(), d.Length()), Data("dir/d.js"));
+}
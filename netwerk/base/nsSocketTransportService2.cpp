@@ -17,6 +17,7 @@
 #include "mozilla/PublicSSL.h"
 #include "mozilla/ReverseIterator.h"
 #include "mozilla/Services.h"
+#include "mozilla/StaticPrefs_memory.h"
 #include "mozilla/StaticPrefs_network.h"
 #include "mozilla/Tokenizer.h"
 #include "mozilla/Telemetry.h"
@@ -1078,6 +1079,15 @@ NS_IMETHODIMP
 nsSocketTransportService::Run() {
   SOCKET_LOG(("STS thread init %d sockets\n", gMaxCount));
 
+#ifdef MOZ_MEMORY
+  // Most of the socket thread's allocations are small and short-lived, let
+  // it make them without taking the allocator's arena lock. The cache is
+  // flushed when the thread exits.
+  if (StaticPrefs::memory_thread_cache_enabled()) {
+    jemalloc_thread_cache(true);
+  }
+#endif
+
 #if defined(XP_WIN)
   // see bug 1361495, gethostname() triggers winsock initialization.
   // so do it here (on parent and child) to protect against it being done first
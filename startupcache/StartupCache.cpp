@@ -15,6 +15,7 @@
 #include "mozilla/ResultExtensions.h"
 #include "mozilla/scache/StartupCache.h"
 #include "mozilla/ScopeExit.h"
+#include "mozilla/StaticPrefs_browser.h"
 #include "mozilla/Try.h"
 
 #include "nsClassHashtable.h"
@@ -90,10 +91,18 @@ static const size_t STARTUP_CACHE_RESERVE_CAPACITY = 450;
 // This is a hard limit which we will assert on, to ensure that we don't
 // have some bug causing runaway cache growth.
 static const size_t STARTUP_CACHE_MAX_CAPACITY = 5000;
+// The maximum number of background tasks decompressing entries after the cache
+// file is loaded.
+static const size_t STARTUP_CACHE_MAX_PREDECOMPRESSION_TASKS = 4;
+// The maximum amount of data decompressed in the background after the cache
+// file is loaded. Entries past it are decompressed by GetBuffer() as before.
+static const size_t STARTUP_CACHE_MAX_PREDECOMPRESSED_SIZE = 16 * 1024 * 1024;
 
 // Not const because we change it for gtests.
 static uint8_t STARTUP_CACHE_WRITE_TIMEOUT = 60;
 
+#define STARTUP_COMPLETE_TOPIC "browser-delayed-startup-finished"
+
 #define STARTUP_CACHE_NAME "startupCache." SC_WORDSIZE "." SC_ENDIAN
 
 static inline Result<Ok, nsresult> Write(PRFileDesc* fd, const void* data,
@@ -115,6 +124,36 @@ static nsresult MapLZ4ErrorToNsresult(size_t aError) {
   return NS_ERROR_FAILURE;
 }
 
+// Decompresses an entry of the mapped cache file. This can be called from any
+// thread, as long as the mapping outlives the call.
+static Result<UniqueFreePtr<char[]>, nsresult> DecompressEntry(
+    LZ4FrameDecompressionContext& aContext, Span<const char> aCompressed,
+    uint32_t aUncompressedSize) {
+  size_t totalRead = 0;
+  size_t totalWritten = 0;
+  UniqueFreePtr<char[]> data(
+      reinterpret_cast<char*>(malloc(sizeof(char) * aUncompressedSize)));
+  Span<char> uncompressed = Span(data.get(), aUncompressedSize);
+  MMAP_FAULT_HANDLER_BEGIN_BUFFER(uncompressed.Elements(),
+                                  uncompressed.Length())
+  bool finished = false;
+  while (!finished) {
+    auto result = aContext.Decompress(uncompressed.From(totalWritten),
+                                      aCompressed.From(totalRead));
+    if (NS_WARN_IF(result.isErr())) {
+      return Err(NS_ERROR_FAILURE);
+    }
+    auto decompressionResult = result.unwrap();
+    totalRead += decompressionResult.mSizeRead;
+    totalWritten += decompressionResult.mSizeWritten;
+    finished = decompressionResult.mFinished;
+  }
+
+  MMAP_FAULT_HANDLER_CATCH(Err(NS_ERROR_FAILURE))
+
+  return data;
+}
+
 StartupCache* StartupCache::GetSingletonNoInit() {
   return StartupCache::gStartupCache;
 }
@@ -226,11 +265,17 @@ nsresult StartupCache::Init() {
   rv = mObserverService->AddObserver(mListener, "intl:app-locales-changed",
                                      false);
   NS_ENSURE_SUCCESS(rv, rv);
+  rv = mObserverService->AddObserver(mListener, STARTUP_COMPLETE_TOPIC, false);
+  NS_ENSURE_SUCCESS(rv, rv);
 
   {
     MutexAutoLock lock(mTableLock);
     auto result = LoadArchive();
     rv = result.isErr() ? result.unwrapErr() : NS_OK;
+    if (NS_SUCCEEDED(rv) &&
+        StaticPrefs::browser_startup_cache_parallel_decompression()) {
+      StartPredecompression();
+    }
   }
 
   gFoundDiskCacheOnInit = rv != NS_ERROR_FILE_NOT_FOUND;
@@ -258,6 +303,82 @@ void StartupCache::StartPrefetchMemory() {
       mCacheData.get<uint8_t>().get(), mCacheData.size()));
 }
 
+void StartupCache::StartPredecompression() {
+  MOZ_ASSERT(NS_IsMainThread());
+  MOZ_ASSERT(!mPredecompressedEntries);
+  if (!mCacheData.initialized() || mTable.empty()) {
+    return;
+  }
+
+  // The file is written in the order in which entries were first requested
+  // during the previous session, so the entries at its start are the ones
+  // this startup is going to request first. Only decompress those.
+  nsTArray<StartupCacheEntry*> entries(mTable.count());
+  for (auto iter = mTable.modIter(); !iter.done(); iter.next()) {
+    entries.AppendElement(&iter.get().value());
+  }
+  entries.Sort([](const StartupCacheEntry* a, const StartupCacheEntry* b) {
+    return int(a->mOffset > b->mOffset) - int(a->mOffset < b->mOffset);
+  });
+  size_t totalSize = 0;
+  for (size_t i = 0; i < entries.Length(); i++) {
+    totalSize += entries[i]->mUncompressedSize;
+    if (totalSize > STARTUP_CACHE_MAX_PREDECOMPRESSED_SIZE) {
+      entries.TruncateLength(i);
+      break;
+    }
+  }
+  if (entries.IsEmpty()) {
+    return;
+  }
+
+  // No background thread is running, see CancelPredecompression().
+  mPredecompressionCanceled = false;
+  mNextPredecompressedEntry = 0;
+  mPredecompressedHitCount = 0;
+  mPredecompressedEntryCount = entries.Length();
+  mPredecompressedEntries =
+      MakeUnique<PredecompressedEntry[]>(mPredecompressedEntryCount);
+  for (uint32_t i = 0; i < mPredecompressedEntryCount; i++) {
+    auto& predecompressed = mPredecompressedEntries[i];
+    predecompressed.mOffset = entries[i]->mOffset;
+    predecompressed.mCompressedSize = entries[i]->mCompressedSize;
+    predecompressed.mUncompressedSize = entries[i]->mUncompressedSize;
+    entries[i]->mPredecompressedIndex = int32_t(i);
+  }
+
+  Span<PredecompressedEntry> predecompressedEntries(
+      mPredecompressedEntries.get(), mPredecompressedEntryCount);
+  const char* cacheEntries =
+      mCacheData.get<char>().get() + mCacheEntriesBaseOffset;
+  // Leave a core to the main thread.
+  size_t taskCount = std::min(
+      std::min(STARTUP_CACHE_MAX_PREDECOMPRESSION_TASKS,
+               std::max<size_t>(GetNumberOfProcessors(), 2) - 1),
+      size_t(mPredecompressedEntryCount));
+  RefPtr<StartupCache> self = this;
+  for (size_t i = 0; i < taskCount; i++) {
+    {
+      MonitorAutoLock lock(mPredecompressionMonitor);
+      mPredecompressionTasks++;
+    }
+    nsresult rv = NS_DispatchBackgroundTask(
+        NS_NewRunnableFunction("StartupCache::Predecompress",
+                               [self, predecompressedEntries, cacheEntries] {
+                                 self->ThreadedPredecompress(
+                                     predecompressedEntries, cacheEntries);
+                               }),
+        NS_DISPATCH_EVENT_MAY_BLOCK);
+    if (NS_WARN_IF(NS_FAILED(rv))) {
+      // Entries nobody decompresses are decompressed by GetBuffer().
+      MonitorAutoLock lock(mPredecompressionMonitor);
+      mPredecompressionTasks--;
+      mPredecompressionMonitor.NotifyAll();
+      break;
+    }
+  }
+}
+
 /**
  * LoadArchive can only be called from the main thread.
  */
@@ -391,6 +512,9 @@ nsresult StartupCache::GetBuffer(const char* id, const char** outbuf,
   auto& value = p->value();
   if (value.mData) {
     label = Telemetry::LABELS_STARTUP_CACHE_REQUESTS::HitMemory;
+  } else if ((value.mData = TakePredecompressedData(value))) {
+    mPredecompressedHitCount++;
+    label = Telemetry::LABELS_STARTUP_CACHE_REQUESTS::HitDisk;
   } else {
     if (!mCacheData.initialized()) {
       return NS_ERROR_NOT_AVAILABLE;
@@ -404,33 +528,17 @@ nsresult StartupCache::GetBuffer(const char* id, const char** outbuf,
     // Also, WriteToDisk() requires mTableLock, so while it's writing we can't
     // be here.
 
-    size_t totalRead = 0;
-    size_t totalWritten = 0;
     Span<const char> compressed = Span(
         mCacheData.get<char>().get() + mCacheEntriesBaseOffset + value.mOffset,
         value.mCompressedSize);
-    value.mData = UniqueFreePtr<char[]>(reinterpret_cast<char*>(
-        malloc(sizeof(char) * value.mUncompressedSize)));
-    Span<char> uncompressed = Span(value.mData.get(), value.mUncompressedSize);
-    MMAP_FAULT_HANDLER_BEGIN_BUFFER(uncompressed.Elements(),
-                                    uncompressed.Length())
-    bool finished = false;
-    while (!finished) {
-      auto result = mDecompressionContext->Decompress(
-          uncompressed.From(totalWritten), compressed.From(totalRead));
-      if (NS_WARN_IF(result.isErr())) {
-        value.mData = nullptr;
-        MutexAutoUnlock unlock(mTableLock);
-        InvalidateCache();
-        return NS_ERROR_FAILURE;
-      }
-      auto decompressionResult = result.unwrap();
-      totalRead += decompressionResult.mSizeRead;
-      totalWritten += decompressionResult.mSizeWritten;
-      finished = decompressionResult.mFinished;
+    auto result = DecompressEntry(*mDecompressionContext, compressed,
+                                  value.mUncompressedSize);
+    if (result.isErr()) {
+      MutexAutoUnlock unlock(mTableLock);
+      InvalidateCache();
+      return NS_ERROR_FAILURE;
     }
-
-    MMAP_FAULT_HANDLER_CATCH(NS_ERROR_FAILURE)
+    value.mData = result.unwrap();
 
     label = Telemetry::LABELS_STARTUP_CACHE_REQUESTS::HitDisk;
   }
@@ -500,6 +608,14 @@ size_t StartupCache::HeapSizeOfIncludingThis(
     n += iter.get().key().SizeOfExcludingThisIfUnshared(aMallocSizeOf);
   }
 
+  n += aMallocSizeOf(mPredecompressedEntries.get());
+  for (uint32_t i = 0; i < mPredecompressedEntryCount; i++) {
+    const auto& entry = mPredecompressedEntries[i];
+    if (entry.mState == PredecompressedEntry::State::Done && entry.mData) {
+      n += aMallocSizeOf(entry.mData.get());
+    }
+  }
+
   return n;
 }
 
@@ -615,6 +731,7 @@ Result<Ok, nsresult> StartupCache::WriteToDisk() {
 
 void StartupCache::InvalidateCache(bool memoryOnly) {
   WaitOnPrefetch();
+  CancelPredecompression();
   // Ensure we're not writing using mTable...
   MutexAutoLock lock(mTableLock);
 
@@ -645,6 +762,8 @@ void StartupCache::InvalidateCache(bool memoryOnly) {
   } else {
     mTable.clear();
   }
+  mPredecompressedEntries = nullptr;
+  mPredecompressedEntryCount = 0;
   mRequestedCount = 0;
   if (!memoryOnly) {
     mCacheData.reset();
@@ -658,6 +777,11 @@ void StartupCache::InvalidateCache(bool memoryOnly) {
   auto result = LoadArchive();
   if (NS_WARN_IF(result.isErr())) {
     gIgnoreDiskCache = true;
+    return;
+  }
+  if (!mStartupFinished &&
+      StaticPrefs::browser_startup_cache_parallel_decompression()) {
+    StartPredecompression();
   }
 }
 
@@ -685,6 +809,8 @@ void StartupCache::EnsureShutdownWriteComplete() {
   // We got the lock. Keep the following in sync with
   // MaybeWriteOffMainThread:
   WaitOnPrefetch();
+  CancelPredecompression();
+  DropPredecompressedData();
   mDirty = true;
   mCacheData.reset();
   // Most of this should be redundant given MaybeWriteOffMainThread should
@@ -728,6 +854,99 @@ void StartupCache::ThreadedPrefetch(uint8_t* aStart, size_t aSize) {
   MMAP_FAULT_HANDLER_CATCH()
 }
 
+void StartupCache::CancelPredecompression() {
+  // Entries that are already being decompressed are finished, but no new ones
+  // are started.
+  mPredecompressionCanceled = true;
+  MonitorAutoLock lock(mPredecompressionMonitor);
+  while (mPredecompressionTasks) {
+    mPredecompressionMonitor.Wait();
+  }
+}
+
+void StartupCache::DropPredecompressedData() {
+  for (auto iter = mTable.modIter(); !iter.done(); iter.next()) {
+    iter.get().value().mPredecompressedIndex = -1;
+  }
+  mPredecompressedEntries = nullptr;
+  mPredecompressedEntryCount = 0;
+}
+
+void StartupCache::EndPredecompression() {
+  CancelPredecompression();
+  MutexAutoLock lock(mTableLock);
+  DropPredecompressedData();
+}
+
+void StartupCache::WaitForPredecompressionForTesting() {
+  MonitorAutoLock lock(mPredecompressionMonitor);
+  while (mPredecompressionTasks) {
+    mPredecompressionMonitor.Wait();
+  }
+}
+
+uint32_t StartupCache::PredecompressedHitCountForTesting() {
+  MutexAutoLock lock(mTableLock);
+  return mPredecompressedHitCount;
+}
+
+void StartupCache::ThreadedPredecompress(Span<PredecompressedEntry> aEntries,
+                                         const char* aCacheEntries) {
+  auto notifyTaskComplete = MakeScopeExit([&] {
+    MonitorAutoLock lock(mPredecompressionMonitor);
+    mPredecompressionTasks--;
+    mPredecompressionMonitor.NotifyAll();
+  });
+
+  LZ4FrameDecompressionContext context(true);
+  while (!mPredecompressionCanceled) {
+    uint32_t index = mNextPredecompressedEntry++;
+    if (index >= aEntries.Length()) {
+      return;
+    }
+    auto& entry = aEntries[index];
+    // GetBuffer() marks the entries it decompresses itself as done.
+    if (!entry.mState.compareExchange(PredecompressedEntry::State::Pending,
+                                      PredecompressedEntry::State::Running)) {
+      continue;
+    }
+    auto result = DecompressEntry(
+        context, Span(aCacheEntries + entry.mOffset, entry.mCompressedSize),
+        entry.mUncompressedSize);
+    if (result.isOk()) {
+      entry.mData = result.unwrap();
+    }
+
+    MonitorAutoLock lock(mPredecompressionMonitor);
+    entry.mState = PredecompressedEntry::State::Done;
+    mPredecompressionMonitor.NotifyAll();
+  }
+}
+
+UniqueFreePtr<char[]> StartupCache::TakePredecompressedData(
+    StartupCacheEntry& aEntry) {
+  if (aEntry.mPredecompressedIndex < 0) {
+    return nullptr;
+  }
+  MOZ_ASSERT(uint32_t(aEntry.mPredecompressedIndex) <
+             mPredecompressedEntryCount);
+  auto& entry = mPredecompressedEntries[aEntry.mPredecompressedIndex];
+  aEntry.mPredecompressedIndex = -1;
+
+  // If no background thread got to the entry yet, keep them off it and let
+  // the caller decompress it.
+  if (entry.mState.compareExchange(PredecompressedEntry::State::Pending,
+                                   PredecompressedEntry::State::Done)) {
+    return nullptr;
+  }
+
+  MonitorAutoLock lock(mPredecompressionMonitor);
+  while (entry.mState != PredecompressedEntry::State::Done) {
+    mPredecompressionMonitor.Wait();
+  }
+  return std::move(entry.mData);
+}
+
 // mTableLock must be held
 bool StartupCache::ShouldCompactCache() {
   // If we've requested less than 4/5 of the startup cache, then we should
@@ -758,6 +977,9 @@ void StartupCache::WriteTimeout(nsITimer* aTimer, void* aClosure) {
  * See StartupCache::WriteTimeout above - this is just the non-static body.
  */
 void StartupCache::MaybeWriteOffMainThread() {
+  // Startup is over by the time the write timer fires, even when we don't
+  // write, so drop what GetBuffer() hasn't taken.
+  EndPredecompression();
   {
     MutexAutoLock lock(mTableLock);
     if (mWrittenOnce || (mCacheData.initialized() && !ShouldCompactCache())) {
@@ -792,14 +1014,22 @@ nsresult StartupCacheListener::Observe(nsISupports* subject, const char* topic,
   if (!sc) return NS_OK;
 
   if (strcmp(topic, NS_XPCOM_SHUTDOWN_OBSERVER_ID) == 0) {
-    // Do not leave the thread running past xpcom shutdown
+    // Do not leave the threads running past xpcom shutdown
     sc->WaitOnPrefetch();
+    sc->CancelPredecompression();
     StartupCache::gShutdownInitiated = true;
     // Note that we don't do anything special for the background write
     // task; we expect the threadpool to finish running any tasks already
     // posted to it prior to shutdown. FastShutdown will call
     // EnsureShutdownWriteComplete() to ensure any pending writes happen
     // in that case.
+  } else if (strcmp(topic, STARTUP_COMPLETE_TOPIC) == 0) {
+    // The entries startup needed have been requested by now.
+    if (sc->mObserverService) {
+      sc->mObserverService->RemoveObserver(this, STARTUP_COMPLETE_TOPIC);
+    }
+    sc->mStartupFinished = true;
+    sc->EndPredecompression();
   } else if (strcmp(topic, "startupcache-invalidate") == 0) {
     sc->InvalidateCache(data && nsCRT::strcmp(data, u"memoryOnly") == 0);
   } else if (strcmp(topic, "intl:app-locales-changed") == 0) {
@@ -20,6 +20,7 @@
 #include "nsIObserver.h"
 #include "nsIObjectOutputStream.h"
 #include "nsIFile.h"
+#include "mozilla/Atomics.h"
 #include "mozilla/Attributes.h"
 #include "mozilla/AutoMemMap.h"
 #include "mozilla/Compression.h"
@@ -72,6 +73,13 @@
  * words, it should be used as a cache only, and not a reliable persistent
  * store.
  *
+ * When the browser.startup.cache.parallel_decompression pref is set, the first
+ * entries of the cache file are decompressed on background threads as soon as
+ * it is loaded, in the order in which they were first requested when the file
+ * was written, so that GetBuffer() usually doesn't have to decompress them on
+ * the main thread. Whatever GetBuffer() hasn't taken once startup is over is
+ * dropped.
+ *
  * Some utility functions are provided in StartupCacheUtils. These functions
  * wrap the buffers into object streams, which may be useful for serializing
  * objects. Note the above caution about multiply-referenced objects, though --
@@ -91,6 +99,8 @@ struct StartupCacheEntry {
   uint32_t mUncompressedSize;
   int32_t mHeaderOffsetInFile;
   int32_t mRequestedOrder;
+  // The index of the entry in StartupCache::mPredecompressedEntries, or -1.
+  int32_t mPredecompressedIndex;
   bool mRequested;
 
   MOZ_IMPLICIT StartupCacheEntry(uint32_t aOffset, uint32_t aCompressedSize,
@@ -101,6 +111,7 @@ struct StartupCacheEntry {
         mUncompressedSize(aUncompressedSize),
         mHeaderOffsetInFile(0),
         mRequestedOrder(0),
+        mPredecompressedIndex(-1),
         mRequested(false) {}
 
   StartupCacheEntry(UniqueFreePtr<char[]> aData, size_t aLength,
@@ -111,6 +122,7 @@ struct StartupCacheEntry {
         mUncompressedSize(aLength),
         mHeaderOffsetInFile(0),
         mRequestedOrder(0),
+        mPredecompressedIndex(-1),
         mRequested(true) {}
 
   // std::pair is not trivially move assignable/constructible, so make our own.
@@ -203,6 +215,13 @@ class StartupCache : public nsIMemoryReporter {
   nsresult ResetStartupWriteTimer() MOZ_REQUIRES(mTableLock);
   bool StartupWriteComplete();
 
+  // Waits for the background decompression started by the last load of the
+  // cache file to finish.
+  void WaitForPredecompressionForTesting();
+  // Number of GetBuffer() calls since that load that were served with data
+  // decompressed in the background.
+  uint32_t PredecompressedHitCountForTesting();
+
  private:
   StartupCache();
   virtual ~StartupCache();
@@ -225,6 +244,41 @@ class StartupCache : public nsIMemoryReporter {
   void WaitOnPrefetch();
   void StartPrefetchMemory() MOZ_REQUIRES(mTableLock);
 
+  // An entry of the cache file that background threads decompress ahead of
+  // GetBuffer().
+  struct PredecompressedEntry {
+    enum class State : uint32_t { Pending, Running, Done };
+
+    Atomic<State> mState{State::Pending};
+    uint32_t mOffset = 0;
+    uint32_t mCompressedSize = 0;
+    uint32_t mUncompressedSize = 0;
+    // Set before mState becomes Done. Null if decompression failed, or if the
+    // main thread got to the entry first.
+    UniqueFreePtr<char[]> mData;
+  };
+
+  // Starts decompressing the entries loaded by LoadArchive() on background
+  // threads, in file order.
+  void StartPredecompression() MOZ_REQUIRES(mTableLock);
+  // Stops the background decompression, and waits for entries that are being
+  // decompressed. This must be called before mCacheData is reset.
+  void CancelPredecompression();
+  // Frees the data decompressed in the background that GetBuffer() hasn't
+  // taken, which would otherwise stay around for the whole session. Must be
+  // called after CancelPredecompression().
+  void DropPredecompressedData() MOZ_REQUIRES(mTableLock);
+  // Cancels the background decompression and drops its data, once startup is
+  // over.
+  void EndPredecompression();
+  void ThreadedPredecompress(Span<PredecompressedEntry> aEntries,
+                             const char* aCacheEntries);
+  // Returns the data decompressed in the background for aEntry, waiting for
+  // it if a background thread is decompressing it, or null if the entry has
+  // to be decompressed on the main thread.
+  UniqueFreePtr<char[]> TakePredecompressedData(StartupCacheEntry& aEntry)
+      MOZ_REQUIRES(mTableLock);
+
   static nsresult InitSingleton();
   static void WriteTimeout(nsITimer* aTimer, void* aClosure);
   void MaybeWriteOffMainThread();
@@ -233,6 +287,13 @@ class StartupCache : public nsIMemoryReporter {
   Monitor mPrefetchComplete{"StartupCachePrefetch"};
   bool mPrefetchInProgress MOZ_GUARDED_BY(mPrefetchComplete){false};
 
+  Monitor mPredecompressionMonitor{"StartupCachePredecompression"};
+  uint32_t mPredecompressionTasks MOZ_GUARDED_BY(mPredecompressionMonitor){0};
+  Atomic<bool> mPredecompressionCanceled{false};
+  // The next entry of mPredecompressedEntries for a background thread to
+  // decompress.
+  Atomic<uint32_t> mNextPredecompressedEntry{0};
+
   // This is normally accessed on MainThread, but WriteToDisk() can
   // access it on other threads
   HashMap<nsCString, StartupCacheEntry> mTable MOZ_GUARDED_BY(mTableLock);
@@ -257,6 +318,16 @@ class StartupCache : public nsIMemoryReporter {
 
   uint32_t mRequestedCount;
   size_t mCacheEntriesBaseOffset;
+  // Set once the first browser window finished starting up. No decompression
+  // happens in the background afterwards.
+  bool mStartupFinished = false;
+
+  // The entries being decompressed in the background, in file order. Only
+  // freed once no background thread uses them anymore.
+  UniquePtr<PredecompressedEntry[]> mPredecompressedEntries
+      MOZ_GUARDED_BY(mTableLock);
+  uint32_t mPredecompressedEntryCount MOZ_GUARDED_BY(mTableLock){0};
+  uint32_t mPredecompressedHitCount MOZ_GUARDED_BY(mTableLock){0};
 
   static StaticRefPtr<StartupCache> gStartupCache;
   static bool gShutdownInitiated;
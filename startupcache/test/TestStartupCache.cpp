@@ -15,13 +15,16 @@
 #include "nsIObjectInputStream.h"
 #include "nsIObjectOutputStream.h"
 #include "nsIURI.h"
+#include "nsPrintfCString.h"
 #include "nsThreadUtils.h"
 #include "prenv.h"
 #include "prio.h"
 #include "prprf.h"
 #include "mozilla/gtest/MozAssertions.h"
 #include "mozilla/Maybe.h"
+#include "mozilla/Preferences.h"
 #include "mozilla/Printf.h"
+#include "mozilla/ScopeExit.h"
 #include "mozilla/UniquePtr.h"
 #include "mozilla/UniquePtrExtensions.h"
 #include "nsNetCID.h"
@@ -120,6 +123,65 @@ TEST_F(TestStartupCache, WriteInvalidateRead) {
   EXPECT_EQ(rv, NS_ERROR_NOT_AVAILABLE);
 }
 
+TEST_F(TestStartupCache, ParallelDecompression) {
+  nsresult rv;
+  StartupCache* sc = StartupCache::GetSingleton();
+  ASSERT_TRUE(sc);
+
+  mozilla::Preferences::SetBool(
+      "browser.startup.cache.parallel_decompression", true);
+  auto restorePref = mozilla::MakeScopeExit([] {
+    mozilla::Preferences::ClearUser(
+        "browser.startup.cache.parallel_decompression");
+  });
+
+  constexpr uint32_t kEntryCount = 200;
+  nsTArray<nsCString> bufs;
+  for (uint32_t i = 0; i < kEntryCount; i++) {
+    nsCString buf;
+    for (uint32_t line = 0; line < 256; line++) {
+      buf.AppendPrintf("BeardBook growth projection %u, line %u\n", i, line);
+    }
+    rv = sc->PutBuffer(nsPrintfCString("id%u", i).get(),
+                       mozilla::UniqueFreePtr<char[]>(strdup(buf.get())),
+                       buf.Length() + 1);
+    EXPECT_NS_SUCCEEDED(rv);
+    bufs.AppendElement(std::move(buf));
+  }
+
+  // Write the entries to disk and load them back, which starts decompressing
+  // them in the background.
+  sc->InvalidateCache(true);
+
+  // Request the last entries first, so that some of them are decompressed on
+  // the main thread while background threads work on the first ones.
+  for (uint32_t i = kEntryCount; i-- > 0;) {
+    const char* outbuf;
+    uint32_t len;
+    rv = sc->GetBuffer(nsPrintfCString("id%u", i).get(), &outbuf, &len);
+    ASSERT_NS_SUCCEEDED(rv);
+    EXPECT_EQ(len, bufs[i].Length() + 1);
+    EXPECT_STREQ(bufs[i].get(), outbuf);
+
+    const char* outbuf2;
+    rv = sc->GetBuffer(nsPrintfCString("id%u", i).get(), &outbuf2, &len);
+    EXPECT_NS_SUCCEEDED(rv);
+    EXPECT_EQ(outbuf, outbuf2);
+  }
+
+  // Once the background threads are done, every entry comes from them.
+  sc->InvalidateCache(true);
+  sc->WaitForPredecompressionForTesting();
+  for (uint32_t i = 0; i < kEntryCount; i++) {
+    const char* outbuf;
+    uint32_t len;
+    rv = sc->GetBuffer(nsPrintfCString("id%u", i).get(), &outbuf, &len);
+    ASSERT_NS_SUCCEEDED(rv);
+    EXPECT_STREQ(bufs[i].get(), outbuf);
+  }
+  EXPECT_EQ(sc->PredecompressedHitCountForTesting(), kEntryCount);
+}
+
 TEST_F(TestStartupCache, WriteObject) {
   nsresult rv;
 
@@ -6,8 +6,10 @@
 
 #include "sqlite3.h"
 
+#include "mozIStorageColumnarCallback.h"
 #include "mozIStorageStatementCallback.h"
 #include "mozStorageBindingParams.h"
+#include "mozStorageColumnarResult.h"
 #include "mozStorageHelper.h"
 #include "mozStorageResultSet.h"
 #include "mozStorageRow.h"
@@ -42,6 +44,14 @@ namespace storage {
 #define MAX_MILLISECONDS_BETWEEN_RESULTS 75
 #define MAX_ROWS_PER_RESULT 15
 
+/**
+ * Columnar results are meant for bulk reads, so they are batched in far larger
+ * chunks.  The time limit above still applies, and a chunk is also sent once
+ * its values take more than MAX_BYTES_PER_COLUMNAR_RESULT.
+ */
+#define MAX_ROWS_PER_COLUMNAR_RESULT 4096
+#define MAX_BYTES_PER_COLUMNAR_RESULT (1024 * 1024)
+
 ////////////////////////////////////////////////////////////////////////////////
 //// AsyncExecuteStatements
 
@@ -86,6 +96,8 @@ AsyncExecuteStatements::AsyncExecuteStatements(
       mHasTransaction(false),
       mCallback(aCallback),
       mCallingThread(::do_GetCurrentThread()),
+      mColumnar(false),
+      mColumnarStatement(nullptr),
       mMaxWait(
           TimeDuration::FromMilliseconds(MAX_MILLISECONDS_BETWEEN_RESULTS)),
       mIntervalStart(TimeStamp::Now()),
@@ -94,6 +106,10 @@ AsyncExecuteStatements::AsyncExecuteStatements(
       mMutex(aConnection->sharedAsyncExecutionMutex),
       mDBMutex(aConnection->sharedDBMutex) {
   NS_ASSERTION(mStatements.Length(), "We weren't given any statements!");
+
+  // The callback can only be queried here, on the calling thread.
+  nsCOMPtr<mozIStorageColumnarCallback> columnar = do_QueryInterface(aCallback);
+  mColumnar = !!columnar;
 }
 
 AsyncExecuteStatements::~AsyncExecuteStatements() {
@@ -193,7 +209,8 @@ bool AsyncExecuteStatements::executeAndProcessStatement(StatementData& aData,
     // Build our result set and notify if we got anything back and have a
     // callback to notify.
     if (mCallback && hasResults &&
-        NS_FAILED(buildAndNotifyResults(aStatement))) {
+        NS_FAILED(mColumnar ? buildAndNotifyColumnarResults(aStatement)
+                            : buildAndNotifyResults(aStatement))) {
       // We had an error notifying, so we notify on error and stop processing.
       mState = ERROR;
 
@@ -328,6 +345,38 @@ nsresult AsyncExecuteStatements::buildAndNotifyResults(
   return NS_OK;
 }
 
+nsresult AsyncExecuteStatements::buildAndNotifyColumnarResults(
+    sqlite3_stmt* aStatement) {
+  NS_ASSERTION(mCallback, "Trying to dispatch results without a callback!");
+  mMutex.AssertNotCurrentThreadOwns();
+
+  // A chunk only ever holds the rows of one statement, since another one may
+  // have different columns.
+  if (mColumnarResult && mColumnarStatement != aStatement) {
+    (void)notifyColumnarResults();
+  }
+  if (!mColumnarResult) {
+    mColumnarResult = new ColumnarResult(aStatement);
+    mColumnarStatement = aStatement;
+  }
+
+  nsresult rv = mColumnarResult->add(aStatement);
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  TimeStamp now = TimeStamp::Now();
+  TimeDuration delta = now - mIntervalStart;
+  if (mColumnarResult->rows() >= MAX_ROWS_PER_COLUMNAR_RESULT ||
+      mColumnarResult->dataSize() >= MAX_BYTES_PER_COLUMNAR_RESULT ||
+      delta > mMaxWait) {
+    rv = notifyColumnarResults();
+    if (NS_FAILED(rv)) return NS_OK;  // we'll try again with the next result
+
+    mIntervalStart = now;
+  }
+
+  return NS_OK;
+}
+
 nsresult AsyncExecuteStatements::notifyComplete() {
   mMutex.AssertNotCurrentThreadOwns();
   NS_ASSERTION(mState != PENDING,
@@ -462,6 +511,32 @@ nsresult AsyncExecuteStatements::notifyResultsOnCallingThread(
   return NS_OK;
 }
 
+nsresult AsyncExecuteStatements::notifyColumnarResults() {
+  mMutex.AssertNotCurrentThreadOwns();
+  MOZ_ASSERT(mCallback, "notifyColumnarResults called without a callback!");
+
+  mColumnarStatement = nullptr;
+  Unused << mCallingThread->Dispatch(
+      NewRunnableMethod<RefPtr<ColumnarResult>>(
+          "AsyncExecuteStatements::notifyColumnarResultsOnCallingThread", this,
+          &AsyncExecuteStatements::notifyColumnarResultsOnCallingThread,
+          mColumnarResult.forget()),
+      NS_DISPATCH_NORMAL);
+
+  return NS_OK;
+}
+
+nsresult AsyncExecuteStatements::notifyColumnarResultsOnCallingThread(
+    ColumnarResult* aResult) {
+  MOZ_ASSERT(mCallingThread->IsOnCurrentThread());
+  // See notifyResultsOnCallingThread for why we take our own reference.
+  nsCOMPtr<mozIStorageColumnarCallback> callback = do_QueryInterface(mCallback);
+  if (shouldNotify() && callback) {
+    Unused << callback->HandleColumnarResult(aResult);
+  }
+  return NS_OK;
+}
+
 NS_IMPL_ISUPPORTS_INHERITED(AsyncExecuteStatements, Runnable,
                             mozIStoragePendingStatement)
 
@@ -571,6 +646,7 @@ AsyncExecuteStatements::Run() {
   // If we still have results that we haven't notified about, take care of
   // them now.
   if (mResultSet) (void)notifyResults();
+  if (mColumnarResult) (void)notifyColumnarResults();
 
   // Notify about completion
   return notifyComplete();
@@ -24,6 +24,7 @@ struct sqlite3_stmt;
 namespace mozilla {
 namespace storage {
 
+class ColumnarResult;
 class Connection;
 class ResultSet;
 class StatementData;
@@ -89,6 +90,7 @@ class AsyncExecuteStatements final : public Runnable,
   nsresult notifyCompleteOnCallingThread();
   nsresult notifyErrorOnCallingThread(mozIStorageError* aError);
   nsresult notifyResultsOnCallingThread(ResultSet* aResultSet);
+  nsresult notifyColumnarResultsOnCallingThread(ColumnarResult* aResult);
 
  private:
   AsyncExecuteStatements(StatementDataArray&& aStatements,
@@ -150,6 +152,17 @@ class AsyncExecuteStatements final : public Runnable,
    */
   nsresult buildAndNotifyResults(sqlite3_stmt* aStatement);
 
+  /**
+   * Like buildAndNotifyResults, but appends the row to a columnar chunk.
+   * Used when the callback implements mozIStorageColumnarCallback.
+   *
+   * @pre mMutex is not held
+   *
+   * @param aStatement
+   *        The statement to get the row data from.
+   */
+  nsresult buildAndNotifyColumnarResults(sqlite3_stmt* aStatement);
+
   /**
    * Notifies callback about completion, and does any necessary cleanup.
    *
@@ -179,6 +192,7 @@ class AsyncExecuteStatements final : public Runnable,
    * @pre mMutex is not held
    */
   nsresult notifyResults();
+  nsresult notifyColumnarResults();
 
   /**
    * Tests whether the current statements should be wrapped in an explicit
@@ -199,6 +213,15 @@ class AsyncExecuteStatements final : public Runnable,
   nsCOMPtr<nsIThread> mCallingThread;
   RefPtr<ResultSet> mResultSet;
 
+  /**
+   * Set at construction if mCallback implements mozIStorageColumnarCallback,
+   * in which case rows are batched into mColumnarResult instead of mResultSet.
+   * mColumnarStatement is the statement the rows of mColumnarResult came from.
+   */
+  bool mColumnar;
+  RefPtr<ColumnarResult> mColumnarResult;
+  sqlite3_stmt* mColumnarStatement;
+
   /**
    * The maximum amount of time we want to wait between results.  Defined by
    * MAX_MILLISECONDS_BETWEEN_RESULTS and set at construction.
@@ -0,0 +1,345 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: sw=2 ts=2 et lcs=trail\:.,tab\:>~ :
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "mozStorageColumnarResult.h"
+#include "mozStoragePrivateHelpers.h"
+
+#include "js/Array.h"
+#include "mozIStorageValueArray.h"
+#include "mozilla/ErrorResult.h"
+#include "mozilla/dom/TypedArray.h"
+#include "nsJSUtils.h"
+#include "xpcpublic.h"
+
+#include "sqlite3.h"
+
+namespace mozilla {
+namespace storage {
+
+namespace {
+
+int32_t ToValueType(int aSqliteType) {
+  switch (aSqliteType) {
+    case SQLITE_INTEGER:
+      return mozIStorageValueArray::VALUE_TYPE_INTEGER;
+    case SQLITE_FLOAT:
+      return mozIStorageValueArray::VALUE_TYPE_FLOAT;
+    case SQLITE_TEXT:
+      return mozIStorageValueArray::VALUE_TYPE_TEXT;
+    case SQLITE_BLOB:
+      return mozIStorageValueArray::VALUE_TYPE_BLOB;
+    default:
+      return mozIStorageValueArray::VALUE_TYPE_NULL;
+  }
+}
+
+bool IsNumeric(int32_t aType) {
+  return aType == mozIStorageValueArray::VALUE_TYPE_INTEGER ||
+         aType == mozIStorageValueArray::VALUE_TYPE_FLOAT;
+}
+
+}  // namespace
+
+////////////////////////////////////////////////////////////////////////////////
+//// ColumnarResult
+
+ColumnarResult::ColumnarResult(sqlite3_stmt* aStatement)
+    : mRowCount(0), mDataSize(0) {
+  int count = ::sqlite3_column_count(aStatement);
+  mColumns.SetLength(count);
+  for (int i = 0; i < count; i++) {
+    const char* name = ::sqlite3_column_name(aStatement, i);
+    if (name) {
+      mColumns[i].mName.Assign(name);
+    }
+    mColumns[i].mType = mozIStorageValueArray::VALUE_TYPE_NULL;
+  }
+}
+
+nsresult ColumnarResult::add(sqlite3_stmt* aStatement) {
+  MOZ_ASSERT(uint32_t(::sqlite3_column_count(aStatement)) == mColumns.Length(),
+             "Rows of another statement added to the chunk");
+  const uint32_t row = mRowCount;
+
+  for (uint32_t i = 0; i < mColumns.Length(); i++) {
+    Column& column = mColumns[i];
+    if (row % 8 == 0) {
+      column.mNulls.AppendElement(0);
+    }
+
+    int32_t type = ToValueType(::sqlite3_column_type(aStatement, i));
+    if (type == mozIStorageValueArray::VALUE_TYPE_NULL) {
+      column.mNulls[row / 8] |= 1 << (row % 8);
+      column.mHasNulls = true;
+    } else if (column.mType == mozIStorageValueArray::VALUE_TYPE_NULL) {
+      setType(column, type);
+    } else if (column.mType != type) {
+      widenType(column, type);
+    }
+
+    switch (column.mType) {
+      case mozIStorageValueArray::VALUE_TYPE_INTEGER:
+        column.mIntegers.AppendElement(::sqlite3_column_int64(aStatement, i));
+        mDataSize += sizeof(int64_t);
+        break;
+      case mozIStorageValueArray::VALUE_TYPE_FLOAT:
+        column.mFloats.AppendElement(::sqlite3_column_double(aStatement, i));
+        mDataSize += sizeof(double);
+        break;
+      case mozIStorageValueArray::VALUE_TYPE_TEXT:
+      case mozIStorageValueArray::VALUE_TYPE_BLOB: {
+        // Numbers in a text column are formatted by SQLite itself.
+        const char* data =
+            type == mozIStorageValueArray::VALUE_TYPE_BLOB
+                ? static_cast<const char*>(::sqlite3_column_blob(aStatement, i))
+                : reinterpret_cast<const char*>(
+                      ::sqlite3_column_text(aStatement, i));
+        uint32_t length =
+            type == mozIStorageValueArray::VALUE_TYPE_NULL
+                ? 0
+                : uint32_t(::sqlite3_column_bytes(aStatement, i));
+        appendBytes(column, data, length);
+        break;
+      }
+      default:
+        // Still all NULLs, nothing to store.
+        break;
+    }
+  }
+
+  mRowCount++;
+  return NS_OK;
+}
+
+void ColumnarResult::setType(Column& aColumn, int32_t aType) {
+  aColumn.mType = aType;
+  switch (aType) {
+    case mozIStorageValueArray::VALUE_TYPE_INTEGER:
+      aColumn.mIntegers.AppendElements(mRowCount);
+      for (auto& value : aColumn.mIntegers) {
+        value = 0;
+      }
+      break;
+    case mozIStorageValueArray::VALUE_TYPE_FLOAT:
+      aColumn.mFloats.AppendElements(mRowCount);
+      for (auto& value : aColumn.mFloats) {
+        value = 0.0;
+      }
+      break;
+    default:
+      aColumn.mOffsets.AppendElements(mRowCount + 1);
+      for (auto& offset : aColumn.mOffsets) {
+        offset = 0;
+      }
+      break;
+  }
+}
+
+void ColumnarResult::widenType(Column& aColumn, int32_t aType) {
+  if (IsNumeric(aColumn.mType) && IsNumeric(aType)) {
+    if (aColumn.mType == mozIStorageValueArray::VALUE_TYPE_INTEGER) {
+      aColumn.mFloats.SetCapacity(aColumn.mIntegers.Length());
+      for (int64_t value : aColumn.mIntegers) {
+        aColumn.mFloats.AppendElement(double(value));
+      }
+      aColumn.mIntegers = nsTArray<int64_t>();
+      aColumn.mType = mozIStorageValueArray::VALUE_TYPE_FLOAT;
+    }
+    // A float column stores integers as they come.
+    return;
+  }
+
+  if (aColumn.mType == mozIStorageValueArray::VALUE_TYPE_TEXT) {
+    return;
+  }
+
+  // Blobs and text share a layout, so a blob column only needs a new type.
+  if (aColumn.mType == mozIStorageValueArray::VALUE_TYPE_BLOB) {
+    aColumn.mType = mozIStorageValueArray::VALUE_TYPE_TEXT;
+    return;
+  }
+
+  // A numeric column turns into text, formatting the values stored so far.
+  const int32_t oldType = aColumn.mType;
+  nsTArray<int64_t> integers = std::move(aColumn.mIntegers);
+  nsTArray<double> floats = std::move(aColumn.mFloats);
+  aColumn.mType = mozIStorageValueArray::VALUE_TYPE_TEXT;
+  aColumn.mOffsets.AppendElement(0);
+  nsAutoCString text;
+  for (uint32_t row = 0; row < mRowCount; row++) {
+    text.Truncate();
+    if (!IsNullAt(aColumn, row)) {
+      if (oldType == mozIStorageValueArray::VALUE_TYPE_INTEGER) {
+        text.AppendInt(integers[row]);
+      } else {
+        text.AppendFloat(floats[row]);
+      }
+    }
+    appendBytes(aColumn, text.get(), text.Length());
+  }
+}
+
+void ColumnarResult::appendBytes(Column& aColumn, const char* aData,
+                                 uint32_t aLength) {
+  if (aLength) {
+    aColumn.mBytes.AppendElements(aData, aLength);
+  }
+  aColumn.mOffsets.AppendElement(aColumn.mBytes.Length());
+  mDataSize += aLength + sizeof(uint32_t);
+}
+
+// static
+bool ColumnarResult::IsNullAt(const Column& aColumn, uint32_t aRow) {
+  return aColumn.mNulls[aRow / 8] & (1 << (aRow % 8));
+}
+
+bool ColumnarResult::isNull(uint32_t aColumn, uint32_t aRow) const {
+  return IsNullAt(mColumns[aColumn], aRow);
+}
+
+Span<const int64_t> ColumnarResult::integers(uint32_t aColumn) const {
+  MOZ_ASSERT(mColumns[aColumn].mType ==
+             mozIStorageValueArray::VALUE_TYPE_INTEGER);
+  return mColumns[aColumn].mIntegers;
+}
+
+Span<const double> ColumnarResult::floats(uint32_t aColumn) const {
+  MOZ_ASSERT(mColumns[aColumn].mType ==
+             mozIStorageValueArray::VALUE_TYPE_FLOAT);
+  return mColumns[aColumn].mFloats;
+}
+
+nsDependentCSubstring ColumnarResult::bytes(uint32_t aColumn,
+                                            uint32_t aRow) const {
+  const Column& column = mColumns[aColumn];
+  MOZ_ASSERT(column.mType == mozIStorageValueArray::VALUE_TYPE_TEXT ||
+             column.mType == mozIStorageValueArray::VALUE_TYPE_BLOB);
+  uint32_t start = column.mOffsets[aRow];
+  return Substring(column.mBytes.Elements() + start,
+                   column.mOffsets[aRow + 1] - start);
+}
+
+/**
+ * Note:  This object is only ever accessed on one thread at a time.  It it not
+ *        threadsafe, but it does need threadsafe AddRef and Release.
+ */
+NS_IMPL_ISUPPORTS(ColumnarResult, mozIStorageColumnarResult)
+
+////////////////////////////////////////////////////////////////////////////////
+//// mozIStorageColumnarResult
+
+NS_IMETHODIMP
+ColumnarResult::GetRowCount(uint32_t* _count) {
+  *_count = mRowCount;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarResult::GetColumnCount(uint32_t* _count) {
+  *_count = mColumns.Length();
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarResult::GetColumnName(uint32_t aColumn, nsACString& _name) {
+  ENSURE_INDEX_VALUE(aColumn, mColumns.Length());
+  _name = mColumns[aColumn].mName;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarResult::GetColumnType(uint32_t aColumn, int32_t* _type) {
+  ENSURE_INDEX_VALUE(aColumn, mColumns.Length());
+  *_type = mColumns[aColumn].mType;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarResult::GetIsNull(uint32_t aColumn, uint32_t aRow, bool* _isNull) {
+  ENSURE_INDEX_VALUE(aColumn, mColumns.Length());
+  ENSURE_INDEX_VALUE(aRow, mRowCount);
+  *_isNull = isNull(aColumn, aRow);
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarResult::GetColumn(uint32_t aColumn, JSContext* aCx,
+                          JS::MutableHandle<JS::Value> _column) {
+  ENSURE_INDEX_VALUE(aColumn, mColumns.Length());
+  const Column& column = mColumns[aColumn];
+
+  if (IsNumeric(column.mType)) {
+    nsTArray<double> values;
+    if (column.mType == mozIStorageValueArray::VALUE_TYPE_INTEGER) {
+      values.SetCapacity(mRowCount);
+      for (int64_t value : column.mIntegers) {
+        values.AppendElement(double(value));
+      }
+    }
+    Span<const double> data = column.mType ==
+                                      mozIStorageValueArray::VALUE_TYPE_FLOAT
+                                  ? Span<const double>(column.mFloats)
+                                  : Span<const double>(values);
+    ErrorResult rv;
+    JSObject* array = dom::Float64Array::Create(aCx, data, rv);
+    if (rv.Failed()) {
+      return rv.StealNSResult();
+    }
+    _column.setObject(*array);
+    return NS_OK;
+  }
+
+  JS::Rooted<JSObject*> array(aCx, JS::NewArrayObject(aCx, mRowCount));
+  NS_ENSURE_TRUE(array, NS_ERROR_OUT_OF_MEMORY);
+  JS::Rooted<JS::Value> value(aCx);
+  for (uint32_t row = 0; row < mRowCount; row++) {
+    if (column.mType == mozIStorageValueArray::VALUE_TYPE_NULL ||
+        isNull(aColumn, row)) {
+      value.setNull();
+    } else if (column.mType == mozIStorageValueArray::VALUE_TYPE_BLOB) {
+      nsDependentCSubstring blob = bytes(aColumn, row);
+      ErrorResult rv;
+      JSObject* bytesArray = dom::Uint8Array::Create(
+          aCx,
+          Span(reinterpret_cast<const uint8_t*>(blob.BeginReading()),
+               blob.Length()),
+          rv);
+      if (rv.Failed()) {
+        return rv.StealNSResult();
+      }
+      value.setObject(*bytesArray);
+    } else if (!xpc::NonVoidUTF8StringToJsval(aCx, bytes(aColumn, row),
+                                              &value)) {
+      return NS_ERROR_OUT_OF_MEMORY;
+    }
+    NS_ENSURE_TRUE(JS_DefineElement(aCx, array, row, value, JSPROP_ENUMERATE),
+                   NS_ERROR_OUT_OF_MEMORY);
+  }
+  _column.setObject(*array);
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarResult::GetNullBitmap(uint32_t aColumn, JSContext* aCx,
+                              JS::MutableHandle<JS::Value> _bitmap) {
+  ENSURE_INDEX_VALUE(aColumn, mColumns.Length());
+  const Column& column = mColumns[aColumn];
+  if (!column.mHasNulls) {
+    _bitmap.setNull();
+    return NS_OK;
+  }
+
+  ErrorResult rv;
+  JSObject* bitmap = dom::Uint8Array::Create(aCx, column.mNulls, rv);
+  if (rv.Failed()) {
+    return rv.StealNSResult();
+  }
+  _bitmap.setObject(*bitmap);
+  return NS_OK;
+}
+
+}  // namespace storage
+}  // namespace mozilla
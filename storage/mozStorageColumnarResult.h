@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: sw=2 ts=2 et lcs=trail\:.,tab\:>~ :
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef mozStorageColumnarResult_h
+#define mozStorageColumnarResult_h
+
+#include "mozIStorageColumnarResult.h"
+#include "mozilla/Span.h"
+#include "nsString.h"
+#include "nsTArray.h"
+
+struct sqlite3_stmt;
+
+namespace mozilla {
+namespace storage {
+
+class ColumnarResult final : public mozIStorageColumnarResult {
+ public:
+  NS_DECL_THREADSAFE_ISUPPORTS
+  NS_DECL_MOZISTORAGECOLUMNARRESULT
+
+  /**
+   * Creates an empty chunk with the columns of aStatement.
+   */
+  explicit ColumnarResult(sqlite3_stmt* aStatement);
+
+  /**
+   * Appends the current row of aStatement, which must be the statement this
+   * chunk was created for.
+   */
+  nsresult add(sqlite3_stmt* aStatement);
+
+  /**
+   * @returns the number of rows this chunk holds.
+   */
+  uint32_t rows() const { return mRowCount; }
+
+  /**
+   * @returns the approximate size of the values this chunk holds, in bytes.
+   */
+  size_t dataSize() const { return mDataSize; }
+
+  /**
+   * Native accessors for the column buffers.  integers() is only valid for
+   * VALUE_TYPE_INTEGER columns, floats() for VALUE_TYPE_FLOAT columns and
+   * bytes() for VALUE_TYPE_TEXT and VALUE_TYPE_BLOB columns, where it
+   * returns the UTF-8 text or the blob of one row.
+   */
+  int32_t columnType(uint32_t aColumn) const {
+    return mColumns[aColumn].mType;
+  }
+  bool isNull(uint32_t aColumn, uint32_t aRow) const;
+  Span<const int64_t> integers(uint32_t aColumn) const;
+  Span<const double> floats(uint32_t aColumn) const;
+  nsDependentCSubstring bytes(uint32_t aColumn, uint32_t aRow) const;
+
+ private:
+  ~ColumnarResult() = default;
+
+  struct Column {
+    nsCString mName;
+    int32_t mType;
+    bool mHasNulls = false;
+    // One value per row for VALUE_TYPE_INTEGER and VALUE_TYPE_FLOAT columns.
+    nsTArray<int64_t> mIntegers;
+    nsTArray<double> mFloats;
+    // For VALUE_TYPE_TEXT and VALUE_TYPE_BLOB columns, row i is
+    // mBytes[mOffsets[i], mOffsets[i + 1]).
+    nsTArray<uint32_t> mOffsets;
+    nsTArray<char> mBytes;
+    // Bit (i % 8) of byte (i / 8) is set if row i is NULL.
+    nsTArray<uint8_t> mNulls;
+  };
+
+  /**
+   * Gives a column that only held NULLs so far the type aType, filling its
+   * buffer with placeholders for the existing rows.
+   */
+  void setType(Column& aColumn, int32_t aType);
+
+  /**
+   * Converts the existing values of a column so it can hold a value of type
+   * aType.
+   */
+  void widenType(Column& aColumn, int32_t aType);
+
+  void appendBytes(Column& aColumn, const char* aData, uint32_t aLength);
+
+  static bool IsNullAt(const Column& aColumn, uint32_t aRow);
+
+  nsTArray<Column> mColumns;
+  uint32_t mRowCount;
+  size_t mDataSize;
+};
+
+}  // namespace storage
+}  // namespace mozilla
+
+#endif  // mozStorageColumnarResult_h
@@ -11,6 +11,7 @@
 #include "nsIFile.h"
 #include "nsIFileURL.h"
 #include "nsIXPConnect.h"
+#include "nsIThreadPool.h"
 #include "mozilla/AppShutdown.h"
 #include "mozilla/CheckedInt.h"
 #include "mozilla/Telemetry.h"
@@ -23,6 +24,7 @@
 #include "mozilla/ScopeExit.h"
 #include "mozilla/SpinEventLoopUntil.h"
 #include "mozilla/StaticPrefs_storage.h"
+#include "mozilla/TaskQueue.h"
 
 #include "mozIStorageCompletionCallback.h"
 #include "mozIStorageFunction.h"
@@ -823,7 +825,7 @@ Connection::~Connection() {
   // Failsafe Close() occurs in our custom Release method because of
   // complications related to Close() potentially invoking AsyncClose() which
   // will increment our refcount.
-  MOZ_ASSERT(!mAsyncExecutionThread,
+  MOZ_ASSERT(!mAsyncExecutionThread && !mAsyncExecutionQueue,
              "The async thread has not been shutdown properly!");
 }
 
@@ -920,8 +922,25 @@ nsIEventTarget* Connection::getAsyncExecutionTarget() {
     return nullptr;
   }
 
+  if (mAsyncExecutionQueue) {
+    return mAsyncExecutionQueue;
+  }
+
   // Create the async event target if there's none yet.
   if (!mAsyncExecutionThread) {
+    if (StaticPrefs::storage_async_execution_shared_pool_enabled()) {
+      // A task queue keeps this connection's statements serialized while
+      // sharing the pool's threads with every other connection.
+      nsCOMPtr<nsIThreadPool> pool = mStorageService->getAsyncExecutionPool();
+      if (!pool) {
+        NS_WARNING("Failed to get the shared async execution pool.");
+        return nullptr;
+      }
+      mAsyncExecutionQueue =
+          TaskQueue::Create(pool.forget(), "sqldb:pool connection");
+      return mAsyncExecutionQueue;
+    }
+
     // Names start with "sqldb:" followed by a recognizable name, like the
     // database file name, or a specially crafted name like "memory".
     // This name will be surfaced on https://crash-stats.mozilla.org, so any
@@ -1452,6 +1471,9 @@ bool Connection::isConnectionReadyOnThisThread() {
   if (mAsyncExecutionThread && mAsyncExecutionThread->IsOnCurrentThread()) {
     return true;
   }
+  if (mAsyncExecutionQueue && mAsyncExecutionQueue->IsOnCurrentThread()) {
+    return true;
+  }
   return connectionReady();
 }
 
@@ -1469,14 +1491,23 @@ bool Connection::isClosed(MutexAutoLock& lock) { return mConnectionClosed; }
 
 bool Connection::isAsyncExecutionThreadAvailable() {
   MOZ_ASSERT(IsOnCurrentSerialEventTarget(eventTargetOpenedOn));
-  return mAsyncExecutionThread && !mAsyncExecutionThreadShuttingDown;
+  return (mAsyncExecutionThread || mAsyncExecutionQueue) &&
+         !mAsyncExecutionThreadShuttingDown;
 }
 
 void Connection::shutdownAsyncThread() {
   MOZ_ASSERT(IsOnCurrentSerialEventTarget(eventTargetOpenedOn));
-  MOZ_ASSERT(mAsyncExecutionThread);
+  MOZ_ASSERT(mAsyncExecutionThread || mAsyncExecutionQueue);
   MOZ_ASSERT(mAsyncExecutionThreadShuttingDown);
 
+  if (mAsyncExecutionQueue) {
+    // The queue only holds the tail of the closing task at this point, and
+    // the pool itself is shut down by the Service at xpcom-shutdown-threads.
+    mAsyncExecutionQueue->BeginShutdown();
+    mAsyncExecutionQueue = nullptr;
+    return;
+  }
+
   MOZ_ALWAYS_SUCCEEDS(mAsyncExecutionThread->Shutdown());
   mAsyncExecutionThread = nullptr;
 }
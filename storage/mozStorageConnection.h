@@ -33,6 +33,10 @@ class nsIEventTarget;
 class nsISerialEventTarget;
 class nsIThread;
 
+namespace mozilla {
+class TaskQueue;
+}
+
 namespace mozilla::storage {
 
 class Connection final : public mozIStorageConnection,
@@ -162,7 +166,8 @@ class Connection final : public mozIStorageConnection,
   /**
    * Mutex used by asynchronous statements to protect state.  The mutex is
    * declared on the connection object because there is no contention between
-   * asynchronous statements (they are serialized on mAsyncExecutionThread).
+   * asynchronous statements (they are serialized on the async execution
+   * target).
    * Currently protects:
    *  - Connection.mAsyncExecutionThreadShuttingDown
    *  - Connection.mConnectionClosed
@@ -418,6 +423,14 @@ class Connection final : public mozIStorageConnection,
    */
   nsCOMPtr<nsIThread> mAsyncExecutionThread;
 
+  /**
+   * Lazily created queue on the Service's shared thread pool, used in place
+   * of mAsyncExecutionThread when storage.async_execution.shared_pool.enabled
+   * was set at the time async execution started.  At most one of the two is
+   * ever set.  The same rules as for mAsyncExecutionThread apply.
+   */
+  RefPtr<TaskQueue> mAsyncExecutionQueue;
+
   /**
    * The filename that will be reported to telemetry for this connection. By
    * default this will be the leaf of the path to the database file.
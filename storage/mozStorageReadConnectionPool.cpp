@@ -0,0 +1,220 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: sw=2 ts=2 et lcs=trail\:.,tab\:>~ :
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "mozStorageReadConnectionPool.h"
+
+#include "mozIStorageAsyncConnection.h"
+#include "mozIStorageAsyncStatement.h"
+#include "mozIStorageCompletionCallback.h"
+#include "mozIStorageService.h"
+#include "mozilla/Unused.h"
+#include "nsThreadUtils.h"
+
+namespace mozilla {
+namespace storage {
+
+////////////////////////////////////////////////////////////////////////////////
+//// ReadConnectionPool::OpenCallback and ReadConnectionPool::CloseCallback
+
+class ReadConnectionPool::OpenCallback final
+    : public mozIStorageCompletionCallback {
+ public:
+  NS_DECL_ISUPPORTS
+
+  explicit OpenCallback(ReadConnectionPool* aPool) : mPool(aPool) {}
+
+  NS_IMETHOD Complete(nsresult aStatus, nsISupports* aValue) override {
+    mPool->onCloneOpened(aStatus, aValue);
+    return NS_OK;
+  }
+
+ private:
+  ~OpenCallback() = default;
+
+  RefPtr<ReadConnectionPool> mPool;
+};
+
+NS_IMPL_ISUPPORTS(ReadConnectionPool::OpenCallback,
+                  mozIStorageCompletionCallback)
+
+class ReadConnectionPool::CloseCallback final
+    : public mozIStorageCompletionCallback {
+ public:
+  NS_DECL_ISUPPORTS
+
+  explicit CloseCallback(ReadConnectionPool* aPool) : mPool(aPool) {}
+
+  NS_IMETHOD Complete(nsresult aStatus, nsISupports*) override {
+    mPool->onCloneClosed(aStatus);
+    return NS_OK;
+  }
+
+ private:
+  ~CloseCallback() = default;
+
+  RefPtr<ReadConnectionPool> mPool;
+};
+
+NS_IMPL_ISUPPORTS(ReadConnectionPool::CloseCallback,
+                  mozIStorageCompletionCallback)
+
+////////////////////////////////////////////////////////////////////////////////
+//// ReadConnectionPool
+
+/* static */
+nsresult ReadConnectionPool::open(mozIStorageAsyncConnection* aConnection,
+                                  uint32_t aSize,
+                                  mozIStorageCompletionCallback* aCallback) {
+  MOZ_ASSERT(NS_IsMainThread());
+  NS_ENSURE_ARG(aConnection);
+  NS_ENSURE_ARG(aCallback);
+  if (aSize == 0 ||
+      aSize > mozIStorageService::MAX_READ_CONNECTION_POOL_SIZE) {
+    return NS_ERROR_INVALID_ARG;
+  }
+
+  RefPtr<ReadConnectionPool> pool = new ReadConnectionPool(aSize, aCallback);
+  for (uint32_t i = 0; i < aSize; i++) {
+    RefPtr<OpenCallback> callback = new OpenCallback(pool);
+    nsresult rv = aConnection->AsyncClone(/* aReadOnly */ true, callback);
+    if (NS_SUCCEEDED(rv)) {
+      continue;
+    }
+    if (i == 0) {
+      // Nothing is in flight yet, so just report the error to the caller.
+      return rv;
+    }
+    // Some clones are already opening, so the error has to go through the
+    // callback, once they are closed again.
+    for (; i < aSize; i++) {
+      pool->onCloneOpened(rv, nullptr);
+    }
+    break;
+  }
+  return NS_OK;
+}
+
+ReadConnectionPool::ReadConnectionPool(uint32_t aSize,
+                                       mozIStorageCompletionCallback* aCallback)
+    : mSize(aSize),
+      mPending(aSize),
+      mStatus(NS_OK),
+      mNext(0),
+      mClosing(false),
+      mCallback(aCallback) {}
+
+void ReadConnectionPool::onCloneOpened(nsresult aStatus, nsISupports* aClone) {
+  MOZ_ASSERT(NS_IsMainThread());
+  MOZ_ASSERT(mPending > 0 && !mClosing);
+
+  nsCOMPtr<mozIStorageAsyncConnection> clone = do_QueryInterface(aClone);
+  if (NS_SUCCEEDED(aStatus) && clone) {
+    mConnections.AppendElement(clone);
+  } else if (NS_SUCCEEDED(mStatus)) {
+    mStatus = NS_FAILED(aStatus) ? aStatus : NS_ERROR_UNEXPECTED;
+  }
+
+  if (--mPending > 0) {
+    return;
+  }
+
+  if (NS_FAILED(mStatus)) {
+    closeAll(mStatus);
+    return;
+  }
+
+  nsCOMPtr<mozIStorageCompletionCallback> callback = std::move(mCallback);
+  Unused << callback->Complete(
+      NS_OK, NS_ISUPPORTS_CAST(mozIStorageReadConnectionPool*, this));
+}
+
+void ReadConnectionPool::closeAll(nsresult aStatus) {
+  mClosing = true;
+  mStatus = aStatus;
+
+  nsTArray<nsCOMPtr<mozIStorageAsyncConnection>> connections =
+      std::move(mConnections);
+  mPending = connections.Length();
+  if (!mPending) {
+    nsCOMPtr<mozIStorageCompletionCallback> callback = std::move(mCallback);
+    if (callback) {
+      Unused << callback->Complete(mStatus, nullptr);
+    }
+    return;
+  }
+
+  for (const auto& connection : connections) {
+    // The callback is notified even if closing fails.
+    RefPtr<CloseCallback> callback = new CloseCallback(this);
+    Unused << connection->AsyncClose(callback);
+  }
+}
+
+void ReadConnectionPool::onCloneClosed(nsresult aStatus) {
+  MOZ_ASSERT(NS_IsMainThread());
+  MOZ_ASSERT(mPending > 0 && mClosing);
+
+  if (NS_FAILED(aStatus) && NS_SUCCEEDED(mStatus)) {
+    mStatus = aStatus;
+  }
+  if (--mPending > 0) {
+    return;
+  }
+
+  nsCOMPtr<mozIStorageCompletionCallback> callback = std::move(mCallback);
+  if (callback) {
+    Unused << callback->Complete(mStatus, nullptr);
+  }
+}
+
+NS_IMPL_ISUPPORTS(ReadConnectionPool, mozIStorageReadConnectionPool)
+
+////////////////////////////////////////////////////////////////////////////////
+//// mozIStorageReadConnectionPool
+
+NS_IMETHODIMP
+ReadConnectionPool::GetSize(uint32_t* _size) {
+  *_size = mSize;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ReadConnectionPool::GetConnection(mozIStorageAsyncConnection** _connection) {
+  NS_ENSURE_TRUE(NS_IsMainThread(), NS_ERROR_NOT_SAME_THREAD);
+  if (mClosing || mConnections.IsEmpty()) {
+    return NS_ERROR_NOT_INITIALIZED;
+  }
+
+  nsCOMPtr<mozIStorageAsyncConnection> connection = mConnections[mNext];
+  mNext = (mNext + 1) % mConnections.Length();
+  connection.forget(_connection);
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ReadConnectionPool::CreateAsyncStatement(const nsACString& aSQLStatement,
+                                         mozIStorageAsyncStatement** _stmt) {
+  nsCOMPtr<mozIStorageAsyncConnection> connection;
+  nsresult rv = GetConnection(getter_AddRefs(connection));
+  NS_ENSURE_SUCCESS(rv, rv);
+
+  return connection->CreateAsyncStatement(aSQLStatement, _stmt);
+}
+
+NS_IMETHODIMP
+ReadConnectionPool::AsyncClose(mozIStorageCompletionCallback* aCallback) {
+  NS_ENSURE_TRUE(NS_IsMainThread(), NS_ERROR_NOT_SAME_THREAD);
+  if (mClosing || mConnections.IsEmpty()) {
+    return NS_ERROR_NOT_INITIALIZED;
+  }
+
+  mCallback = aCallback;
+  closeAll(NS_OK);
+  return NS_OK;
+}
+
+}  // namespace storage
+}  // namespace mozilla
@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: sw=2 ts=2 et lcs=trail\:.,tab\:>~ :
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef mozStorageReadConnectionPool_h
+#define mozStorageReadConnectionPool_h
+
+#include "mozIStorageReadConnectionPool.h"
+#include "nsCOMPtr.h"
+#include "nsTArray.h"
+
+class mozIStorageAsyncConnection;
+class mozIStorageCompletionCallback;
+
+namespace mozilla {
+namespace storage {
+
+/**
+ * Implements mozIStorageReadConnectionPool on top of read-only clones of a
+ * connection.  Main thread only, like the asynchronous connections it holds.
+ */
+class ReadConnectionPool final : public mozIStorageReadConnectionPool {
+ public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_MOZISTORAGEREADCONNECTIONPOOL
+
+  /**
+   * Clones aConnection aSize times and notifies aCallback with the pool once
+   * every clone is ready, or with the first error.
+   *
+   * @see mozIStorageService::openReadConnectionPool
+   */
+  static nsresult open(mozIStorageAsyncConnection* aConnection, uint32_t aSize,
+                       mozIStorageCompletionCallback* aCallback);
+
+ private:
+  class OpenCallback;
+  class CloseCallback;
+
+  ReadConnectionPool(uint32_t aSize, mozIStorageCompletionCallback* aCallback);
+  ~ReadConnectionPool() = default;
+
+  /**
+   * Called as each clone finishes opening, successfully or not.
+   */
+  void onCloneOpened(nsresult aStatus, nsISupports* aClone);
+
+  /**
+   * Called as each clone finishes closing.
+   */
+  void onCloneClosed(nsresult aStatus);
+
+  /**
+   * Closes the clones opened so far and calls mCallback with aStatus once they
+   * are all closed.
+   */
+  void closeAll(nsresult aStatus);
+
+  nsTArray<nsCOMPtr<mozIStorageAsyncConnection>> mConnections;
+  const uint32_t mSize;
+
+  /**
+   * The number of clones still opening, then still closing.
+   */
+  uint32_t mPending;
+
+  /**
+   * The status reported to mCallback: the first error of the clones, if any.
+   */
+  nsresult mStatus;
+
+  /**
+   * The index of the connection getConnection() hands out next.
+   */
+  uint32_t mNext;
+
+  bool mClosing;
+
+  /**
+   * Notified when opening the pool completes, then when closing it does.
+   */
+  nsCOMPtr<mozIStorageCompletionCallback> mCallback;
+};
+
+}  // namespace storage
+}  // namespace mozilla
+
+#endif  // mozStorageReadConnectionPool_h
@@ -12,6 +12,7 @@
 #include "nsIFileURL.h"
 #include "mozStorageService.h"
 #include "mozStorageConnection.h"
+#include "mozStorageReadConnectionPool.h"
 #include "nsComponentManagerUtils.h"
 #include "nsEmbedCID.h"
 #include "nsExceptionHandler.h"
@@ -19,6 +20,7 @@
 #include "mozStoragePrivateHelpers.h"
 #include "nsIObserverService.h"
 #include "nsIPropertyBag2.h"
+#include "nsThreadPool.h"
 #include "ObfuscatingVFS.h"
 #include "QuotaVFS.h"
 #include "mozilla/Services.h"
@@ -29,6 +31,8 @@
 #include "mozilla/intl/Collator.h"
 #include "mozilla/intl/LocaleService.h"
 
+#include <algorithm>
+
 #include "sqlite3.h"
 #include "mozilla/AutoSQLiteLifetime.h"
 
@@ -205,6 +209,8 @@ Service::AutoVFSRegistration::~AutoVFSRegistration() {
 Service::Service()
     : mMutex("Service::mMutex"),
       mRegistrationMutex("Service::mRegistrationMutex"),
+      mAsyncExecutionPoolMutex("Service::mAsyncExecutionPoolMutex"),
+      mAsyncExecutionPoolShutDown(false),
       mLastSensitivity(mozilla::intl::Collator::Sensitivity::Base) {}
 
 Service::~Service() {
@@ -214,6 +220,28 @@ Service::~Service() {
   gService = nullptr;
 }
 
+already_AddRefed<nsIThreadPool> Service::getAsyncExecutionPool() {
+  MutexAutoLock lock(mAsyncExecutionPoolMutex);
+  if (mAsyncExecutionPoolShutDown) {
+    return nullptr;
+  }
+
+  if (!mAsyncExecutionPool) {
+    nsCOMPtr<nsIThreadPool> pool = new nsThreadPool();
+    MOZ_ALWAYS_SUCCEEDS(pool->SetThreadLimit(std::max(
+        1u, StaticPrefs::storage_async_execution_shared_pool_max_threads())));
+    // Keep one thread around so a lone busy connection doesn't pay for a
+    // thread creation on every statement.
+    MOZ_ALWAYS_SUCCEEDS(pool->SetIdleThreadLimit(1));
+    // Thread names are surfaced in crash reports like the per-connection
+    // "sqldb:" threads, but can't name a database since they serve them all.
+    MOZ_ALWAYS_SUCCEEDS(pool->SetName("sqldb:pool"_ns));
+    mAsyncExecutionPool = std::move(pool);
+  }
+
+  return do_AddRef(mAsyncExecutionPool);
+}
+
 void Service::registerConnection(Connection* aConnection) {
   mRegistrationMutex.AssertNotCurrentThreadOwns();
   MutexAutoLock mutex(mRegistrationMutex);
@@ -605,6 +633,16 @@ Service::OpenAsyncDatabase(nsIVariant* aDatabaseStore, uint32_t aOpenFlags,
   return target->Dispatch(asyncInit, nsIEventTarget::DISPATCH_NORMAL);
 }
 
+NS_IMETHODIMP
+Service::OpenReadConnectionPool(mozIStorageAsyncConnection* aConnection,
+                                uint32_t aSize,
+                                mozIStorageCompletionCallback* aCallback) {
+  if (!NS_IsMainThread()) {
+    return NS_ERROR_NOT_SAME_THREAD;
+  }
+  return ReadConnectionPool::open(aConnection, aSize, aCallback);
+}
+
 NS_IMETHODIMP
 Service::OpenDatabase(nsIFile* aDatabaseFile, uint32_t aConnectionFlags,
                       mozIStorageConnection** _connection) {
@@ -722,6 +760,19 @@ Service::Observe(nsISupports*, const char* aTopic, const char16_t*) {
                          return true;
                        });
 
+    // Every connection that used the shared pool is closed by now.  From here
+    // on getAsyncExecutionPool() returns null, so no new task queues are
+    // created on it.
+    nsCOMPtr<nsIThreadPool> pool;
+    {
+      MutexAutoLock lock(mAsyncExecutionPoolMutex);
+      mAsyncExecutionPoolShutDown = true;
+      pool = std::move(mAsyncExecutionPool);
+    }
+    if (pool) {
+      MOZ_ALWAYS_SUCCEEDS(pool->Shutdown());
+    }
+
 #ifdef DEBUG
     nsTArray<RefPtr<Connection>> connections;
     getConnections(connections);
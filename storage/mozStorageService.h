@@ -19,6 +19,7 @@
 #include "mozIStorageService.h"
 
 class nsIMemoryReporter;
+class nsIThreadPool;
 struct sqlite3_vfs;
 namespace mozilla::intl {
 class Collator;
@@ -106,6 +107,16 @@ class Service : public mozIStorageService,
    */
   void getConnections(nsTArray<RefPtr<Connection> >& aConnections);
 
+  /**
+   * Returns the thread pool that connections share for asynchronous statement
+   * execution when storage.async_execution.shared_pool.enabled is set,
+   * creating it if needed.  Each connection runs its statements through its
+   * own TaskQueue on top of this pool, which keeps them serialized.
+   *
+   * @return The pool, or null once xpcom-shutdown-threads has been observed.
+   */
+  already_AddRefed<nsIThreadPool> getAsyncExecutionPool();
+
  private:
   Service();
   virtual ~Service();
@@ -145,6 +156,15 @@ class Service : public mozIStorageService,
    */
   nsTArray<RefPtr<Connection> > mConnections;
 
+  /**
+   * Protects mAsyncExecutionPool and mAsyncExecutionPoolShutDown, which are
+   * used from the opener threads of all connections.
+   */
+  Mutex mAsyncExecutionPoolMutex;
+  nsCOMPtr<nsIThreadPool> mAsyncExecutionPool
+      MOZ_GUARDED_BY(mAsyncExecutionPoolMutex);
+  bool mAsyncExecutionPoolShutDown MOZ_GUARDED_BY(mAsyncExecutionPoolMutex);
+
   /**
    * Frees as much heap memory as possible from all of the known open
    * connections.
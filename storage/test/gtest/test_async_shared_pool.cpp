@@ -0,0 +1,66 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: sw=2 ts=2 et lcs=trail\:.,tab\:>~ :
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "storage_test_harness.h"
+#include "mozilla/Preferences.h"
+#include "mozilla/SyncRunnable.h"
+
+using namespace mozilla;
+
+/**
+ * With storage.async_execution.shared_pool.enabled set, connections execute
+ * asynchronous statements on task queues over one shared thread pool rather
+ * than on threads of their own.
+ */
+
+static nsAutoCString get_target_thread_name(nsIEventTarget* aTarget) {
+  nsAutoCString name;
+  SyncRunnable::DispatchToThread(
+      aTarget, NS_NewRunnableFunction(__func__, [&name] {
+        name.Assign(PR_GetThreadName(PR_GetCurrentThread()));
+      }));
+  return name;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//// Tests
+
+TEST(storage_async_shared_pool, ConnectionsShareThreads)
+{
+  Preferences::SetBool("storage.async_execution.shared_pool.enabled", true);
+
+  nsCOMPtr<mozIStorageConnection> db1(getMemoryDatabase());
+  nsCOMPtr<mozIStorageConnection> db2(getMemoryDatabase());
+
+  nsCOMPtr<mozIStorageAsyncStatement> stmt;
+  for (mozIStorageConnection* db : {db1.get(), db2.get()}) {
+    do_check_success(
+        db->CreateAsyncStatement("SELECT 1"_ns, getter_AddRefs(stmt)));
+    blocking_async_execute(stmt);
+    stmt->Finalize();
+  }
+
+  nsCOMPtr<nsIEventTarget> target1 = do_GetInterface(db1);
+  nsCOMPtr<nsIEventTarget> target2 = do_GetInterface(db2);
+  do_check_true(target1);
+  do_check_true(target2);
+  // Each connection has its own serial queue rather than a thread.
+  do_check_true(target1 != target2);
+  nsCOMPtr<nsIThread> thread = do_QueryInterface(target1);
+  do_check_false(thread);
+  nsCOMPtr<nsISerialEventTarget> serial = do_QueryInterface(target1);
+  do_check_true(serial);
+
+  do_check_true(
+      StringBeginsWith(get_target_thread_name(target1), "sqldb:pool"_ns));
+  do_check_true(
+      StringBeginsWith(get_target_thread_name(target2), "sqldb:pool"_ns));
+
+  blocking_async_close(db1);
+  blocking_async_close(db2);
+
+  Preferences::ClearUser("storage.async_execution.shared_pool.enabled");
+}
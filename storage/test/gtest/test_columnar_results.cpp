@@ -0,0 +1,194 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: sw=2 ts=2 et lcs=trail\:.,tab\:>~ :
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "storage_test_harness.h"
+#include "mozIStorageColumnarCallback.h"
+#include "mozStorageColumnarResult.h"
+#include "mozilla/SpinEventLoopUntil.h"
+
+using namespace mozilla;
+using namespace mozilla::storage;
+
+/**
+ * Callbacks implementing mozIStorageColumnarCallback get their rows in
+ * columnar chunks rather than as result sets.
+ */
+
+class ColumnarSpinner final : public mozIStorageColumnarCallback {
+ public:
+  NS_DECL_ISUPPORTS
+  NS_DECL_MOZISTORAGESTATEMENTCALLBACK
+  NS_DECL_MOZISTORAGECOLUMNARCALLBACK
+
+  void SpinUntilCompleted() {
+    MOZ_ALWAYS_TRUE(SpinEventLoopUntil("ColumnarSpinner"_ns,
+                                       [&] { return mCompleted; }));
+  }
+
+  nsTArray<RefPtr<ColumnarResult>> mChunks;
+  uint32_t mResultSets = 0;
+  uint16_t mCompletionReason = 0;
+
+ private:
+  ~ColumnarSpinner() = default;
+  bool mCompleted = false;
+};
+
+NS_IMPL_ISUPPORTS(ColumnarSpinner, mozIStorageStatementCallback,
+                  mozIStorageColumnarCallback)
+
+NS_IMETHODIMP
+ColumnarSpinner::HandleResult(mozIStorageResultSet* aResultSet) {
+  mResultSets++;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarSpinner::HandleError(mozIStorageError* aError) {
+  ADD_FAILURE() << "Unexpected error";
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarSpinner::HandleCompletion(uint16_t aReason) {
+  mCompletionReason = aReason;
+  mCompleted = true;
+  return NS_OK;
+}
+
+NS_IMETHODIMP
+ColumnarSpinner::HandleColumnarResult(mozIStorageColumnarResult* aResult) {
+  mChunks.AppendElement(static_cast<ColumnarResult*>(aResult));
+  return NS_OK;
+}
+
+static already_AddRefed<ColumnarSpinner> execute_columnar(
+    mozIStorageConnection* aDB, const nsACString& aSQL) {
+  nsCOMPtr<mozIStorageAsyncStatement> stmt;
+  (void)aDB->CreateAsyncStatement(aSQL, getter_AddRefs(stmt));
+  RefPtr<ColumnarSpinner> spinner = new ColumnarSpinner();
+  nsCOMPtr<mozIStoragePendingStatement> pending;
+  (void)stmt->ExecuteAsync(spinner, getter_AddRefs(pending));
+  spinner->SpinUntilCompleted();
+  stmt->Finalize();
+  return spinner.forget();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//// Tests
+
+TEST(storage_columnar_results, ColumnTypes)
+{
+  nsCOMPtr<mozIStorageConnection> db(getMemoryDatabase());
+  do_check_success(db->ExecuteSimpleSQL(
+      "CREATE TABLE test (i INTEGER, f REAL, t TEXT, b BLOB, n)"_ns));
+  do_check_success(db->ExecuteSimpleSQL(
+      "INSERT INTO test VALUES (1, 1.5, 'one', x'0102', NULL), "
+      "(NULL, NULL, NULL, NULL, NULL), (3, 3.5, 'three', x'', NULL)"_ns));
+
+  RefPtr<ColumnarSpinner> spinner =
+      execute_columnar(db, "SELECT i, f, t, b, n FROM test ORDER BY rowid"_ns);
+  do_check_eq(mozIStorageStatementCallback::REASON_FINISHED,
+              spinner->mCompletionReason);
+  do_check_eq(0u, spinner->mResultSets);
+  ASSERT_EQ(1u, spinner->mChunks.Length());
+
+  RefPtr<ColumnarResult> chunk = spinner->mChunks[0];
+  do_check_eq(3u, chunk->rows());
+  uint32_t columns;
+  do_check_success(chunk->GetColumnCount(&columns));
+  do_check_eq(5u, columns);
+  nsAutoCString name;
+  do_check_success(chunk->GetColumnName(2, name));
+  do_check_true(name.EqualsLiteral("t"));
+
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_INTEGER, chunk->columnType(0));
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_FLOAT, chunk->columnType(1));
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_TEXT, chunk->columnType(2));
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_BLOB, chunk->columnType(3));
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_NULL, chunk->columnType(4));
+
+  do_check_eq(1, chunk->integers(0)[0]);
+  do_check_eq(0, chunk->integers(0)[1]);
+  do_check_eq(3, chunk->integers(0)[2]);
+  do_check_eq(3.5, chunk->floats(1)[2]);
+  do_check_true(chunk->bytes(2, 0).EqualsLiteral("one"));
+  do_check_true(chunk->bytes(2, 1).IsEmpty());
+  do_check_true(chunk->bytes(2, 2).EqualsLiteral("three"));
+  do_check_eq(2u, chunk->bytes(3, 0).Length());
+  do_check_eq('\x02', chunk->bytes(3, 0)[1]);
+  do_check_true(chunk->bytes(3, 2).IsEmpty());
+
+  for (uint32_t column = 0; column < 4; column++) {
+    do_check_false(chunk->isNull(column, 0));
+    do_check_true(chunk->isNull(column, 1));
+    do_check_false(chunk->isNull(column, 2));
+  }
+  bool isNull;
+  do_check_success(chunk->GetIsNull(4, 2, &isNull));
+  do_check_true(isNull);
+  do_check_false(NS_SUCCEEDED(chunk->GetIsNull(0, 3, &isNull)));
+
+  blocking_async_close(db);
+}
+
+TEST(storage_columnar_results, MixedTypes)
+{
+  nsCOMPtr<mozIStorageConnection> db(getMemoryDatabase());
+  do_check_success(db->ExecuteSimpleSQL("CREATE TABLE test (a, b, c)"_ns));
+  do_check_success(db->ExecuteSimpleSQL(
+      "INSERT INTO test VALUES (NULL, 1, 2), (1, 2.5, 'x'), (2, 3, 4)"_ns));
+
+  RefPtr<ColumnarSpinner> spinner =
+      execute_columnar(db, "SELECT a, b, c FROM test ORDER BY rowid"_ns);
+  ASSERT_EQ(1u, spinner->mChunks.Length());
+  RefPtr<ColumnarResult> chunk = spinner->mChunks[0];
+
+  // A column that starts with NULLs takes the type of its first value.
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_INTEGER, chunk->columnType(0));
+  do_check_true(chunk->isNull(0, 0));
+  do_check_eq(2, chunk->integers(0)[2]);
+
+  // Integers widen to floats.
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_FLOAT, chunk->columnType(1));
+  do_check_eq(1.0, chunk->floats(1)[0]);
+  do_check_eq(2.5, chunk->floats(1)[1]);
+  do_check_eq(3.0, chunk->floats(1)[2]);
+
+  // Any other mix turns into text.
+  do_check_eq(mozIStorageValueArray::VALUE_TYPE_TEXT, chunk->columnType(2));
+  do_check_true(chunk->bytes(2, 0).EqualsLiteral("2"));
+  do_check_true(chunk->bytes(2, 1).EqualsLiteral("x"));
+  do_check_true(chunk->bytes(2, 2).EqualsLiteral("4"));
+
+  blocking_async_close(db);
+}
+
+TEST(storage_columnar_results, Chunking)
+{
+  nsCOMPtr<mozIStorageConnection> db(getMemoryDatabase());
+
+  RefPtr<ColumnarSpinner> spinner = execute_columnar(
+      db,
+      "WITH RECURSIVE n(x) AS (SELECT 0 UNION ALL SELECT x + 1 FROM n "
+      "WHERE x < 9999) SELECT x FROM n"_ns);
+  do_check_eq(mozIStorageStatementCallback::REASON_FINISHED,
+              spinner->mCompletionReason);
+  do_check_true(spinner->mChunks.Length() >= 3);
+
+  // Chunks arrive in order and hold every row exactly once.
+  int64_t expected = 0;
+  for (const auto& chunk : spinner->mChunks) {
+    do_check_true(chunk->rows() <= 4096);
+    for (int64_t value : chunk->integers(0)) {
+      do_check_eq(expected, value);
+      expected++;
+    }
+  }
+  do_check_eq(10000, expected);
+
+  blocking_async_close(db);
+}
@@ -0,0 +1,115 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * vim: sw=2 ts=2 et lcs=trail\:.,tab\:>~ :
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "storage_test_harness.h"
+#include "mozIStorageReadConnectionPool.h"
+
+/**
+ * mozIStorageService::openReadConnectionPool opens read-only clones of a
+ * connection, each running its statements on its own thread.
+ */
+
+static already_AddRefed<mozIStorageReadConnectionPool> open_pool(
+    mozIStorageConnection* aDB, uint32_t aSize) {
+  nsCOMPtr<mozIStorageService> ss = getService();
+  RefPtr<AsyncCompletionSpinner> spinner = new AsyncCompletionSpinner();
+  do_check_success(ss->OpenReadConnectionPool(aDB, aSize, spinner));
+  spinner->SpinUntilCompleted();
+  do_check_success(spinner->mCompletionReason);
+  nsCOMPtr<mozIStorageReadConnectionPool> pool =
+      do_QueryInterface(spinner->mCompletionValue);
+  return pool.forget();
+}
+
+static uint16_t execute_on_pool(mozIStorageReadConnectionPool* aPool,
+                                const nsACString& aSQL) {
+  nsCOMPtr<mozIStorageAsyncStatement> stmt;
+  do_check_success(aPool->CreateAsyncStatement(aSQL, getter_AddRefs(stmt)));
+  RefPtr<AsyncStatementSpinner> spinner = new AsyncStatementSpinner();
+  nsCOMPtr<mozIStoragePendingStatement> pending;
+  (void)stmt->ExecuteAsync(spinner, getter_AddRefs(pending));
+  spinner->SpinUntilCompleted();
+  stmt->Finalize();
+  return spinner->completionReason;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//// Tests
+
+TEST(storage_read_connection_pool, ReadsOnSeparateThreads)
+{
+  nsCOMPtr<mozIStorageConnection> db(getDatabase());
+  do_check_success(db->ExecuteSimpleSQL("PRAGMA journal_mode = WAL"_ns));
+  do_check_success(db->ExecuteSimpleSQL("DROP TABLE IF EXISTS test"_ns));
+  do_check_success(db->ExecuteSimpleSQL("CREATE TABLE test (id INTEGER)"_ns));
+  do_check_success(db->ExecuteSimpleSQL("INSERT INTO test VALUES (1)"_ns));
+
+  nsCOMPtr<mozIStorageReadConnectionPool> pool = open_pool(db, 3);
+  ASSERT_TRUE(pool);
+  uint32_t size;
+  do_check_success(pool->GetSize(&size));
+  do_check_eq(3u, size);
+
+  // Connections are handed out in turn, and each has its own thread.
+  nsCOMPtr<mozIStorageAsyncConnection> connections[4];
+  for (auto& connection : connections) {
+    do_check_success(pool->GetConnection(getter_AddRefs(connection)));
+  }
+  do_check_true(connections[0] != connections[1]);
+  do_check_true(connections[1] != connections[2]);
+  do_check_true(connections[0] != connections[2]);
+  do_check_true(connections[0] == connections[3]);
+  nsCOMPtr<nsIEventTarget> targets[3];
+  for (uint32_t i = 0; i < 3; i++) {
+    targets[i] = do_GetInterface(connections[i]);
+    do_check_true(targets[i]);
+  }
+  do_check_true(targets[0] != targets[1]);
+  do_check_true(targets[1] != targets[2]);
+
+  for (uint32_t i = 0; i < 3; i++) {
+    do_check_eq(mozIStorageStatementCallback::REASON_FINISHED,
+                execute_on_pool(pool, "SELECT * FROM test"_ns));
+  }
+  // The clones are read-only.
+  do_check_eq(mozIStorageStatementCallback::REASON_ERROR,
+              execute_on_pool(pool, "INSERT INTO test VALUES (2)"_ns));
+
+  RefPtr<AsyncCompletionSpinner> spinner = new AsyncCompletionSpinner();
+  do_check_success(pool->AsyncClose(spinner));
+  spinner->SpinUntilCompleted();
+  do_check_success(spinner->mCompletionReason);
+
+  nsCOMPtr<mozIStorageAsyncConnection> connection;
+  do_check_eq(NS_ERROR_NOT_INITIALIZED,
+              pool->GetConnection(getter_AddRefs(connection)));
+  do_check_eq(NS_ERROR_NOT_INITIALIZED, pool->AsyncClose(nullptr));
+
+  // Other tests share the database file.
+  do_check_success(db->ExecuteSimpleSQL("DROP TABLE test"_ns));
+  do_check_success(db->ExecuteSimpleSQL("PRAGMA journal_mode = DELETE"_ns));
+  blocking_async_close(db);
+}
+
+TEST(storage_read_connection_pool, InvalidArguments)
+{
+  nsCOMPtr<mozIStorageService> ss = getService();
+  RefPtr<AsyncCompletionSpinner> spinner = new AsyncCompletionSpinner();
+
+  nsCOMPtr<mozIStorageConnection> db(getDatabase());
+  do_check_eq(NS_ERROR_INVALID_ARG, ss->OpenReadConnectionPool(db, 0, spinner));
+  do_check_eq(
+      NS_ERROR_INVALID_ARG,
+      ss->OpenReadConnectionPool(
+          db, mozIStorageService::MAX_READ_CONNECTION_POOL_SIZE + 1, spinner));
+  db->Close();
+
+  // In-memory databases can't be cloned.
+  nsCOMPtr<mozIStorageConnection> memoryDB(getMemoryDatabase());
+  do_check_false(
+      NS_SUCCEEDED(ss->OpenReadConnectionPool(memoryDB, 2, spinner)));
+  memoryDB->Close();
+}
@@ -4,8 +4,16 @@
 
 #include "DAPTelemetryBindings.h"
 
+#include "mozilla/ClearOnShutdown.h"
 #include "mozilla/Logging.h"
+#include "mozilla/MozPromise.h"
+#include "mozilla/StaticMutex.h"
+#include "mozilla/StaticPtr.h"
+#include "mozilla/dom/Promise.h"
 #include "nsPromiseFlatString.h"
+#include "nsTHashMap.h"
+#include "nsThreadUtils.h"
+#include "xpcpublic.h"
 
 #include "nss.h"
 #include "nsNSSComponent.h"
@@ -49,15 +57,99 @@ static unsigned char* toUcharPtr(const uint8_t* v) {
   return const_cast<unsigned char*>(static_cast<const unsigned char*>(v));
 }
 
+// The HPKE suite is fixed, so it only needs to be validated once.
+static bool HpkeParametersValid() {
+  static const bool sValid =
+      PK11_HPKE_ValidateParameters(HpkeDhKemX25519Sha256, HpkeKdfHkdfSha256,
+                                   HpkeAeadAes128Gcm) == SECSuccess;
+  return sValid;
+}
+
+// A deserialized aggregator public key, shared by every report encrypted to
+// that aggregator. NSS only reads it during setup, so it may be used from
+// several threads at once.
+class DAPHpkePublicKey final {
+ public:
+  NS_INLINE_DECL_THREADSAFE_REFCOUNTING(DAPHpkePublicKey)
+
+  explicit DAPHpkePublicKey(UniqueSECKEYPublicKey aKey)
+      : mKey(std::move(aKey)) {}
+
+  SECKEYPublicKey* get() const { return mKey.get(); }
+
+ private:
+  ~DAPHpkePublicKey() = default;
+
+  UniqueSECKEYPublicKey mKey;
+};
+
+// There is one key per aggregator, so a handful of entries covers every key
+// in use. The cache is emptied when full and before NSS shuts down.
+static constexpr uint32_t kMaxCachedHpkeKeys = 8;
+static StaticMutex sHpkeKeyCacheMutex;
+static StaticAutoPtr<nsTHashMap<nsCStringHashKey, RefPtr<DAPHpkePublicKey>>>
+    sHpkeKeyCache MOZ_GUARDED_BY(sHpkeKeyCacheMutex);
+
+static void ClearHpkeKeyCache() {
+  StaticMutexAutoLock lock(sHpkeKeyCacheMutex);
+  sHpkeKeyCache = nullptr;
+}
+
+static already_AddRefed<DAPHpkePublicKey> GetHpkePublicKey(
+    HpkeContext* aContext, const uint8_t* aKey, uint32_t aKeyLength) {
+  const nsDependentCSubstring keyBytes(reinterpret_cast<const char*>(aKey),
+                                       aKeyLength);
+  {
+    StaticMutexAutoLock lock(sHpkeKeyCacheMutex);
+    if (sHpkeKeyCache) {
+      if (auto entry = sHpkeKeyCache->Lookup(keyBytes)) {
+        return do_AddRef(entry.Data());
+      }
+    }
+  }
+
+  SECKEYPublicKey* pkR_raw = nullptr;
+  SECStatus status =
+      PK11_HPKE_Deserialize(aContext, aKey, aKeyLength, &pkR_raw);
+  UniqueSECKEYPublicKey pkR(pkR_raw);
+  pkR_raw = nullptr;
+  if (status != SECSuccess) {
+    return nullptr;
+  }
+
+  RefPtr<DAPHpkePublicKey> key = new DAPHpkePublicKey(std::move(pkR));
+
+  bool registerCleanup = false;
+  {
+    StaticMutexAutoLock lock(sHpkeKeyCacheMutex);
+    if (!sHpkeKeyCache) {
+      sHpkeKeyCache =
+          new nsTHashMap<nsCStringHashKey, RefPtr<DAPHpkePublicKey>>();
+      registerCleanup = true;
+    } else if (sHpkeKeyCache->Count() >= kMaxCachedHpkeKeys) {
+      sHpkeKeyCache->Clear();
+    }
+    sHpkeKeyCache->InsertOrUpdate(keyBytes, key);
+  }
+
+  // Release the keys while NSS is still up.
+  if (registerCleanup) {
+    NS_DispatchToMainThread(
+        NS_NewRunnableFunction("DAPTelemetry::ClearHpkeKeyCache", [] {
+          RunOnShutdown(ClearHpkeKeyCache, ShutdownPhase::XPCOMWillShutdown);
+        }));
+  }
+
+  return key.forget();
+}
+
 /// If successful this returns a pointer to a HpkeContext which must be
 /// released using dapDestroyHpkeContext or PK11_HPKE_DestroyContext.
 HpkeContext* dapSetupHpkeContextInternal(
     const uint8_t* aKey, uint32_t aKeyLength, const uint8_t* aInfo,
     uint32_t aInfoLength, SECKEYPublicKey* aPkE, SECKEYPrivateKey* aSkE,
     nsTArray<uint8_t>* aOutputEncapsulatedKey) {
-  SECStatus status = PK11_HPKE_ValidateParameters(
-      HpkeDhKemX25519Sha256, HpkeKdfHkdfSha256, HpkeAeadAes128Gcm);
-  if (status != SECSuccess) {
+  if (!HpkeParametersValid()) {
     MOZ_LOG(sLogger, mozilla::LogLevel::Error,
             ("Invalid HKPE parameters found."));
     return nullptr;
@@ -66,12 +158,15 @@ HpkeContext* dapSetupHpkeContextInternal(
   UniqueHpkeContext context(
       PK11_HPKE_NewContext(HpkeDhKemX25519Sha256, HpkeKdfHkdfSha256,
                            HpkeAeadAes128Gcm, nullptr, nullptr));
+  if (!context) {
+    MOZ_LOG(sLogger, mozilla::LogLevel::Error,
+            ("Failed to create HPKE context."));
+    return nullptr;
+  }
 
-  SECKEYPublicKey* pkR_raw = nullptr;
-  status = PK11_HPKE_Deserialize(context.get(), aKey, aKeyLength, &pkR_raw);
-  UniqueSECKEYPublicKey pkR(pkR_raw);
-  pkR_raw = nullptr;
-  if (status != SECSuccess) {
+  RefPtr<DAPHpkePublicKey> pkR =
+      GetHpkePublicKey(context.get(), aKey, aKeyLength);
+  if (!pkR) {
     MOZ_LOG(sLogger, mozilla::LogLevel::Error,
             ("Failed to deserialize HPKE encryption key."));
     return nullptr;
@@ -79,7 +174,8 @@ HpkeContext* dapSetupHpkeContextInternal(
 
   const SECItem hpkeInfo = {siBuffer, toUcharPtr(aInfo), aInfoLength};
 
-  status = PK11_HPKE_SetupS(context.get(), aPkE, aSkE, pkR.get(), &hpkeInfo);
+  SECStatus status =
+      PK11_HPKE_SetupS(context.get(), aPkE, aSkE, pkR->get(), &hpkeInfo);
   if (status != SECSuccess) {
     MOZ_LOG(sLogger, mozilla::LogLevel::Error, ("HPKE setup failed."));
     return nullptr;
@@ -178,6 +274,45 @@ bool dapHpkeEncryptOneshot(const uint8_t* aKey, uint32_t aKeyLength,
 }
 }
 
+enum class DAPMeasurementType { U8, VecU8, VecU16 };
+
+using DAPReportsPromise =
+    MozPromise<nsTArray<nsTArray<uint8_t>>, nsresult, true>;
+
+// Runs off the main thread; the inputs were validated by GetReportsAsync.
+static bool GenerateReport(DAPMeasurementType aType,
+                           const nsTArray<uint8_t>& aLeaderHpkeConfig,
+                           const nsTArray<uint8_t>& aHelperHpkeConfig,
+                           Span<const uint16_t> aMeasurement,
+                           const nsTArray<uint8_t>& aTaskID,
+                           uint64_t aTimePrecision,
+                           nsTArray<uint8_t>& aOutReport) {
+  switch (aType) {
+    case DAPMeasurementType::U8:
+      return dapGetReportU8(&aLeaderHpkeConfig, &aHelperHpkeConfig,
+                            static_cast<uint8_t>(aMeasurement[0]), &aTaskID,
+                            aTimePrecision, &aOutReport);
+    case DAPMeasurementType::VecU8: {
+      nsTArray<uint8_t> measurement(aMeasurement.Length());
+      for (uint16_t value : aMeasurement) {
+        measurement.AppendElement(static_cast<uint8_t>(value));
+      }
+      return dapGetReportVecU8(&aLeaderHpkeConfig, &aHelperHpkeConfig,
+                               &measurement, &aTaskID, aTimePrecision,
+                               &aOutReport);
+    }
+    case DAPMeasurementType::VecU16: {
+      nsTArray<uint16_t> measurement;
+      measurement.AppendElements(aMeasurement);
+      return dapGetReportVecU16(&aLeaderHpkeConfig, &aHelperHpkeConfig,
+                                &measurement, &aTaskID, aTimePrecision,
+                                &aOutReport);
+    }
+  }
+  MOZ_ASSERT_UNREACHABLE("Unknown measurement type");
+  return false;
+}
+
 NS_IMETHODIMP DAPTelemetry::GetReportU8(
     const nsTArray<uint8_t>& aLeaderHpkeConfig,
     const nsTArray<uint8_t>& aHelperHpkeConfig, uint8_t aMeasurement,
@@ -220,4 +355,86 @@ NS_IMETHODIMP DAPTelemetry::GetReportVecU16(
   return NS_OK;
 }
 
+NS_IMETHODIMP DAPTelemetry::GetReportsAsync(
+    const nsACString& aMeasurementType,
+    const nsTArray<uint8_t>& aLeaderHpkeConfig,
+    const nsTArray<uint8_t>& aHelperHpkeConfig,
+    const nsTArray<uint16_t>& aMeasurements, uint32_t aMeasurementLength,
+    const nsTArray<uint8_t>& aTaskID, uint64_t aTimePrecision, JSContext* aCx,
+    dom::Promise** aPromise) {
+  MOZ_ASSERT(NS_IsMainThread());
+  NS_ENSURE_ARG_POINTER(aCx);
+  NS_ENSURE_ARG_POINTER(aPromise);
+  NS_ENSURE_TRUE(aTaskID.Length() == 32, NS_ERROR_INVALID_ARG);
+  NS_ENSURE_TRUE(aMeasurementLength > 0 &&
+                     aMeasurements.Length() % aMeasurementLength == 0,
+                 NS_ERROR_INVALID_ARG);
+
+  DAPMeasurementType type;
+  uint16_t maxValue = UINT8_MAX;
+  if (aMeasurementType.EqualsLiteral("u8")) {
+    NS_ENSURE_TRUE(aMeasurementLength == 1, NS_ERROR_INVALID_ARG);
+    type = DAPMeasurementType::U8;
+  } else if (aMeasurementType.EqualsLiteral("vecu8")) {
+    type = DAPMeasurementType::VecU8;
+  } else if (aMeasurementType.EqualsLiteral("vecu16")) {
+    type = DAPMeasurementType::VecU16;
+    maxValue = UINT16_MAX;
+  } else {
+    return NS_ERROR_INVALID_ARG;
+  }
+  for (uint16_t value : aMeasurements) {
+    NS_ENSURE_TRUE(value <= maxValue, NS_ERROR_INVALID_ARG);
+  }
+
+  // NSS may only be initialized on the main thread.
+  NS_ENSURE_TRUE(EnsureNSSInitializedChromeOrContent(), NS_ERROR_FAILURE);
+
+  if (!mBackgroundQueue) {
+    nsresult rv = NS_CreateBackgroundTaskQueue(
+        "DAPTelemetry", getter_AddRefs(mBackgroundQueue));
+    NS_ENSURE_SUCCESS(rv, rv);
+  }
+
+  nsIGlobalObject* globalObject = xpc::CurrentNativeGlobal(aCx);
+  NS_ENSURE_TRUE(globalObject, NS_ERROR_UNEXPECTED);
+
+  ErrorResult result;
+  RefPtr<dom::Promise> promise = dom::Promise::Create(globalObject, result);
+  if (result.Failed()) {
+    return result.StealNSResult();
+  }
+
+  InvokeAsync(
+      mBackgroundQueue, __func__,
+      [type, leader = aLeaderHpkeConfig.Clone(),
+       helper = aHelperHpkeConfig.Clone(), measurements = aMeasurements.Clone(),
+       aMeasurementLength, taskID = aTaskID.Clone(), aTimePrecision]() {
+        const size_t count = measurements.Length() / aMeasurementLength;
+        nsTArray<nsTArray<uint8_t>> reports(count);
+        for (size_t i = 0; i < count; ++i) {
+          auto measurement = Span<const uint16_t>(measurements)
+                                 .Subspan(i * aMeasurementLength,
+                                          aMeasurementLength);
+          if (!GenerateReport(type, leader, helper, measurement, taskID,
+                              aTimePrecision, *reports.AppendElement())) {
+            return DAPReportsPromise::CreateAndReject(NS_ERROR_FAILURE,
+                                                      __func__);
+          }
+        }
+        LOG("Generated %zu DAP reports", count);
+        return DAPReportsPromise::CreateAndResolve(std::move(reports),
+                                                   __func__);
+      })
+      ->Then(
+          GetMainThreadSerialEventTarget(), __func__,
+          [promise](nsTArray<nsTArray<uint8_t>>&& aReports) {
+            promise->MaybeResolve(aReports);
+          },
+          [promise](nsresult aRv) { promise->MaybeReject(aRv); });
+
+  promise.forget(aPromise);
+  return NS_OK;
+}
+
 }  // namespace mozilla
@@ -4,8 +4,11 @@
 #ifndef mozilla_nsIDAPTelemetry_h__
 #define mozilla_nsIDAPTelemetry_h__
 
+#include "nsCOMPtr.h"
 #include "nsIDAPTelemetry.h"
 
+class nsISerialEventTarget;
+
 namespace mozilla {
 
 class DAPTelemetry final : public nsIDAPTelemetry {
@@ -18,6 +21,9 @@ class DAPTelemetry final : public nsIDAPTelemetry {
 
  private:
   ~DAPTelemetry() = default;
+
+  // Created on first use; GetReportsAsync generates reports here.
+  nsCOMPtr<nsISerialEventTarget> mBackgroundQueue;
 };
 
 }  // namespace mozilla
@@ -16,6 +16,7 @@ ChromeUtils.defineLazyGetter(lazy, "logConsole", function () {
 ChromeUtils.defineESModuleGetters(lazy, {
   AsyncShutdown: "resource://gre/modules/AsyncShutdown.sys.mjs",
   NimbusFeatures: "resource://nimbus/ExperimentAPI.sys.mjs",
+  clearTimeout: "resource://gre/modules/Timer.sys.mjs",
   setTimeout: "resource://gre/modules/Timer.sys.mjs",
   ObliviousHTTP: "resource://gre/modules/ObliviousHTTP.sys.mjs",
 });
@@ -43,6 +44,10 @@ XPCOMUtils.defineLazyPreferenceGetter(
   "toolkit.telemetry.dap.helper.hpke"
 );
 
+// How long queued measurements wait for more measurements of the same task
+// before their reports are generated and sent.
+const BATCH_FLUSH_DELAY_MS = 1000;
+
 /**
  * The purpose of this singleton is to handle sending of DAP telemetry data.
  * The current DAP draft standard is available here:
@@ -185,12 +190,9 @@ export const DAPTelemetrySender = new (class {
       const controller = new AbortController();
       lazy.setTimeout(() => controller.abort(), options.timeout ?? 30_000);
 
-      let keys = {
-        leader_hpke: HPKEConfigManager.decodeKey(lazy.gLeaderHpke),
-        helper_hpke: HPKEConfigManager.decodeKey(lazy.gHelperHpke),
-      };
+      let keys = this.getAggregatorKeys();
 
-      let report = this.generateReport(task, measurement, keys);
+      let [report] = await this.generateReports(task, [measurement], keys);
 
       await this.sendReport(
         lazy.gDapEndpoint,
@@ -210,12 +212,136 @@ export const DAPTelemetrySender = new (class {
     }
   }
 
+  /**
+   * Queues a measurement for a task. Measurements queued for the same task
+   * within BATCH_FLUSH_DELAY_MS have their reports generated together off the
+   * main thread, and the reports are then uploaded concurrently.
+   *
+   * @param {Task} task
+   *   Definition of the task for which the measurement was taken.
+   * @param {number|Array<Number>} measurement
+   *   The measured value for which a report is generated.
+   * @param {object} options
+   *   Same as for sendDAPMeasurement.
+   *
+   * @returns Promise
+   * @resolves {undefined} Once the report for this measurement was sent.
+   * @rejects {Error} If generating or sending the report failed.
+   */
+  queueDAPMeasurement(task, measurement, options = {}) {
+    if (!this._pendingBatches) {
+      this._pendingBatches = new Map();
+      lazy.AsyncShutdown.quitApplicationGranted.addBlocker(
+        "DAPTelemetrySender: flushing queued reports",
+        () => this.flushQueuedMeasurements()
+      );
+    }
+
+    let batch = this._pendingBatches.get(task.id);
+    if (!batch) {
+      batch = { task, entries: [] };
+      this._pendingBatches.set(task.id, batch);
+    }
+
+    const { promise, resolve, reject } = Promise.withResolvers();
+    batch.entries.push({ measurement, options, resolve, reject });
+
+    if (!this._flushTimer) {
+      this._flushTimer = lazy.setTimeout(
+        () => this.flushQueuedMeasurements(),
+        BATCH_FLUSH_DELAY_MS
+      );
+    }
+    return promise;
+  }
+
+  /**
+   * Generates and sends the reports for all queued measurements.
+   */
+  async flushQueuedMeasurements() {
+    if (this._flushTimer) {
+      lazy.clearTimeout(this._flushTimer);
+      this._flushTimer = null;
+    }
+    if (!this._pendingBatches?.size) {
+      return;
+    }
+
+    const batches = Array.from(this._pendingBatches.values());
+    this._pendingBatches.clear();
+    await Promise.allSettled(batches.map(batch => this.sendBatch(batch)));
+  }
+
+  async sendBatch({ task, entries }) {
+    let reports;
+    try {
+      let keys = this.getAggregatorKeys();
+      reports = await this.generateReports(
+        task,
+        entries.map(entry => entry.measurement),
+        keys
+      );
+    } catch (e) {
+      lazy.logConsole.error("DAP report generation failed: " + e);
+      entries.forEach(entry => entry.reject(e));
+      return;
+    }
+
+    lazy.logConsole.debug(`Sending ${reports.length} reports for ${task.id}`);
+    await Promise.allSettled(
+      entries.map(async (entry, i) => {
+        const controller = new AbortController();
+        lazy.setTimeout(
+          () => controller.abort(),
+          entry.options.timeout ?? 30_000
+        );
+        try {
+          await this.sendReport(
+            lazy.gDapEndpoint,
+            task.id,
+            reports[i],
+            controller.signal,
+            entry.options
+          );
+          entry.resolve();
+        } catch (e) {
+          entry.reject(e);
+        }
+      })
+    );
+  }
+
   /*
    * @typedef {object} AggregatorKeys
    * @property {Uint8Array} leader_hpke - The leader's DAP HPKE key.
    * @property {Uint8Array} helper_hpke - The helper's DAP HPKE key.
    */
 
+  /**
+   * Returns the configured aggregator keys. They are decoded again only when
+   * the prefs change.
+   *
+   * @returns {AggregatorKeys}
+   */
+  getAggregatorKeys() {
+    const leader = lazy.gLeaderHpke;
+    const helper = lazy.gHelperHpke;
+    if (
+      this._aggregatorKeys?.leader !== leader ||
+      this._aggregatorKeys?.helper !== helper
+    ) {
+      this._aggregatorKeys = {
+        leader,
+        helper,
+        keys: {
+          leader_hpke: HPKEConfigManager.decodeKey(leader),
+          helper_hpke: HPKEConfigManager.decodeKey(helper),
+        },
+      };
+    }
+    return this._aggregatorKeys.keys;
+  }
+
   /**
    * Generates the encrypted DAP report.
    *
@@ -262,6 +388,58 @@ export const DAPTelemetrySender = new (class {
     return new Uint8Array(reportOut.value).buffer;
   }
 
+  /**
+   * Generates the encrypted DAP reports for several measurements of one task.
+   * The reports are generated on a background thread.
+   *
+   * @param {Task} task
+   *   Definition of the task for which the measurements were taken.
+   * @param {Array<number|Array<number>>} measurements
+   *   The measured values. For vector types they must all have the same
+   *   length.
+   * @param {AggregatorKeys} keys
+   *   The DAP encryption keys for each aggregator.
+   *
+   * @returns {Promise<Array<ArrayBuffer>>} One report per measurement.
+   */
+  async generateReports(task, measurements, keys) {
+    let flattened;
+    let length;
+    switch (task.measurement_type) {
+      case "u8":
+        flattened = measurements;
+        length = 1;
+        break;
+      case "vecu8":
+      case "vecu16":
+        length = measurements[0].length;
+        if (measurements.some(m => m.length != length)) {
+          throw new Error(`Measurements for task ${task.id} differ in length`);
+        }
+        flattened = measurements.flatMap(m => Array.from(m));
+        break;
+      default:
+        throw new Error(
+          `Unknown measurement type for task ${task.id}: ${task.measurement_type}`
+        );
+    }
+
+    let task_id = new Uint8Array(
+      ChromeUtils.base64URLDecode(task.id, { padding: "ignore" })
+    );
+
+    let reports = await Services.DAPTelemetry.GetReportsAsync(
+      task.measurement_type,
+      keys.leader_hpke,
+      keys.helper_hpke,
+      flattened,
+      length,
+      task_id,
+      task.time_precision
+    );
+    return reports.map(report => new Uint8Array(report).buffer);
+  }
+
   /**
    * Sends a report to the leader.
    *
@@ -1250,7 +1250,7 @@ NS_IMPL_ISUPPORTS(PageFaultsHardReporter, nsIMemoryReporter)
 
 static size_t HeapOverhead(const jemalloc_stats_t& aStats) {
   return aStats.waste + aStats.bookkeeping + aStats.pages_dirty +
-         aStats.bin_unused;
+         aStats.bin_unused + aStats.thread_cache;
 }
 
 // This has UNITS_PERCENTAGE, so it is multiplied by 100x *again* on top of the
@@ -1310,7 +1310,7 @@ class JemallocHeapReporter final : public nsIMemoryReporter {
         stats.waste,
 "Committed bytes which do not correspond to an active allocation and which the "
 "allocator is not intentionally keeping alive (i.e., not "
-"'heap/{bookkeeping,unused-pages,bin-unused}').");
+"'heap/{bookkeeping,unused-pages,bin-unused,thread-cache}').");
     }
 
     MOZ_COLLECT_REPORT(
@@ -1318,6 +1318,14 @@ class JemallocHeapReporter final : public nsIMemoryReporter {
       stats.bookkeeping,
 "Committed bytes which the heap allocator uses for internal data structures.");
 
+    if (stats.thread_cache > 0) {
+      MOZ_COLLECT_REPORT(
+        "heap/committed/thread-cache", KIND_NONHEAP, UNITS_BYTES,
+        stats.thread_cache,
+"Freed small allocations which threads keep in a cache, so that they can "
+"reuse them without taking a lock.");
+    }
+
     MOZ_COLLECT_REPORT(
       "heap/committed/unused-pages/dirty", KIND_NONHEAP, UNITS_BYTES,
       stats.pages_dirty,
@@ -1353,7 +1361,7 @@ class JemallocHeapReporter final : public nsIMemoryReporter {
 "from the application's resident set.");
 
     {
-      size_t decommitted = stats.mapped - stats.allocated - stats.waste - stats.pages_dirty - stats.pages_fresh - stats.bookkeeping - stats.bin_unused;
+      size_t decommitted = stats.mapped - stats.allocated - stats.waste - stats.pages_dirty - stats.pages_fresh - stats.bookkeeping - stats.bin_unused - stats.thread_cache;
       MOZ_COLLECT_REPORT(
         "heap/decommitted/unmapped", KIND_OTHER, UNITS_BYTES, decommitted,
   "Amount of memory currently mapped but not committed, "
@@ -4,6 +4,7 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <algorithm>
 #include <new>
 #include <stdio.h>
 #include <stdlib.h>
@@ -20,6 +21,16 @@
 #include "mozilla/MemoryReporting.h"
 #include "mozilla/Maybe.h"
 #include "mozilla/ChaosMode.h"
+#include "mozilla/EndianUtils.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define PLDHASHTABLE_GROUP_SSE2
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#  define PLDHASHTABLE_GROUP_NEON
+#  include <arm_neon.h>
+#endif
 
 using namespace mozilla;
 
@@ -113,14 +124,154 @@ static const PLDHashTableOps gStubOps = {
   return &gStubOps;
 }
 
+// Group probing looks at the control bytes of kGroupWidth slots at once.
+// Groups are aligned, so that a probe never straddles two of them.
+static const uint32_t kGroupWidth = 16;
+
+// A control byte is either the low bits of a live slot's hash, below 0x80,
+// or one of these.
+static const uint8_t kControlFree = 0x80;
+static const uint8_t kControlRemoved = 0xfe;
+// Fills the group of tables with fewer slots than a group. It never matches.
+static const uint8_t kControlPadding = 0xff;
+
+static inline uint32_t ControlSize(uint32_t aCapacity) {
+  return std::max(aCapacity, kGroupWidth);
+}
+
 static bool SizeOfEntryStore(uint32_t aCapacity, uint32_t aEntrySize,
-                             uint32_t* aNbytes) {
+                             bool aGroupProbing, uint32_t* aNbytes) {
   uint32_t slotSize = aEntrySize + sizeof(PLDHashNumber);
   uint64_t nbytes64 = uint64_t(aCapacity) * uint64_t(slotSize);
   *aNbytes = aCapacity * slotSize;
+  if (aGroupProbing) {
+    nbytes64 += ControlSize(aCapacity);
+    *aNbytes += ControlSize(aCapacity);
+  }
   return uint64_t(*aNbytes) == nbytes64;  // returns false on overflow
 }
 
+static void InitControl(uint8_t* aControl, uint32_t aCapacity) {
+  memset(aControl, kControlFree, aCapacity);
+  memset(aControl + aCapacity, kControlPadding,
+         ControlSize(aCapacity) - aCapacity);
+}
+
+// The control byte of a live slot. The multiplicative hash leaves the most
+// entropy in the high bits, which select the group, so mix some of them into
+// the low ones.
+static inline uint8_t ControlHash(PLDHashNumber aKeyHash) {
+  return ((aKeyHash ^ (aKeyHash >> 16)) >> 1) & 0x7f;
+}
+
+namespace {
+
+// The slots of a group whose control bytes match something.
+class ControlMatch {
+ public:
+#ifdef PLDHASHTABLE_GROUP_NEON
+  // The NEON matching code produces 4 bits per slot.
+  static const uint32_t kSlotShift = 2;
+#else
+  static const uint32_t kSlotShift = 0;
+#endif
+
+  explicit ControlMatch(uint64_t aBits) : mBits(aBits) {}
+
+  explicit operator bool() const { return mBits != 0; }
+
+  // The index in the group of the first matching slot.
+  uint32_t Lowest() const {
+    MOZ_ASSERT(mBits);
+    return CountTrailingZeroes64(mBits) >> kSlotShift;
+  }
+
+  void RemoveLowest() { mBits &= mBits - 1; }
+
+ private:
+  uint64_t mBits;
+};
+
+// The control bytes of a group, loaded to be matched all at once.
+class ControlGroup {
+ public:
+  explicit ControlGroup(const uint8_t* aControl) {
+#if defined(PLDHASHTABLE_GROUP_SSE2)
+    mControl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(aControl));
+#elif defined(PLDHASHTABLE_GROUP_NEON)
+    mControl = vld1q_u8(aControl);
+#else
+    mControl[0] = LittleEndian::readUint64(aControl);
+    mControl[1] = LittleEndian::readUint64(aControl + 8);
+#endif
+  }
+
+  ControlMatch Match(uint8_t aControl) const {
+#if defined(PLDHASHTABLE_GROUP_SSE2)
+    __m128i match = _mm_set1_epi8(static_cast<char>(aControl));
+    return ControlMatch(_mm_movemask_epi8(_mm_cmpeq_epi8(match, mControl)));
+#elif defined(PLDHASHTABLE_GROUP_NEON)
+    return NarrowNEON(vceqq_u8(mControl, vdupq_n_u8(aControl)));
+#else
+    const uint64_t pattern = kLowBits * aControl;
+    return ControlMatch(MaskSWAR(ZeroBytesSWAR(mControl[0] ^ pattern)) |
+                        (MaskSWAR(ZeroBytesSWAR(mControl[1] ^ pattern)) << 8));
+#endif
+  }
+
+  ControlMatch MatchFree() const { return Match(kControlFree); }
+
+  ControlMatch MatchFreeOrRemoved() const {
+    // These are the only control bytes below kControlPadding when signed.
+#if defined(PLDHASHTABLE_GROUP_SSE2)
+    __m128i padding = _mm_set1_epi8(static_cast<char>(kControlPadding));
+    return ControlMatch(_mm_movemask_epi8(_mm_cmpgt_epi8(padding, mControl)));
+#elif defined(PLDHASHTABLE_GROUP_NEON)
+    return NarrowNEON(
+        vcltq_s8(vreinterpretq_s8_u8(mControl),
+                 vdupq_n_s8(static_cast<int8_t>(kControlPadding))));
+#else
+    // That is, the bytes with their high bit set and their low bit clear.
+    return ControlMatch(
+        MaskSWAR(mControl[0] & ~(mControl[0] << 7) & kHighBits) |
+        (MaskSWAR(mControl[1] & ~(mControl[1] << 7) & kHighBits) << 8));
+#endif
+  }
+
+ private:
+#if defined(PLDHASHTABLE_GROUP_SSE2)
+  __m128i mControl;
+#elif defined(PLDHASHTABLE_GROUP_NEON)
+  static ControlMatch NarrowNEON(uint8x16_t aMatch) {
+    // Narrow each byte to a nibble, and keep a bit per nibble.
+    uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(aMatch), 4);
+    return ControlMatch(vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+                        0x8888888888888888ULL);
+  }
+
+  uint8x16_t mControl;
+#else
+  // Without SIMD instructions, match 8 bytes at a time in 64-bit words.
+  static constexpr uint64_t kLowBits = 0x0101010101010101ULL;
+  static constexpr uint64_t kHighBits = 0x8080808080808080ULL;
+
+  // Sets the high bit of the bytes of aWord that are zero, and only those.
+  static uint64_t ZeroBytesSWAR(uint64_t aWord) {
+    const uint64_t lowSeven = ~kHighBits;
+    return ~(((aWord & lowSeven) + lowSeven) | aWord | lowSeven);
+  }
+
+  // Gathers the high bits of the bytes of aWord into its lowest byte.
+  static uint64_t MaskSWAR(uint64_t aWord) {
+    return ((aWord & kHighBits) * 0x0002040810204081ULL) >> 56;
+  }
+
+  uint64_t mControl[2];
+#endif
+};
+
+}  // namespace
+
 // Compute max and min load numbers (entry counts). We have a secondary max
 // that allows us to overload a table reasonably if it cannot be grown further
 // (i.e. if ChangeTable() fails). The table slows down drastically if the
@@ -162,8 +313,8 @@ static inline void BestCapacity(uint32_t aLength, uint32_t* aCapacityOut,
   *aLog2CapacityOut = log2;
 }
 
-/* static */ MOZ_ALWAYS_INLINE uint32_t
-PLDHashTable::HashShift(uint32_t aEntrySize, uint32_t aLength) {
+/* static */ MOZ_ALWAYS_INLINE uint32_t PLDHashTable::HashShift(
+    uint32_t aEntrySize, uint32_t aLength, bool aGroupProbing) {
   if (aLength > kMaxInitialLength) {
     MOZ_CRASH("Initial length is too large");
   }
@@ -172,7 +323,7 @@ PLDHashTable::HashShift(uint32_t aEntrySize, uint32_t aLength) {
   BestCapacity(aLength, &capacity, &log2);
 
   uint32_t nbytes;
-  if (!SizeOfEntryStore(capacity, aEntrySize, &nbytes)) {
+  if (!SizeOfEntryStore(capacity, aEntrySize, aGroupProbing, &nbytes)) {
     MOZ_CRASH("Initial entry store size is too large");
   }
 
@@ -181,13 +332,14 @@ PLDHashTable::HashShift(uint32_t aEntrySize, uint32_t aLength) {
 }
 
 PLDHashTable::PLDHashTable(const PLDHashTableOps* aOps, uint32_t aEntrySize,
-                           uint32_t aLength)
+                           uint32_t aLength, Probing aProbing)
     : mOps(aOps),
       mGeneration(0),
-      mHashShift(HashShift(aEntrySize, aLength)),
+      mHashShift(HashShift(aEntrySize, aLength, aProbing == Probing::Group)),
       mEntrySize(aEntrySize),
       mEntryCount(0),
-      mRemovedCount(0) {
+      mRemovedCount(0),
+      mGroupProbing(aProbing == Probing::Group) {
   // An entry size greater than 0xff is unlikely, but let's check anyway. If
   // you hit this, your hashtable would waste lots of space for unused entries
   // and you should change your hash table's entries to pointers.
@@ -208,10 +360,11 @@ PLDHashTable& PLDHashTable::operator=(PLDHashTable&& aOther) {
   MOZ_RELEASE_ASSERT(mOps == aOther.mOps || !mOps);
   MOZ_RELEASE_ASSERT(mEntrySize == aOther.mEntrySize || !mEntrySize);
 
-  // Reconstruct |this|.
+  // Reconstruct |this|. The probing goes with the entry store.
   const PLDHashTableOps* ops = aOther.mOps;
   this->~PLDHashTable();
-  new (KnownNotNull, this) PLDHashTable(ops, aOther.mEntrySize, 0);
+  new (KnownNotNull, this)
+      PLDHashTable(ops, aOther.mEntrySize, 0, aOther.GetProbing());
 
   // Move non-const pieces over.
   mHashShift = std::move(aOther.mHashShift);
@@ -303,13 +456,89 @@ void PLDHashTable::ClearAndPrepareForLength(uint32_t aLength) {
   // Get these values before the destructor clobbers them.
   const PLDHashTableOps* ops = mOps;
   uint32_t entrySize = mEntrySize;
+  Probing probing = GetProbing();
 
   this->~PLDHashTable();
-  new (KnownNotNull, this) PLDHashTable(ops, entrySize, aLength);
+  new (KnownNotNull, this) PLDHashTable(ops, entrySize, aLength, probing);
 }
 
 void PLDHashTable::Clear() { ClearAndPrepareForLength(kDefaultInitialLength); }
 
+// Group probing visits the groups starting at the one selected by the high
+// bits of the hash, like Hash1(), moving on by 1, 2, 3... groups, which
+// visits every group of a power-of-two number of them. The search stops at
+// the first group with a free slot, which is why RawRemove() can only free a
+// slot whose group already has a free slot: otherwise a search could stop
+// before getting to a key that was added while the group was full.
+//
+// Slots are only marked removed, never colliding, so live slots cache the
+// key hash as is.
+template <PLDHashTable::SearchReason Reason, typename Success, typename Failure>
+MOZ_ALWAYS_INLINE auto PLDHashTable::SearchGroups(const void* aKey,
+                                                  PLDHashNumber aKeyHash,
+                                                  Success&& aSuccess,
+                                                  Failure&& aFailure) const {
+  const uint8_t* control = Control();
+  const uint8_t controlHash = ControlHash(aKeyHash);
+  const uint32_t groupMask = (ControlSize(Capacity()) / kGroupWidth) - 1;
+  uint32_t group = Hash1(aKeyHash) / kGroupWidth;
+  PLDHashMatchEntry matchEntry = mOps->matchEntry;
+
+  // The first free or removed slot, where Add() will put the new entry. (Only
+  // used if Reason==ForAdd.)
+  Maybe<Slot> firstAvailable;
+
+  for (uint32_t step = 1;; step++) {
+    const uint32_t base = group * kGroupWidth;
+    ControlGroup controls(control + base);
+
+    for (ControlMatch match = controls.Match(controlHash); match;
+         match.RemoveLowest()) {
+      Slot slot = SlotForIndex(base + match.Lowest());
+      if (slot.KeyHash() == aKeyHash && matchEntry(slot.ToEntry(), aKey)) {
+        return aSuccess(slot);
+      }
+    }
+
+    if (Reason == ForAdd && !firstAvailable) {
+      if (ControlMatch available = controls.MatchFreeOrRemoved()) {
+        firstAvailable.emplace(SlotForIndex(base + available.Lowest()));
+      }
+    }
+
+    if (controls.MatchFree()) {
+      if (Reason != ForAdd) {
+        return aFailure();
+      }
+      return aSuccess(*firstAvailable);
+    }
+
+    // The load limits guarantee that some group has a free slot.
+    MOZ_ASSERT(step <= groupMask);
+    group = (group + step) & groupMask;
+  }
+
+  // NOTREACHED
+  return aFailure();
+}
+
+// The group probing version of FindFreeSlot(), with the same assumptions.
+auto PLDHashTable::FindFreeSlotInGroups(PLDHashNumber aKeyHash) const
+    -> Slot {
+  const uint8_t* control = Control();
+  const uint32_t groupMask = (ControlSize(Capacity()) / kGroupWidth) - 1;
+  uint32_t group = Hash1(aKeyHash) / kGroupWidth;
+
+  for (uint32_t step = 1;; step++) {
+    const uint32_t base = group * kGroupWidth;
+    if (ControlMatch available = ControlGroup(control + base).MatchFree()) {
+      return SlotForIndex(base + available.Lowest());
+    }
+    MOZ_ASSERT(step <= groupMask);
+    group = (group + step) & groupMask;
+  }
+}
+
 // If |Reason| is |ForAdd|, the return value is always non-null and it may be
 // a previously-removed entry. If |Reason| is |ForSearchOrRemove|, the return
 // value is null on a miss, and will never be a previously-removed entry on a
@@ -324,6 +553,10 @@ MOZ_ALWAYS_INLINE auto PLDHashTable::SearchTable(const void* aKey,
   MOZ_ASSERT(mEntryStore.IsAllocated());
   NS_ASSERTION(!(aKeyHash & kCollisionFlag), "!(aKeyHash & kCollisionFlag)");
 
+  if (mGroupProbing) {
+    return SearchGroups<Reason>(aKey, aKeyHash, aSuccess, aFailure);
+  }
+
   // Compute the primary hash address.
   PLDHashNumber hash1 = Hash1(aKeyHash);
   Slot slot = SlotForIndex(hash1);
@@ -395,6 +628,10 @@ MOZ_ALWAYS_INLINE auto PLDHashTable::FindFreeSlot(PLDHashNumber aKeyHash) const
   MOZ_ASSERT(mEntryStore.IsAllocated());
   NS_ASSERTION(!(aKeyHash & kCollisionFlag), "!(aKeyHash & kCollisionFlag)");
 
+  if (mGroupProbing) {
+    return FindFreeSlotInGroups(aKeyHash);
+  }
+
   // Compute the primary hash address.
   PLDHashNumber hash1 = Hash1(aKeyHash);
   Slot slot = SlotForIndex(hash1);
@@ -437,7 +674,7 @@ bool PLDHashTable::ChangeTable(int32_t aDeltaLog2) {
   }
 
   uint32_t nbytes;
-  if (!SizeOfEntryStore(newCapacity, mEntrySize, &nbytes)) {
+  if (!SizeOfEntryStore(newCapacity, mEntrySize, mGroupProbing, &nbytes)) {
     return false;  // overflowed
   }
 
@@ -453,6 +690,9 @@ bool PLDHashTable::ChangeTable(int32_t aDeltaLog2) {
   // Assign the new entry store to table.
   char* oldEntryStore = mEntryStore.Get();
   mEntryStore.Set(newEntryStore, &mGeneration);
+  if (mGroupProbing) {
+    InitControl(Control(), newCapacity);
+  }
   PLDHashMoveEntry moveEntry = mOps->moveEntry;
 
   // Copy only live entries, leaving removed ones behind.
@@ -465,6 +705,9 @@ bool PLDHashTable::ChangeTable(int32_t aDeltaLog2) {
           MOZ_ASSERT(newSlot.IsFree());
           moveEntry(this, slot.ToEntry(), newSlot.ToEntry());
           newSlot.SetKeyHash(key);
+          if (mGroupProbing) {
+            SetControl(newSlot, ControlHash(key));
+          }
         }
       });
 
@@ -574,7 +817,20 @@ void PLDHashTable::RawRemove(Slot& aSlot) {
     PLDHashEntryHdr* entry = aSlot.ToEntry();
     mOps->clearEntry(this, entry);
   }
-  if (keyHash & kCollisionFlag) {
+  if (mGroupProbing) {
+    // See SearchGroups() for why a slot can only be freed if its group
+    // already has a free one.
+    uint32_t index = mEntryStore.IndexOfSlot(aSlot);
+    ControlGroup controls(Control() + (index & ~(kGroupWidth - 1)));
+    if (controls.MatchFree()) {
+      aSlot.MarkFree();
+      SetControl(aSlot, kControlFree);
+    } else {
+      aSlot.MarkRemoved();
+      SetControl(aSlot, kControlRemoved);
+      mRemovedCount++;
+    }
+  } else if (keyHash & kCollisionFlag) {
     aSlot.MarkRemoved();
     mRemovedCount++;
   } else {
@@ -625,12 +881,15 @@ mozilla::Maybe<PLDHashTable::EntryHandle> PLDHashTable::MakeEntryHandle(
   if (!mEntryStore.IsAllocated()) {
     uint32_t nbytes;
     // We already checked this in the constructor, so it must still be true.
-    MOZ_RELEASE_ASSERT(
-        SizeOfEntryStore(CapacityFromHashShift(), mEntrySize, &nbytes));
+    MOZ_RELEASE_ASSERT(SizeOfEntryStore(CapacityFromHashShift(), mEntrySize,
+                                        mGroupProbing, &nbytes));
     mEntryStore.Set((char*)calloc(1, nbytes), &mGeneration);
     if (!mEntryStore.IsAllocated()) {
       return Nothing();
     }
+    if (mGroupProbing) {
+      InitControl(Control(), CapacityFromHashShift());
+    }
   }
 
   // If alpha is >= .75, grow or compress the table. If aKey is already in the
@@ -676,7 +935,8 @@ PLDHashTable::EntryHandle PLDHashTable::MakeEntryHandle(const void* aKey) {
     if (!mEntryStore.IsAllocated()) {
       // We OOM'd while allocating the initial entry storage.
       uint32_t nbytes;
-      (void)SizeOfEntryStore(CapacityFromHashShift(), mEntrySize, &nbytes);
+      (void)SizeOfEntryStore(CapacityFromHashShift(), mEntrySize,
+                             mGroupProbing, &nbytes);
       NS_ABORT_OOM(nbytes);
     } else {
       // We failed to resize the existing entry storage, either due to OOM or
@@ -726,9 +986,14 @@ void PLDHashTable::EntryHandle::OccupySlot() {
   PLDHashNumber keyHash = mKeyHash;
   if (mSlot.IsRemoved()) {
     mTable->mRemovedCount--;
-    keyHash |= kCollisionFlag;
+    if (!mTable->mGroupProbing) {
+      keyHash |= kCollisionFlag;
+    }
   }
   mSlot.SetKeyHash(keyHash);
+  if (mTable->mGroupProbing) {
+    mTable->SetControl(mSlot, ControlHash(keyHash));
+  }
   mTable->mEntryCount++;
 }
 
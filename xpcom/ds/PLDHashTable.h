@@ -209,6 +209,13 @@ class Checker {
 // and use it after an add or remove operation, unless you sample Generation()
 // before adding or removing, and compare the sample after, dereferencing the
 // entry pointer only if Generation() has not changed.
+//
+// A table can instead use group probing (see PLDHashTable::Probing), where
+// the slots are split into groups of 16 and a control byte per slot holding
+// a few bits of the slot's hash lets a probe check a whole group at once,
+// with SSE2 or NEON where available. A lookup then mostly touches a single
+// group of control bytes and only calls the matchEntry hook for slots whose
+// hash matches.
 class PLDHashTable {
  private:
   // A slot represents a cached hash value and its associated entry stored in
@@ -299,6 +306,13 @@ class PLDHashTable {
   // Entries may have problems if they contain over-aligned members such as
   // SIMD vector types, but this has not been a problem in practice.
   //
+  // Tables using group probing also have a control byte per slot after the
+  // entries, padded to a whole group for tables smaller than one:
+  //
+  // +-------+-----+-------+--------+-----+--------+-------+-----+-------+
+  // | hash0 | ... | hashN | entry0 | ... | entryN | ctrl0 | ... | ctrlN |
+  // +-------+-----+-------+--------+-----+--------+-------+-----+-------+
+  //
   // Note: It would be natural to store the generation within this class, but
   // we can't do that without bloating sizeof(PLDHashTable) on 64-bit machines.
   // So instead we store it outside this class, and Set() takes a pointer to it
@@ -326,6 +340,16 @@ class PLDHashTable {
     char* Get() const { return mEntryStore; }
     bool IsAllocated() const { return !!mEntryStore; }
 
+    // The control bytes of tables using group probing follow the entries.
+    uint8_t* Control(uint32_t aCapacity, uint32_t aEntrySize) const {
+      return reinterpret_cast<uint8_t*>(Entries(aCapacity) +
+                                        aCapacity * aEntrySize);
+    }
+
+    uint32_t IndexOfSlot(const Slot& aSlot) const {
+      return aSlot.HashPtr() - reinterpret_cast<PLDHashNumber*>(Get());
+    }
+
     Slot SlotForIndex(uint32_t aIndex, uint32_t aEntrySize,
                       uint32_t aCapacity) const {
       char* entries = Entries(aCapacity);
@@ -368,8 +392,8 @@ class PLDHashTable {
   };
 
   // These fields are packed carefully. On 32-bit platforms,
-  // sizeof(PLDHashTable) is 20. On 64-bit platforms, sizeof(PLDHashTable) is
-  // 32; 28 bytes of data followed by 4 bytes of padding for alignment.
+  // sizeof(PLDHashTable) is 24. On 64-bit platforms, sizeof(PLDHashTable) is
+  // 32; 29 bytes of data followed by 3 bytes of padding for alignment.
   const PLDHashTableOps* const mOps;  // Virtual operations; see below.
   EntryStore mEntryStore;             // (Lazy) entry storage and generation.
   uint16_t mGeneration;               // The storage generation.
@@ -377,6 +401,7 @@ class PLDHashTable {
   const uint8_t mEntrySize;           // Number of bytes in an entry.
   uint32_t mEntryCount;               // Number of entries in table.
   uint32_t mRemovedCount;             // Removed entry sentinels in table.
+  const bool mGroupProbing;           // Whether Probing::Group is used.
 
 #ifdef MOZ_HASH_TABLE_CHECKS_ENABLED
   mutable Checker mChecker;
@@ -400,6 +425,17 @@ class PLDHashTable {
   // This gives a default initial capacity of 8.
   static const uint32_t kDefaultInitialLength = 4;
 
+  // How a table looks for a key's slot.
+  //
+  // - Double: probe single slots by double hashing, comparing the cached hash
+  //   of each slot with the key's. This is the default.
+  //
+  // - Group: probe groups of 16 slots, comparing a control byte per slot with
+  //   a few bits of the key's hash, 16 slots at once with SIMD instructions
+  //   where available. This makes misses and lookups in large, busy tables
+  //   cheaper, at the cost of a byte per slot.
+  enum class Probing : uint8_t { Double, Group };
+
   // Initialize the table with |aOps| and |aEntrySize|. The table's initial
   // capacity is chosen such that |aLength| elements can be inserted without
   // rehashing; if |aLength| is a power-of-two, this capacity will be
@@ -409,12 +445,13 @@ class PLDHashTable {
   //
   // This will crash if |aEntrySize| and/or |aLength| are too large.
   PLDHashTable(const PLDHashTableOps* aOps, uint32_t aEntrySize,
-               uint32_t aLength = kDefaultInitialLength);
+               uint32_t aLength = kDefaultInitialLength,
+               Probing aProbing = Probing::Double);
 
   PLDHashTable(PLDHashTable&& aOther)
       // Initialize fields which are checked by the move assignment operator
       // and the destructor (which the move assignment operator calls).
-      : mOps(nullptr), mGeneration(0), mEntrySize(0) {
+      : mOps(nullptr), mGeneration(0), mEntrySize(0), mGroupProbing(false) {
     *this = std::move(aOther);
   }
 
@@ -435,6 +472,9 @@ class PLDHashTable {
   uint32_t EntrySize() const { return mEntrySize; }
   uint32_t EntryCount() const { return mEntryCount; }
   uint32_t Generation() const { return mGeneration; }
+  Probing GetProbing() const {
+    return mGroupProbing ? Probing::Group : Probing::Double;
+  }
 
   // To search for a |key| in |table|, call:
   //
@@ -700,7 +740,8 @@ class PLDHashTable {
   }
 
  private:
-  static uint32_t HashShift(uint32_t aEntrySize, uint32_t aLength);
+  static uint32_t HashShift(uint32_t aEntrySize, uint32_t aLength,
+                            bool aGroupProbing);
 
   static const PLDHashNumber kCollisionFlag = 1;
 
@@ -729,6 +770,19 @@ class PLDHashTable {
 
   Slot FindFreeSlot(PLDHashNumber aKeyHash) const;
 
+  // The group probing counterparts of SearchTable() and FindFreeSlot().
+  template <SearchReason Reason, typename PLDSuccess, typename PLDFailure>
+  auto SearchGroups(const void* aKey, PLDHashNumber aKeyHash,
+                    PLDSuccess&& aSucess, PLDFailure&& aFailure) const;
+  Slot FindFreeSlotInGroups(PLDHashNumber aKeyHash) const;
+
+  uint8_t* Control() const {
+    return mEntryStore.Control(CapacityFromHashShift(), mEntrySize);
+  }
+  void SetControl(const Slot& aSlot, uint8_t aControl) {
+    Control()[mEntryStore.IndexOfSlot(aSlot)] = aControl;
+  }
+
   bool ChangeTable(int aDeltaLog2);
 
   void RawRemove(Slot& aSlot);
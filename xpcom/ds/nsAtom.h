@@ -200,7 +200,9 @@ class nsDynamicAtom : public nsAtom {
   static nsDynamicAtom* Create(const nsAString& aString, uint32_t aHash);
   static void Destroy(nsDynamicAtom* aAtom);
 
-  mozilla::ThreadSafeAutoRefCnt mRefCnt;
+  // Not a ThreadSafeAutoRefCnt, because lock-free atomization needs to
+  // compare-and-swap it. See nsAtomTable::AtomizeLockFree().
+  mozilla::Atomic<nsrefcnt, mozilla::ReleaseAcquire> mRefCnt;
   RefPtr<mozilla::StringBuffer> mStringBuffer;
 };
 
@@ -7,10 +7,14 @@
 #include "mozilla/Assertions.h"
 #include "mozilla/Attributes.h"
 #include "mozilla/HashFunctions.h"
+#include "mozilla/MathAlgorithms.h"
 #include "mozilla/MemoryReporting.h"
 #include "mozilla/MruCache.h"
+#include "mozilla/Mutex.h"
 #include "mozilla/RWLock.h"
 #include "mozilla/TextUtils.h"
+#include "mozilla/ThreadLocal.h"
+#include "mozilla/UniquePtr.h"
 #include "nsHashKeys.h"
 #include "nsThreadUtils.h"
 
@@ -19,8 +23,8 @@
 #include "nsGkAtoms.h"
 #include "nsPrintfCString.h"
 #include "nsString.h"
+#include "nsTArray.h"
 #include "nsUnicharUtils.h"
-#include "PLDHashTable.h"
 #include "prenv.h"
 
 // There are two kinds of atoms handled by this module.
@@ -31,6 +35,8 @@
 //   When that counter reaches a certain threshold, we iterate over the atom
 //   table, removing and deleting dynamic atoms with refcount zero. This allows
 //   us to avoid acquiring the atom table lock during normal refcounting.
+//   Atomizing a string whose atom is already in use doesn't acquire it either,
+//   see nsAtomSubTable.
 //
 // - Static: both the atom and its chars are statically allocated and
 //   immutable, so it ignores all AddRef/Release calls.
@@ -165,13 +171,6 @@ struct AtomTableKey {
   uint32_t mHash;
 };
 
-struct AtomTableEntry : public PLDHashEntryHdr {
-  // These references are either to dynamic atoms, in which case they are
-  // non-owning, or they are to static atoms, which aren't really refcounted.
-  // See the comment at the top of this file for more details.
-  nsAtom* MOZ_NON_OWNING_REF mAtom;
-};
-
 struct AtomCache : public MruCache<AtomTableKey, nsAtom*, AtomCache> {
   static HashNumber Hash(const AtomTableKey& aKey) { return aKey.mHash; }
   static bool Match(const AtomTableKey& aKey, const nsAtom* aVal) {
@@ -184,6 +183,44 @@ struct AtomCache : public MruCache<AtomTableKey, nsAtom*, AtomCache> {
 static AtomCache sRecentlyUsedSmallMainThreadAtoms;
 static AtomCache sRecentlyUsedLargeMainThreadAtoms;
 
+// The value of the slots of removed atoms, which lookups probe past and
+// insertions reuse.
+static nsAtom* RemovedAtom() { return reinterpret_cast<nsAtom*>(uintptr_t(1)); }
+
+struct AtomTableSlot {
+  // Set before mAtom, so that readers who see an atom see its hash.
+  Atomic<uint32_t, Relaxed> mHash;
+  // These references are either to dynamic atoms, in which case they are
+  // non-owning, or they are to static atoms, which aren't really refcounted.
+  // See the comment at the top of this file for more details.
+  Atomic<nsAtom*> mAtom;
+};
+
+// The entries of a subtable, as an open-addressed array that is probed
+// linearly. A slot only goes from empty to holding an atom, and from holding
+// an atom to removed and back, so readers that race with a writer always
+// reach an empty slot, and find every atom that stays in the array while they
+// probe it.
+struct AtomTableArray {
+  explicit AtomTableArray(uint32_t aCapacity)
+      : mCapacity(aCapacity),
+        mHashShift(32 - FloorLog2(aCapacity)),
+        mSlots(MakeUnique<AtomTableSlot[]>(aCapacity)) {
+    MOZ_ASSERT(IsPowerOfTwo(aCapacity));
+  }
+
+  // Like PLDHashTable, start from the leftmost bits of the hash. See
+  // nsAtomTable::SelectSubTable().
+  uint32_t StartIndex(uint32_t aHash) const { return aHash >> mHashShift; }
+  uint32_t NextIndex(uint32_t aIndex) const {
+    return (aIndex + 1) & (mCapacity - 1);
+  }
+
+  const uint32_t mCapacity;
+  const uint32_t mHashShift;
+  UniquePtr<AtomTableSlot[]> mSlots;
+};
+
 // In order to reduce locking contention for concurrent atomization, we segment
 // the atom table into N subtables, each with a separate lock. If the hash
 // values we use to select the subtable are evenly distributed, this reduces the
@@ -191,31 +228,47 @@ static AtomCache sRecentlyUsedLargeMainThreadAtoms;
 //
 // NB: This is somewhat similar to the technique used by Java's
 // ConcurrentHashTable.
+//
+// On top of that, atomizing a string whose atom already exists and is in use
+// doesn't take the lock at all, since parallel style and HTML parsing do it
+// constantly. The subtable's array is only modified and replaced with mLock
+// held for writing, and is read without it from within an
+// AutoLockFreeAtomRead. Such readers only take a reference to atoms whose
+// refcount is already non-zero, so that going from zero to non-zero still
+// happens with the lock held, which GC relies on. Arrays replaced when a
+// subtable grows or shrinks and atoms removed by GC may still be in use by
+// these readers, so they are retired and only freed by a later GC, once
+// every reader that could have seen them is done. See
+// nsAtomTable::TryReclaimRetired().
 class nsAtomSubTable {
   friend class nsAtomTable;
   mozilla::RWLock mLock;
-  PLDHashTable mTable;
+  Atomic<AtomTableArray*> mArray;
+  uint32_t mEntryCount MOZ_GUARDED_BY(mLock);
+  uint32_t mRemovedCount MOZ_GUARDED_BY(mLock);
   nsAtomSubTable();
-  void GCLocked(GCKind aKind) MOZ_REQUIRES(mLock);
+  ~nsAtomSubTable();
+  void GCLocked(GCKind aKind, nsTArray<nsDynamicAtom*>& aRemoved)
+      MOZ_REQUIRES(mLock);
   void AddSizeOfExcludingThisLocked(MallocSizeOf aMallocSizeOf,
                                     AtomsSizes& aSizes)
       MOZ_REQUIRES_SHARED(mLock);
 
-  AtomTableEntry* Search(AtomTableKey& aKey) const MOZ_REQUIRES_SHARED(mLock) {
-    // XXX There's no LockedForReadingByCurrentThread();
-    return static_cast<AtomTableEntry*>(mTable.Search(&aKey));
-  }
+  // Requires either mLock, or an AutoLockFreeAtomRead.
+  nsAtom* Search(const AtomTableKey& aKey) const;
 
-  AtomTableEntry* Add(AtomTableKey& aKey) MOZ_REQUIRES(mLock) {
-    MOZ_ASSERT(mLock.LockedForWritingByCurrentThread());
-    return static_cast<AtomTableEntry*>(mTable.Add(&aKey));  // Infallible
-  }
+  void Add(const AtomTableKey& aKey, nsAtom* aAtom) MOZ_REQUIRES(mLock);
+
+  // Moves the atoms to a new array with room for aLength of them, and retires
+  // the current one.
+  void ResizeLocked(uint32_t aLength) MOZ_REQUIRES(mLock);
 };
 
 // The outer atom table, which coordinates access to the inner array of
 // subtables.
 class nsAtomTable {
  public:
+  ~nsAtomTable();
   nsAtomSubTable& SelectSubTable(AtomTableKey& aKey);
   void AddSizeOfIncludingThis(MallocSizeOf aMallocSizeOf, AtomsSizes& aSizes);
   void GC(GCKind aKind);
@@ -226,16 +279,14 @@ class nsAtomTable {
   nsStaticAtom* GetStaticAtom(const nsAString& aUTF16String);
   void RegisterStaticAtoms(const nsStaticAtom* aAtoms, size_t aAtomsLen);
 
+  // Called by subtables with the arrays they replace.
+  void RetireArray(AtomTableArray* aArray);
+
   // The result of this function may be imprecise if other threads are operating
   // on atoms concurrently. It's also slow, since it triggers a GC before
   // counting.
   size_t RacySlowCount();
 
-  // This hash table op is a static member of this class so that it can take
-  // advantage of |friend| declarations.
-  static void AtomTableClearEntry(PLDHashTable* aTable,
-                                  PLDHashEntryHdr* aEntry);
-
   // We achieve measurable reduction in locking contention in parallel CSS
   // parsing by increasing the number of subtables up to 128. This has been
   // measured to have neglible impact on the performance of initialization, GC,
@@ -278,6 +329,8 @@ class nsAtomTable {
   // (~2700), divide that across the N subtables, and the largest capacity that
   // will allow each subtable to be > 25% full with that count.
   //
+  // (Subtables only shrink during GC, but the same reasoning applies.)
+  //
   // So want an initial subtable capacity less than (2700 / N) * 4 = 10800 / N.
   // Rounding down to the nearest power of two gives us 8192 / N. Since the
   // capacity is double the initial length, we end up with (4096 / N) per
@@ -285,45 +338,87 @@ class nsAtomTable {
   constexpr static size_t kInitialSubTableSize = 4096 / kNumSubTables;
 
  private:
+  // Returns a new reference to the atom for aKey without taking any lock, or
+  // null if it isn't in aTable or its refcount is zero.
+  already_AddRefed<nsAtom> AtomizeLockFree(nsAtomSubTable& aTable,
+                                           const AtomTableKey& aKey);
+
+  void RetireAtoms(nsTArray<nsDynamicAtom*>&& aAtoms);
+
+  // Frees what was retired during the previous epoch and moves on to the next
+  // one, if no lock-free reader is left from the previous epoch. Returns
+  // whether it did.
+  bool TryReclaimRetired();
+
   nsAtomSubTable mSubTables[kNumSubTables];
+
+  // Arrays and atoms that lock-free readers may still be using, indexed by the
+  // parity of the epoch they were retired in.
+  Mutex mRetiredLock{"Atom Table Retired Lock"};
+  nsTArray<UniquePtr<AtomTableArray>> mRetiredArrays[2]
+      MOZ_GUARDED_BY(mRetiredLock);
+  nsTArray<nsDynamicAtom*> mRetiredAtoms[2] MOZ_GUARDED_BY(mRetiredLock);
 };
 
 // Static singleton instance for the atom table.
 static nsAtomTable* gAtomTable;
 
-static PLDHashNumber AtomTableGetHash(const void* aKey) {
-  const AtomTableKey* k = static_cast<const AtomTableKey*>(aKey);
-  return k->mHash;
-}
-
-static bool AtomTableMatchKey(const PLDHashEntryHdr* aEntry, const void* aKey) {
-  const AtomTableEntry* he = static_cast<const AtomTableEntry*>(aEntry);
-  const AtomTableKey* k = static_cast<const AtomTableKey*>(aKey);
-
-  if (k->mUTF8String) {
+static bool AtomTableMatchKey(const nsAtom* aAtom, const AtomTableKey& aKey) {
+  if (aKey.mUTF8String) {
     bool err = false;
-    return (CompareUTF8toUTF16(nsDependentCSubstring(
-                                   k->mUTF8String, k->mUTF8String + k->mLength),
-                               nsDependentAtomString(he->mAtom), &err) == 0) &&
+    return (CompareUTF8toUTF16(
+                nsDependentCSubstring(aKey.mUTF8String,
+                                      aKey.mUTF8String + aKey.mLength),
+                nsDependentAtomString(aAtom), &err) == 0) &&
            !err;
   }
 
-  return he->mAtom->Equals(k->mUTF16String, k->mLength);
+  return aAtom->Equals(aKey.mUTF16String, aKey.mLength);
 }
 
-void nsAtomTable::AtomTableClearEntry(PLDHashTable* aTable,
-                                      PLDHashEntryHdr* aEntry) {
-  auto* entry = static_cast<AtomTableEntry*>(aEntry);
-  entry->mAtom = nullptr;
-}
+// Lock-free readers count themselves in one of these stripes, assigned to
+// their thread on first use, for the parity of the epoch they started reading
+// in. Things are retired with the parity of the current epoch, and
+// nsAtomTable::TryReclaimRetired() only advances the epoch once the stripes
+// count no reader for the previous one. So once it has advanced twice since
+// something was retired, every reader that could have seen it is done.
+//
+// Stripes keep readers on different threads from contending on the same cache
+// line, which is the point of not taking the subtable locks.
+static constexpr uint32_t kNumReaderStripes = 64;
 
-static void AtomTableInitEntry(PLDHashEntryHdr* aEntry, const void* aKey) {
-  static_cast<AtomTableEntry*>(aEntry)->mAtom = nullptr;
-}
+struct alignas(64) AtomTableReaderStripe {
+  Atomic<uint32_t> mReaders[2];
+};
 
-static const PLDHashTableOps AtomTableOps = {
-    AtomTableGetHash, AtomTableMatchKey, PLDHashTable::MoveEntryStub,
-    nsAtomTable::AtomTableClearEntry, AtomTableInitEntry};
+static AtomTableReaderStripe sReaderStripes[kNumReaderStripes];
+static Atomic<uint32_t> sReadEpoch;
+static Atomic<uint32_t, Relaxed> sNextReaderStripe;
+// One more than the index of the current thread's stripe, or zero if it
+// hasn't been assigned one yet.
+static MOZ_THREAD_LOCAL(uint32_t) sReaderStripe;
+
+// Subtable arrays and the atoms in them that are read within the scope of this
+// aren't freed before it ends. The stripe counters, the epoch, the arrays and
+// their slots are all sequentially consistent atomics, so that a reader GC
+// doesn't see in its stripe can't see what GC unpublished before looking.
+class MOZ_RAII AutoLockFreeAtomRead {
+ public:
+  AutoLockFreeAtomRead() {
+    uint32_t stripe = sReaderStripe.get();
+    if (MOZ_UNLIKELY(!stripe)) {
+      stripe = sNextReaderStripe++ % kNumReaderStripes + 1;
+      sReaderStripe.set(stripe);
+    }
+    mReaders = &sReaderStripes[stripe - 1].mReaders[sReadEpoch & 1];
+    ++*mReaders;
+  }
+
+  ~AutoLockFreeAtomRead() { --*mReaders; }
+
+ private:
+  Atomic<uint32_t>* mReaders;
+};
 
 nsAtomSubTable& nsAtomTable::SelectSubTable(AtomTableKey& aKey) {
   // There are a few considerations around how we select subtables.
@@ -337,9 +432,9 @@ nsAtomSubTable& nsAtomTable::SelectSubTable(AtomTableKey& aKey) {
   // entry's position within the subtable. If we used the exact same bits used
   // by the subtables, then each subtable would compute the same position for
   // every entry it observes, leading to pessimal performance. In this case,
-  // we're using PLDHashTable, whose primary hash function uses the N leftmost
-  // bits of the hash value (where N is the log2 capacity of the table). This
-  // means we should prefer the rightmost bits here.
+  // the subtables start probing at the N leftmost bits of the hash value (where
+  // N is the log2 capacity of the table). This means we should prefer the
+  // rightmost bits here.
   //
   // Note that the below is equivalent to mHash % kNumSubTables, a replacement
   // which an optimizing compiler should make, but let's avoid any doubt.
@@ -356,6 +451,20 @@ void nsAtomTable::AddSizeOfIncludingThis(MallocSizeOf aMallocSizeOf,
     AutoReadLock lock(table.mLock);
     table.AddSizeOfExcludingThisLocked(aMallocSizeOf, aSizes);
   }
+
+  MutexAutoLock lock(mRetiredLock);
+  for (size_t i = 0; i < 2; i++) {
+    aSizes.mTable +=
+        mRetiredArrays[i].ShallowSizeOfExcludingThis(aMallocSizeOf) +
+        mRetiredAtoms[i].ShallowSizeOfExcludingThis(aMallocSizeOf);
+    for (const auto& array : mRetiredArrays[i]) {
+      aSizes.mTable +=
+          aMallocSizeOf(array.get()) + aMallocSizeOf(array->mSlots.get());
+    }
+    for (nsDynamicAtom* atom : mRetiredAtoms[i]) {
+      atom->AddSizeOfIncludingThis(aMallocSizeOf, aSizes);
+    }
+  }
 }
 
 void nsAtomTable::GC(GCKind aKind) {
@@ -365,9 +474,17 @@ void nsAtomTable::GC(GCKind aKind) {
 
   // Note that this is effectively an incremental GC, since only one subtable
   // is locked at a time.
+  nsTArray<nsDynamicAtom*> removed;
   for (auto& table : mSubTables) {
     AutoWriteLock lock(table.mLock);
-    table.GCLocked(aKind);
+    table.GCLocked(aKind, removed);
+  }
+
+  // Free what was retired before, and then what was just removed, unless
+  // lock-free readers are still around.
+  RetireAtoms(std::move(removed));
+  if (TryReclaimRetired()) {
+    TryReclaimRetired();
   }
 
   // We would like to assert that gUnusedAtomCount matches the number of atoms
@@ -394,13 +511,62 @@ void nsAtomTable::GC(GCKind aKind) {
                 nsDynamicAtom::gUnusedAtomCount == 0);
 }
 
+void nsAtomTable::RetireArray(AtomTableArray* aArray) {
+  MutexAutoLock lock(mRetiredLock);
+  mRetiredArrays[sReadEpoch & 1].AppendElement(WrapUnique(aArray));
+}
+
+void nsAtomTable::RetireAtoms(nsTArray<nsDynamicAtom*>&& aAtoms) {
+  MOZ_ASSERT(NS_IsMainThread());
+  MutexAutoLock lock(mRetiredLock);
+  mRetiredAtoms[sReadEpoch & 1].AppendElements(std::move(aAtoms));
+}
+
+bool nsAtomTable::TryReclaimRetired() {
+  MOZ_ASSERT(NS_IsMainThread());
+
+  nsTArray<UniquePtr<AtomTableArray>> arrays;
+  nsTArray<nsDynamicAtom*> atoms;
+  {
+    // Holding the lock keeps anything from being retired while we check the
+    // readers, which would then be freed too early.
+    MutexAutoLock lock(mRetiredLock);
+    uint32_t epoch = sReadEpoch;
+    uint32_t previous = (epoch - 1) & 1;
+    for (auto& stripe : sReaderStripes) {
+      if (stripe.mReaders[previous]) {
+        return false;
+      }
+    }
+    arrays = std::move(mRetiredArrays[previous]);
+    atoms = std::move(mRetiredAtoms[previous]);
+    sReadEpoch = epoch + 1;
+  }
+
+  for (nsDynamicAtom* atom : atoms) {
+    MOZ_ASSERT(atom->mRefCnt == 0, "Retired atoms can't be resurrected");
+    nsDynamicAtom::Destroy(atom);
+  }
+  return true;
+}
+
+nsAtomTable::~nsAtomTable() {
+  // No reader is left by now.
+  MutexAutoLock lock(mRetiredLock);
+  for (auto& atoms : mRetiredAtoms) {
+    for (nsDynamicAtom* atom : atoms) {
+      nsDynamicAtom::Destroy(atom);
+    }
+  }
+}
+
 size_t nsAtomTable::RacySlowCount() {
   // Trigger a GC so that the result is deterministic modulo other threads.
   GC(GCKind::RegularOperation);
   size_t count = 0;
   for (auto& table : mSubTables) {
     AutoReadLock lock(table.mLock);
-    count += table.mTable.EntryCount();
+    count += table.mEntryCount;
   }
 
   return count;
@@ -408,26 +574,113 @@ size_t nsAtomTable::RacySlowCount() {
 
 nsAtomSubTable::nsAtomSubTable()
     : mLock("Atom Sub-Table Lock"),
-      mTable(&AtomTableOps, sizeof(AtomTableEntry),
-             nsAtomTable::kInitialSubTableSize) {}
+      mArray(new AtomTableArray(nsAtomTable::kInitialSubTableSize * 2)),
+      mEntryCount(0),
+      mRemovedCount(0) {}
+
+nsAtomSubTable::~nsAtomSubTable() {
+  AtomTableArray* array = mArray;
+  delete array;
+}
+
+nsAtom* nsAtomSubTable::Search(const AtomTableKey& aKey) const {
+  const AtomTableArray* array = mArray;
+  uint32_t index = array->StartIndex(aKey.mHash);
+  for (uint32_t i = 0; i < array->mCapacity; i++) {
+    const AtomTableSlot& slot = array->mSlots[index];
+    nsAtom* atom = slot.mAtom;
+    if (!atom) {
+      break;
+    }
+    if (atom != RemovedAtom() && slot.mHash == aKey.mHash &&
+        AtomTableMatchKey(atom, aKey)) {
+      return atom;
+    }
+    index = array->NextIndex(index);
+  }
+  return nullptr;
+}
+
+void nsAtomSubTable::Add(const AtomTableKey& aKey, nsAtom* aAtom) {
+  MOZ_ASSERT(mLock.LockedForWritingByCurrentThread());
+  MOZ_ASSERT(!Search(aKey));
+  MOZ_ASSERT(aAtom->hash() == aKey.mHash);
+
+  // Keep a quarter of the slots empty, so that probes stay short. Removed
+  // slots count as used, since lookups probe past them.
+  AtomTableArray* array = mArray;
+  if ((mEntryCount + mRemovedCount + 1) * 4 > array->mCapacity * 3) {
+    ResizeLocked(mEntryCount + 1);
+    array = mArray;
+  }
+
+  uint32_t index = array->StartIndex(aKey.mHash);
+  while (true) {
+    AtomTableSlot& slot = array->mSlots[index];
+    nsAtom* atom = slot.mAtom;
+    if (!atom || atom == RemovedAtom()) {
+      if (atom) {
+        mRemovedCount--;
+      }
+      slot.mHash = aKey.mHash;
+      slot.mAtom = aAtom;
+      mEntryCount++;
+      return;
+    }
+    index = array->NextIndex(index);
+  }
+}
 
-void nsAtomSubTable::GCLocked(GCKind aKind) {
+void nsAtomSubTable::ResizeLocked(uint32_t aLength) {
+  MOZ_ASSERT(mLock.LockedForWritingByCurrentThread());
+
+  // Like PLDHashTable, make the capacity double the length.
+  uint32_t length =
+      std::max(aLength, uint32_t(nsAtomTable::kInitialSubTableSize));
+  AtomTableArray* oldArray = mArray;
+  auto* newArray = new AtomTableArray(uint32_t(RoundUpPow2(length * 2)));
+  for (uint32_t i = 0; i < oldArray->mCapacity; i++) {
+    const AtomTableSlot& oldSlot = oldArray->mSlots[i];
+    nsAtom* atom = oldSlot.mAtom;
+    if (!atom || atom == RemovedAtom()) {
+      continue;
+    }
+    uint32_t index = newArray->StartIndex(oldSlot.mHash);
+    while (newArray->mSlots[index].mAtom) {
+      index = newArray->NextIndex(index);
+    }
+    newArray->mSlots[index].mHash = oldSlot.mHash;
+    newArray->mSlots[index].mAtom = atom;
+  }
+
+  mRemovedCount = 0;
+  mArray = newArray;
+  gAtomTable->RetireArray(oldArray);
+}
+
+void nsAtomSubTable::GCLocked(GCKind aKind,
+                              nsTArray<nsDynamicAtom*>& aRemoved) {
   MOZ_ASSERT(NS_IsMainThread());
   MOZ_ASSERT(mLock.LockedForWritingByCurrentThread());
 
   int32_t removedCount = 0;  // A non-atomic temporary for cheaper increments.
   nsAutoCString nonZeroRefcountAtoms;
   uint32_t nonZeroRefcountAtomsCount = 0;
-  for (auto i = mTable.Iter(); !i.Done(); i.Next()) {
-    auto* entry = static_cast<AtomTableEntry*>(i.Get());
-    if (entry->mAtom->IsStatic()) {
+  AtomTableArray* array = mArray;
+  for (uint32_t i = 0; i < array->mCapacity; i++) {
+    AtomTableSlot& slot = array->mSlots[i];
+    nsAtom* atom = slot.mAtom;
+    if (!atom || atom == RemovedAtom() || atom->IsStatic()) {
       continue;
     }
 
-    nsAtom* atom = entry->mAtom;
     if (atom->IsDynamic() && atom->AsDynamic()->mRefCnt == 0) {
-      i.Remove();
-      nsDynamicAtom::Destroy(atom->AsDynamic());
+      // Lock-free readers may still be looking at the atom, so it is only
+      // destroyed once they are done.
+      slot.mAtom = RemovedAtom();
+      mEntryCount--;
+      mRemovedCount++;
+      aRemoved.AppendElement(atom->AsDynamic());
       ++removedCount;
     }
 #ifdef NS_FREE_PERMANENT_DATA
@@ -455,6 +708,12 @@ void nsAtomSubTable::GCLocked(GCKind aKind) {
   }
 
   nsDynamicAtom::gUnusedAtomCount -= removedCount;
+
+  // Give memory back after a spike of atoms.
+  if (array->mCapacity > nsAtomTable::kInitialSubTableSize * 2 &&
+      mEntryCount * 4 < array->mCapacity) {
+    ResizeLocked(mEntryCount);
+  }
 }
 
 void nsDynamicAtom::GCAtomTable() {
@@ -473,6 +732,10 @@ void NS_InitAtomTable() {
   MOZ_ASSERT(NS_IsMainThread());
   MOZ_ASSERT(!gAtomTable);
 
+  if (!sReaderStripe.init()) {
+    MOZ_CRASH();
+  }
+
   // We register static atoms immediately so they're available for use as early
   // as possible.
   gAtomTable = new nsAtomTable();
@@ -502,10 +765,13 @@ void NS_AddSizeOfAtoms(MallocSizeOf aMallocSizeOf, AtomsSizes& aSizes) {
 
 void nsAtomSubTable::AddSizeOfExcludingThisLocked(MallocSizeOf aMallocSizeOf,
                                                   AtomsSizes& aSizes) {
-  aSizes.mTable += mTable.ShallowSizeOfExcludingThis(aMallocSizeOf);
-  for (auto iter = mTable.Iter(); !iter.Done(); iter.Next()) {
-    auto* entry = static_cast<AtomTableEntry*>(iter.Get());
-    entry->mAtom->AddSizeOfIncludingThis(aMallocSizeOf, aSizes);
+  const AtomTableArray* array = mArray;
+  aSizes.mTable += aMallocSizeOf(array) + aMallocSizeOf(array->mSlots.get());
+  for (uint32_t i = 0; i < array->mCapacity; i++) {
+    nsAtom* atom = array->mSlots[i].mAtom;
+    if (atom && atom != RemovedAtom()) {
+      atom->AddSizeOfIncludingThis(aMallocSizeOf, aSizes);
+    }
   }
 }
 
@@ -529,8 +795,7 @@ void nsAtomTable::RegisterStaticAtoms(const nsStaticAtom* aAtoms,
     AtomTableKey key(atom);
     nsAtomSubTable& table = SelectSubTable(key);
     AutoWriteLock lock(table.mLock);
-    AtomTableEntry* he = table.Add(key);
-    if (he->mAtom) {
+    if (nsAtom* existing = table.Search(key)) {
       // There are two ways we could get here.
       // - Register two static atoms with the same string.
       // - Create a dynamic atom and then register a static atom with the same
@@ -538,13 +803,34 @@ void nsAtomTable::RegisterStaticAtoms(const nsStaticAtom* aAtoms,
       // Both cases can cause subtle bugs, and are disallowed. We're
       // programming in C++ here, not Smalltalk.
       nsAutoCString name;
-      he->mAtom->ToUTF8String(name);
+      existing->ToUTF8String(name);
       MOZ_CRASH_UNSAFE_PRINTF("Atom for '%s' already exists", name.get());
     }
-    he->mAtom = const_cast<nsStaticAtom*>(atom);
+    table.Add(key, const_cast<nsStaticAtom*>(atom));
   }
 }
 
+already_AddRefed<nsAtom> nsAtomTable::AtomizeLockFree(
+    nsAtomSubTable& aTable, const AtomTableKey& aKey) {
+  AutoLockFreeAtomRead read;
+  nsAtom* atom = aTable.Search(aKey);
+  if (!atom) {
+    return nullptr;
+  }
+  if (atom->IsStatic()) {
+    return dont_AddRef(atom);
+  }
+
+  // Only add a reference if there already is one, see nsAtomSubTable.
+  auto& refCnt = atom->AsDynamic()->mRefCnt;
+  for (nsrefcnt count = refCnt; count; count = refCnt) {
+    if (refCnt.compareExchange(count, count + 1)) {
+      return dont_AddRef(atom);
+    }
+  }
+  return nullptr;
+}
+
 already_AddRefed<nsAtom> NS_Atomize(const char* aUTF8String) {
   MOZ_ASSERT(gAtomTable);
   return gAtomTable->Atomize(nsDependentCString(aUTF8String));
@@ -562,18 +848,19 @@ already_AddRefed<nsAtom> nsAtomTable::Atomize(const nsACString& aUTF8String) {
     return Atomize(str, HashString(str));
   }
   nsAtomSubTable& table = SelectSubTable(key);
+  if (RefPtr<nsAtom> atom = AtomizeLockFree(table, key)) {
+    return atom.forget();
+  }
   {
     AutoReadLock lock(table.mLock);
-    if (AtomTableEntry* he = table.Search(key)) {
-      return do_AddRef(he->mAtom);
+    if (nsAtom* atom = table.Search(key)) {
+      return do_AddRef(atom);
     }
   }
 
   AutoWriteLock lock(table.mLock);
-  AtomTableEntry* he = table.Add(key);
-
-  if (he->mAtom) {
-    return do_AddRef(he->mAtom);
+  if (nsAtom* atom = table.Search(key)) {
+    return do_AddRef(atom);
   }
 
   nsString str;
@@ -581,7 +868,7 @@ already_AddRefed<nsAtom> nsAtomTable::Atomize(const nsACString& aUTF8String) {
   MOZ_ASSERT(str.GetStringBuffer(), "Should create a string buffer");
   RefPtr<nsAtom> atom = dont_AddRef(nsDynamicAtom::Create(str, key.mHash));
 
-  he->mAtom = atom;
+  table.Add(key, atom);
 
   return atom.forget();
 }
@@ -599,23 +886,23 @@ already_AddRefed<nsAtom> nsAtomTable::Atomize(const nsAString& aUTF16String,
                                               uint32_t aHash) {
   AtomTableKey key(aUTF16String.Data(), aUTF16String.Length(), aHash);
   nsAtomSubTable& table = SelectSubTable(key);
+  if (RefPtr<nsAtom> atom = AtomizeLockFree(table, key)) {
+    return atom.forget();
+  }
   {
     AutoReadLock lock(table.mLock);
-    if (AtomTableEntry* he = table.Search(key)) {
-      return do_AddRef(he->mAtom);
+    if (nsAtom* atom = table.Search(key)) {
+      return do_AddRef(atom);
     }
   }
   AutoWriteLock lock(table.mLock);
-  AtomTableEntry* he = table.Add(key);
-
-  if (he->mAtom) {
-    RefPtr<nsAtom> atom = he->mAtom;
-    return atom.forget();
+  if (nsAtom* atom = table.Search(key)) {
+    return do_AddRef(atom);
   }
 
   RefPtr<nsAtom> atom =
       dont_AddRef(nsDynamicAtom::Create(aUTF16String, key.mHash));
-  he->mAtom = atom;
+  table.Add(key, atom);
 
   return atom.forget();
 }
@@ -645,22 +932,26 @@ already_AddRefed<nsAtom> nsAtomTable::AtomizeMainThread(
   }
 
   nsAtomSubTable& table = SelectSubTable(key);
+  retVal = AtomizeLockFree(table, key);
+  if (retVal) {
+    p.Set(retVal);
+    return retVal.forget();
+  }
   {
     AutoReadLock lock(table.mLock);
-    if (AtomTableEntry* he = table.Search(key)) {
-      p.Set(he->mAtom);
-      return do_AddRef(he->mAtom);
+    if (nsAtom* atom = table.Search(key)) {
+      p.Set(atom);
+      return do_AddRef(atom);
     }
   }
 
   AutoWriteLock lock(table.mLock);
-  AtomTableEntry* he = table.Add(key);
-  if (he->mAtom) {
-    retVal = he->mAtom;
+  if (nsAtom* atom = table.Search(key)) {
+    retVal = atom;
   } else {
     RefPtr<nsAtom> newAtom =
         dont_AddRef(nsDynamicAtom::Create(aUTF16String, key.mHash));
-    he->mAtom = newAtom;
+    table.Add(key, newAtom);
     retVal = std::move(newAtom);
   }
 
@@ -689,10 +980,10 @@ nsStaticAtom* NS_GetStaticAtom(const nsAString& aUTF16String) {
 nsStaticAtom* nsAtomTable::GetStaticAtom(const nsAString& aUTF16String) {
   AtomTableKey key(aUTF16String.Data(), aUTF16String.Length());
   nsAtomSubTable& table = SelectSubTable(key);
-  AutoReadLock lock(table.mLock);
-  AtomTableEntry* he = table.Search(key);
-  return he && he->mAtom->IsStatic() ? static_cast<nsStaticAtom*>(he->mAtom)
-                                     : nullptr;
+  // Static atoms are never removed, so there is no need for a lock.
+  AutoLockFreeAtomRead read;
+  nsAtom* atom = table.Search(key);
+  return atom && atom->IsStatic() ? static_cast<nsStaticAtom*>(atom) : nullptr;
 }
 
 void ToLowerCaseASCII(RefPtr<nsAtom>& aAtom) {
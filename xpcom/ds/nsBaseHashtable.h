@@ -306,6 +306,8 @@ class nsBaseHashtable
   nsBaseHashtable() = default;
   explicit nsBaseHashtable(uint32_t aInitLength)
       : nsTHashtable<EntryType>(aInitLength) {}
+  nsBaseHashtable(uint32_t aInitLength, PLDHashTable::Probing aProbing)
+      : nsTHashtable<EntryType>(aInitLength, aProbing) {}
 
   /**
    * Return the number of entries in the table.
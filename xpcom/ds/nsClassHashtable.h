@@ -51,6 +51,8 @@ class nsClassHashtable : public nsBaseHashtable<KeyClass, mozilla::UniquePtr<T>,
 
   nsClassHashtable() = default;
   explicit nsClassHashtable(uint32_t aInitLength) : base_type(aInitLength) {}
+  nsClassHashtable(uint32_t aInitLength, PLDHashTable::Probing aProbing)
+      : base_type(aInitLength, aProbing) {}
 
   /**
    * @copydoc nsBaseHashtable::Get
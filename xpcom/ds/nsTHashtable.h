@@ -241,6 +241,10 @@ class MOZ_NEEDS_NO_VTABLE_TYPE nsTHashtable {
       : mTable(Ops(), sizeof(EntryType), PLDHashTable::kDefaultInitialLength) {}
   explicit nsTHashtable(uint32_t aInitLength)
       : mTable(Ops(), sizeof(EntryType), aInitLength) {}
+  // Tables that are looked up a lot, and are large or often missed, may be
+  // faster with PLDHashTable::Probing::Group.
+  nsTHashtable(uint32_t aInitLength, PLDHashTable::Probing aProbing)
+      : mTable(Ops(), sizeof(EntryType), aInitLength, aProbing) {}
 
   /**
    * destructor, cleans up and deallocates
@@ -791,6 +795,8 @@ class nsTHashtable<nsPtrHashKey<T>>
  public:
   nsTHashtable() = default;
   explicit nsTHashtable(uint32_t aInitLength) : Base(aInitLength) {}
+  nsTHashtable(uint32_t aInitLength, PLDHashTable::Probing aProbing)
+      : Base(aInitLength, aProbing) {}
 
   ~nsTHashtable() = default;
 
@@ -13,7 +13,10 @@
 #include "nsThreadUtils.h"
 
 #include "gtest/gtest.h"
+#include "gtest/MozGTestBench.h"  // For MOZ_GTEST_BENCH
 #include "mozilla/gtest/MozAssertions.h"
+#include "nsPrintfCString.h"
+#include "nsTArray.h"
 
 using namespace mozilla;
 
@@ -174,4 +177,125 @@ TEST(Atoms, ConcurrentAccessing)
   EXPECT_EQ(NS_GetUnusedAtomCount(), int32_t(1));
 }
 
+static constexpr size_t kConcurrentThreadCount = 4;
+static constexpr uint32_t kConcurrentAtomCount = 2000;
+
+static void MakeAtomStrings(const char* aPrefix, nsTArray<nsString>& aStrings) {
+  for (uint32_t i = 0; i < kConcurrentAtomCount; i++) {
+    aStrings.AppendElement(
+        NS_ConvertUTF8toUTF16(nsPrintfCString("%s %u", aPrefix, i)));
+  }
+}
+
+static void RunOnThreads(void (*aFunc)(void*), void* aArg) {
+  PRThread* threads[kConcurrentThreadCount];
+  for (auto& thread : threads) {
+    thread = PR_CreateThread(PR_USER_THREAD, aFunc, aArg, PR_PRIORITY_NORMAL,
+                             PR_GLOBAL_THREAD, PR_JOINABLE_THREAD, 0);
+    MOZ_RELEASE_ASSERT(thread);
+  }
+  for (auto& thread : threads) {
+    MOZ_RELEASE_ASSERT(PR_JoinThread(thread) == PR_SUCCESS);
+  }
+}
+
+struct GCWhileAtomizingData {
+  nsTArray<nsString> mStrings;
+  Atomic<uint32_t> mMismatches{0};
+};
+
+static void AtomizeWhileGCing(void* aData) {
+  auto* data = static_cast<GCWhileAtomizingData*>(aData);
+  for (int pass = 0; pass < 10; pass++) {
+    for (const auto& str : data->mStrings) {
+      // Drop the atom right away, so that GC keeps removing atoms that other
+      // threads are looking up.
+      RefPtr<nsAtom> atom = NS_Atomize(str);
+      RefPtr<nsAtom> again = NS_Atomize(str);
+      if (!atom->Equals(str) || atom != again) {
+        data->mMismatches++;
+      }
+    }
+  }
+}
+
+TEST(Atoms, ConcurrentAtomizeAndGC)
+{
+  GCWhileAtomizingData data;
+  MakeAtomStrings("ConcurrentAtomizeAndGC", data.mStrings);
+
+  // Collect from the main thread, as Release() would, while other threads
+  // atomize, some of them through the lock-free path.
+  PRThread* threads[kConcurrentThreadCount];
+  for (auto& thread : threads) {
+    thread = PR_CreateThread(PR_USER_THREAD, AtomizeWhileGCing, &data,
+                             PR_PRIORITY_NORMAL, PR_GLOBAL_THREAD,
+                             PR_JOINABLE_THREAD, 0);
+    EXPECT_TRUE(thread);
+  }
+  for (int i = 0; i < 50; i++) {
+    NS_GetNumberOfAtoms();
+  }
+  for (auto& thread : threads) {
+    EXPECT_EQ(PR_SUCCESS, PR_JoinThread(thread));
+  }
+
+  EXPECT_EQ(uint32_t(data.mMismatches), 0u);
+  NS_GetNumberOfAtoms();
+  EXPECT_EQ(NS_GetUnusedAtomCount(), int32_t(0));
+}
+
+struct InsertionData {
+  nsTArray<nsString> mStrings;
+  nsTArray<RefPtr<nsAtom>> mAtoms[kConcurrentThreadCount];
+  Atomic<uint32_t> mNextThread{0};
+};
+
+static void InsertAtoms(void* aData) {
+  auto* data = static_cast<InsertionData*>(aData);
+  auto& atoms = data->mAtoms[data->mNextThread++];
+  for (const auto& str : data->mStrings) {
+    atoms.AppendElement(NS_Atomize(str));
+  }
+}
+
+TEST(Atoms, ConcurrentInsertion)
+{
+  InsertionData data;
+  MakeAtomStrings("ConcurrentInsertion", data.mStrings);
+  nsrefcnt count = NS_GetNumberOfAtoms();
+
+  // Every thread adds the same atoms at the same time, growing the subtables
+  // under each other's lookups, and must end up with the same ones.
+  RunOnThreads(InsertAtoms, &data);
+
+  EXPECT_EQ(NS_GetNumberOfAtoms(), count + kConcurrentAtomCount);
+  for (uint32_t i = 0; i < kConcurrentAtomCount; i++) {
+    RefPtr<nsAtom> atom = NS_Atomize(data.mStrings[i]);
+    for (auto& atoms : data.mAtoms) {
+      EXPECT_EQ(atoms[i], atom);
+    }
+  }
+}
+
+// Atomizes strings whose atoms are alive from several threads at once, which
+// is what parallel style and HTML parsing do.
+static void AtomizeExisting(void* aStrings) {
+  for (int pass = 0; pass < 50; pass++) {
+    for (const auto& str : *static_cast<nsTArray<nsString>*>(aStrings)) {
+      RefPtr<nsAtom> atom = NS_Atomize(str);
+    }
+  }
+}
+
+MOZ_GTEST_BENCH(Atoms, PerfConcurrentAtomizeExisting, [] {
+  nsTArray<nsString> strings;
+  MakeAtomStrings("PerfConcurrentAtomizeExisting", strings);
+  nsTArray<RefPtr<nsAtom>> atoms;
+  for (const auto& str : strings) {
+    atoms.AppendElement(NS_Atomize(str));
+  }
+  RunOnThreads(AtomizeExisting, &strings);
+});
+
 }  // namespace TestAtoms
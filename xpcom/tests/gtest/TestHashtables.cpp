@@ -1082,6 +1082,37 @@ TEST(Hashtables, DataHashtable)
   ASSERT_EQ(count, uint32_t(0));
 }
 
+TEST(Hashtables, DataHashtable_GroupProbing)
+{
+  nsTHashMap<nsUint32HashKey, const char*> UniToEntity(
+      ENTITY_COUNT, PLDHashTable::Probing::Group);
+
+  for (auto& entity : gEntities) {
+    UniToEntity.InsertOrUpdate(entity.mUnicode, entity.mStr);
+  }
+
+  for (auto& entity : gEntities) {
+    const char* str;
+    ASSERT_TRUE(UniToEntity.Get(entity.mUnicode, &str));
+    ASSERT_STREQ(str, entity.mStr);
+  }
+  ASSERT_FALSE(UniToEntity.Contains(99446));
+  ASSERT_EQ(UniToEntity.Count(), ENTITY_COUNT);
+
+  UniToEntity.Remove(gEntities[0].mUnicode);
+  ASSERT_FALSE(UniToEntity.Contains(gEntities[0].mUnicode));
+  ASSERT_EQ(UniToEntity.Count(), ENTITY_COUNT - 1);
+
+  // The probing moves along with the entries.
+  nsTHashMap<nsUint32HashKey, const char*> moved = std::move(UniToEntity);
+  for (uint32_t i = 1; i < ENTITY_COUNT; i++) {
+    ASSERT_TRUE(moved.Contains(gEntities[i].mUnicode));
+  }
+  moved.Clear();
+  moved.InsertOrUpdate(1, "one");
+  ASSERT_TRUE(moved.Contains(1));
+}
+
 TEST(Hashtables, DataHashtable_STLIterators)
 {
   using mozilla::Unused;
@@ -0,0 +1,160 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "gtest/MozGTestBench.h"  // For MOZ_GTEST_BENCH
+
+#include "mozilla/EventQueue.h"
+#include "mozilla/LockFreeEventQueue.h"
+#include "mozilla/ThreadEventQueue.h"
+#include "nsISerialEventTarget.h"
+#include "nsTArray.h"
+#include "nsThreadUtils.h"
+
+using namespace mozilla;
+
+namespace TestLockFreeEventQueue {
+
+static constexpr uint32_t kProducerCount = 4;
+
+TEST(LockFreeEventQueue, ProducersKeepTheirOrder)
+{
+  constexpr uint32_t kEventsPerProducer = 10000;
+  RefPtr<LockFreeEventQueue> queue = new LockFreeEventQueue();
+
+  nsTArray<uint32_t> ran[kProducerCount];
+  std::vector<std::thread> producers;
+  for (uint32_t p = 0; p < kProducerCount; p++) {
+    producers.emplace_back([&, p] {
+      for (uint32_t i = 0; i < kEventsPerProducer; i++) {
+        EXPECT_TRUE(queue->PutEvent(
+            NS_NewRunnableFunction("ProducersKeepTheirOrder",
+                                   [&, p, i] { ran[p].AppendElement(i); }),
+            EventQueuePriority::Normal));
+      }
+    });
+  }
+
+  // Wait for events as the thread owning the queue would, so that some of
+  // them are posted while we are waiting.
+  for (uint32_t i = 0; i < kProducerCount * kEventsPerProducer; i++) {
+    nsCOMPtr<nsIRunnable> event = queue->GetEvent(true);
+    ASSERT_TRUE(event);
+    event->Run();
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+
+  ASSERT_FALSE(queue->HasPendingEvent());
+  for (auto& events : ran) {
+    ASSERT_EQ(events.Length(), kEventsPerProducer);
+    for (uint32_t i = 0; i < kEventsPerProducer; i++) {
+      ASSERT_EQ(events[i], i);
+    }
+  }
+  ASSERT_TRUE(queue->ShutdownIfNoPendingEvents());
+}
+
+TEST(LockFreeEventQueue, Shutdown)
+{
+  RefPtr<LockFreeEventQueue> queue = new LockFreeEventQueue();
+  nsCOMPtr<nsIRunnable> event =
+      NS_NewRunnableFunction("LockFreeEventQueue::Shutdown", [] {});
+
+  ASSERT_TRUE(queue->PutEvent(do_AddRef(event), EventQueuePriority::Normal));
+  ASSERT_TRUE(queue->HasPendingEvent());
+  ASSERT_FALSE(queue->ShutdownIfNoPendingEvents());
+  nsCOMPtr<nsIRunnable> taken = queue->GetEvent(false);
+  ASSERT_EQ(taken, event);
+  ASSERT_FALSE(queue->GetEvent(false));
+
+  ASSERT_TRUE(queue->ShutdownIfNoPendingEvents());
+  // Events that can't be posted anymore are leaked rather than released on
+  // the posting thread, so release this one ourselves.
+  nsIRunnable* raw = event;
+  ASSERT_FALSE(queue->PutEvent(do_AddRef(raw), EventQueuePriority::Normal));
+  raw->Release();
+  ASSERT_FALSE(queue->HasPendingEvent());
+}
+
+TEST(LockFreeEventQueue, NestedQueue)
+{
+  RefPtr<LockFreeEventQueue> queue = new LockFreeEventQueue();
+  nsTArray<uint32_t> ran;
+  auto makeEvent = [&](uint32_t aId) {
+    return NS_NewRunnableFunction("LockFreeEventQueue::NestedQueue",
+                                  [&, aId] { ran.AppendElement(aId); });
+  };
+
+  ASSERT_TRUE(queue->PutEvent(makeEvent(1), EventQueuePriority::Normal));
+  nsCOMPtr<nsISerialEventTarget> nested = queue->PushEventQueue();
+  ASSERT_TRUE(queue->PutEvent(makeEvent(2), EventQueuePriority::Normal));
+  ASSERT_TRUE(NS_SUCCEEDED(nested->Dispatch(makeEvent(3))));
+  ASSERT_TRUE(NS_SUCCEEDED(nested->Dispatch(makeEvent(4))));
+
+  // Only the nested queue's events run while it is pushed.
+  while (nsCOMPtr<nsIRunnable> event = queue->GetEvent(false)) {
+    event->Run();
+  }
+  ASSERT_EQ(ran, (nsTArray<uint32_t>{3, 4}));
+
+  ASSERT_TRUE(NS_SUCCEEDED(nested->Dispatch(makeEvent(5))));
+  queue->PopEventQueue(nested);
+
+  // Leftover nested events go after the ones posted to the base queue.
+  while (nsCOMPtr<nsIRunnable> event = queue->GetEvent(false)) {
+    event->Run();
+  }
+  ASSERT_EQ(ran, (nsTArray<uint32_t>{3, 4, 1, 2, 5}));
+  ASSERT_TRUE(queue->ShutdownIfNoPendingEvents());
+}
+
+// The benchmarks have several threads post events to one thread as fast as
+// they can, which is where posting to a ThreadEventQueue contends on its
+// lock.
+
+static constexpr uint32_t kBenchEventsPerProducer = 50000;
+
+static void PostFromProducers(SynchronizedEventQueue* aQueue) {
+  std::atomic<uint32_t> count = 0;
+  std::vector<std::thread> producers;
+  for (uint32_t p = 0; p < kProducerCount; p++) {
+    producers.emplace_back([&] {
+      nsCOMPtr<nsIRunnable> event =
+          NS_NewRunnableFunction("PostFromProducers", [&] { ++count; });
+      for (uint32_t i = 0; i < kBenchEventsPerProducer; i++) {
+        aQueue->PutEvent(do_AddRef(event), EventQueuePriority::Normal);
+      }
+    });
+  }
+
+  for (uint32_t i = 0; i < kProducerCount * kBenchEventsPerProducer; i++) {
+    nsCOMPtr<nsIRunnable> event = aQueue->GetEvent(true);
+    event->Run();
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  MOZ_RELEASE_ASSERT(count == kProducerCount * kBenchEventsPerProducer);
+}
+
+MOZ_GTEST_BENCH(LockFreeEventQueue, PerfProducersThreadEventQueue, [] {
+  RefPtr<ThreadEventQueue> queue =
+      new ThreadEventQueue(MakeUnique<EventQueue>());
+  PostFromProducers(queue);
+});
+
+MOZ_GTEST_BENCH(LockFreeEventQueue, PerfProducersLockFreeEventQueue, [] {
+  RefPtr<LockFreeEventQueue> queue = new LockFreeEventQueue();
+  PostFromProducers(queue);
+});
+
+}  // namespace TestLockFreeEventQueue
@@ -6,7 +6,10 @@
 
 #include "PLDHashTable.h"
 #include "gtest/gtest.h"
+#include "gtest/MozGTestBench.h"  // For MOZ_GTEST_BENCH
 #include "mozilla/gtest/MozHelpers.h"
+#include "mozilla/HashFunctions.h"
+#include "nsTArray.h"
 
 // This test mostly focuses on edge cases. But more coverage of normal
 // operations wouldn't be a bad thing.
@@ -372,6 +375,171 @@ TEST(PLDHashTableTest, WithEntryHandle)
   ASSERT_EQ(entry1, entry2);
 }
 
+// Keys that collide a lot, to exercise probing past the first slot or group.
+static PLDHashNumber CollidingHash(const void* key) {
+  return (PLDHashNumber)((size_t)key % 61);
+}
+
+static const PLDHashTableOps collidingOps = {
+    CollidingHash, PLDHashTable::MatchEntryStub, PLDHashTable::MoveEntryStub,
+    PLDHashTable::ClearEntryStub, TrivialInitEntry};
+
+static void AddRemoveAndCheck(const PLDHashTableOps* aOps) {
+  PLDHashTable t(aOps, sizeof(PLDHashEntryStub),
+                 PLDHashTable::kDefaultInitialLength,
+                 PLDHashTable::Probing::Group);
+  ASSERT_EQ(t.GetProbing(), PLDHashTable::Probing::Group);
+
+  // Add and remove keys in a pseudo-random order, so that the table grows,
+  // shrinks and gets removed-entry sentinels, checking it against a plain
+  // array of which keys are present.
+  const uint32_t kKeyCount = 2000;
+  nsTArray<bool> present;
+  present.SetLength(kKeyCount);
+  for (auto& p : present) {
+    p = false;
+  }
+  uint32_t count = 0;
+  uint32_t random = 1;
+  for (uint32_t i = 0; i < 100000; i++) {
+    random = random * 1103515245 + 12345;
+    const uint32_t k = (random >> 8) % kKeyCount;
+    const void* key = (const void*)(uintptr_t)(k + 1);
+    if ((random >> 4) % 3 == 0) {
+      t.Remove(key);
+      count -= present[k];
+      present[k] = false;
+    } else {
+      auto entry = static_cast<PLDHashEntryStub*>(t.Add(key));
+      ASSERT_EQ(entry->key, key);
+      count += !present[k];
+      present[k] = true;
+    }
+    ASSERT_EQ(t.EntryCount(), count);
+  }
+
+  for (uint32_t k = 0; k < kKeyCount; k++) {
+    ASSERT_EQ(!!t.Search((const void*)(uintptr_t)(k + 1)), present[k]);
+  }
+  uint32_t iterated = 0;
+  for (auto iter = t.Iter(); !iter.Done(); iter.Next()) {
+    auto entry = static_cast<PLDHashEntryStub*>(iter.Get());
+    ASSERT_TRUE(present[(uintptr_t)entry->key - 1]);
+    iterated++;
+  }
+  ASSERT_EQ(iterated, count);
+}
+
+TEST(PLDHashTableTest, GroupProbing)
+{
+  AddRemoveAndCheck(&trivialOps);
+  AddRemoveAndCheck(&collidingOps);
+}
+
+TEST(PLDHashTableTest, GroupProbingIterator)
+{
+  PLDHashTable t(&trivialOps, sizeof(PLDHashEntryStub),
+                 PLDHashTable::kDefaultInitialLength,
+                 PLDHashTable::Probing::Group);
+
+  // The same growth and shrinking as in the Iterator test.
+  for (intptr_t i = 0; i < 64; i++) {
+    t.Add((const void*)i);
+  }
+  ASSERT_EQ(t.EntryCount(), 64u);
+  ASSERT_EQ(t.Capacity(), 128u);
+
+  for (auto iter = t.Iter(); !iter.Done(); iter.Next()) {
+    auto entry = static_cast<PLDHashEntryStub*>(iter.Get());
+    if ((intptr_t)(entry->key) % 2 == 0) {
+      iter.Remove();
+    }
+  }
+  ASSERT_EQ(t.EntryCount(), 32u);
+  ASSERT_EQ(t.Capacity(), 64u);
+  for (intptr_t i = 0; i < 64; i++) {
+    ASSERT_EQ(!!t.Search((const void*)i), i % 2 == 1);
+  }
+
+  // Clearing and moving the table keep its probing.
+  t.ClearAndPrepareForLength(100);
+  ASSERT_EQ(t.GetProbing(), PLDHashTable::Probing::Group);
+  t.Add((const void*)7);
+  PLDHashTable t2(std::move(t));
+  ASSERT_EQ(t2.GetProbing(), PLDHashTable::Probing::Group);
+  ASSERT_TRUE(t2.Search((const void*)7));
+}
+
+// The benchmarks compare the two kinds of probing on a table of pointer-like
+// keys, large enough not to fit in the L1 cache, looking keys up, half of
+// which are missing, adding them, and iterating over them.
+
+static const uint32_t kBenchKeyCount = 100000;
+
+static PLDHashNumber BenchHash(const void* key) {
+  return mozilla::HashGeneric(key);
+}
+
+static const PLDHashTableOps benchOps = {
+    BenchHash, PLDHashTable::MatchEntryStub, PLDHashTable::MoveEntryStub,
+    PLDHashTable::ClearEntryStub, TrivialInitEntry};
+
+static const void* BenchKey(uint32_t aIndex) {
+  return (const void*)(uintptr_t(aIndex + 1) * 16);
+}
+
+static void BenchInsert(PLDHashTable::Probing aProbing) {
+  PLDHashTable t(&benchOps, sizeof(PLDHashEntryStub),
+                 PLDHashTable::kDefaultInitialLength, aProbing);
+  for (uint32_t i = 0; i < kBenchKeyCount; i++) {
+    t.Add(BenchKey(i));
+  }
+  MOZ_RELEASE_ASSERT(t.EntryCount() == kBenchKeyCount);
+}
+
+static void BenchLookup(PLDHashTable::Probing aProbing) {
+  PLDHashTable t(&benchOps, sizeof(PLDHashEntryStub), kBenchKeyCount,
+                 aProbing);
+  for (uint32_t i = 0; i < kBenchKeyCount; i += 2) {
+    t.Add(BenchKey(i));
+  }
+  uint32_t found = 0;
+  for (uint32_t round = 0; round < 10; round++) {
+    for (uint32_t i = 0; i < kBenchKeyCount; i++) {
+      found += !!t.Search(BenchKey(i));
+    }
+  }
+  MOZ_RELEASE_ASSERT(found == 10 * kBenchKeyCount / 2);
+}
+
+static void BenchIterate(PLDHashTable::Probing aProbing) {
+  PLDHashTable t(&benchOps, sizeof(PLDHashEntryStub), kBenchKeyCount,
+                 aProbing);
+  for (uint32_t i = 0; i < kBenchKeyCount; i++) {
+    t.Add(BenchKey(i));
+  }
+  uintptr_t sum = 0;
+  for (uint32_t round = 0; round < 10; round++) {
+    for (auto iter = t.Iter(); !iter.Done(); iter.Next()) {
+      sum += (uintptr_t) static_cast<PLDHashEntryStub*>(iter.Get())->key;
+    }
+  }
+  MOZ_RELEASE_ASSERT(sum);
+}
+
+MOZ_GTEST_BENCH(PLDHashTableTest, PerfInsertDouble,
+                [] { BenchInsert(PLDHashTable::Probing::Double); });
+MOZ_GTEST_BENCH(PLDHashTableTest, PerfInsertGroup,
+                [] { BenchInsert(PLDHashTable::Probing::Group); });
+MOZ_GTEST_BENCH(PLDHashTableTest, PerfLookupDouble,
+                [] { BenchLookup(PLDHashTable::Probing::Double); });
+MOZ_GTEST_BENCH(PLDHashTableTest, PerfLookupGroup,
+                [] { BenchLookup(PLDHashTable::Probing::Group); });
+MOZ_GTEST_BENCH(PLDHashTableTest, PerfIterateDouble,
+                [] { BenchIterate(PLDHashTable::Probing::Double); });
+MOZ_GTEST_BENCH(PLDHashTableTest, PerfIterateGroup,
+                [] { BenchIterate(PLDHashTable::Probing::Group); });
+
 // This test involves resizing a table repeatedly up to 512 MiB in size. On
 // 32-bit platforms (Win32, Android) it sometimes OOMs, causing the test to
 // fail. (See bug 931062 and bug 1267227.) Therefore, we only run it on 64-bit
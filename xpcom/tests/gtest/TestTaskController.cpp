@@ -7,15 +7,18 @@
 #include "gtest/gtest.h"
 
 #include <stdint.h>  // uint32_t
+#include <set>       // std::set
 
 #include "nsString.h"                // nsACString
 #include "nsThreadUtils.h"           // NS_ProcessNextEvent
 #include "mozilla/Atomics.h"         // Atomic
 #include "mozilla/EventQueue.h"      // EventQueuePriority
 #include "mozilla/Mutex.h"           // Mutex, MutexAutoLock
+#include "mozilla/Preferences.h"     // Preferences
 #include "mozilla/RefPtr.h"          // RefPtr, do_AddRef
+#include "mozilla/ScopeExit.h"       // MakeScopeExit
 #include "mozilla/TaskController.h"  // TaskController, Task
-#include "prthread.h"                // PR_Sleep
+#include "prthread.h"                // PR_Sleep, PR_GetCurrentThread
 
 using namespace mozilla;
 
@@ -42,8 +45,10 @@ class ReschedulingTask : public Task {
   static constexpr uint32_t LoopCount = 3;
 
  public:
-  explicit ReschedulingTask(Kind aKind, Logger* aLogger, const char* aName)
-      : Task(aKind, EventQueuePriority::Normal),
+  explicit ReschedulingTask(
+      Kind aKind, Logger* aLogger, const char* aName,
+      EventQueuePriority aPriority = EventQueuePriority::Normal)
+      : Task(aKind, aPriority),
         mCount(0),
         mIsDone(false),
         mLogger(aLogger),
@@ -79,6 +84,126 @@ class ReschedulingTask : public Task {
   const char* mName;
 };
 
+// Records the thread it ran on.
+class ThreadRecordingTask : public Task {
+ public:
+  ThreadRecordingTask(Mutex* aMutex, std::set<PRThread*>* aThreads,
+                      Atomic<uint32_t>* aDoneCount)
+      : Task(Kind::OffMainThreadOnly, EventQueuePriority::Normal),
+        mMutex(aMutex),
+        mThreads(aThreads),
+        mDoneCount(aDoneCount) {}
+
+  TaskResult Run() override {
+    {
+      MutexAutoLock lock(*mMutex);
+      mThreads->insert(PR_GetCurrentThread());
+    }
+    (*mDoneCount)++;
+    return TaskResult::Complete;
+  }
+
+#ifdef MOZ_COLLECTING_RUNNABLE_TELEMETRY
+  bool GetName(nsACString& aName) override {
+    aName.AssignLiteral("ThreadRecordingTask");
+    return true;
+  }
+#endif
+
+ private:
+  Mutex* mMutex;
+  std::set<PRThread*>* mThreads;
+  Atomic<uint32_t>* mDoneCount;
+};
+
+// Adds aCount ThreadRecordingTasks from a pool thread, which puts them on the
+// work queue of that thread, then keeps the thread busy until they all ran.
+class SpawningTask : public Task {
+ public:
+  SpawningTask(uint32_t aCount, Mutex* aMutex, std::set<PRThread*>* aThreads,
+               Atomic<uint32_t>* aDoneCount)
+      : Task(Kind::OffMainThreadOnly, EventQueuePriority::Normal),
+        mCount(aCount),
+        mMutex(aMutex),
+        mThreads(aThreads),
+        mDoneCount(aDoneCount) {}
+
+  TaskResult Run() override {
+    mThread = PR_GetCurrentThread();
+    for (uint32_t i = 0; i < mCount; i++) {
+      TaskController::Get()->AddTask(
+          MakeAndAddRef<ThreadRecordingTask>(mMutex, mThreads, mDoneCount));
+    }
+
+    uint32_t count = 0;
+    while (*mDoneCount < mCount && count < 100) {
+      PR_Sleep(PR_MillisecondsToInterval(100));
+      count++;
+    }
+    mIsDone = true;
+    return TaskResult::Complete;
+  }
+
+#ifdef MOZ_COLLECTING_RUNNABLE_TELEMETRY
+  bool GetName(nsACString& aName) override {
+    aName.AssignLiteral("SpawningTask");
+    return true;
+  }
+#endif
+
+  bool IsDone() const { return mIsDone; }
+  PRThread* GetThread() const { return mThread; }
+
+ private:
+  const uint32_t mCount;
+  Mutex* mMutex;
+  std::set<PRThread*>* mThreads;
+  Atomic<uint32_t>* mDoneCount;
+  Atomic<PRThread*> mThread{nullptr};
+
+// Keeps its pool thread busy until it is interrupted or told to stop.
+class BusyTask : public Task {
+ public:
+  BusyTask(Atomic<uint32_t>* aStartedCount, Atomic<uint32_t>* aInterruptedCount,
+           Atomic<bool>* aStop)
+      : Task(Kind::OffMainThreadOnly, EventQueuePriority::Normal),
+        mStartedCount(aStartedCount),
+        mInterruptedCount(aInterruptedCount),
+        mStop(aStop) {}
+
+  TaskResult Run() override {
+    (*mStartedCount)++;
+    uint32_t count = 0;
+    while (!mInterrupted && !*mStop && count < 200) {
+      PR_Sleep(PR_MillisecondsToInterval(50));
+      count++;
+    }
+    if (mInterrupted) {
+      (*mInterruptedCount)++;
+    }
+    return TaskResult::Complete;
+  }
+
+  void RequestInterrupt(uint32_t aInterruptPriority) override {
+    mInterrupted = true;
+  }
+
+#ifdef MOZ_COLLECTING_RUNNABLE_TELEMETRY
+  bool GetName(nsACString& aName) override {
+    aName.AssignLiteral("BusyTask");
+    return true;
+  }
+#endif
+
+ private:
+  Atomic<uint32_t>* mStartedCount;
+  Atomic<uint32_t>* mInterruptedCount;
+  Atomic<bool>* mStop;
+  Atomic<bool> mInterrupted{false};
+};
+  Atomic<bool> mIsDone{false};
+};
+
 using namespace mozilla;
 
 TEST(TaskController, RescheduleOnMainThread)
@@ -211,4 +336,144 @@ TEST(TaskController, RescheduleOrderOffMainThread)
   ASSERT_TRUE(logger3.GetLog() == "333");
 }
 
+TEST(TaskController, MainThreadDependsOnOffMainThread)
+{
+  Logger logger;
+
+  // Off-main-thread tasks without dependencies go to the work queues of the
+  // pool threads, but must still release the tasks that depend on them.
+  RefPtr<ReschedulingTask> offThreadTask1 =
+      new ReschedulingTask(Task::Kind::OffMainThreadOnly, &logger, "1");
+  RefPtr<ReschedulingTask> offThreadTask2 =
+      new ReschedulingTask(Task::Kind::OffMainThreadOnly, &logger, "2");
+  RefPtr<ReschedulingTask> mainThreadTask =
+      new ReschedulingTask(Task::Kind::MainThreadOnly, &logger, "3");
+  mainThreadTask->AddDependency(offThreadTask1);
+  mainThreadTask->AddDependency(offThreadTask2);
+
+  TaskController::Get()->AddTask(do_AddRef(offThreadTask1));
+  TaskController::Get()->AddTask(do_AddRef(offThreadTask2));
+  TaskController::Get()->AddTask(do_AddRef(mainThreadTask));
+
+  uint32_t count = 0;
+  while (!mainThreadTask->IsDone() && count < 100) {
+    if (!NS_ProcessNextEvent(nullptr, false)) {
+      PR_Sleep(PR_MillisecondsToInterval(100));
+      count++;
+    }
+  }
+
+  ASSERT_TRUE(offThreadTask1->IsDone());
+  ASSERT_TRUE(offThreadTask2->IsDone());
+  ASSERT_TRUE(mainThreadTask->IsDone());
+
+  // The main thread task only ran once both of its dependencies completed.
+  ASSERT_TRUE(StringEndsWith(logger.GetLog(), "333"_ns));
+  ASSERT_TRUE(logger.GetLog().Length() == 9);
+}
+
+static constexpr char kWorkStealingPref[] = "threads.work_stealing.enabled";
+
+TEST(TaskController, WorkStealing)
+{
+  if (TaskController::GetPoolThreadCount() < 2) {
+    return;
+  }
+  Preferences::SetBool(kWorkStealingPref, true);
+  auto restorePref =
+      MakeScopeExit([] { Preferences::ClearUser(kWorkStealingPref); });
+
+  static constexpr uint32_t kTaskCount = 20;
+  Mutex mutex("TestTaskController::WorkStealing");
+  std::set<PRThread*> threads;
+  Atomic<uint32_t> doneCount(0);
+
+  RefPtr<SpawningTask> spawningTask =
+      new SpawningTask(kTaskCount, &mutex, &threads, &doneCount);
+  TaskController::Get()->AddTask(do_AddRef(spawningTask));
+
+  uint32_t count = 0;
+  while (!spawningTask->IsDone() && count < 200) {
+    PR_Sleep(PR_MillisecondsToInterval(100));
+    count++;
+  }
+
+  ASSERT_TRUE(spawningTask->IsDone());
+  // The thread that queued the tasks stayed busy until they all completed,
+  // so they can only have run because other threads stole them.
+  ASSERT_EQ(uint32_t(doneCount), kTaskCount);
+  MutexAutoLock lock(mutex);
+  ASSERT_FALSE(threads.empty());
+  ASSERT_TRUE(threads.find(spawningTask->GetThread()) == threads.end());
+}
+
+// Threads running queued tasks are busy: a higher priority task that finds
+// no idle thread interrupts one of them rather than waiting behind them.
+TEST(TaskController, QueuedTasksAreInterrupted)
+{
+  // Static, since the busy tasks may outlive the test.
+  static Atomic<bool> stop;
+  static Atomic<uint32_t> startedCount;
+  static Atomic<uint32_t> interruptedCount;
+  stop = false;
+  startedCount = 0;
+  interruptedCount = 0;
+
+  Preferences::SetBool(kWorkStealingPref, true);
+  auto cleanup = MakeScopeExit([] {
+    stop = true;
+    Preferences::ClearUser(kWorkStealingPref);
+  });
+
+  const uint32_t threadCount = TaskController::GetPoolThreadCount();
+  for (uint32_t i = 0; i < threadCount; i++) {
+    TaskController::Get()->AddTask(
+        MakeAndAddRef<BusyTask>(&startedCount, &interruptedCount, &stop));
+  }
+  uint32_t count = 0;
+  while (startedCount < threadCount && count < 100) {
+    PR_Sleep(PR_MillisecondsToInterval(50));
+    count++;
+  }
+  const bool allBusy = startedCount == threadCount;
+
+  Logger logger;
+  RefPtr<ReschedulingTask> urgentTask = new ReschedulingTask(
+      Task::Kind::OffMainThreadOnly, &logger, "1",
+      EventQueuePriority::MediumHigh);
+  TaskController::Get()->AddTask(do_AddRef(urgentTask));
+
+  count = 0;
+  while (!urgentTask->IsDone() && count < 100) {
+    PR_Sleep(PR_MillisecondsToInterval(50));
+    count++;
+  }
+  // Well before the busy tasks would have given up on their own.
+  ASSERT_TRUE(urgentTask->IsDone());
+  if (allBusy) {
+    ASSERT_GE(uint32_t(interruptedCount), 1u);
+  }
+}
+
+TEST(TaskController, DisableWorkStealingPref)
+{
+  Preferences::SetBool(kWorkStealingPref, false);
+  auto restorePref =
+      MakeScopeExit([] { Preferences::ClearUser(kWorkStealingPref); });
+
+  // Tasks go through the graph again.
+  Logger logger;
+  RefPtr<ReschedulingTask> offThreadTask =
+      new ReschedulingTask(Task::Kind::OffMainThreadOnly, &logger, "1");
+  TaskController::Get()->AddTask(do_AddRef(offThreadTask));
+
+  uint32_t count = 0;
+  while (!offThreadTask->IsDone() && count < 100) {
+    PR_Sleep(PR_MillisecondsToInterval(100));
+    count++;
+  }
+  ASSERT_TRUE(offThreadTask->IsDone());
+  ASSERT_TRUE(logger.GetLog() == "111");
+}
+
 }  // namespace TestTaskController
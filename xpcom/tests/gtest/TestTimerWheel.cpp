@@ -0,0 +1,214 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "gtest/gtest.h"
+#include "gtest/MozGTestBench.h"  // For MOZ_GTEST_BENCH
+
+#include "mozilla/TimerWheel.h"
+#include "nsISupportsImpl.h"
+#include "nsTArray.h"
+
+using namespace mozilla;
+
+namespace TestTimerWheel {
+
+class WheelTimer final : public TimerWheelElement<WheelTimer> {
+ public:
+  NS_INLINE_DECL_REFCOUNTING(WheelTimer)
+
+  explicit WheelTimer(const TimeStamp& aTimeout) : mTimeout(aTimeout) {}
+
+  const TimeStamp mTimeout;
+
+ private:
+  ~WheelTimer() = default;
+};
+
+// Delays spread over several levels of the wheel, in milliseconds. They start
+// at a second so no timer is due before the wheel's origin, which is set when
+// the first timer is added.
+static uint32_t DelayFor(uint32_t aIndex) {
+  return 1000 + (aIndex * 7919) % 300000;
+}
+
+TEST(TimerWheel, ExpiresInOrder)
+{
+  const TimeStamp start = TimeStamp::Now();
+  TimerWheel<WheelTimer> wheel;
+  nsTArray<RefPtr<WheelTimer>> timers;
+  for (uint32_t i = 0; i < 1000; i++) {
+    RefPtr<WheelTimer> timer =
+        new WheelTimer(start + TimeDuration::FromMilliseconds(DelayFor(i)));
+    ASSERT_TRUE(wheel.Insert(timer, timer->mTimeout));
+    timers.AppendElement(std::move(timer));
+  }
+  ASSERT_EQ(wheel.Count(), 1000u);
+
+  size_t expiredCount = 0;
+  for (uint32_t ms = 0; ms <= 301100; ms += 37) {
+    const TimeStamp now = start + TimeDuration::FromMilliseconds(ms);
+    wheel.AdvanceTo(now, [&](already_AddRefed<WheelTimer> aTimer) {
+      RefPtr<WheelTimer> timer(aTimer);
+      // Timers may expire up to a tick late, never early.
+      ASSERT_LE(timer->mTimeout, now + TimeDuration::FromMilliseconds(1));
+      ASSERT_FALSE(TimerWheel<WheelTimer>::Contains(timer));
+      ++expiredCount;
+    });
+    ASSERT_GE(wheel.Horizon(), now);
+    wheel.ForEach(
+        [&](WheelTimer* aTimer) { ASSERT_GT(aTimer->mTimeout, now); });
+  }
+  ASSERT_EQ(expiredCount, 1000u);
+  ASSERT_TRUE(wheel.IsEmpty());
+}
+
+TEST(TimerWheel, AdvanceToNextSlot)
+{
+  const TimeStamp start = TimeStamp::Now();
+  TimerWheel<WheelTimer> wheel;
+  const uint32_t delays[] = {250000, 1070, 5000, 1004, 4100, 1064};
+  for (uint32_t delay : delays) {
+    RefPtr<WheelTimer> timer =
+        new WheelTimer(start + TimeDuration::FromMilliseconds(delay));
+    ASSERT_TRUE(wheel.Insert(timer, timer->mTimeout));
+  }
+
+  // Going from slot to slot hands the timers back sorted to the tick.
+  nsTArray<TimeStamp> expired;
+  while (!wheel.IsEmpty()) {
+    wheel.AdvanceToNextSlot([&](already_AddRefed<WheelTimer> aTimer) {
+      RefPtr<WheelTimer> timer(aTimer);
+      expired.AppendElement(timer->mTimeout);
+    });
+  }
+  ASSERT_EQ(expired.Length(), std::size(delays));
+  for (size_t i = 1; i < expired.Length(); i++) {
+    ASSERT_LE(expired[i - 1], expired[i]);
+  }
+}
+
+// The earliest timeout is a lower bound that only moves as the slots do, and
+// stays after the horizon.
+TEST(TimerWheel, EarliestTimeout)
+{
+  const TimeStamp start = TimeStamp::Now();
+  TimerWheel<WheelTimer> wheel;
+  nsTArray<RefPtr<WheelTimer>> timers;
+  for (uint32_t i = 0; i < 100; i++) {
+    RefPtr<WheelTimer> timer =
+        new WheelTimer(start + TimeDuration::FromMilliseconds(DelayFor(i)));
+    ASSERT_TRUE(wheel.Insert(timer, timer->mTimeout));
+    timers.AppendElement(std::move(timer));
+  }
+
+  while (!wheel.IsEmpty()) {
+    const TimeStamp earliest = wheel.EarliestTimeout();
+    ASSERT_GE(earliest, wheel.Horizon());
+    wheel.ForEach(
+        [&](WheelTimer* aTimer) { ASSERT_GT(aTimer->mTimeout, earliest); });
+    wheel.AdvanceToNextSlot([](already_AddRefed<WheelTimer> aTimer) {
+      RefPtr<WheelTimer> timer(aTimer);
+    });
+  }
+}
+
+TEST(TimerWheel, Remove)
+{
+  const TimeStamp start = TimeStamp::Now();
+  TimerWheel<WheelTimer> wheel;
+  nsTArray<RefPtr<WheelTimer>> timers;
+  for (uint32_t i = 0; i < 100; i++) {
+    RefPtr<WheelTimer> timer =
+        new WheelTimer(start + TimeDuration::FromMilliseconds(DelayFor(i)));
+    ASSERT_TRUE(wheel.Insert(timer, timer->mTimeout));
+    timers.AppendElement(std::move(timer));
+  }
+  for (uint32_t i = 0; i < 100; i += 2) {
+    wheel.Remove(timers[i]);
+    ASSERT_FALSE(TimerWheel<WheelTimer>::Contains(timers[i]));
+  }
+  ASSERT_EQ(wheel.Count(), 50u);
+
+  wheel.AdvanceTo(start + TimeDuration::FromSeconds(400),
+                  [&](already_AddRefed<WheelTimer> aTimer) {
+                    RefPtr<WheelTimer> timer(aTimer);
+                    ASSERT_EQ(timers.IndexOf(timer) % 2, 1u);
+                  });
+  ASSERT_TRUE(wheel.IsEmpty());
+}
+
+TEST(TimerWheel, InsertBeforeHorizon)
+{
+  const TimeStamp start = TimeStamp::Now();
+  TimerWheel<WheelTimer> wheel;
+  RefPtr<WheelTimer> farTimer =
+      new WheelTimer(start + TimeDuration::FromSeconds(2));
+  ASSERT_TRUE(wheel.Insert(farTimer, farTimer->mTimeout));
+  wheel.AdvanceTo(start + TimeDuration::FromSeconds(1),
+                  [](already_AddRefed<WheelTimer>) { FAIL(); });
+  ASSERT_TRUE(TimerWheel<WheelTimer>::Contains(farTimer));
+
+  // The caller has to keep timers due before the horizon elsewhere.
+  RefPtr<WheelTimer> timer =
+      new WheelTimer(start + TimeDuration::FromMilliseconds(500));
+  ASSERT_FALSE(wheel.Insert(timer, timer->mTimeout));
+  ASSERT_FALSE(TimerWheel<WheelTimer>::Contains(timer));
+  ASSERT_EQ(wheel.Count(), 1u);
+
+  wheel.Remove(farTimer);
+  ASSERT_TRUE(wheel.IsEmpty());
+}
+
+// The benchmarks add many timers and cancel them all before they are due, as
+// pages using timers to debounce events do. The sorted array is the way
+// TimerThread kept all its timers: a linear scan for the insertion point,
+// and canceled timers left in place.
+
+static constexpr uint32_t kBenchTimerCount = 10000;
+
+static nsTArray<RefPtr<WheelTimer>> MakeBenchTimers() {
+  const TimeStamp start = TimeStamp::Now();
+  nsTArray<RefPtr<WheelTimer>> timers(kBenchTimerCount);
+  for (uint32_t i = 0; i < kBenchTimerCount; i++) {
+    timers.AppendElement(
+        new WheelTimer(start + TimeDuration::FromMilliseconds(DelayFor(i))));
+  }
+  return timers;
+}
+
+MOZ_GTEST_BENCH(TimerWheel, PerfAddCancelWheel, [] {
+  nsTArray<RefPtr<WheelTimer>> timers = MakeBenchTimers();
+  TimerWheel<WheelTimer> wheel;
+  for (WheelTimer* timer : timers) {
+    wheel.Insert(timer, timer->mTimeout);
+  }
+  for (WheelTimer* timer : timers) {
+    wheel.Remove(timer);
+  }
+});
+
+MOZ_GTEST_BENCH(TimerWheel, PerfAddCancelSortedArray, [] {
+  nsTArray<RefPtr<WheelTimer>> timers = MakeBenchTimers();
+  nsTArray<RefPtr<WheelTimer>> sorted;
+  for (WheelTimer* timer : timers) {
+    size_t index = 0;
+    while (index < sorted.Length() &&
+           (!sorted[index] || sorted[index]->mTimeout <= timer->mTimeout)) {
+      ++index;
+    }
+    sorted.InsertElementAt(index, timer);
+  }
+  for (WheelTimer* timer : timers) {
+    for (auto& entry : sorted) {
+      if (entry == timer) {
+        entry = nullptr;
+        break;
+      }
+    }
+  }
+});
+
+}  // namespace TestTimerWheel
@@ -0,0 +1,367 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "mozilla/LockFreeEventQueue.h"
+
+#include "GeckoProfiler.h"
+#include "LeakRefPtr.h"
+#include "nsITargetShutdownTask.h"
+#include "nsIThreadInternal.h"
+#include "nsThreadUtils.h"
+#include "ThreadEventTarget.h"
+#include "mozilla/ProfilerLabels.h"
+#include "mozilla/Unused.h"
+
+using namespace mozilla;
+
+class LockFreeEventQueue::NestedSink : public ThreadTargetSink {
+ public:
+  NestedSink(EventQueue* aQueue, LockFreeEventQueue* aOwner)
+      : mQueue(aQueue), mOwner(aOwner) {}
+
+  bool PutEvent(already_AddRefed<nsIRunnable>&& aEvent,
+                EventQueuePriority aPriority) final {
+    return mOwner->PutNestedEvent(std::move(aEvent), aPriority, this);
+  }
+
+  void Disconnect(const MutexAutoLock& aProofOfLock) final { mQueue = nullptr; }
+
+  nsresult RegisterShutdownTask(nsITargetShutdownTask* aTask) final {
+    return NS_ERROR_NOT_IMPLEMENTED;
+  }
+  nsresult UnregisterShutdownTask(nsITargetShutdownTask* aTask) final {
+    return NS_ERROR_NOT_IMPLEMENTED;
+  }
+
+  size_t SizeOfExcludingThis(mozilla::MallocSizeOf aMallocSizeOf) {
+    if (mQueue) {
+      return mQueue->SizeOfIncludingThis(aMallocSizeOf);
+    }
+    return 0;
+  }
+
+ private:
+  friend class LockFreeEventQueue;
+
+  // This is a non-owning reference. It must live at least until Disconnect is
+  // called to clear it out.
+  EventQueue* mQueue;
+  RefPtr<LockFreeEventQueue> mOwner;
+};
+
+LockFreeEventQueue::LockFreeEventQueue()
+    : mLock("LockFreeEventQueue"),
+      mEventsAvailable(mLock, "EventsAvail"),
+      mBaseQueue(MakeUnique<EventQueue>()) {}
+
+LockFreeEventQueue::~LockFreeEventQueue() {
+  MOZ_ASSERT(mNestedQueues.IsEmpty());
+
+  IncomingEvent* incoming = mIncoming.load();
+  if (incoming == Doomed()) {
+    return;
+  }
+  while (incoming) {
+    IncomingEvent* next = incoming->mNext;
+    NS_RELEASE(incoming->mEvent);
+    delete incoming;
+    incoming = next;
+  }
+}
+
+bool LockFreeEventQueue::PutEvent(already_AddRefed<nsIRunnable>&& aEvent,
+                                  EventQueuePriority aPriority) {
+  // We want to leak the reference when we fail to dispatch it, so that
+  // we won't release the event in a wrong thread.
+  LeakRefPtr<nsIRunnable> event(std::move(aEvent));
+
+  // Observers live as long as the queue, so this stays valid even if the
+  // event runs and replaces the observer before we notify it.
+  nsIThreadObserver* obs = mObserverPtr.load();
+
+  auto* incoming = new IncomingEvent{
+      nullptr, event.get(), aPriority,
+      profiler_is_active() ? TimeStamp::Now() : TimeStamp()};
+  IncomingEvent* head = mIncoming.load(std::memory_order_relaxed);
+  do {
+    if (head == Doomed()) {
+      delete incoming;
+      return false;
+    }
+    incoming->mNext = head;
+  } while (!mIncoming.compare_exchange_weak(head, incoming));
+  Unused << event.take().take();
+
+  // Either the thread sees the event before it waits, or we see that it is
+  // waiting, since both mIncoming and mWaiting are sequentially consistent.
+  // The thread holds the lock from setting mWaiting to waiting, so this
+  // notification can't be lost.
+  if (mWaiting.load()) {
+    MutexAutoLock lock(mLock);
+    mEventsAvailable.Notify();
+  }
+
+  if (obs) {
+    obs->OnDispatchedEvent();
+  }
+
+  return true;
+}
+
+bool LockFreeEventQueue::PutNestedEvent(already_AddRefed<nsIRunnable>&& aEvent,
+                                        EventQueuePriority aPriority,
+                                        NestedSink* aSink) {
+  LeakRefPtr<nsIRunnable> event(std::move(aEvent));
+  nsCOMPtr<nsIThreadObserver> obs;
+
+  {
+    MutexAutoLock lock(mLock);
+
+    if (mEventsAreDoomed || !aSink->mQueue) {
+      return false;
+    }
+
+    aSink->mQueue->PutEvent(event.take(), aPriority, lock);
+    mEventsAvailable.Notify();
+    obs = mObserver;
+  }
+
+  if (obs) {
+    obs->OnDispatchedEvent();
+  }
+
+  return true;
+}
+
+bool LockFreeEventQueue::HasIncomingEvents() const {
+  IncomingEvent* incoming = mIncoming.load();
+  return incoming && incoming != Doomed();
+}
+
+void LockFreeEventQueue::TakeIncomingEvents(const MutexAutoLock& aProofOfLock) {
+  // mIncoming is only doomed with the lock held, so it can't become doomed
+  // between the check and the exchange.
+  if (!HasIncomingEvents()) {
+    return;
+  }
+  IncomingEvent* incoming = mIncoming.exchange(nullptr);
+
+  // The events were pushed most recent first.
+  IncomingEvent* oldest = nullptr;
+  while (incoming) {
+    IncomingEvent* next = incoming->mNext;
+    incoming->mNext = oldest;
+    oldest = incoming;
+    incoming = next;
+  }
+
+  while (oldest) {
+    IncomingEvent* next = oldest->mNext;
+    if (oldest->mDispatchTime.IsNull()) {
+      mBaseQueue->PutEvent(dont_AddRef(oldest->mEvent), oldest->mPriority,
+                           aProofOfLock);
+    } else {
+      // Let the profiler know how long the event has already waited.
+      TimeDuration delay = TimeStamp::Now() - oldest->mDispatchTime;
+      mBaseQueue->PutEvent(dont_AddRef(oldest->mEvent), oldest->mPriority,
+                           aProofOfLock, &delay);
+    }
+    delete oldest;
+    oldest = next;
+  }
+}
+
+already_AddRefed<nsIRunnable> LockFreeEventQueue::GetEvent(
+    bool aMayWait, mozilla::TimeDuration* aLastEventDelay) {
+  nsCOMPtr<nsIRunnable> event;
+  {
+    MutexAutoLock lock(mLock);
+
+    for (;;) {
+      TakeIncomingEvents(lock);
+
+      if (mNestedQueues.IsEmpty()) {
+        event = mBaseQueue->GetEvent(lock, aLastEventDelay);
+      } else {
+        // We always get events from the topmost queue when there are nested
+        // queues.
+        event =
+            mNestedQueues.LastElement().mQueue->GetEvent(lock, aLastEventDelay);
+      }
+
+      if (event || !aMayWait) {
+        break;
+      }
+
+      // Events posted after this see that we are waiting, and those posted
+      // before it are seen by the check below.
+      mWaiting = true;
+      if (!HasIncomingEvents()) {
+        AUTO_PROFILER_LABEL("LockFreeEventQueue::GetEvent::Wait", IDLE);
+        mEventsAvailable.Wait();
+      }
+      mWaiting = false;
+    }
+  }
+
+  return event.forget();
+}
+
+bool LockFreeEventQueue::HasPendingEvent() {
+  MutexAutoLock lock(mLock);
+  TakeIncomingEvents(lock);
+
+  // We always get events from the topmost queue when there are nested queues.
+  if (mNestedQueues.IsEmpty()) {
+    return mBaseQueue->HasReadyEvent(lock);
+  } else {
+    return mNestedQueues.LastElement().mQueue->HasReadyEvent(lock);
+  }
+}
+
+bool LockFreeEventQueue::ShutdownIfNoPendingEvents() {
+  MutexAutoLock lock(mLock);
+  TakeIncomingEvents(lock);
+  if (!mNestedQueues.IsEmpty() || !mBaseQueue->IsEmpty(lock)) {
+    return false;
+  }
+
+  // This fails if an event was posted since we took the incoming ones.
+  IncomingEvent* expected = nullptr;
+  if (!mIncoming.compare_exchange_strong(expected, Doomed())) {
+    return false;
+  }
+  mEventsAreDoomed = true;
+  return true;
+}
+
+already_AddRefed<nsISerialEventTarget> LockFreeEventQueue::PushEventQueue() {
+  auto queue = MakeUnique<EventQueue>();
+  RefPtr<NestedSink> sink = new NestedSink(queue.get(), this);
+  RefPtr<ThreadEventTarget> eventTarget =
+      new ThreadEventTarget(sink, NS_IsMainThread(), false);
+
+  MutexAutoLock lock(mLock);
+
+  mNestedQueues.AppendElement(NestedQueueItem(std::move(queue), eventTarget));
+  return eventTarget.forget();
+}
+
+void LockFreeEventQueue::PopEventQueue(nsIEventTarget* aTarget) {
+  MutexAutoLock lock(mLock);
+
+  MOZ_ASSERT(!mNestedQueues.IsEmpty());
+
+  NestedQueueItem& item = mNestedQueues.LastElement();
+
+  MOZ_ASSERT(aTarget == item.mEventTarget);
+
+  // Disconnect the event target that will be popped.
+  item.mEventTarget->Disconnect(lock);
+
+  // Events posted to the base queue while the nested queue was pushed go
+  // first, as they would have with ThreadEventQueue.
+  TakeIncomingEvents(lock);
+
+  EventQueue* prevQueue =
+      mNestedQueues.Length() == 1
+          ? mBaseQueue.get()
+          : mNestedQueues[mNestedQueues.Length() - 2].mQueue.get();
+
+  // Move events from the old queue to the new one.
+  nsCOMPtr<nsIRunnable> event;
+  TimeDuration delay;
+  while ((event = item.mQueue->GetEvent(lock, &delay))) {
+    // preserve the event delay so far
+    prevQueue->PutEvent(event.forget(), EventQueuePriority::Normal, lock,
+                        &delay);
+  }
+
+  mNestedQueues.RemoveLastElement();
+}
+
+size_t LockFreeEventQueue::SizeOfExcludingThis(
+    mozilla::MallocSizeOf aMallocSizeOf) {
+  size_t n = 0;
+
+  {
+    MutexAutoLock lock(mLock);
+    TakeIncomingEvents(lock);
+    n += mBaseQueue->SizeOfIncludingThis(aMallocSizeOf);
+    n += mNestedQueues.ShallowSizeOfExcludingThis(aMallocSizeOf);
+    for (auto& queue : mNestedQueues) {
+      n += queue.mEventTarget->SizeOfIncludingThis(aMallocSizeOf);
+    }
+    n += mRetiredObservers.ShallowSizeOfExcludingThis(aMallocSizeOf);
+  }
+
+  return SynchronizedEventQueue::SizeOfExcludingThis(aMallocSizeOf) + n;
+}
+
+already_AddRefed<nsIThreadObserver> LockFreeEventQueue::GetObserver() {
+  MutexAutoLock lock(mLock);
+  return do_AddRef(mObserver);
+}
+
+already_AddRefed<nsIThreadObserver> LockFreeEventQueue::GetObserverOnThread()
+    MOZ_NO_THREAD_SAFETY_ANALYSIS {
+  // only written on this thread
+  return do_AddRef(mObserver);
+}
+
+void LockFreeEventQueue::SetObserver(nsIThreadObserver* aObserver) {
+  // Always called from the thread - single writer.
+  MOZ_ASSERT(!NS_IsMainThread());
+  MutexAutoLock lock(mLock);
+  if (mObserver == aObserver) {
+    return;
+  }
+  // Threads posting events may still be using the old observer.
+  if (mObserver) {
+    mRetiredObservers.AppendElement(std::move(mObserver));
+  }
+  mObserver = aObserver;
+  mObserverPtr = aObserver;
+}
+
+nsresult LockFreeEventQueue::RegisterShutdownTask(
+    nsITargetShutdownTask* aTask) {
+  NS_ENSURE_ARG(aTask);
+  MutexAutoLock lock(mLock);
+  if (mEventsAreDoomed || mShutdownTasksRun) {
+    return NS_ERROR_UNEXPECTED;
+  }
+  MOZ_ASSERT(!mShutdownTasks.Contains(aTask));
+  mShutdownTasks.AppendElement(aTask);
+  return NS_OK;
+}
+
+nsresult LockFreeEventQueue::UnregisterShutdownTask(
+    nsITargetShutdownTask* aTask) {
+  NS_ENSURE_ARG(aTask);
+  MutexAutoLock lock(mLock);
+  if (mEventsAreDoomed || mShutdownTasksRun) {
+    return NS_ERROR_UNEXPECTED;
+  }
+  return mShutdownTasks.RemoveElement(aTask) ? NS_OK : NS_ERROR_UNEXPECTED;
+}
+
+void LockFreeEventQueue::RunShutdownTasks() {
+  nsTArray<nsCOMPtr<nsITargetShutdownTask>> shutdownTasks;
+  {
+    MutexAutoLock lock(mLock);
+    shutdownTasks = std::move(mShutdownTasks);
+    mShutdownTasks.Clear();
+    mShutdownTasksRun = true;
+  }
+  for (auto& task : shutdownTasks) {
+    task->TargetShutdown();
+  }
+}
+
+LockFreeEventQueue::NestedQueueItem::NestedQueueItem(
+    UniquePtr<EventQueue> aQueue, ThreadEventTarget* aEventTarget)
+    : mQueue(std::move(aQueue)), mEventTarget(aEventTarget) {}
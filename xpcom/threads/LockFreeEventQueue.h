@@ -0,0 +1,132 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef mozilla_LockFreeEventQueue_h
+#define mozilla_LockFreeEventQueue_h
+
+#include <atomic>
+
+#include "mozilla/CondVar.h"
+#include "mozilla/EventQueue.h"
+#include "mozilla/SynchronizedEventQueue.h"
+#include "mozilla/TimeStamp.h"
+#include "mozilla/UniquePtr.h"
+#include "nsCOMPtr.h"
+#include "nsTArray.h"
+
+class nsIEventTarget;
+class nsISerialEventTarget;
+class nsIThreadObserver;
+
+namespace mozilla {
+
+class ThreadEventTarget;
+
+// A LockFreeEventQueue is a SynchronizedEventQueue for threads that many other
+// threads dispatch to. Posting an event to the thread pushes it onto a
+// lock-free stack with a single compare-and-swap, and only takes the lock to
+// wake the thread up if it is waiting for events. The thread takes everything
+// on the stack at once and moves it, in dispatch order, to an EventQueue it
+// then runs events from, so events run in the same order as with a
+// ThreadEventQueue.
+//
+// Events dispatched to nested event queues (see PushEventQueue) go through
+// the lock, as they do with ThreadEventQueue.
+//
+// Observers are kept alive until the queue is destroyed, so that posting
+// threads can notify the current one without taking the lock.
+//
+// This can't be used for the main thread, whose events go to the
+// TaskController.
+class LockFreeEventQueue final : public SynchronizedEventQueue {
+ public:
+  LockFreeEventQueue();
+
+  bool PutEvent(already_AddRefed<nsIRunnable>&& aEvent,
+                EventQueuePriority aPriority) final;
+
+  already_AddRefed<nsIRunnable> GetEvent(
+      bool aMayWait, mozilla::TimeDuration* aLastEventDelay = nullptr) final;
+  bool HasPendingEvent() final;
+
+  bool ShutdownIfNoPendingEvents() final;
+
+  void Disconnect(const MutexAutoLock& aProofOfLock) final {}
+
+  nsresult RegisterShutdownTask(nsITargetShutdownTask* aTask) final;
+  nsresult UnregisterShutdownTask(nsITargetShutdownTask* aTask) final;
+  void RunShutdownTasks() final;
+
+  already_AddRefed<nsISerialEventTarget> PushEventQueue() final;
+  void PopEventQueue(nsIEventTarget* aTarget) final;
+
+  already_AddRefed<nsIThreadObserver> GetObserver() final;
+  already_AddRefed<nsIThreadObserver> GetObserverOnThread() final;
+  void SetObserver(nsIThreadObserver* aObserver) final;
+
+  size_t SizeOfExcludingThis(mozilla::MallocSizeOf aMallocSizeOf) override;
+
+ private:
+  class NestedSink;
+
+  // An event posted to the base queue, which the thread hasn't taken yet.
+  struct IncomingEvent {
+    IncomingEvent* mNext;
+    nsIRunnable* mEvent;  // Owning reference.
+    EventQueuePriority mPriority;
+    // Only set while the profiler is running, see EventQueue::PutEvent.
+    TimeStamp mDispatchTime;
+  };
+
+  // The value of mIncoming once events are doomed.
+  static IncomingEvent* Doomed() {
+    return reinterpret_cast<IncomingEvent*>(uintptr_t(1));
+  }
+
+  virtual ~LockFreeEventQueue();
+
+  bool PutNestedEvent(already_AddRefed<nsIRunnable>&& aEvent,
+                      EventQueuePriority aPriority, NestedSink* aSink);
+
+  // Moves the events on mIncoming to mBaseQueue, oldest first.
+  void TakeIncomingEvents(const MutexAutoLock& aProofOfLock)
+      MOZ_REQUIRES(mLock);
+  bool HasIncomingEvents() const;
+
+  // The events posted to the base queue, most recent first.
+  std::atomic<IncomingEvent*> mIncoming = nullptr;
+  // Whether the thread is, or is about to start, waiting on mEventsAvailable.
+  std::atomic<bool> mWaiting = false;
+  // The current observer, kept alive by mObserver or mRetiredObservers.
+  std::atomic<nsIThreadObserver*> mObserverPtr = nullptr;
+
+  Mutex mLock;
+  CondVar mEventsAvailable MOZ_GUARDED_BY(mLock);
+
+  const UniquePtr<EventQueue> mBaseQueue MOZ_GUARDED_BY(mLock);
+
+  struct NestedQueueItem {
+    UniquePtr<EventQueue> mQueue;
+    RefPtr<ThreadEventTarget> mEventTarget;
+
+    NestedQueueItem(UniquePtr<EventQueue> aQueue,
+                    ThreadEventTarget* aEventTarget);
+  };
+
+  nsTArray<NestedQueueItem> mNestedQueues MOZ_GUARDED_BY(mLock);
+
+  bool mEventsAreDoomed MOZ_GUARDED_BY(mLock) = false;
+  nsCOMPtr<nsIThreadObserver> mObserver MOZ_GUARDED_BY(mLock);
+  nsTArray<nsCOMPtr<nsIThreadObserver>> mRetiredObservers
+      MOZ_GUARDED_BY(mLock);
+  nsTArray<nsCOMPtr<nsITargetShutdownTask>> mShutdownTasks
+      MOZ_GUARDED_BY(mLock);
+  bool mShutdownTasksRun MOZ_GUARDED_BY(mLock) = false;
+};
+
+}  // namespace mozilla
+
+#endif  // mozilla_LockFreeEventQueue_h
@@ -24,11 +24,14 @@
 #include "mozilla/ScopeExit.h"
 #include "mozilla/FlowMarkers.h"
 #include "mozilla/StaticPrefs_memory.h"
+#include "mozilla/StaticPrefs_threads.h"
 #include "nsIThreadInternal.h"
 #include "nsThread.h"
 #include "prenv.h"
 #include "prsystem.h"
 
+#include <deque>
+
 namespace mozilla {
 
 StaticAutoPtr<TaskController> TaskController::sSingleton;
@@ -49,11 +52,30 @@ struct PoolThread {
   // propagation. This is -only- valid when mCurrentTask != nullptr.
   uint32_t mEffectiveTaskPriority = 0;
 
+  // Whether the thread is waiting on mThreadCV. Protected by the graph mutex.
+  bool mSleeping = false;
+
+  // Whether the thread is running queued tasks, which makes it busy as far as
+  // graph tasks are concerned. Protected by the graph mutex.
+  bool mRunningQueuedTasks = false;
+
+  // Work queue of tasks that don't need the graph, see
+  // TaskController::AddQueuedTask.
+  Mutex mQueueMutex;
+  std::deque<RefPtr<Task>> mQueue MOZ_GUARDED_BY(mQueueMutex);
+  // The queued task the thread is running, if any, so that MaybeInterruptTask
+  // can interrupt it.
+  RefPtr<Task> mQueuedTask MOZ_GUARDED_BY(mQueueMutex);
+
   PoolThread(size_t aIndex, Mutex& aGraphMutex)
-      : mIndex(aIndex), mThreadCV(aGraphMutex, "PoolThread::mThreadCV") {}
+      : mIndex(aIndex),
+        mThreadCV(aGraphMutex, "PoolThread::mThreadCV"),
+        mQueueMutex("PoolThread::mQueueMutex") {}
 };
 
-/* static */
+// The pool thread the current thread is, if any.
+static MOZ_THREAD_LOCAL(PoolThread*) sCurrentPoolThread;
+
 int32_t TaskController::GetPoolThreadCount() {
   if (PR_GetEnv("MOZ_TASKCONTROLLER_THREADCOUNT")) {
     return strtol(PR_GetEnv("MOZ_TASKCONTROLLER_THREADCOUNT"), nullptr, 0);
@@ -311,6 +333,7 @@ static const char kMinPurgeReuseGracePref[] =
 
 void TaskController::Initialize() {
   MOZ_ASSERT(!sSingleton);
+  sCurrentPoolThread.infallibleInit();
   sSingleton = new TaskController();
 }
 
@@ -407,21 +430,71 @@ void TaskController::ShutdownThreadPoolInternal() {
   }
 
   MOZ_ASSERT(mIdleThreadCount == mPoolThreads.size());
+
+#ifdef DEBUG
+  // Like mThreadableTasks, the work queues must have been drained by now.
+  for (auto& thread : mPoolThreads) {
+    MutexAutoLock lock(thread->mQueueMutex);
+    MOZ_ASSERT(thread->mQueue.empty());
+  }
+#endif
+  MOZ_ASSERT(mQueuedTaskCount == 0);
 }
 
 void TaskController::RunPoolThread(PoolThread* aThread) {
   IOInterposer::RegisterCurrentThread();
 
+#ifdef MOZ_MEMORY
+  // Pool threads run the JS helper tasks, among others, which allocate a
+  // lot. Let them make small allocations without taking the arena lock.
+  if (StaticPrefs::memory_thread_cache_enabled()) {
+    jemalloc_thread_cache(true);
+  }
+#endif
+
   nsAutoCString threadName;
   threadName.AppendLiteral("TaskController #");
   threadName.AppendInt(static_cast<int64_t>(aThread->mIndex));
   AUTO_PROFILER_REGISTER_THREAD(threadName.get());
+  sCurrentPoolThread.set(aThread);
 
   MutexAutoLock lock(mGraphMutex);
   while (!mShuttingDown) {
     if (!aThread->mCurrentTask) {
-      AUTO_PROFILER_LABEL("TaskController::RunPoolThread", IDLE);
-      aThread->mThreadCV.Wait();
+      bool ranQueuedTask = false;
+      // Queued tasks are run even once work stealing is disabled, so none
+      // are left behind.
+      if (mQueuedTaskCount) {
+        // We are busy until we come back, so graph tasks go to other threads
+        // or wait for us, and MaybeInterruptTask can interrupt our task.
+        aThread->mRunningQueuedTasks = true;
+        mIdleThreadCount--;
+        {
+          MutexAutoUnlock unlock(mGraphMutex);
+          ranQueuedTask = RunQueuedTasks(aThread);
+        }
+        aThread->mRunningQueuedTasks = false;
+        mIdleThreadCount++;
+        mGraphTaskWaiting = false;
+        DispatchThreadableTasks(lock);
+      }
+      if (ranQueuedTask || aThread->mCurrentTask || mShuttingDown) {
+        continue;
+      }
+
+      // Count ourselves as sleeping before looking at the queues one last
+      // time: AddQueuedTask either sees us sleeping and wakes us up, or we see
+      // the task it queued.
+      aThread->mSleeping = true;
+      mSleepingThreadCount++;
+      if (!mQueuedTaskCount) {
+        AUTO_PROFILER_LABEL("TaskController::RunPoolThread", IDLE);
+        aThread->mThreadCV.Wait();
+      }
+      if (aThread->mSleeping) {
+        aThread->mSleeping = false;
+        mSleepingThreadCount--;
+      }
       continue;
     }
 
@@ -477,9 +550,133 @@ void TaskController::RunPoolThread(PoolThread* aThread) {
 
   MOZ_ASSERT(mThreadableTasks.empty());
 
+  sCurrentPoolThread.set(nullptr);
   IOInterposer::UnregisterCurrentThread();
 }
 
+bool TaskController::ShouldQueue(Task* aTask) {
+  // Tasks others depend on are fine, but a task with dependencies of its own
+  // needs the graph to know when it can run, and one with a non default
+  // priority needs the graph to be ordered against other tasks.
+  // Managed tasks need the graph for DidQueueTask and the priority modifier.
+  return StaticPrefs::threads_work_stealing_enabled() &&
+         aTask->GetKind() == Task::Kind::OffMainThreadOnly &&
+         !aTask->GetManager() &&
+         aTask->mDependencies.empty() &&
+         aTask->GetPriority() == static_cast<uint32_t>(kDefaultPriorityValue) &&
+         !mPoolThreads.empty();
+}
+
+void TaskController::AddQueuedTask(RefPtr<Task>&& aTask) {
+  // Pool threads queue follow-up work on their own queue, which they will
+  // most likely run next. Other threads spread their tasks over all queues.
+  PoolThread* thread = sCurrentPoolThread.get();
+  if (!thread) {
+    thread = mPoolThreads[mNextQueue++ % mPoolThreads.size()].get();
+  }
+
+  aTask->mQueued = true;
+  {
+    MutexAutoLock lock(thread->mQueueMutex);
+    thread->mQueue.push_back(std::move(aTask));
+  }
+  mQueuedTaskCount++;
+
+  if (mSleepingThreadCount) {
+    MutexAutoLock lock(mGraphMutex);
+    WakeSleepingThread(thread, lock);
+  }
+}
+
+already_AddRefed<Task> TaskController::TakeQueuedTask(PoolThread* aThread) {
+  if (!mQueuedTaskCount) {
+    return nullptr;
+  }
+
+  // Our own queue first, then steal the oldest task of the others.
+  size_t count = mPoolThreads.size();
+  for (size_t i = 0; i < count; i++) {
+    PoolThread* thread = mPoolThreads[(aThread->mIndex + i) % count].get();
+    MutexAutoLock lock(thread->mQueueMutex);
+    if (!thread->mQueue.empty()) {
+      RefPtr<Task> task = std::move(thread->mQueue.front());
+      thread->mQueue.pop_front();
+      mQueuedTaskCount--;
+      return task.forget();
+    }
+  }
+  return nullptr;
+}
+
+bool TaskController::RunQueuedTasks(PoolThread* aThread) {
+  bool ranTask = false;
+  while (!mGraphTaskWaiting && !mShuttingDown) {
+    RefPtr<Task> task = TakeQueuedTask(aThread);
+    if (!task) {
+      break;
+    }
+    ranTask = true;
+
+    {
+      MutexAutoLock lock(aThread->mQueueMutex);
+      aThread->mQueuedTask = task;
+    }
+    Task::TaskResult result = RunTask(task);
+    {
+      MutexAutoLock lock(aThread->mQueueMutex);
+      aThread->mQueuedTask = nullptr;
+    }
+
+    if (result == Task::TaskResult::Incomplete) {
+      // Run it again once the tasks queued before it had their turn.
+      AddQueuedTask(std::move(task));
+      continue;
+    }
+    CompleteQueuedTask(task);
+  }
+  return ranTask;
+}
+
+void TaskController::CompleteQueuedTask(Task* aTask) {
+#ifdef DEBUG
+  aTask->mIsInGraph = false;
+#endif
+  aTask->mCompleted = true;
+  if (!aTask->mHasDependents) {
+    return;
+  }
+
+  // Same as for graph tasks in RunPoolThread.
+  MutexAutoLock lock(mGraphMutex);
+  mMayHaveMainThreadTask = true;
+  EnsureMainThreadTasksScheduled();
+  MaybeInterruptTask(GetHighestPriorityMTTask(), lock);
+  DispatchThreadableTasks(lock);
+}
+
+void TaskController::WakeSleepingThread(PoolThread* aPreferredThread,
+                                        const MutexAutoLock& aProofOfLock) {
+  PoolThread* sleepingThread = nullptr;
+  if (aPreferredThread->mSleeping) {
+    sleepingThread = aPreferredThread;
+  } else {
+    for (auto& thread : mPoolThreads) {
+      if (thread->mSleeping) {
+        sleepingThread = thread.get();
+        break;
+      }
+    }
+  }
+  if (!sleepingThread) {
+    return;
+  }
+
+  // Clear the flag here so the next task wakes another thread.
+  sleepingThread->mSleeping = false;
+  mSleepingThreadCount--;
+  sleepingThread->mThreadCV.Notify();
+}
+
 void TaskController::AddTask(already_AddRefed<Task>&& aTask) {
   RefPtr<Task> task(aTask);
 
@@ -490,6 +687,20 @@ void TaskController::AddTask(already_AddRefed<Task>&& aTask) {
     }
   }
 
+  if (ShouldQueue(task)) {
+#ifdef DEBUG
+    task->mIsInGraph = true;
+#endif
+    if (profiler_is_active_and_unpaused()) {
+      task->mInsertionTime = TimeStamp::Now();
+    }
+    LogTask::LogDispatch(task);
+    PROFILER_MARKER("TaskController::AddTask", OTHER, {}, FlowMarker,
+                    Flow::FromPointer(task.get()));
+    AddQueuedTask(std::move(task));
+    return;
+  }
+
   MutexAutoLock lock(mGraphMutex);
 
   if (TaskManager* manager = task->GetManager()) {
@@ -520,6 +731,11 @@ void TaskController::AddTask(already_AddRefed<Task>&& aTask) {
   PROFILER_MARKER("TaskController::AddTask", OTHER, {}, FlowMarker,
                   Flow::FromPointer(task.get()));
 
+  // Queued dependencies will take the lock to wake us once they complete.
+  for (const RefPtr<Task>& otherTask : task->mDependencies) {
+    otherTask->mHasDependents = true;
+  }
+
   std::pair<std::set<RefPtr<Task>, Task::PriorityCompare>::iterator, bool>
       insertion;
   switch (task->GetKind()) {
@@ -565,7 +781,14 @@ bool TaskController::MaybeDispatchOneThreadableTask(
   PoolThread* thread = SelectThread(aProofOfLock);
 
   MOZ_ASSERT(!thread->mCurrentTask);
+  MOZ_ASSERT(!thread->mRunningQueuedTasks);
   MOZ_ASSERT(mIdleThreadCount != 0);
+  // The thread may be asleep waiting for queued work; it is busy now, so
+  // WakeSleepingThread must not pick it for the next queued task.
+  if (thread->mSleeping) {
+    thread->mSleeping = false;
+    mSleepingThreadCount--;
+  }
   thread->mCurrentTask = task;
   thread->mEffectiveTaskPriority = effetivePriority;
   thread->mThreadCV.Notify();
@@ -588,7 +811,9 @@ TaskController::TaskToRun TaskController::TakeThreadableTaskToRun(
       task = nextTask;
     }
 
-    if (task->GetKind() != Task::Kind::MainThreadOnly && !task->mInProgress) {
+    // Queued tasks are run from the work queues; their dependents wait.
+    if (task->GetKind() != Task::Kind::MainThreadOnly && !task->mInProgress &&
+        !task->mQueued) {
       TaskToRun taskToRun{task, rootTask->GetPriority()};
       mThreadableTasks.erase(task->mIterator);
       task->mIterator = mThreadableTasks.end();
@@ -602,12 +827,22 @@ TaskController::TaskToRun TaskController::TakeThreadableTaskToRun(
 PoolThread* TaskController::SelectThread(const MutexAutoLock& aProofOfLock) {
   MOZ_ASSERT(mIdleThreadCount != 0);
 
-  // This just picks the first free thread.
+  // This picks the first sleeping thread, or the first free one. Threads
+  // running queued tasks aren't free.
+  PoolThread* freeThread = nullptr;
   for (auto& thread : mPoolThreads) {
-    if (!thread->mCurrentTask) {
-      return thread.get();
+    if (!thread->mCurrentTask && !thread->mRunningQueuedTasks) {
+      if (thread->mSleeping) {
+        return thread.get();
+      }
+      if (!freeThread) {
+        freeThread = thread.get();
+      }
     }
   }
+  if (freeThread) {
+    return freeThread;
+  }
 
   MOZ_CRASH("Couldn't find idle thread");
 }
@@ -674,6 +909,12 @@ void TaskController::ProcessPendingMTTask(bool aMayWait) {
 
 void TaskController::ReprioritizeTask(Task* aTask, uint32_t aPriority) {
   MutexAutoLock lock(mGraphMutex);
+  if (aTask->mQueued) {
+    // Work queues aren't ordered by priority, the task keeps its place.
+    aTask->mPriority = aPriority;
+    return;
+  }
+
   std::set<RefPtr<Task>, Task::PriorityCompare>* queue = &mMainThreadTasks;
   if (aTask->GetKind() == Task::Kind::OffMainThreadOnly) {
     queue = &mThreadableTasks;
@@ -1338,7 +1579,7 @@ void TaskController::MaybeInterruptTask(Task* aTask,
 
   Task* finalDependency = GetFinalDependency(aTask);
 
-  if (finalDependency->mInProgress) {
+  if (finalDependency->mInProgress || finalDependency->mQueued) {
     // No need to wake anything, we can't schedule this task right now anyway.
     return;
   }
@@ -1369,9 +1610,28 @@ void TaskController::MaybeInterruptTask(Task* aTask,
       return;
     }
 
+    // Threads running queued tasks stop taking new ones, and come back for
+    // this task once their current one is done. Queued tasks all have the
+    // default priority, so interrupt one of them first.
+    mGraphTaskWaiting = true;
+    for (auto& thread : mPoolThreads) {
+      if (!thread->mRunningQueuedTasks) {
+        continue;
+      }
+      MutexAutoLock queueLock(thread->mQueueMutex);
+      if (thread->mQueuedTask &&
+          thread->mQueuedTask->GetPriority() < aTask->GetPriority()) {
+        thread->mQueuedTask->RequestInterrupt(aTask->GetPriority());
+        return;
+      }
+    }
+
     Task* lowestPriorityTask = nullptr;
     for (auto& thread : mPoolThreads) {
-      MOZ_ASSERT(thread->mCurrentTask);
+      if (!thread->mCurrentTask) {
+        MOZ_ASSERT(thread->mRunningQueuedTasks);
+        continue;
+      }
       if (!lowestPriorityTask) {
         lowestPriorityTask = thread->mCurrentTask.get();
         continue;
@@ -1386,7 +1646,8 @@ void TaskController::MaybeInterruptTask(Task* aTask,
       }
     }
 
-    if (lowestPriorityTask->GetPriority() < aTask->GetPriority()) {
+    if (lowestPriorityTask &&
+        lowestPriorityTask->GetPriority() < aTask->GetPriority()) {
       lowestPriorityTask->RequestInterrupt(aTask->GetPriority());
     }
 
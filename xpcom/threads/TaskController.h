@@ -238,8 +238,17 @@ class Task {
 
   // Access to these variables is protected by the GraphMutex.
   Kind mKind;
-  bool mCompleted = false;
   bool mInProgress = false;
+  // Set when the task was handed to a pool thread's work queue rather than
+  // inserted into mThreadableTasks. Written before the task is queued.
+  bool mQueued = false;
+
+  // Queued tasks complete without taking the GraphMutex, so these are atomic.
+  // A task added to the graph sets mHasDependents on its dependencies; a
+  // queued task sets mCompleted and then only takes the GraphMutex to wake its
+  // dependents if mHasDependents is set.
+  std::atomic<bool> mCompleted = false;
+  std::atomic<bool> mHasDependents = false;
 #ifdef DEBUG
   bool mIsInGraph = false;
 #endif
@@ -390,6 +399,21 @@ class TaskController {
   void MaybeInterruptTask(Task* aTask, const MutexAutoLock& aProofOfLock);
   Task* GetHighestPriorityMTTask();
 
+  // When the threads.work_stealing.enabled pref is set, tasks without
+  // dependencies at the default priority bypass the graph and go to the work
+  // queue of a pool thread. Threads run their own queue first and steal from
+  // the others when it is empty, so these tasks never touch mGraphMutex
+  // unless a task added later depends on them.
+  bool ShouldQueue(Task* aTask);
+  void AddQueuedTask(RefPtr<Task>&& aTask);
+  already_AddRefed<Task> TakeQueuedTask(PoolThread* aThread);
+  // Runs queued tasks until there are none left or a graph task waits for a
+  // thread. Returns whether any task ran.
+  bool RunQueuedTasks(PoolThread* aThread);
+  void CompleteQueuedTask(Task* aTask);
+  void WakeSleepingThread(PoolThread* aPreferredThread,
+                          const MutexAutoLock& aProofOfLock);
+
   void DispatchThreadableTasks(const MutexAutoLock& aProofOfLock);
   bool MaybeDispatchOneThreadableTask(const MutexAutoLock& aProofOfLock);
   PoolThread* SelectThread(const MutexAutoLock& aProofOfLock);
@@ -441,9 +465,20 @@ class TaskController {
   // Number of pool threads that are currently idle.
   size_t mIdleThreadCount = 0;
 
+  // Tasks waiting in the work queues of the pool threads, pool threads
+  // waiting on their condition variable, and the queue the next task added
+  // from outside the pool goes to. These are accessed without mGraphMutex.
+  std::atomic<size_t> mQueuedTaskCount = 0;
+  std::atomic<size_t> mSleepingThreadCount = 0;
+  std::atomic<size_t> mNextQueue = 0;
+  // Set when a graph task found no idle thread, so that threads running queued
+  // tasks come back for it. Written under mGraphMutex.
+  std::atomic<bool> mGraphTaskWaiting = false;
+
   // This ensures we keep running the main thread if we processed a task there.
   bool mMayHaveMainThreadTask = true;
-  bool mShuttingDown = false;
+  // Written under mGraphMutex, but also read by RunQueuedTasks without it.
+  std::atomic<bool> mShuttingDown = false;
 
 #ifdef MOZ_MEMORY
   // Flag if we should trigger deferred idle purging in mozjemalloc.
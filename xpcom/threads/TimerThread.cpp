@@ -577,7 +577,7 @@ nsresult TimerThread::Shutdown() {
     // might potentially call some code reentering the same lock
     // that leads to unexpected behavior or deadlock.
     // See bug 422472.
-    timers.SetCapacity(mTimers.Length());
+    timers.SetCapacity(mTimers.Length() + mTimerWheel.Count());
     for (Entry& entry : mTimers) {
       if (entry.Value()) {
         timers.AppendElement(entry.Take());
@@ -585,6 +585,12 @@ nsresult TimerThread::Shutdown() {
     }
 
     mTimers.Clear();
+
+    mTimerWheel.TakeAll([&](already_AddRefed<nsTimerImpl> aTimer) {
+      RefPtr<nsTimerImpl> timer(aTimer);
+      timer->SetIsInTimerThread(false);
+      timers.AppendElement(std::move(timer));
+    });
   }
 
   for (const RefPtr<nsTimerImpl>& timer : timers) {
@@ -825,7 +831,7 @@ TimerThread::Run() {
       }
 #endif
 
-      RemoveLeadingCanceledTimersInternal();
+      UpdateLeadingTimersInternal();
 
       if (!mTimers.IsEmpty()) {
         if (now + allowedEarlyFiring >= mTimers[0].Value()->mTimeout ||
@@ -862,7 +868,7 @@ TimerThread::Run() {
         }
       }
 
-      RemoveLeadingCanceledTimersInternal();
+      UpdateLeadingTimersInternal();
 
       if (!mTimers.IsEmpty()) {
         TimeStamp timeout = mTimers[0].Value()->mTimeout;
@@ -1127,6 +1133,14 @@ TimeStamp TimerThread::FindNextFireTimeForCurrentThread(TimeStamp aDefault,
   MonitorAutoLock lock(mMonitor);
   AUTO_TIMERS_STATS(TimerThread_FindNextFireTimeForCurrentThread);
 
+  // Timers still in the wheel can't be searched in firing order, and moving
+  // them out on every idle query would cost more than it saves. Instead, stop
+  // the search where the first of them may be due, as if it were for this
+  // thread.
+  if (!mTimerWheel.IsEmpty()) {
+    aDefault = std::min(aDefault, mTimerWheel.EarliestTimeout());
+  }
+
   for (const Entry& entry : mTimers) {
     const nsTimerImpl* timer = entry.Value();
     if (timer) {
@@ -1172,6 +1186,20 @@ bool TimerThread::AddTimerInternal(nsTimerImpl& aTimer) {
 
   LogTimerEvent::LogDispatch(&aTimer);
 
+  if (StaticPrefs::timer_wheel_enabled() &&
+      mTimerWheel.Insert(&aTimer, aTimer.mTimeout)) {
+    AUTO_TIMERS_STATS(TimerThread_AddTimerInternal_wheel);
+    aTimer.SetIsInTimerThread(true);
+    return true;
+  }
+
+  return InsertTimerInternal(aTimer);
+}
+
+// This function must be called from within a lock
+bool TimerThread::InsertTimerInternal(nsTimerImpl& aTimer) {
+  mMonitor.AssertCurrentThreadOwns();
+
   const TimeStamp& timeout = aTimer.mTimeout;
   const size_t insertionIndex = ComputeTimerInsertionIndex(timeout);
 
@@ -1252,6 +1280,12 @@ bool TimerThread::RemoveTimerInternal(nsTimerImpl& aTimer) {
     COUNT_TIMERS_STATS(TimerThread_RemoveTimerInternal_not_in_list);
     return false;
   }
+  if (mTimerWheel.Contains(&aTimer)) {
+    AUTO_TIMERS_STATS(TimerThread_RemoveTimerInternal_in_wheel);
+    aTimer.SetIsInTimerThread(false);
+    mTimerWheel.Remove(&aTimer);
+    return true;
+  }
   AUTO_TIMERS_STATS(TimerThread_RemoveTimerInternal_in_list);
   for (auto& entry : mTimers) {
     if (entry.Value() == &aTimer) {
@@ -1275,6 +1309,66 @@ void TimerThread::RemoveLeadingCanceledTimersInternal() {
   mTimers.RemoveElementsAt(0, toRemove);
 }
 
+void TimerThread::UpdateLeadingTimersInternal() {
+  mMonitor.AssertCurrentThreadOwns();
+  AUTO_TIMERS_STATS(TimerThread_UpdateLeadingTimersInternal);
+
+  RemoveLeadingCanceledTimersInternal();
+
+  while (!mTimerWheel.IsEmpty()) {
+    if (mTimers.IsEmpty()) {
+      // The wheel has the next timer, wherever it is.
+      mTimerWheel.AdvanceToNextSlot(
+          [this](already_AddRefed<nsTimerImpl> aTimer) {
+            mMonitor.AssertCurrentThreadOwns();
+            MoveTimerFromWheelInternal(std::move(aTimer));
+          });
+      continue;
+    }
+
+    // ComputeWakeupTimeFromTimers bundles later timers with mTimers[0] if
+    // they are due by this cutoff, so they all have to be in mTimers.
+    const TimeDuration minTimerDelay = TimeDuration::FromMilliseconds(
+        StaticPrefs::timer_minimum_firing_delay_tolerance_ms());
+    const TimeDuration maxTimerDelay = TimeDuration::FromMilliseconds(
+        StaticPrefs::timer_maximum_firing_delay_tolerance_ms());
+    const TimeStamp cutoffTime =
+        mTimers[0].Timeout() + ComputeAcceptableFiringDelay(mTimers[0].Delay(),
+                                                            minTimerDelay,
+                                                            maxTimerDelay);
+    if (mTimerWheel.Horizon() >= cutoffTime) {
+      break;
+    }
+    // This may move timers before mTimers[0] if it was added to mTimers while
+    // due after the horizon, so go around again.
+    MoveTimersFromWheelInternal(cutoffTime);
+  }
+}
+
+void TimerThread::MoveTimersFromWheelInternal(const TimeStamp& aUntil) {
+  mMonitor.AssertCurrentThreadOwns();
+  AUTO_TIMERS_STATS(TimerThread_MoveTimersFromWheelInternal);
+
+  mTimerWheel.AdvanceTo(aUntil, [this](already_AddRefed<nsTimerImpl> aTimer) {
+    mMonitor.AssertCurrentThreadOwns();
+    MoveTimerFromWheelInternal(std::move(aTimer));
+  });
+}
+
+void TimerThread::MoveTimerFromWheelInternal(
+    already_AddRefed<nsTimerImpl> aTimer) {
+  mMonitor.AssertCurrentThreadOwns();
+
+  // The Entry created for the timer takes its own reference, so this one is
+  // never the last and the timer isn't released on this thread.
+  RefPtr<nsTimerImpl> timer(aTimer);
+  MOZ_ASSERT(timer->IsInTimerThread());
+  if (!InsertTimerInternal(*timer)) {
+    // Unlike when adding the timer, there is no caller to report this to.
+    NS_ABORT_OOM(sizeof(Entry));
+  }
+}
+
 void TimerThread::RemoveFirstTimerInternal() {
   mMonitor.AssertCurrentThreadOwns();
   AUTO_TIMERS_STATS(TimerThread_RemoveFirstTimerInternal);
@@ -1546,6 +1640,8 @@ nsresult TimerThread::GetTimers(nsTArray<RefPtr<nsITimer>>& aRetVal) {
       }
       timers.AppendElement(timer);
     }
+    mTimerWheel.ForEach(
+        [&](nsTimerImpl* aTimer) { timers.AppendElement(aTimer); });
   }
 
   for (nsTimerImpl* timer : timers) {
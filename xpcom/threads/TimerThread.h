@@ -20,6 +20,7 @@
 #include "mozilla/HalTypes.h"
 #include "mozilla/Monitor.h"
 #include "mozilla/ProfilerUtils.h"
+#include "mozilla/TimerWheel.h"
 
 // Enable this to compute lots of interesting statistics and print them out when
 // PrintStatistics() is called.
@@ -67,9 +68,20 @@ class TimerThread final : public mozilla::Runnable, public nsIObserver {
   // These internal helper methods must be called while mMonitor is held.
   // AddTimerInternal returns false if the insertion failed.
   bool AddTimerInternal(nsTimerImpl& aTimer) MOZ_REQUIRES(mMonitor);
+  // Inserts aTimer into mTimers. Returns false if the insertion failed.
+  bool InsertTimerInternal(nsTimerImpl& aTimer) MOZ_REQUIRES(mMonitor);
   bool RemoveTimerInternal(nsTimerImpl& aTimer)
       MOZ_REQUIRES(mMonitor, aTimer.mMutex);
   void RemoveLeadingCanceledTimersInternal() MOZ_REQUIRES(mMonitor);
+  // Removes the leading canceled timers, then moves timers from mTimerWheel
+  // to mTimers until mTimers[0] is the first timer to fire and mTimers holds
+  // every timer that could fire in the same wake-up.
+  void UpdateLeadingTimersInternal() MOZ_REQUIRES(mMonitor);
+  // Moves the timers of mTimerWheel that are due by aUntil to mTimers.
+  void MoveTimersFromWheelInternal(const TimeStamp& aUntil)
+      MOZ_REQUIRES(mMonitor);
+  void MoveTimerFromWheelInternal(already_AddRefed<nsTimerImpl> aTimer)
+      MOZ_REQUIRES(mMonitor);
   void RemoveFirstTimerInternal() MOZ_REQUIRES(mMonitor);
   nsresult Init() MOZ_REQUIRES(mMonitor);
 
@@ -197,6 +209,14 @@ class TimerThread final : public mozilla::Runnable, public nsIObserver {
   // that you cannot use a binary search on this list.
   nsTArray<Entry> mTimers MOZ_GUARDED_BY(mMonitor);
 
+  // Timers due after mTimerWheel.Horizon() are added to the wheel instead of
+  // mTimers, which keeps adding and canceling them cheap no matter how many
+  // timers there are. They are moved to mTimers as the horizon gets close to
+  // the first timers of mTimers, see UpdateLeadingTimersInternal. Timers in
+  // mTimers may still be due after the horizon, but no timer in the wheel is
+  // due before it.
+  mozilla::TimerWheel<nsTimerImpl> mTimerWheel MOZ_GUARDED_BY(mMonitor);
+
   // Set only at the start of the thread's Run():
   uint32_t mAllowedEarlyFiringMicroseconds MOZ_GUARDED_BY(mMonitor);
 
@@ -0,0 +1,276 @@
+/* -*- Mode: C++; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+/* vim: set ts=8 sts=2 et sw=2 tw=80: */
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#ifndef mozilla_TimerWheel_h
+#define mozilla_TimerWheel_h
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+
+#include "mozilla/Assertions.h"
+#include "mozilla/LinkedList.h"
+#include "mozilla/MathAlgorithms.h"
+#include "mozilla/RefPtr.h"
+#include "mozilla/TimeStamp.h"
+
+namespace mozilla {
+
+template <typename T>
+class TimerWheel;
+
+// Elements of a TimerWheel<T> must derive from TimerWheelElement<T>, and be
+// refcounted: the wheel holds a strong reference to the elements it contains.
+// An element can only be in one wheel at a time.
+template <typename T>
+class TimerWheelElement : public LinkedListElement<RefPtr<T>> {
+ private:
+  friend class TimerWheel<T>;
+
+  // The tick the element is due at, and the index of the slot holding it.
+  uint64_t mTimerWheelTick = 0;
+  size_t mTimerWheelSlot = 0;
+};
+
+// A hierarchical timing wheel: elements are bucketed by due time into slots
+// that get 64 times coarser at each level, so that inserting and removing an
+// element take constant time regardless of how many elements there are.
+//
+// Level 0 has a slot per tick (a millisecond), level 1 a slot per 64 ticks,
+// and so on. An element goes to the lowest level whose slots distinguish its
+// due tick from the current one. As time advances, the elements of a slot of
+// a higher level are moved down to the lower levels, until they reach the
+// horizon and are handed back to the caller.
+//
+// The wheel only orders elements to the tick. It's meant to hold the elements
+// that aren't due soon, with the caller keeping the elements due before
+// Horizon() in a precisely sorted structure of its own.
+template <typename T>
+class TimerWheel final {
+  using Element = TimerWheelElement<T>;
+  using List = LinkedList<RefPtr<T>>;
+
+ public:
+  static constexpr size_t kSlotBits = 6;
+  static constexpr size_t kSlotsPerLevel = size_t(1) << kSlotBits;
+  static constexpr size_t kLevelCount = 6;
+
+  // About 795 days at a millisecond per tick.
+  static constexpr uint64_t kMaxTicks = uint64_t(1)
+                                        << (kSlotBits * kLevelCount);
+
+  TimerWheel() : mTickDuration(TimeDuration::FromMilliseconds(1)) {}
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  ~TimerWheel() { MOZ_ASSERT(IsEmpty(), "Elements remain in the TimerWheel"); }
+
+  bool IsEmpty() const { return mCount == 0; }
+  size_t Count() const { return mCount; }
+
+  // All the elements in the wheel are due strictly after this.
+  TimeStamp Horizon() const {
+    return mOrigin + mTickDuration * static_cast<int64_t>(mElapsed);
+  }
+
+  // No element in the wheel is due before this. It's found from the first
+  // occupied slot without touching the elements, so it may be well before the
+  // first element's due time if that slot is at a higher level. The wheel
+  // must not be empty.
+  TimeStamp EarliestTimeout() const {
+    MOZ_ASSERT(!IsEmpty());
+    size_t index;
+    uint64_t deadline;
+    NextOccupiedSlot(&index, &deadline);
+    // Due times are rounded up to their tick.
+    return mOrigin + mTickDuration * static_cast<int64_t>(deadline - 1);
+  }
+
+  static bool Contains(const T* aElement) {
+    return static_cast<const Element*>(aElement)->isInList();
+  }
+
+  // Adds aElement, which is due at aTimeout. Returns false without adding it
+  // if aTimeout isn't after Horizon(), or too far after it for the wheel.
+  bool Insert(T* aElement, const TimeStamp& aTimeout) {
+    if (mOrigin.IsNull()) {
+      mOrigin = TimeStamp::Now();
+    }
+
+    const uint64_t tick = TickFor(aTimeout);
+    // Elements whose tick only differs from the current one above the top
+    // level would wrap around it.
+    if (tick <= mElapsed || (tick ^ mElapsed) >= kMaxTicks) {
+      return false;
+    }
+
+    Element* element = aElement;
+    MOZ_ASSERT(!element->isInList());
+    element->mTimerWheelTick = tick;
+    InsertAtTick(aElement);
+    ++mCount;
+    return true;
+  }
+
+  // Removes aElement, which must be in the wheel. Since this releases the
+  // wheel's reference, the caller should hold one.
+  void Remove(T* aElement) {
+    Element* element = aElement;
+    MOZ_ASSERT(element->isInList());
+    const size_t index = element->mTimerWheelSlot;
+    element->remove();
+    if (mSlots[index].isEmpty()) {
+      mOccupied[index / kSlotsPerLevel] &=
+          ~(uint64_t(1) << (index % kSlotsPerLevel));
+    }
+    --mCount;
+  }
+
+  // Moves the horizon to the next tick at which some elements may be due,
+  // and calls aExpired with each element due by then. Depending on which
+  // level the next elements are at, this may only move them down to a lower
+  // level, without any expiring. The wheel must not be empty.
+  template <typename F>
+  void AdvanceToNextSlot(F&& aExpired) {
+    MOZ_ASSERT(!IsEmpty());
+    size_t index;
+    uint64_t deadline;
+    NextOccupiedSlot(&index, &deadline);
+    mElapsed = deadline;
+    ProcessSlot(index, aExpired);
+  }
+
+  // Moves the horizon to aTime, calling aExpired with each element due by
+  // then. Elements due in the same tick as aTime expire as well.
+  template <typename F>
+  void AdvanceTo(const TimeStamp& aTime, F&& aExpired) {
+    if (mOrigin.IsNull()) {
+      return;
+    }
+
+    const uint64_t target = TickFor(aTime);
+    while (!IsEmpty()) {
+      size_t index;
+      uint64_t deadline;
+      NextOccupiedSlot(&index, &deadline);
+      if (deadline > target) {
+        break;
+      }
+      mElapsed = deadline;
+      ProcessSlot(index, aExpired);
+    }
+    if (target > mElapsed) {
+      mElapsed = target;
+    }
+  }
+
+  // Calls aFunc with each element, in no particular order.
+  template <typename F>
+  void ForEach(F&& aFunc) {
+    for (List& slot : mSlots) {
+      for (T* element : slot) {
+        aFunc(element);
+      }
+    }
+  }
+
+  // Removes all the elements, handing them to aFunc.
+  template <typename F>
+  void TakeAll(F&& aFunc) {
+    for (List& slot : mSlots) {
+      while (RefPtr<T> element = slot.popFirst()) {
+        aFunc(element.forget());
+      }
+    }
+    for (uint64_t& occupied : mOccupied) {
+      occupied = 0;
+    }
+    mCount = 0;
+  }
+
+ private:
+  uint64_t TickFor(const TimeStamp& aTime) const {
+    if (aTime <= mOrigin) {
+      return 0;
+    }
+    // Round up, so an element never expires before its due time.
+    const double ticks = ceil((aTime - mOrigin) / mTickDuration);
+    return ticks < double(kMaxTicks * 2) ? uint64_t(ticks) : kMaxTicks * 2;
+  }
+
+  // The lowest level whose slots tell aTick apart from mElapsed.
+  size_t LevelFor(uint64_t aTick) const {
+    const uint64_t masked = (mElapsed ^ aTick) | (kSlotsPerLevel - 1);
+    const size_t significantBit = 63 - CountLeadingZeroes64(masked);
+    MOZ_ASSERT(significantBit / kSlotBits < kLevelCount);
+    return significantBit / kSlotBits;
+  }
+
+  void InsertAtTick(T* aElement) {
+    Element* element = aElement;
+    const size_t level = LevelFor(element->mTimerWheelTick);
+    const size_t slot = (element->mTimerWheelTick >> (level * kSlotBits)) &
+                        (kSlotsPerLevel - 1);
+    const size_t index = level * kSlotsPerLevel + slot;
+    element->mTimerWheelSlot = index;
+    mSlots[index].insertBack(aElement);
+    mOccupied[level] |= uint64_t(1) << slot;
+  }
+
+  // Finds the first occupied slot, and the tick it starts at. Every element
+  // of a level is due before any element of the levels above it, and no
+  // element is ever in a slot before the current one of its level, so this
+  // is the first occupied slot of the lowest occupied level.
+  void NextOccupiedSlot(size_t* aIndex, uint64_t* aDeadline) const {
+    for (size_t level = 0; level < kLevelCount; ++level) {
+      if (!mOccupied[level]) {
+        continue;
+      }
+      const size_t slot = CountTrailingZeroes64(mOccupied[level]);
+      const size_t shift = level * kSlotBits;
+      const uint64_t levelStart =
+          mElapsed & ~((uint64_t(1) << (shift + kSlotBits)) - 1);
+      *aIndex = level * kSlotsPerLevel + slot;
+      *aDeadline = levelStart + (uint64_t(slot) << shift);
+      MOZ_ASSERT(*aDeadline > mElapsed);
+      return;
+    }
+    MOZ_CRASH("NextOccupiedSlot called on an empty TimerWheel");
+  }
+
+  // Expires the elements of a slot that are due, and moves the others down.
+  template <typename F>
+  void ProcessSlot(size_t aIndex, F& aExpired) {
+    List& slot = mSlots[aIndex];
+    mOccupied[aIndex / kSlotsPerLevel] &=
+        ~(uint64_t(1) << (aIndex % kSlotsPerLevel));
+    while (RefPtr<T> element = slot.popFirst()) {
+      if (static_cast<Element*>(element.get())->mTimerWheelTick <= mElapsed) {
+        --mCount;
+        aExpired(element.forget());
+        continue;
+      }
+      // Now that mElapsed is within this slot, the element belongs to a
+      // lower level, so it can't land back in this slot.
+      InsertAtTick(element);
+    }
+  }
+
+  const TimeDuration mTickDuration;
+  TimeStamp mOrigin;
+  // The current tick. Everything due up to it has expired.
+  uint64_t mElapsed = 0;
+  size_t mCount = 0;
+  // A bit per slot of each level, set when the slot isn't empty.
+  uint64_t mOccupied[kLevelCount] = {};
+  List mSlots[kLevelCount * kSlotsPerLevel];
+};
+
+}  // namespace mozilla
+
+#endif  // mozilla_TimerWheel_h
@@ -19,6 +19,7 @@
 #include "mozilla/CycleCollectedJSContext.h"  // nsAutoMicroTask
 #include "mozilla/EventQueue.h"
 #include "mozilla/InputTaskManager.h"
+#include "mozilla/LockFreeEventQueue.h"
 #include "mozilla/Mutex.h"
 #include "mozilla/NeverDestroyed.h"
 #include "mozilla/Perfetto.h"
@@ -608,8 +609,12 @@ nsThreadManager::NewNamedThread(
 
   [[maybe_unused]] TimeStamp startTime = TimeStamp::Now();
 
-  RefPtr<ThreadEventQueue> queue =
-      new ThreadEventQueue(MakeUnique<EventQueue>());
+  RefPtr<SynchronizedEventQueue> queue;
+  if (aOptions.lockFreeEventQueue) {
+    queue = new LockFreeEventQueue();
+  } else {
+    queue = new ThreadEventQueue(MakeUnique<EventQueue>());
+  }
   RefPtr<nsThread> thr =
       new nsThread(WrapNotNull(queue), nsThread::NOT_MAIN_THREAD, aOptions);
 
@@ -17,6 +17,7 @@
 #include "mozilla/Mutex.h"
 #include "mozilla/StaticMutex.h"
 #include "mozilla/TimeStamp.h"
+#include "mozilla/TimerWheel.h"
 #include "mozilla/Variant.h"
 #include "mozilla/Logging.h"
 
@@ -38,7 +39,7 @@ class LogModule;
 // TimerThread, nsTimerEvent, and nsTimer have references to these. nsTimer has
 // a separate lifecycle so we can Cancel() the underlying timer when the user of
 // the nsTimer has let go of its last reference.
-class nsTimerImpl {
+class nsTimerImpl : public mozilla::TimerWheelElement<nsTimerImpl> {
   ~nsTimerImpl() {
     MOZ_ASSERT(!mIsInTimerThread);
 
@@ -147,7 +148,8 @@ class nsTimerImpl {
                                    const mozilla::TimeDuration& aDelay,
                                    uint32_t aType, const char* aNameString);
 
-  // Is this timer currently referenced from a TimerThread::Entry?
+  // Is this timer currently referenced from a TimerThread::Entry, or from the
+  // TimerThread's timer wheel?
   // Note: It is cleared before the Entry is destroyed.  Take() also sets it to
   // false, to indicate it's no longer in the TimerThread's list. This Take()
   // call is NOT made under the nsTimerImpl's mutex (all other